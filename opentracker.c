@@ -31,36 +31,98 @@
 /* Opentracker */
 #include "trackerlogic.h"
 #include "ot_mutex.h"
+#include "ot_loop.h"
+#include "ot_shard.h"
 #include "ot_http.h"
+#include "ot_iovec.h"
 #include "ot_udp.h"
 #include "ot_accesslist.h"
 #include "ot_stats.h"
 #include "ot_livesync.h"
+#include "ot_fullscrape.h"
+#include "ot_snapshot.h"
+#include "ot_handoff.h"
+#include "ot_clock.h"
 
 /* Globals */
-time_t       g_now_seconds;
 char *       g_redirecturl;
 uint32_t     g_tracker_id;
+size_t       g_replycache_min_peers = OT_REPLYCACHE_MIN_PEERS;
 volatile int g_opentracker_running = 1;
-int          g_self_pipe[2];
 
 static char * g_serverdir;
 static char * g_serveruser;
 
+/* Every I/O thread binds its own socket to each of these addresses, the
+   kernel spreads connections and packets over them */
+typedef struct {
+  ot_ip6     ip;
+  uint16_t   port;
+  PROTO_FLAG proto;
+} ot_listen_address;
+
+static ot_listen_address *g_listen_addresses;
+static size_t             g_listen_address_count;
+static unsigned long      g_io_threads = 1;
+static ot_loop           *g_loops[OT_MAX_THREADS];
+
+/* All listening sockets and the loop serving each, for handing them over */
+typedef struct {
+  ot_handoff_socket handed;
+  ot_loop          *loop;
+} ot_listen_socket;
+
+static ot_listen_socket  *g_listen_sockets;
+static size_t             g_listen_socket_count;
+
+static int64              g_handoff_listener = -1;
+static int64              g_handoff_conn = -1;
+
+/* Torrents handed over to us are loaded while serving */
+static int64              g_handoff_state = -1;
+static pthread_t          g_state_loader;
+static int                g_state_loading;
+
+/* Set when handing over or shutting down, then each I/O thread closes its
+   listening sockets */
+static volatile int       g_stopping;
+
+/* Handing over and SIGINT only set g_shutdown, unless the full teardown
+   is configured for SIGINT. I/O threads without connections left count
+   themselves in g_drained */
+static int                g_shutdown_full;
+static volatile int       g_shutdown;
+static int                g_drained;
+
 static void panic( const char *routine ) {
   fprintf( stderr, "%s: %s\n", routine, strerror(errno) );
   exit( 111 );
 }
 
+/* Snapshots and handing over must not miss torrents still being loaded */
+static void wait_state_loaded( void ) {
+  if( g_state_loading ) {
+    pthread_join( g_state_loader, NULL );
+    g_state_loading = 0;
+  }
+}
+
 static void signal_handler( int s ) {
   if( s == SIGINT ) {
     /* Any new interrupt signal quits the application */
     signal( SIGINT, SIG_DFL);
 
+    /* The main loop finishes all replies and leaves without freeing */
+    if( !g_shutdown_full ) {
+      g_shutdown = g_stopping = 1;
+      return;
+    }
+
     /* Tell all other threads to not acquire any new lock on a bucket
        but cancel their operations and return */
     g_opentracker_running = 0;
 
+    wait_state_loaded( );
     trackerlogic_deinit();
 
 #ifdef WANT_SYSLOGS
@@ -68,10 +130,6 @@ static void signal_handler( int s ) {
 #endif
 
     exit( 0 );
-  } else if( s == SIGALRM ) {
-    /* Maintain our copy of the clock. time() on BSDs is very expensive. */
-    g_now_seconds = time(NULL);
-    alarm(5);
   }
 }
 
@@ -81,7 +139,6 @@ static void defaul_signal_handlers( void ) {
   sigaddset (&signal_mask, SIGPIPE);
   sigaddset (&signal_mask, SIGHUP);
   sigaddset (&signal_mask, SIGINT);
-  sigaddset (&signal_mask, SIGALRM);
   pthread_sigmask (SIG_BLOCK, &signal_mask, NULL);
 }
 
@@ -93,16 +150,15 @@ static void install_signal_handlers( void ) {
   sa.sa_handler = signal_handler;
   sigemptyset(&sa.sa_mask);
   sa.sa_flags = SA_RESTART;
-  if ((sigaction(SIGINT, &sa, NULL) == -1) || (sigaction(SIGALRM, &sa, NULL) == -1) )
+  if( sigaction(SIGINT, &sa, NULL) == -1 )
     panic( "install_signal_handlers" );
 
   sigaddset (&signal_mask, SIGINT);
-  sigaddset (&signal_mask, SIGALRM);
   pthread_sigmask (SIG_UNBLOCK, &signal_mask, NULL);
 }
 
 static void usage( char *name ) {
-  fprintf( stderr, "Usage: %s [-i ip] [-p port] [-P port] [-r redirect] [-d dir] [-u user] [-A ip] [-f config] [-s livesyncport]"
+  fprintf( stderr, "Usage: %s [-i ip] [-p port] [-P port] [-r redirect] [-d dir] [-u user] [-A ip] [-f config] [-s livesyncport] [-t threads]"
 #ifdef WANT_ACCESSLIST_BLACK
   " [-b blacklistfile]"
 #elif defined ( WANT_ACCESSLIST_WHITE )
@@ -123,6 +179,7 @@ static void help( char *name ) {
   HELPLINE("-d dir","specify directory to try to chroot to (default: \".\")");
   HELPLINE("-u user","specify user under whose priviliges opentracker should run (default: \"nobody\")");
   HELPLINE("-A ip","bless an ip address as admin address (e.g. to allow syncs from this address)");
+  HELPLINE("-t threads","specify the number of threads serving requests (default: 1)");
 #ifdef WANT_ACCESSLIST_BLACK
   HELPLINE("-b file","specify blacklist file.");
 #elif defined( WANT_ACCESSLIST_WHITE )
@@ -152,22 +209,24 @@ static size_t header_complete( char * request, ssize_t byte_count ) {
 }
 
 static void handle_dead( const int64 sock ) {
-  struct http_data* cookie=io_getcookie( sock );
+  struct http_data* cookie=loop_getcookie( sock );
   if( cookie ) {
     iob_reset( &cookie->batch );
     array_reset( &cookie->request );
+    if( cookie->shared )
+      iovec_shared_release( cookie->shared );
     if( cookie->flag & STRUCT_HTTP_FLAG_WAITINGFORTASK )
       mutex_workqueue_canceltask( sock );
     free( cookie );
   }
-  io_close( sock );
+  loop_close( sock );
 }
 
 static void handle_read( const int64 sock, struct ot_workstruct *ws ) {
-  struct http_data* cookie = io_getcookie( sock );
+  struct http_data* cookie = loop_getcookie( sock );
   ssize_t byte_count;
 
-  if( ( byte_count = io_tryread( sock, ws->inbuf, G_INBUF_SIZE ) ) <= 0 ) {
+  if( ( byte_count = loop_read( sock, ws->inbuf, G_INBUF_SIZE ) ) <= 0 ) {
     handle_dead( sock );
     return;
   }
@@ -201,51 +260,118 @@ static void handle_read( const int64 sock, struct ot_workstruct *ws ) {
 }
 
 static void handle_write( const int64 sock ) {
-  struct http_data* cookie=io_getcookie( sock );
+  struct http_data* cookie=loop_getcookie( sock );
   if( !cookie || ( iob_send( sock, &cookie->batch ) <= 0 ) )
     handle_dead( sock );
 }
 
-static void handle_accept( const int64 serversocket ) {
+static void handle_accept( const int64 serversocket, ot_loop *loop ) {
   struct http_data *cookie;
   int64 sock;
   ot_ip6 ip;
   uint16 port;
-  tai6464 t;
-
-  while( ( sock = socket_accept6( serversocket, ip, &port, NULL ) ) != -1 ) {
 
-    /* Put fd into a non-blocking mode */
-    io_nonblock( sock );
-
-    if( !io_fd( sock ) ||
-        !( cookie = (struct http_data*)malloc( sizeof(struct http_data) ) ) ) {
-      io_close( sock );
+  while( ( sock = loop_accept( serversocket, ip, &port ) ) != -1 ) {
+    if( !( cookie = (struct http_data*)malloc( sizeof(struct http_data) ) ) ) {
+      close( sock );
       continue;
     }
     memset(cookie, 0, sizeof( struct http_data ) );
     memcpy(cookie->ip,ip,sizeof(ot_ip6));
 
-    io_setcookie( sock, cookie );
-    io_wantread( sock );
+    if( !loop_add_connection( loop, sock, cookie ) ) {
+      free( cookie );
+      close( sock );
+      continue;
+    }
 
     stats_issue_event( EVENT_ACCEPT, FLAG_TCP, (uintptr_t)ip);
 
-    /* That breaks taia encapsulation. But there is no way to take system
-       time this often in FreeBSD and libowfat does not allow to set unix time */
-    taia_uint( &t, 0 ); /* Clear t */
-    tai_unix( &(t.sec), (g_now_seconds + OT_CLIENT_TIMEOUT) );
-    io_timeout( sock, t );
+    loop_timeout( sock, g_now_monotonic + OT_CLIENT_TIMEOUT );
   }
 }
 
+/* A new opentracker holds copies of handed over sockets, closing ours
+   leaves them open */
+static void stop_listening( ot_loop *loop ) {
+  size_t i;
+  for( i=0; i<g_listen_socket_count; ++i )
+    if( g_listen_sockets[i].loop == loop )
+      loop_close( g_listen_sockets[i].handed.sock );
+  if( loop == g_loops[0] && g_handoff_listener != -1 )
+    loop_close( g_handoff_listener );
+}
+
+/* A new opentracker takes over. It gets all listening sockets, then we
+   stop serving them and drain like on shutdown, so that the state handed
+   over is final. */
+static void handle_handoff( const int64 serversocket ) {
+  int64  conn = accept( serversocket, NULL, NULL );
+  size_t i;
+
+  if( conn == -1 )
+    return;
+  io_block( conn );
+
+  for( i=0; i<g_listen_socket_count; ++i )
+    if( handoff_send_socket( conn, &g_listen_sockets[i].handed ) ) {
+      close( conn );
+      return;
+    }
+  if( handoff_send_end( conn ) ) {
+    close( conn );
+    return;
+  }
+
+  g_handoff_conn = conn;
+  g_shutdown = g_stopping = 1;
+}
+
+/* Each thread counts itself in once all of its connections are finished,
+   the main thread waits for all of them or OT_SHUTDOWN_DRAIN seconds. Then
+   the torrents are handed over or the last snapshot is written and we leave
+   without walking the heap. */
+static void shutdown_drain( ot_loop *loop, int *drained ) {
+  static time_t deadline;
+  size_t i;
+
+  if( !*drained && !loop_busy( loop ) ) {
+    *drained = 1;
+    __sync_fetch_and_add( &g_drained, 1 );
+    loop_wakeup( g_loops[0] );
+  }
+
+  if( loop != g_loops[0] )
+    return;
+
+  if( !deadline ) {
+    deadline = g_now_monotonic + OT_SHUTDOWN_DRAIN;
+    for( i=1; i<g_io_threads; ++i )
+      loop_wakeup( g_loops[i] );
+  }
+
+  if( g_drained < (int)g_io_threads && g_now_monotonic < deadline )
+    return;
+
+  wait_state_loaded( );
+  g_opentracker_running = 0;
+  if( g_handoff_conn != -1 ) {
+    if( handoff_send_state( g_handoff_conn ) )
+      fprintf( stderr, "Warning: Handing over the torrents failed.\n" );
+  } else
+    snapshot_deinit( );
+#ifdef WANT_SYSLOGS
+  closelog();
+#endif
+  _exit( 0 );
+}
+
 static void * server_mainloop( void * args ) {
+  ot_loop *loop = (ot_loop*)args;
   struct ot_workstruct ws;
-  time_t next_timeout_check = g_now_seconds + OT_CLIENT_TIMEOUT_CHECKINTERVAL;
   struct iovec *iovector;
-  int    iovec_entries;
-
-  (void)args;
+  int    iovec_entries, stopped = 0, drained = 0;
+  ot_iovec_shared *shared;
 
   /* Initialize our "thread local storage" */
   ws.inbuf   = malloc( G_INBUF_SIZE );
@@ -256,54 +382,103 @@ static void * server_mainloop( void * args ) {
   if( !ws.inbuf || !ws.outbuf )
     panic( "Initializing worker failed" );
 
+  shard_enter( loop );
+
   for( ; ; ) {
     int64 sock;
 
-    io_wait();
+    /* Wake up at least every second, for the clock and the timer wheel */
+    loop_wait( loop, 1000 );
+    clock_update( );
 
-    while( ( sock = io_canread( ) ) != -1 ) {
-      const void *cookie = io_getcookie( sock );
+    while( ( sock = loop_canread( loop ) ) != -1 ) {
+      const void *cookie = loop_getcookie( sock );
       if( (intptr_t)cookie == FLAG_TCP )
-        handle_accept( sock );
+        handle_accept( sock, loop );
       else if( (intptr_t)cookie == FLAG_UDP )
         handle_udp6( sock, &ws );
       else if( (intptr_t)cookie == FLAG_SELFPIPE )
-        io_tryread( sock, ws.inbuf, G_INBUF_SIZE );
+        read( sock, ws.inbuf, G_INBUF_SIZE );
+      else if( (intptr_t)cookie == FLAG_HANDOFF )
+        handle_handoff( sock );
       else
         handle_read( sock, &ws );
     }
 
-    while( ( sock = mutex_workqueue_popresult( &iovec_entries, &iovector ) ) != -1 )
-      http_sendiovecdata( sock, &ws, iovec_entries, iovector );
+#ifdef WANT_SHARDS
+    {
+      /* Announces passed on by other threads and the answers to ours */
+      ot_shard_msg *msg = shard_take( ), *next;
+      for( ; msg; msg = next ) {
+        next = msg->next;
+        switch( msg->type ) {
+          case SHARD_UDP_ANNOUNCE:  udp_handle_shard_announce( msg, &ws ); break;
+          case SHARD_HTTP_ANNOUNCE: http_handle_shard_announce( msg, &ws ); break;
+          case SHARD_HTTP_REPLY:    http_send_shard_reply( msg, &ws ); break;
+        }
+      }
+    }
+#endif
+
+    while( ( sock = mutex_workqueue_popresult( &iovec_entries, &iovector, &shared ) ) != -1 )
+      http_sendiovecdata( sock, &ws, iovec_entries, iovector, shared );
 
-    while( ( sock = io_canwrite( ) ) != -1 )
+    while( ( sock = loop_canwrite( loop ) ) != -1 )
       handle_write( sock );
 
-    if( g_now_seconds > next_timeout_check ) {
-      while( ( sock = io_timeouted() ) != -1 )
-        handle_dead( sock );
-      next_timeout_check = g_now_seconds + OT_CLIENT_TIMEOUT_CHECKINTERVAL;
+    while( ( sock = loop_timeouted( loop, g_now_monotonic ) ) != -1 )
+      handle_dead( sock );
+
+    if( g_stopping && !stopped ) {
+      stop_listening( loop );
+      stopped = 1;
     }
 
+    if( g_shutdown )
+      shutdown_drain( loop, &drained );
+
     livesync_ticker();
+  }
+  return 0;
+}
 
-    /* Enforce setting the clock */
-    signal_handler( SIGALRM );
+static void ot_add_listener( ot_loop *loop, int64 sock, ot_ip6 ip, uint16_t port, PROTO_FLAG proto ) {
+  ot_listen_socket *sockets = realloc( g_listen_sockets, ( g_listen_socket_count + 1 ) * sizeof(ot_listen_socket) );
+  if( !sockets )
+    panic( "ot_add_listener" );
+  sockets[g_listen_socket_count].handed.sock  = sock;
+  sockets[g_listen_socket_count].handed.proto = proto;
+  memcpy( sockets[g_listen_socket_count].handed.ip, ip, sizeof(ot_ip6) );
+  sockets[g_listen_socket_count].handed.port  = port;
+  sockets[g_listen_socket_count].loop         = loop;
+  g_listen_sockets = sockets;
+  ++g_listen_socket_count;
+
+  /* Handed over sockets carry the steering for the old thread count */
+  if( proto == FLAG_UDP ) {
+    shard_steer_udp( sock );
   }
+
+  if( !( proto == FLAG_TCP ? loop_add_listener( loop, sock, (void*)proto ) : loop_add( loop, sock, (void*)proto ) ) )
+    panic( "loop_add" );
+}
+
+/* Takes an unused socket handed over for this address, if there is one */
+static int ot_try_adopt( ot_loop *loop, ot_ip6 ip, uint16_t port, PROTO_FLAG proto, ot_handoff_socket *handed, size_t handed_count ) {
+  size_t i;
+  for( i=0; i<handed_count; ++i )
+    if( handed[i].sock != -1 && handed[i].proto == proto && handed[i].port == port && !memcmp( handed[i].ip, ip, sizeof(ot_ip6) ) ) {
+      ot_add_listener( loop, handed[i].sock, ip, port, proto );
+      handed[i].sock = -1;
+      return 1;
+    }
   return 0;
 }
 
-static int64_t ot_try_bind( ot_ip6 ip, uint16_t port, PROTO_FLAG proto ) {
+static int64_t ot_try_bind( ot_loop *loop, ot_ip6 ip, uint16_t port, PROTO_FLAG proto ) {
   int64 sock = proto == FLAG_TCP ? socket_tcp6( ) : socket_udp6( );
-
-#ifndef WANT_V6
-  if( !ip6_isv4mapped(ip) ) {
-    exerr( "V4 Tracker is V4 only!" );
-  }
-#else
-  if( ip6_isv4mapped(ip) ) {
-    exerr( "V6 Tracker is V6 only!" );
-  }
+#ifdef SO_REUSEPORT
+  int one = 1;
 #endif
 
 #ifdef _DEBUG
@@ -317,18 +492,19 @@ static int64_t ot_try_bind( ot_ip6 ip, uint16_t port, PROTO_FLAG proto ) {
   }
 #endif
 
+#ifdef SO_REUSEPORT
+  /* Each I/O thread binds its own socket to the same address */
+  if( setsockopt( sock, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one) ) == -1 )
+    panic( "setsockopt SO_REUSEPORT" );
+#endif
+
   if( socket_bind6_reuse( sock, ip, port, 0 ) == -1 )
     panic( "socket_bind6_reuse" );
 
   if( ( proto == FLAG_TCP ) && ( socket_listen( sock, SOMAXCONN) == -1 ) )
     panic( "socket_listen" );
 
-  if( !io_fd( sock ) )
-    panic( "io_fd" );
-
-  io_setcookie( sock, (void*)proto );
-
-  io_wantread( sock );
+  ot_add_listener( loop, sock, ip, port, proto );
 
 #ifdef _DEBUG
   fputs( " success.\n", stderr);
@@ -337,6 +513,17 @@ static int64_t ot_try_bind( ot_ip6 ip, uint16_t port, PROTO_FLAG proto ) {
   return sock;
 }
 
+static void ot_listen( ot_ip6 ip, uint16_t port, PROTO_FLAG proto ) {
+  ot_listen_address *addresses = realloc( g_listen_addresses, ( g_listen_address_count + 1 ) * sizeof(ot_listen_address) );
+  if( !addresses )
+    panic( "ot_listen" );
+  memcpy( addresses[g_listen_address_count].ip, ip, sizeof(ot_ip6) );
+  addresses[g_listen_address_count].port  = port;
+  addresses[g_listen_address_count].proto = proto;
+  g_listen_addresses = addresses;
+  ++g_listen_address_count;
+}
+
 char * set_config_option( char **option, char *value ) {
 #ifdef _DEBUG
   fprintf( stderr, "Setting config option: %s\n", value );
@@ -404,17 +591,17 @@ int parse_configfile( char * config_filename ) {
     } else if(!byte_diff(p,14,"listen.tcp_udp" ) && isspace(p[14])) {
       uint16_t tmpport = 6969;
       if( !scan_ip6_port( p+15, tmpip, &tmpport )) goto parse_error;
-      ot_try_bind( tmpip, tmpport, FLAG_TCP ); ++bound;
-      ot_try_bind( tmpip, tmpport, FLAG_UDP ); ++bound;
+      ot_listen( tmpip, tmpport, FLAG_TCP ); ++bound;
+      ot_listen( tmpip, tmpport, FLAG_UDP ); ++bound;
     } else if(!byte_diff(p,10,"listen.tcp" ) && isspace(p[10])) {
       uint16_t tmpport = 6969;
       if( !scan_ip6_port( p+11, tmpip, &tmpport )) goto parse_error;
-      ot_try_bind( tmpip, tmpport, FLAG_TCP );
+      ot_listen( tmpip, tmpport, FLAG_TCP );
       ++bound;
     } else if(!byte_diff(p, 10, "listen.udp" ) && isspace(p[10])) {
       uint16_t tmpport = 6969;
       if( !scan_ip6_port( p+11, tmpip, &tmpport )) goto parse_error;
-      ot_try_bind( tmpip, tmpport, FLAG_UDP );
+      ot_listen( tmpip, tmpport, FLAG_UDP );
       ++bound;
 #ifdef WANT_ACCESSLIST_WHITE
     } else if(!byte_diff(p, 16, "access.whitelist" ) && isspace(p[16])) {
@@ -437,6 +624,42 @@ int parse_configfile( char * config_filename ) {
 #endif
     } else if(!byte_diff(p, 20, "tracker.redirect_url" ) && isspace(p[20])) {
       set_config_option( &g_redirecturl, p+21 );
+    } else if(!byte_diff(p, 24, "tracker.replycache_peers" ) && isspace(p[24])) {
+      unsigned long tmppeers;
+      if( !scan_ulong( p+25, &tmppeers ) ) goto parse_error;
+      g_replycache_min_peers = tmppeers;
+    } else if(!byte_diff(p, 18, "tracker.io_threads" ) && isspace(p[18])) {
+      if( !scan_ulong( p+19, &g_io_threads ) || !g_io_threads || g_io_threads > OT_MAX_THREADS ) goto parse_error;
+#ifdef WANT_IO_URING
+    } else if(!byte_diff(p, 18, "tracker.event_loop" ) && isspace(p[18])) {
+      if( !strcmp( p+19, "io_uring" ) ) g_loop_io_uring = 1;
+      else if( !strcmp( p+19, "epoll" ) ) g_loop_io_uring = 0;
+      else goto parse_error;
+#endif
+    } else if(!byte_diff(p, 17, "tracker.udp_batch" ) && isspace(p[17])) {
+      unsigned long tmpbatch;
+      if( !scan_ulong( p+18, &tmpbatch ) || !tmpbatch || tmpbatch > OT_UDP_BATCH_MAX ) goto parse_error;
+      g_udp_batch = tmpbatch;
+#ifdef WANT_FULLSCRAPE
+    } else if(!byte_diff(p, 24, "tracker.fullscrape_cache" ) && isspace(p[24])) {
+      if( !scan_ulong( p+25, &g_fullscrape_cache_interval ) ) goto parse_error;
+    } else if(!byte_diff(p, 26, "tracker.fullscrape_threads" ) && isspace(p[26])) {
+      if( !scan_ulong( p+27, &g_fullscrape_threads ) || g_fullscrape_threads > OT_MAX_THREADS ) goto parse_error;
+#endif
+    } else if(!byte_diff(p, 25, "tracker.snapshot_interval" ) && isspace(p[25])) {
+      if( !scan_ulong( p+26, &g_snapshot_interval ) ) goto parse_error;
+    } else if(!byte_diff(p, 22, "tracker.snapshot_peers" ) && isspace(p[22])) {
+      unsigned long tmppeers;
+      if( !scan_ulong( p+23, &tmppeers ) || tmppeers > 1 ) goto parse_error;
+      g_snapshot_peers = tmppeers;
+    } else if(!byte_diff(p, 16, "tracker.snapshot" ) && isspace(p[16])) {
+      set_config_option( &g_snapshot_file, p+17 );
+    } else if(!byte_diff(p, 15, "tracker.handoff" ) && isspace(p[15])) {
+      set_config_option( &g_handoff_path, p+16 );
+    } else if(!byte_diff(p, 16, "tracker.shutdown" ) && isspace(p[16])) {
+      if( !strcmp( p+17, "fast" ) ) g_shutdown_full = 0;
+      else if( !strcmp( p+17, "full" ) ) g_shutdown_full = 1;
+      else goto parse_error;
 #ifdef WANT_SYNC_LIVE
     } else if(!byte_diff(p, 24, "livesync.cluster.node_ip" ) && isspace(p[24])) {
       if( !scan_ip6( p+25, tmpip )) goto parse_error;
@@ -492,6 +715,16 @@ void load_state(const char * const state_filename ) {
   fclose( state_filehandle );
 }
 
+/* The state file only adds torrents not handed over */
+static void * load_handed_state( void * statefile ) {
+  if( handoff_receive_state( g_handoff_state ) < 0 && g_snapshot_file )
+    snapshot_load( g_snapshot_file );
+  close( g_handoff_state );
+  if( statefile )
+    load_state( statefile );
+  return NULL;
+}
+
 int drop_privileges ( const char * const serveruser, const char * const serverdir ) {
   struct passwd *pws = NULL;
 
@@ -546,15 +779,17 @@ int main( int argc, char **argv ) {
   int bound = 0, scanon = 1;
   uint16_t tmpport;
   char * statefile = 0;
+  ot_handoff_socket *handed = NULL;
+  ssize_t handed_count = 0;
+  int64 handoff = -1;
+  size_t i, j;
 
+  /* Listen on all addresses of both families by default */
   memset( serverip, 0, sizeof(ot_ip6) );
-#ifndef WANT_V6
-  serverip[10]=serverip[11]=-1;
-  noipv6=1;
-#endif
+  clock_update( );
 
   while( scanon ) {
-    switch( getopt( argc, argv, ":i:p:A:P:d:u:r:s:f:l:v"
+    switch( getopt( argc, argv, ":i:p:A:P:d:u:r:s:f:l:t:v"
 #ifdef WANT_ACCESSLIST_BLACK
 "b:"
 #elif defined( WANT_ACCESSLIST_WHITE )
@@ -572,10 +807,10 @@ int main( int argc, char **argv ) {
 #endif
       case 'p':
         if( !scan_ushort( optarg, &tmpport)) { usage( argv[0] ); exit( 1 ); }
-        ot_try_bind( serverip, tmpport, FLAG_TCP ); bound++; break;
+        ot_listen( serverip, tmpport, FLAG_TCP ); bound++; break;
       case 'P':
         if( !scan_ushort( optarg, &tmpport)) { usage( argv[0] ); exit( 1 ); }
-        ot_try_bind( serverip, tmpport, FLAG_UDP ); bound++; break;
+        ot_listen( serverip, tmpport, FLAG_UDP ); bound++; break;
 #ifdef WANT_SYNC_LIVE
       case 's':
         if( !scan_ushort( optarg, &tmpport)) { usage( argv[0] ); exit( 1 ); }
@@ -585,6 +820,9 @@ int main( int argc, char **argv ) {
       case 'u': set_config_option( &g_serveruser, optarg ); break;
       case 'r': set_config_option( &g_redirecturl, optarg ); break;
       case 'l': statefile = optarg; break;
+      case 't':
+        if( !scan_ulong( optarg, &g_io_threads ) || !g_io_threads || g_io_threads > OT_MAX_THREADS ) { usage( argv[0] ); exit( 1 ); }
+        break;
       case 'A':
         if( !scan_ip6( optarg, tmpip )) { usage( argv[0] ); exit( 1 ); }
         accesslist_blessip( tmpip, 0xffff ); /* Allow everything for now */
@@ -604,8 +842,36 @@ int main( int argc, char **argv ) {
 
   /* Bind to our default tcp/udp ports */
   if( !bound) {
-    ot_try_bind( serverip, 6969, FLAG_TCP );
-    ot_try_bind( serverip, 6969, FLAG_UDP );
+    ot_listen( serverip, 6969, FLAG_TCP );
+    ot_listen( serverip, 6969, FLAG_UDP );
+  }
+
+  /* A running opentracker hands over its listening sockets */
+  if( g_handoff_path && ( handoff = handoff_connect( g_handoff_path ) ) != -1 )
+    handed_count = handoff_receive_sockets( handoff, &handed );
+
+  /* Set up one loop per I/O thread, each with its own listening sockets */
+  for( i=0; i<g_io_threads; ++i )
+    if( !( g_loops[i] = loop_create( ) ) )
+      panic( "loop_create" );
+  shard_init( g_loops, g_io_threads );
+  for( i=0; i<g_io_threads; ++i )
+    for( j=0; j<g_listen_address_count; ++j )
+      if( !ot_try_adopt( g_loops[i], g_listen_addresses[j].ip, g_listen_addresses[j].port, g_listen_addresses[j].proto, handed, handed_count ) )
+        ot_try_bind( g_loops[i], g_listen_addresses[j].ip, g_listen_addresses[j].port, g_listen_addresses[j].proto );
+
+  /* Handed over sockets left, from more threads or other addresses, are
+     served all the same */
+  for( i=0; i<(size_t)handed_count; ++i )
+    if( handed[i].sock != -1 )
+      ot_add_listener( g_loops[i%g_io_threads], handed[i].sock, handed[i].ip, handed[i].port, handed[i].proto );
+  free( handed );
+
+  if( g_handoff_path ) {
+    if( ( g_handoff_listener = handoff_listen( g_handoff_path ) ) == -1 )
+      panic( "handoff_listen" );
+    if( !loop_add( g_loops[0], g_handoff_listener, (void*)FLAG_HANDOFF ) )
+      panic( "loop_add" );
   }
 
 #ifdef WANT_SYSLOGS
@@ -616,30 +882,36 @@ int main( int argc, char **argv ) {
   if( drop_privileges( g_serveruser ? g_serveruser : "nobody", g_serverdir ) == -1 )
     panic( "drop_privileges failed, exiting. Last error");
 
-  g_now_seconds = time( NULL );
-
-  /* Create our self pipe which allows us to interrupt mainloops
-     io_wait in case some data is available to send out */
-  if( pipe( g_self_pipe ) == -1 )
-    panic( "selfpipe failed: " );
-  if( !io_fd( g_self_pipe[0] ) )
-    panic( "selfpipe io_fd failed: " );
-  io_setcookie( g_self_pipe[0], (void*)FLAG_SELFPIPE );
-  io_wantread( g_self_pipe[0] );
-
   defaul_signal_handlers( );
   /* Init all sub systems. This call may fail with an exit() */
   trackerlogic_init( );
 
-  if( statefile )
-    load_state( statefile );
+  /* Torrents come from the opentracker handing over, while we already
+     serve its sockets, or from the last snapshot */
+  if( handoff != -1 ) {
+    g_handoff_state = handoff;
+    if( !pthread_create( &g_state_loader, NULL, load_handed_state, statefile ) )
+      g_state_loading = 1;
+    else
+      load_handed_state( statefile );
+  } else {
+    if( g_snapshot_file )
+      snapshot_load( g_snapshot_file );
+    if( statefile )
+      load_state( statefile );
+  }
 
-  install_signal_handlers( );
+  /* Additional I/O threads inherit the blocked signals, only the main
+     thread handles them */
+  for( i=1; i<g_io_threads; ++i ) {
+    pthread_t thread_id;
+    if( pthread_create( &thread_id, NULL, server_mainloop, g_loops[i] ) )
+      panic( "pthread_create" );
+  }
 
-  /* Kick off our initial clock setting alarm */
-  alarm(5);
+  install_signal_handlers( );
 
-  server_mainloop( 0 );
+  server_mainloop( g_loops[0] );
 
   return 0;
 }
@@ -5,8 +5,12 @@
 
 /* System */
 #include <pthread.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#if defined( __x86_64__ ) || defined( __i386__ )
+#include <immintrin.h>
+#endif
 
 /* Libowfat */
 #include "io.h"
@@ -17,42 +21,263 @@
 #include "ot_vector.h"
 #include "ot_clean.h"
 
-/* Returns amount of removed peers */
-static ssize_t clean_single_bucket( ot_peer *peers, size_t peer_count, time_t timedout, int *removed_seeders ) {
-  ot_peer *last_peer = peers + peer_count, *insert_point;
-  time_t timediff;
+/* Torrents with peers hang in the wheel slot of the minute their oldest
+   peer times out, idle torrents in the slot of the hour they time out.
+   Slots hold hashes, torrents are looked up when their slot is due. The
+   minute a torrent is due is kept in its peer list, entries not matching
+   are left over from earlier and are dropped. Each wheel is guarded by
+   the lock of its bucket. */
+typedef struct {
+  ot_hash *data;
+  size_t   size;
+  size_t   space;
+} ot_clean_slot;
 
-  /* Two scan modes: unless there is one peer removed, just increase ot_peertime */
-  while( peers < last_peer ) {
-    if( ( timediff = timedout + OT_PEERTIME( peers ) ) >= OT_PEER_TIMEOUT )
-      break;
-    OT_PEERTIME( peers++ ) = timediff;
+typedef struct {
+  ot_clean_slot torrents[OT_CLEAN_WHEEL_MINUTES];
+  ot_clean_slot idle[OT_CLEAN_WHEEL_HOURS];
+  ot_time       minute;  /* the next minute to be visited */
+} ot_clean_wheel;
+
+static ot_clean_wheel g_clean_wheels[OT_BUCKET_COUNT];
+
+static void clean_slot_add( ot_clean_slot *slot, const ot_hash hash ) {
+  if( slot->size == slot->space ) {
+    size_t   space = slot->space ? 2 * slot->space : 16;
+    ot_hash *data = realloc( slot->data, space * sizeof(ot_hash) );
+    /* The torrent is not cleaned before its next announce, then */
+    if( !data )
+      return;
+    slot->data  = data;
+    slot->space = space;
   }
+  memcpy( slot->data[slot->size++], hash, sizeof(ot_hash) );
+}
 
-  /* If we at least remove one peer, we have to copy  */
-  insert_point = peers;
-  while( peers < last_peer )
-    if( ( timediff = timedout + OT_PEERTIME( peers ) ) < OT_PEER_TIMEOUT ) {
-      OT_PEERTIME( peers ) = timediff;
-      memcpy( insert_point++, peers++, sizeof(ot_peer));
-    } else
-      if( OT_PEERFLAG( peers++ ) & PEER_FLAG_SEEDING )
-        (*removed_seeders)++;
+void clean_schedule_torrent( ot_torrent *torrent, ot_time due ) {
+  ot_clean_wheel *wheel = g_clean_wheels + OT_BUCKET_BY_HASH( torrent->hash );
 
-  return peers - insert_point;
+  /* Slots passed already are only visited on the next turn */
+  if( due < wheel->minute )
+    due = wheel->minute;
+  torrent->peer_list->due = due;
+  clean_slot_add( wheel->torrents + due % OT_CLEAN_WHEEL_MINUTES, torrent->hash );
 }
 
-/* Clean a single torrent
-   return 1 if torrent timed out
-*/
-int clean_single_torrent( ot_torrent *torrent ) {
+/* An idle torrent is due once it is older than OT_TORRENT_TIMEOUT */
+static ot_time clean_idle_due( const ot_idle_torrent *idle ) {
+  return g_now_minutes - OT_IDLE_AGE( idle ) + OT_TORRENT_TIMEOUT + 1;
+}
+
+void clean_schedule_idle( ot_idle_torrent *idle ) {
+  ot_clean_wheel *wheel = g_clean_wheels + OT_BUCKET_BY_HASH( idle->hash );
+  ot_time         due = clean_idle_due( idle );
+
+  if( due < wheel->minute )
+    due = wheel->minute;
+  clean_slot_add( wheel->idle + ( ( due + 59 ) / 60 ) % OT_CLEAN_WHEEL_HOURS, idle->hash );
+}
+
+/* Peers are aged in blocks of OT_CLEAN_BLOCK bytes, a multiple of both
+   peer sizes and vector widths. The masks mark each peer's time byte and
+   the seeding bit in its flag byte. A time byte never is the first in a
+   vector, so its flag byte is in the same one. */
+#define OT_CLEAN_BLOCK 160
+
+typedef struct {
+  uint8_t time[OT_CLEAN_BLOCK];
+  uint8_t seed[OT_CLEAN_BLOCK];
+} ot_clean_masks;
+
+typedef struct {
+  size_t expired;  /* peers timed out */
+  size_t seeders;  /* seeders among them */
+  size_t first;    /* position of the first one */
+  int    oldest;   /* highest age of those kept */
+} ot_clean_aged;
+
+/* Kernels adding timedout to the age of all peers, timed out ones keep an
+   age of OT_PEER_TIMEOUT or more. And those moving the peers kept from
+   first on to the front, returning their new number. */
+typedef void   (*ot_clean_age)( uint8_t *peers, size_t count, int family, int timedout, ot_clean_aged *aged );
+typedef size_t (*ot_clean_compact)( uint8_t *peers, size_t count, int family, size_t first );
+
+static ot_clean_masks g_clean_masks[OT_PEER_FAMILIES];
+static uint32_t       g_clean_lanes[16][8];
+
+static void clean_age_peers( uint8_t *peers, size_t pos, size_t count, size_t peer_size, int timedout, ot_clean_aged *aged ) {
+  for( ; pos<count; ++pos ) {
+    uint8_t *peer = peers + pos * peer_size;
+    int      age = OT_PEERTIME_D( peer, peer_size ) += timedout;
+
+    if( age < OT_PEER_TIMEOUT ) {
+      if( age > aged->oldest )
+        aged->oldest = age;
+      continue;
+    }
+    if( !aged->expired++ )
+      aged->first = pos;
+    if( OT_PEERFLAG_D( peer, peer_size ) & PEER_FLAG_SEEDING )
+      ++aged->seeders;
+  }
+}
+
+static size_t clean_compact_peers( uint8_t *peers, size_t pos, size_t kept, size_t count, size_t peer_size ) {
+  for( ; pos<count; ++pos ) {
+    if( OT_PEERTIME_D( peers + pos * peer_size, peer_size ) >= OT_PEER_TIMEOUT )
+      continue;
+    if( kept != pos )
+      memcpy( peers + kept * peer_size, peers + pos * peer_size, peer_size );
+    ++kept;
+  }
+  return kept;
+}
+
+static void clean_age_scalar( uint8_t *peers, size_t count, int family, int timedout, ot_clean_aged *aged ) {
+  clean_age_peers( peers, 0, count, OT_PEER_SIZE_FOR_FAMILY( family ), timedout, aged );
+}
+
+static size_t clean_compact_scalar( uint8_t *peers, size_t count, int family, size_t first ) {
+  return clean_compact_peers( peers, first, first, count, OT_PEER_SIZE_FOR_FAMILY( family ) );
+}
+
+#if defined( __x86_64__ ) || defined( __i386__ )
+__attribute__(( target( "sse2" ) ))
+static void clean_age_sse2( uint8_t *peers, size_t count, int family, int timedout, ot_clean_aged *aged ) {
+  const ot_clean_masks *masks = g_clean_masks + family;
+  const __m128i add = _mm_set1_epi8( timedout ), limit = _mm_set1_epi8( OT_PEER_TIMEOUT - 1 );
+  __m128i       oldest = _mm_setzero_si128( );
+  size_t        peer_size = OT_PEER_SIZE_FOR_FAMILY( family ), block = OT_CLEAN_BLOCK / peer_size, pos, i;
+  uint8_t       ages[16];
+
+  for( pos=0; pos + block <= count; pos += block ) {
+    uint8_t *p = peers + pos * peer_size;
+    for( i=0; i<OT_CLEAN_BLOCK; i+=16 ) {
+      __m128i  time = _mm_loadu_si128( (const __m128i*)( masks->time + i ) );
+      __m128i  seed = _mm_loadu_si128( (const __m128i*)( masks->seed + i ) );
+      __m128i  v = _mm_add_epi8( _mm_loadu_si128( (const __m128i*)( p + i ) ), _mm_and_si128( time, add ) );
+      __m128i  gone = _mm_and_si128( _mm_cmpgt_epi8( v, limit ), time );
+      uint32_t expired;
+
+      _mm_storeu_si128( (__m128i*)( p + i ), v );
+      oldest = _mm_max_epu8( oldest, _mm_andnot_si128( gone, _mm_and_si128( v, time ) ) );
+      if( !( expired = _mm_movemask_epi8( gone ) ) )
+        continue;
+      if( !aged->expired )
+        aged->first = pos + ( i + __builtin_ctz( expired ) ) / peer_size;
+      aged->expired += __builtin_popcount( expired );
+      aged->seeders += __builtin_popcount( expired & ( (uint32_t)_mm_movemask_epi8( _mm_cmpeq_epi8( _mm_and_si128( v, seed ), seed ) ) << 1 ) );
+    }
+  }
+
+  _mm_storeu_si128( (__m128i*)ages, oldest );
+  for( i=0; i<sizeof(ages); ++i )
+    if( ages[i] > aged->oldest )
+      aged->oldest = ages[i];
+  clean_age_peers( peers, pos, count, peer_size, timedout, aged );
+}
+
+__attribute__(( target( "avx2" ) ))
+static void clean_age_avx2( uint8_t *peers, size_t count, int family, int timedout, ot_clean_aged *aged ) {
+  const ot_clean_masks *masks = g_clean_masks + family;
+  const __m256i add = _mm256_set1_epi8( timedout ), limit = _mm256_set1_epi8( OT_PEER_TIMEOUT - 1 );
+  __m256i       oldest = _mm256_setzero_si256( );
+  size_t        peer_size = OT_PEER_SIZE_FOR_FAMILY( family ), block = OT_CLEAN_BLOCK / peer_size, pos, i;
+  uint8_t       ages[32];
+
+  for( pos=0; pos + block <= count; pos += block ) {
+    uint8_t *p = peers + pos * peer_size;
+    for( i=0; i<OT_CLEAN_BLOCK; i+=32 ) {
+      __m256i  time = _mm256_loadu_si256( (const __m256i*)( masks->time + i ) );
+      __m256i  seed = _mm256_loadu_si256( (const __m256i*)( masks->seed + i ) );
+      __m256i  v = _mm256_add_epi8( _mm256_loadu_si256( (const __m256i*)( p + i ) ), _mm256_and_si256( time, add ) );
+      __m256i  gone = _mm256_and_si256( _mm256_cmpgt_epi8( v, limit ), time );
+      uint32_t expired;
+
+      _mm256_storeu_si256( (__m256i*)( p + i ), v );
+      oldest = _mm256_max_epu8( oldest, _mm256_andnot_si256( gone, _mm256_and_si256( v, time ) ) );
+      if( !( expired = _mm256_movemask_epi8( gone ) ) )
+        continue;
+      if( !aged->expired )
+        aged->first = pos + ( i + __builtin_ctz( expired ) ) / peer_size;
+      aged->expired += __builtin_popcount( expired );
+      aged->seeders += __builtin_popcount( expired & ( (uint32_t)_mm256_movemask_epi8( _mm256_cmpeq_epi8( _mm256_and_si256( v, seed ), seed ) ) << 1 ) );
+    }
+  }
+
+  _mm256_storeu_si256( (__m256i*)ages, oldest );
+  for( i=0; i<sizeof(ages); ++i )
+    if( ages[i] > aged->oldest )
+      aged->oldest = ages[i];
+  clean_age_peers( peers, pos, count, peer_size, timedout, aged );
+}
+
+/* Four v4 peers per vector, the ones kept are shuffled to the front and
+   stored over those already looked at */
+__attribute__(( target( "avx2" ) ))
+static size_t clean_compact_avx2( uint8_t *peers, size_t count, int family, size_t first ) {
+  const __m256i limit = _mm256_set1_epi8( OT_PEER_TIMEOUT - 1 );
+  size_t        pos = first, kept = first;
+
+  if( family != OT_PEER_FAMILY_V4 )
+    return clean_compact_scalar( peers, count, family, first );
+
+  for( ; pos + 4 <= count; pos += 4 ) {
+    __m256i v = _mm256_loadu_si256( (const __m256i*)( peers + pos * OT_PEER_SIZE4 ) );
+    int     keep = ~_mm256_movemask_pd( _mm256_castsi256_pd( _mm256_cmpgt_epi8( v, limit ) ) ) & 15;
+
+    _mm256_storeu_si256( (__m256i*)( peers + kept * OT_PEER_SIZE4 ),
+                         _mm256_permutevar8x32_epi32( v, _mm256_loadu_si256( (const __m256i*)g_clean_lanes[keep] ) ) );
+    kept += __builtin_popcount( keep );
+  }
+  return clean_compact_peers( peers, pos, kept, count, OT_PEER_SIZE4 );
+}
+#endif
+
+static ot_clean_age     g_clean_age     = clean_age_scalar;
+static ot_clean_compact g_clean_compact = clean_compact_scalar;
+
+static void clean_init_kernels( void ) {
+  int    family, keep, lane;
+  size_t i;
+
+  for( family=0; family<OT_PEER_FAMILIES; ++family ) {
+    size_t peer_size = OT_PEER_SIZE_FOR_FAMILY( family );
+    for( i=peer_size; i<=OT_CLEAN_BLOCK; i+=peer_size ) {
+      g_clean_masks[family].time[i-1] = 0xff;
+      g_clean_masks[family].seed[i-2] = PEER_FLAG_SEEDING;
+    }
+  }
+  for( keep=0; keep<16; ++keep )
+    for( lane=0, i=0; lane<4; ++lane )
+      if( keep & ( 1 << lane ) ) {
+        g_clean_lanes[keep][i++] = 2 * lane;
+        g_clean_lanes[keep][i++] = 2 * lane + 1;
+      }
+
+#if defined( __x86_64__ ) || defined( __i386__ )
+  __builtin_cpu_init( );
+  if( __builtin_cpu_supports( "avx2" ) ) {
+    g_clean_age     = clean_age_avx2;
+    g_clean_compact = clean_compact_avx2;
+  } else if( __builtin_cpu_supports( "sse2" ) )
+    g_clean_age     = clean_age_sse2;
+#endif
+}
+
+/* Ages the torrent's peers to now and drops those timed out. Returns 1 if
+   the torrent timed out. With due given, the peers are looked at even if
+   the torrent was cleaned this minute, to tell when the oldest times out */
+static int clean_torrent( ot_torrent *torrent, ot_time *due ) {
   ot_peerlist *peer_list = torrent->peer_list;
-  ot_vector *bucket_list = &peer_list->peers;
-  time_t timedout = (time_t)( g_now_minutes - peer_list->base );
-  int num_buckets = 1, removed_seeders = 0;
+  time_t timedout = (time_t)( g_now_minutes - peer_list->base ), oldest = 0;
+  int    family;
+
+  if( due )
+    *due = g_now_minutes + OT_PEER_TIMEOUT;
 
   /* No need to clean empty torrent */
-  if( !timedout )
+  if( !timedout && !due )
     return 0;
 
   /* Torrent has idled out */
@@ -66,25 +291,33 @@ int clean_single_torrent( ot_torrent *torrent ) {
     timedout = OT_PEER_TIMEOUT;
   }
 
-  if( OT_PEERLIST_HASBUCKETS( peer_list ) ) {
-    num_buckets = bucket_list->size;
-    bucket_list = (ot_vector *)bucket_list->data;
-  }
-
-  while( num_buckets-- ) {
-    size_t removed_peers = clean_single_bucket( bucket_list->data, bucket_list->size, timedout, &removed_seeders );
-    peer_list->peer_count -= removed_peers;
-    bucket_list->size     -= removed_peers;
-    if( bucket_list->size < removed_peers )
-      vector_fixup_peers( bucket_list );
-    ++bucket_list;
-  }
+  /* All peers are aged at once. Few timed out of an indexed set are
+     swapped out for the last one, working from the back so that one is
+     always kept. Otherwise those kept are packed and indexed anew. */
+  for( family=0; family<OT_PEER_FAMILIES; ++family ) {
+    ot_peerset   *set = peer_list->families + family;
+    size_t        peer_size = OT_PEER_SIZE_FOR_FAMILY( family ), pos;
+    ot_clean_aged aged;
 
-  peer_list->seed_count -= removed_seeders;
+    memset( &aged, 0, sizeof(aged) );
+    g_clean_age( set->peers.data, set->peers.size, family, (int)timedout, &aged );
+    if( aged.oldest > oldest )
+      oldest = aged.oldest;
+    if( !aged.expired )
+      continue;
 
-  /* See, if we need to convert a torrent from simple vector to bucket list */
-  if( ( peer_list->peer_count > OT_PEER_BUCKET_MINCOUNT ) || OT_PEERLIST_HASBUCKETS(peer_list) )
-    vector_redistribute_buckets( peer_list );
+    peer_list->seed_count -= aged.seeders;
+    peer_list->peer_count -= aged.expired;
+    peer_list->changed = g_now_seconds;
+    if( !set->index || aged.expired * OT_CLEAN_REINDEX_SHARE >= set->peers.size ) {
+      set->peers.size = g_clean_compact( set->peers.data, set->peers.size, family, aged.first );
+      vector_reindex_peers( set, peer_size );
+    } else {
+      for( pos=set->peers.size; pos-- > aged.first; )
+        if( OT_PEERTIME_D( (uint8_t*)set->peers.data + pos * peer_size, peer_size ) >= OT_PEER_TIMEOUT )
+          vector_remove_peer_at( set, pos, peer_size );
+    }
+  }
 
   if( peer_list->peer_count )
     peer_list->base = g_now_minutes;
@@ -93,45 +326,223 @@ int clean_single_torrent( ot_torrent *torrent ) {
      has been touched is OT_PEER_TIMEOUT Minutes before */
     peer_list->base = g_now_minutes - OT_PEER_TIMEOUT;
   }
+  if( due )
+    *due = g_now_minutes + OT_PEER_TIMEOUT - oldest;
   return 0;
+}
+
+/* Clean a single torrent
+   return 1 if torrent timed out
+*/
+int clean_single_torrent( ot_torrent *torrent ) {
+  return clean_torrent( torrent, NULL );
+}
+
+/* Torrents removed are logged oldest first, entries older than
+   OT_CLEAN_REMOVED_KEEP are dropped from the front */
+typedef struct {
+  ot_hash hash;
+  ot_time removed;
+} ot_removed_torrent;
+
+static pthread_mutex_t     g_removed_lock = PTHREAD_MUTEX_INITIALIZER;
+static ot_removed_torrent *g_removed;
+static size_t              g_removed_first, g_removed_size, g_removed_space;
+static ot_time             g_removed_start;
+
+static void clean_log_removed( ot_hash hash ) {
+  ot_removed_torrent *entry;
+
+  pthread_mutex_lock( &g_removed_lock );
+  while( g_removed_first < g_removed_size && g_now_seconds - g_removed[g_removed_first].removed > OT_CLEAN_REMOVED_KEEP )
+    ++g_removed_first;
+
+  /* Move entries to the front before growing */
+  if( g_removed_size == g_removed_space ) {
+    if( g_removed_first > g_removed_size / 2 ) {
+      memmove( g_removed, g_removed + g_removed_first, ( g_removed_size - g_removed_first ) * sizeof(ot_removed_torrent) );
+      g_removed_size -= g_removed_first;
+      g_removed_first = 0;
+    } else {
+      size_t space = g_removed_space ? 2 * g_removed_space : 1024;
+      ot_removed_torrent *removed = realloc( g_removed, space * sizeof(ot_removed_torrent) );
+
+      /* Deltas reaching back this far can not be told anymore */
+      if( !removed ) {
+        g_removed_first = g_removed_size = 0;
+        g_removed_start = g_now_seconds;
+        pthread_mutex_unlock( &g_removed_lock );
+        return;
+      }
+      g_removed = removed;
+      g_removed_space = space;
+    }
+  }
+
+  entry = g_removed + g_removed_size++;
+  memcpy( entry->hash, hash, sizeof(ot_hash) );
+  entry->removed = g_now_seconds;
+  pthread_mutex_unlock( &g_removed_lock );
+}
 
+ot_time clean_removed_horizon( void ) {
+  ot_time horizon = g_now_seconds - OT_CLEAN_REMOVED_KEEP;
+  return horizon > g_removed_start ? horizon : g_removed_start;
 }
 
-/* Clean up all peers in current bucket, remove timedout pools and
- torrents */
+size_t clean_removed_since( ot_time since, ot_hash **hashes ) {
+  size_t first, count, i;
+
+  *hashes = NULL;
+  pthread_mutex_lock( &g_removed_lock );
+  for( first = g_removed_first; first < g_removed_size && g_removed[first].removed < since; ++first );
+  count = g_removed_size - first;
+  if( count && ( *hashes = malloc( count * sizeof(ot_hash) ) ) ) {
+    for( i=0; i<count; ++i )
+      memcpy( (*hashes)[i], g_removed[first+i].hash, sizeof(ot_hash) );
+  } else
+    count = 0;
+  pthread_mutex_unlock( &g_removed_lock );
+  return count;
+}
+
+/* Entries of a slot due a turn of the wheel later are put back, after the
+   clock jumped, or when the cleaner fell behind */
+static int clean_visit_torrents( ot_torrent_list *torrents_list, ot_clean_wheel *wheel, ot_time minute ) {
+  ot_clean_slot slot = wheel->torrents[minute % OT_CLEAN_WHEEL_MINUTES];
+  int           delta_torrentcount = 0;
+  size_t        i;
+
+  memset( wheel->torrents + minute % OT_CLEAN_WHEEL_MINUTES, 0, sizeof(ot_clean_slot) );
+  for( i=0; i<slot.size; ++i ) {
+    ot_torrent *torrent = index_find_torrent( torrents_list, slot.data[i] );
+    ot_time     due;
+
+    if( !torrent || torrent->peer_list->due % OT_CLEAN_WHEEL_MINUTES != minute % OT_CLEAN_WHEEL_MINUTES )
+      continue;
+    if( torrent->peer_list->due > g_now_minutes ) {
+      clean_slot_add( wheel->torrents + minute % OT_CLEAN_WHEEL_MINUTES, torrent->hash );
+      continue;
+    }
+
+    if( clean_torrent( torrent, &due ) ) {
+      clean_log_removed( torrent->hash );
+      index_remove_torrent( torrents_list, torrent );
+      --delta_torrentcount;
+      continue;
+    }
+
+    /* Torrents without peers keep only their completed count */
+    if( !torrent->peer_list->peer_count ) {
+      ot_idle_torrent *idle;
+      ot_hash          hash;
+
+      if( !torrent->peer_list->down_count ) {
+        clean_log_removed( torrent->hash );
+        index_remove_torrent( torrents_list, torrent );
+        --delta_torrentcount;
+        continue;
+      }
+      memcpy( hash, torrent->hash, sizeof(ot_hash) );
+      if( !index_demote_torrent( torrents_list, torrent ) ) {
+        if( ( idle = index_find_idle( torrents_list, hash ) ) )
+          clean_schedule_idle( idle );
+        continue;
+      }
+    }
+    clean_schedule_torrent( torrent, due );
+  }
+  free( slot.data );
+  return delta_torrentcount;
+}
+
+static int clean_visit_idle( ot_torrent_list *torrents_list, ot_clean_wheel *wheel, ot_time hour ) {
+  ot_clean_slot slot = wheel->idle[hour % OT_CLEAN_WHEEL_HOURS];
+  int           delta_torrentcount = 0;
+  size_t        i;
+
+  memset( wheel->idle + hour % OT_CLEAN_WHEEL_HOURS, 0, sizeof(ot_clean_slot) );
+  for( i=0; i<slot.size; ++i ) {
+    ot_idle_torrent *idle = index_find_idle( torrents_list, slot.data[i] );
+    ot_time          due;
+
+    if( !idle )
+      continue;
+    if( OT_IDLE_AGE( idle ) > OT_TORRENT_TIMEOUT ) {
+      clean_log_removed( idle->hash );
+      index_remove_idle( torrents_list, idle );
+      --delta_torrentcount;
+      continue;
+    }
+    due = ( clean_idle_due( idle ) + 59 ) / 60;
+    if( due % OT_CLEAN_WHEEL_HOURS == hour % OT_CLEAN_WHEEL_HOURS )
+      clean_slot_add( wheel->idle + hour % OT_CLEAN_WHEEL_HOURS, idle->hash );
+  }
+  free( slot.data );
+  return delta_torrentcount;
+}
+
+/* Visits the wheel slots of every minute passed, bucket by bucket. Only
+   torrents with peers due and idle torrents timing out are looked at, the
+   work done follows the churn, not the number of torrents */
 static void * clean_worker( void * args ) {
   args=args;
   while( 1 ) {
-    int bucket = OT_BUCKET_COUNT;
-    while( bucket-- ) {
-      ot_vector *torrents_list = mutex_bucket_lock( bucket );
-      size_t     toffs;
-      int        delta_torrentcount = 0;
-
-      for( toffs=0; toffs<torrents_list->size; ++toffs ) {
-        ot_torrent *torrent = ((ot_torrent*)(torrents_list->data)) + toffs;
-        if( clean_single_torrent( torrent ) ) {
-          vector_remove_torrent( torrents_list, torrent );
-          --delta_torrentcount;
-          --toffs;
-        }
+    int bucket;
+    for( bucket=0; bucket<OT_BUCKET_COUNT; ++bucket ) {
+      ot_torrent_list *torrents_list;
+      ot_clean_wheel  *wheel = g_clean_wheels + bucket;
+      int              delta_torrentcount = 0;
+
+      /* Only we move on the wheel, no need to lock for looking */
+      if( wheel->minute > g_now_minutes )
+        continue;
+      torrents_list = mutex_bucket_lock( bucket );
+
+      /* After the clock jumped, one turn visits every slot */
+      if( g_now_minutes - wheel->minute >= OT_CLEAN_WHEEL_HOURS * 60 )
+        wheel->minute = g_now_minutes - OT_CLEAN_WHEEL_HOURS * 60 + 1;
+
+      while( wheel->minute <= g_now_minutes ) {
+        ot_time minute = wheel->minute++;
+        delta_torrentcount += clean_visit_torrents( torrents_list, wheel, minute );
+        if( !( minute % 60 ) )
+          delta_torrentcount += clean_visit_idle( torrents_list, wheel, minute / 60 );
       }
       mutex_bucket_unlock( bucket, delta_torrentcount );
       if( !g_opentracker_running )
         return NULL;
-      usleep( OT_CLEAN_SLEEP );
     }
+    mutex_reclaim( );
+    sleep( 1 );
   }
   return NULL;
 }
 
 static pthread_t thread_id;
 void clean_init( void ) {
+  int bucket;
+  clean_init_kernels( );
+  for( bucket=0; bucket<OT_BUCKET_COUNT; ++bucket )
+    g_clean_wheels[bucket].minute = g_now_minutes;
+  g_removed_start = g_now_seconds;
   pthread_create( &thread_id, NULL, clean_worker, NULL );
 }
 
 void clean_deinit( void ) {
+  int bucket, i;
+
   pthread_cancel( thread_id );
+  for( bucket=0; bucket<OT_BUCKET_COUNT; ++bucket ) {
+    for( i=0; i<OT_CLEAN_WHEEL_MINUTES; ++i )
+      free( g_clean_wheels[bucket].torrents[i].data );
+    for( i=0; i<OT_CLEAN_WHEEL_HOURS; ++i )
+      free( g_clean_wheels[bucket].idle[i].data );
+  }
+  memset( g_clean_wheels, 0, sizeof(g_clean_wheels) );
+  free( g_removed );
+  g_removed = NULL;
+  g_removed_first = g_removed_size = g_removed_space = 0;
 }
 
 const char *g_version_clean_c = "$Source: /home/cvsroot/opentracker/ot_clean.c,v $: $Revision: 1.19 $\n";
@@ -6,14 +6,34 @@
 #ifndef __OT_CLEAN_H__
 #define __OT_CLEAN_H__
 
-/* The amount of time a clean cycle should take */
-#define OT_CLEAN_INTERVAL_MINUTES       2
+/* Torrents are visited when their oldest peer times out, the wheel of
+   minutes needs to reach further than OT_PEER_TIMEOUT. Idle torrents are
+   visited within the hour they time out, the wheel of hours needs to
+   reach further than OT_TORRENT_TIMEOUT. */
+#define OT_CLEAN_WHEEL_MINUTES 64
+#define OT_CLEAN_WHEEL_HOURS   32
 
-/* So after each bucket wait 1 / OT_BUCKET_COUNT intervals */
-#define OT_CLEAN_SLEEP ( ( ( OT_CLEAN_INTERVAL_MINUTES ) * 60 * 1000000 ) / ( OT_BUCKET_COUNT ) )
+/* Peers timed out are swapped out one by one, unless they are at least
+   one in this many of an indexed set, then the set is indexed anew */
+#define OT_CLEAN_REINDEX_SHARE 8
+
+/* Torrents removed are remembered this many seconds for delta full
+   scrapes */
+#define OT_CLEAN_REMOVED_KEEP ( 24 * 60 * 60 )
 
 void clean_init( void );
 void clean_deinit( void );
 int  clean_single_torrent( ot_torrent *torrent );
 
+/* New torrents and idle torrents are handed to the cleaner, with the lock
+   of their bucket held. A torrent is visited in the minute due, or later */
+void clean_schedule_torrent( ot_torrent *torrent, ot_time due );
+void clean_schedule_idle( ot_idle_torrent *idle );
+
+/* Removals are known completely from this time on */
+ot_time clean_removed_horizon( void );
+/* Fills in an array of the hashes removed since, to be freed by the
+   caller, and returns their number */
+size_t  clean_removed_since( ot_time since, ot_hash **hashes );
+
 #endif
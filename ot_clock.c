@@ -0,0 +1,40 @@
+/* This software was written by Dirk Engling <erdgeist@erdgeist.org>
+   It is considered beerware. Prost. Skol. Cheers or whatever.
+
+   $id$ */
+
+/* System */
+#include <stdint.h>
+#include <time.h>
+
+/* Opentracker */
+#include "trackerlogic.h"
+#include "ot_clock.h"
+
+#ifndef CLOCK_REALTIME_COARSE
+#define CLOCK_REALTIME_COARSE CLOCK_REALTIME
+#endif
+#ifndef CLOCK_MONOTONIC_COARSE
+#define CLOCK_MONOTONIC_COARSE CLOCK_MONOTONIC
+#endif
+
+time_t g_now_seconds;
+time_t g_now_monotonic;
+
+/* All threads write the same values and only once a second, so the cache
+   line is not bounced around with every batch. The monotonic clock never
+   goes back, not even when a thread having read it early stores late. */
+void clock_update( void ) {
+  struct timespec now;
+
+  if( !clock_gettime( CLOCK_REALTIME_COARSE, &now ) && now.tv_sec != g_now_seconds )
+    g_now_seconds = now.tv_sec;
+
+  if( !clock_gettime( CLOCK_MONOTONIC_COARSE, &now ) ) {
+    time_t seen = g_now_monotonic;
+    while( now.tv_sec > seen && !__sync_bool_compare_and_swap( &g_now_monotonic, seen, now.tv_sec ) )
+      seen = g_now_monotonic;
+  }
+}
+
+const char *g_version_clock_c = "$Source: /home/cvsroot/opentracker/ot_clock.c,v $: $Revision: 1.1 $\n";
@@ -0,0 +1,20 @@
+/* This software was written by Dirk Engling <erdgeist@erdgeist.org>
+   It is considered beerware. Prost. Skol. Cheers or whatever.
+
+   $id$ */
+
+#ifndef __OT_CLOCK_H__
+#define __OT_CLOCK_H__
+
+/* Every I/O thread reads the clock once per batch of events. The coarse
+   clocks are read from the vDSO without a system call and are as fine as
+   a few milliseconds, plenty for second resolution. g_now_seconds is wall
+   clock time, as handed out to clients and stored in snapshots, all
+   deadlines are taken from the monotonic clock instead, so that the wall
+   clock being set does not time out every connection at once. */
+
+extern time_t g_now_monotonic;
+
+void clock_update( void );
+
+#endif
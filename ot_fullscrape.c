@@ -8,8 +8,11 @@
 /* System */
 #include <sys/param.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include <arpa/inet.h>
 #ifdef WANT_COMPRESSION_GZIP
 #include <zlib.h>
@@ -19,11 +22,13 @@
 #include "byte.h"
 #include "io.h"
 #include "textcode.h"
+#include "uint32.h"
 
 /* Opentracker */
 #include "trackerlogic.h"
 #include "ot_mutex.h"
 #include "ot_iovec.h"
+#include "ot_clean.h"
 #include "ot_fullscrape.h"
 
 /* Fetch full scrape info for all torrents
@@ -37,14 +42,125 @@
 
 #ifdef WANT_COMPRESSION_GZIP
 #define IF_COMPRESSION( TASK ) if( mode & TASK_FLAG_GZIP ) TASK
-#define WANT_COMPRESSION_GZIP_PARAM( param1, param2, param3 ) , param1, param2, param3
+#define WANT_COMPRESSION_GZIP_PARAM( ... ) , __VA_ARGS__
 #else
 #define IF_COMPRESSION( TASK )
-#define WANT_COMPRESSION_GZIP_PARAM( param1, param2, param3 )
+#define WANT_COMPRESSION_GZIP_PARAM( ... )
 #endif
 
-/* Forward declaration */
-static void fullscrape_make( int *iovec_entries, struct iovec **iovector, ot_tasktype mode );
+/* Buckets keep their torrents in no particular order, but bencoded
+   dictionaries need sorted keys. So copy what we need while holding
+   the bucket lock and sort without it */
+typedef struct {
+  ot_hash hash;
+  ot_time base;
+  size_t  seed_count;
+  size_t  peer_count;
+  size_t  down_count;
+} ot_scrape_entry;
+
+/* Each format and encoding served to the public is built at most once per
+   g_fullscrape_cache_interval and then handed out as shared chunks to every
+   request in that interval. Slots are locked while building, so requests
+   arriving meanwhile wait for the fresh result. */
+#define OT_FULLSCRAPE_CACHE_FORMATS (TASK_FULLSCRAPE_TPB_URLENCODED-TASK_FULLSCRAPE+1)
+
+typedef struct {
+  pthread_mutex_t  lock;
+  ot_iovec_shared *chunks;
+  time_t           built;
+  size_t           size;
+} ot_fullscrape_cache;
+
+static ot_fullscrape_cache g_fullscrape_cache[OT_FULLSCRAPE_CACHE_FORMATS][2];
+unsigned long g_fullscrape_cache_interval = OT_FULLSCRAPE_CACHE_INTERVAL;
+
+/* A full scrape is made by a pool of threads, each walking a range of
+   buckets into chunks of its own. The reply is all chunks in bucket order.
+   When compressing, it is a single gzip stream: the first job writes the
+   header, each job deflates its range on its own, ending on a byte
+   boundary with a sync flush, and the last one finishes the stream. The
+   trailer is made of the jobs' checksums and lengths when all are done. */
+#define OT_FULLSCRAPE_JOBS 64
+
+typedef struct {
+  int           iovec_entries;
+  struct iovec *iovector;
+#ifdef WANT_COMPRESSION_GZIP
+  uLong         crc;   /* of the bytes deflated */
+  uLong         size;
+#endif
+} ot_scrape_job;
+
+#ifdef WANT_COMPRESSION_GZIP
+#define OT_GZIP_HEADER_SIZE  10
+#define OT_GZIP_TRAILER_SIZE 8
+static const uint8_t g_gzip_header[OT_GZIP_HEADER_SIZE] = { 0x1f, 0x8b, Z_DEFLATED, 0, 0, 0, 0, 0, 0, 3 };
+#endif
+
+static pthread_mutex_t g_make_lock     = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t g_jobs_lock     = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  g_jobs_wait     = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t  g_jobs_finished = PTHREAD_COND_INITIALIZER;
+static ot_scrape_job   g_jobs[OT_FULLSCRAPE_JOBS];
+static ot_tasktype     g_jobs_mode;
+static ot_taskargs     g_jobs_args;
+static int             g_jobs_next = OT_FULLSCRAPE_JOBS;
+static int             g_jobs_done;
+
+unsigned long g_fullscrape_threads;
+
+/* g_now_seconds may lag behind by the few seconds between clock updates, so
+   deltas reach back that much further */
+#define OT_FULLSCRAPE_SINCE_SLACK 10
+
+/* Forward declarations */
+static void fullscrape_make( int *iovec_entries, struct iovec **iovector, ot_tasktype mode, const ot_taskargs *args );
+static void * fullscrape_helper( void * args );
+
+static ot_fullscrape_cache *fullscrape_cache_slot( ot_tasktype tasktype ) {
+  int format = ( tasktype & TASK_TASK_MASK ) - TASK_FULLSCRAPE;
+  if( format < 0 || format >= OT_FULLSCRAPE_CACHE_FORMATS )
+    return NULL;
+  return &g_fullscrape_cache[format][ tasktype & TASK_FLAG_GZIP ? 1 : 0 ];
+}
+
+/* Returns a reference to chunks no older than the interval, or NULL */
+static ot_iovec_shared *fullscrape_cache_get( ot_fullscrape_cache *cache, ot_tasktype tasktype ) {
+  ot_iovec_shared *chunks;
+
+  pthread_mutex_lock( &cache->lock );
+  if( !cache->chunks || (unsigned long)( g_now_seconds - cache->built ) >= g_fullscrape_cache_interval ) {
+    int           iovec_entries;
+    struct iovec *iovector;
+
+    fullscrape_make( &iovec_entries, &iovector, tasktype, NULL );
+
+    /* If the new one can not be made, the old one still is better than none */
+    if( iovec_entries && ( chunks = iovec_share( &iovec_entries, &iovector ) ) ) {
+      if( cache->chunks )
+        iovec_shared_release( cache->chunks );
+      cache->chunks = chunks;
+      cache->built  = g_now_seconds;
+      cache->size   = chunks->size;
+    } else {
+      iovec_free( &iovec_entries, &iovector );
+      free( iovector );
+    }
+  }
+  if( ( chunks = cache->chunks ) )
+    iovec_shared_hold( chunks );
+  pthread_mutex_unlock( &cache->lock );
+  return chunks;
+}
+
+long fullscrape_cache_age( ot_tasktype tasktype, size_t *size ) {
+  ot_fullscrape_cache *cache = fullscrape_cache_slot( tasktype );
+  if( !cache || !cache->built )
+    return -1;
+  *size = cache->size;
+  return (long)( g_now_seconds - cache->built );
+}
 
 /* Converter function from memory to human readable hex strings
    XXX - Duplicated from ot_stats. Needs fix. */
@@ -60,11 +176,25 @@ static void * fullscrape_worker( void * args ) {
   args = args;
 
   while( 1 ) {
-    ot_tasktype tasktype = TASK_FULLSCRAPE;
-    ot_taskid   taskid   = mutex_workqueue_poptask( &tasktype );
-    fullscrape_make( &iovec_entries, &iovector, tasktype );
-    if( mutex_workqueue_pushresult( taskid, iovec_entries, iovector ) )
-      iovec_free( &iovec_entries, &iovector );
+    ot_tasktype          tasktype = TASK_FULLSCRAPE;
+    ot_taskid            taskid   = mutex_workqueue_poptask( &tasktype );
+    ot_taskargs          taskargs = *mutex_workqueue_taskargs( taskid );
+    ot_fullscrape_cache *cache    = fullscrape_cache_slot( tasktype );
+
+    /* Deltas and ranges are made for each request */
+    if( cache && g_fullscrape_cache_interval && !taskargs.since && !taskargs.ranged ) {
+      ot_iovec_shared *chunks = fullscrape_cache_get( cache, tasktype );
+      if( !chunks )
+        mutex_workqueue_pushresult( taskid, 0, NULL );
+      else if( mutex_workqueue_pushshared( taskid, chunks ) )
+        iovec_shared_release( chunks );
+    } else {
+      if( taskargs.since )
+        taskargs.since = taskargs.since > OT_FULLSCRAPE_SINCE_SLACK ? taskargs.since - OT_FULLSCRAPE_SINCE_SLACK : 1;
+      fullscrape_make( &iovec_entries, &iovector, tasktype, &taskargs );
+      if( mutex_workqueue_pushresult( taskid, iovec_entries, iovector ) )
+        iovec_free( &iovec_entries, &iovector );
+    }
     if( !g_opentracker_running )
       return NULL;
   }
@@ -72,16 +202,45 @@ static void * fullscrape_worker( void * args ) {
 }
 
 static pthread_t thread_id;
+static pthread_t helper_ids[OT_MAX_THREADS];
+static int       helper_count;
+
 void fullscrape_init( ) {
+  int i, j;
+  for( i=0; i<OT_FULLSCRAPE_CACHE_FORMATS; ++i )
+    for( j=0; j<2; ++j )
+      pthread_mutex_init( &g_fullscrape_cache[i][j].lock, NULL );
   pthread_create( &thread_id, NULL, fullscrape_worker, NULL );
+
+  /* The worker takes jobs, too */
+  if( !g_fullscrape_threads ) {
+    long cpus = sysconf( _SC_NPROCESSORS_ONLN );
+    g_fullscrape_threads = cpus > 0 ? cpus : 1;
+  }
+  if( g_fullscrape_threads > OT_MAX_THREADS )
+    g_fullscrape_threads = OT_MAX_THREADS;
+  for( helper_count=0; helper_count<(int)g_fullscrape_threads-1; ++helper_count )
+    if( pthread_create( helper_ids + helper_count, NULL, fullscrape_helper, NULL ) )
+      break;
 }
 
 void fullscrape_deinit( ) {
+  int i, j;
   pthread_cancel( thread_id );
+  for( i=0; i<helper_count; ++i )
+    pthread_cancel( helper_ids[i] );
+  for( i=0; i<OT_FULLSCRAPE_CACHE_FORMATS; ++i )
+    for( j=0; j<2; ++j )
+      if( g_fullscrape_cache[i][j].chunks )
+        iovec_shared_release( g_fullscrape_cache[i][j].chunks );
 }
 
-void fullscrape_deliver( int64 sock, ot_tasktype tasktype ) {
-  mutex_workqueue_pushtask( sock, tasktype );
+int fullscrape_deliver( int64 sock, ot_tasktype tasktype, const ot_taskargs *args ) {
+  return mutex_workqueue_pushtask_args( sock, tasktype, args );
+}
+
+static int fullscrape_compare_entry( const void *a, const void *b ) {
+  return memcmp( a, b, sizeof(ot_hash) );
 }
 
 static int fullscrape_increase( int *iovec_entries, struct iovec **iovector,
@@ -114,9 +273,55 @@ static int fullscrape_increase( int *iovec_entries, struct iovec **iovector,
   return 0;
 }
 
-static void fullscrape_make( int *iovec_entries, struct iovec **iovector, ot_tasktype mode ) {
-  int      bucket;
-  char    *r, *re;
+/* Passes what was written to compress_buffer on to deflate, when
+   compressing, and makes sure there is room for the next entry */
+static int fullscrape_advance( int *iovec_entries, struct iovec **iovector,
+                               char **r, char **re WANT_COMPRESSION_GZIP_PARAM( z_stream *strm, ot_tasktype mode, char *compress_buffer, uLong *crc ) ) {
+#ifdef WANT_COMPRESSION_GZIP
+  if( mode & TASK_FLAG_GZIP ) {
+    *crc = crc32( *crc, (uint8_t*)compress_buffer, *r - compress_buffer );
+    strm->next_in  = (uint8_t*)compress_buffer;
+    strm->avail_in = *r - compress_buffer;
+    if( deflate( strm, Z_NO_FLUSH ) < Z_OK )
+      fprintf( stderr, "deflate() failed while in fullscrape_make().\n" );
+    *r = (char*)strm->next_out;
+  }
+#endif
+
+  /* Check if there still is enough buffer left */
+  while( *r >= *re )
+    if( fullscrape_increase( iovec_entries, iovector, r, re WANT_COMPRESSION_GZIP_PARAM( strm, mode, Z_NO_FLUSH ) ) )
+      return -1;
+
+  IF_COMPRESSION( *r = compress_buffer; )
+  return 0;
+}
+
+/* Removed torrents are those not there anymore, they may have come back */
+static int fullscrape_is_gone( ot_hash hash ) {
+  ot_torrent_list *torrents_list = mutex_bucket_lock_by_hash( hash );
+  int gone = !index_find_torrent( torrents_list, hash ) && !index_find_idle( torrents_list, hash );
+  mutex_bucket_unlock_by_hash( hash, 0 );
+  return gone;
+}
+
+static int fullscrape_in_range( ot_hash hash, const ot_taskargs *args ) {
+  uint32_t prefix = uint32_read_big( (char*)hash );
+  return !args->ranged || ( prefix >= args->range_first && prefix <= args->range_last );
+}
+
+static void fullscrape_make_job( ot_scrape_job *result, ot_tasktype mode, const ot_taskargs *args, int job ) {
+  /* Jobs split the buckets the range maps onto */
+  int              bucket_first = args->ranged ? (int)( args->range_first >> OT_BUCKET_COUNT_SHIFT ) : 0;
+  int              buckets = args->ranged ? (int)( args->range_last >> OT_BUCKET_COUNT_SHIFT ) - bucket_first + 1 : OT_BUCKET_COUNT;
+  int              bucket = bucket_first + job * buckets / OT_FULLSCRAPE_JOBS;
+  int              bucket_end = bucket_first + ( job + 1 ) * buckets / OT_FULLSCRAPE_JOBS;
+  ot_time          since = args->since;
+  int             *iovec_entries = &result->iovec_entries;
+  struct iovec   **iovector = &result->iovector;
+  char            *r, *re;
+  ot_scrape_entry *entries = NULL;
+  size_t           entries_space = 0;
 #ifdef WANT_COMPRESSION_GZIP
   char     compress_buffer[OT_SCRAPE_MAXENTRYLEN];
   z_stream strm;
@@ -135,29 +340,82 @@ static void fullscrape_make( int *iovec_entries, struct iovec **iovector, ot_tas
   if( mode & TASK_FLAG_GZIP ) {
     re += OT_SCRAPE_MAXENTRYLEN;
     byte_zero( &strm, sizeof(strm) );
+    result->crc = crc32( 0L, Z_NULL, 0 );
+    if( !job ) {
+      memcpy( r, g_gzip_header, OT_GZIP_HEADER_SIZE );
+      r += OT_GZIP_HEADER_SIZE;
+    }
     strm.next_in   = (uint8_t*)compress_buffer;
     strm.next_out  = (uint8_t*)r;
-    strm.avail_out = OT_SCRAPE_CHUNK_SIZE;
-    if( deflateInit2(&strm,7,Z_DEFLATED,31,8,Z_DEFAULT_STRATEGY) != Z_OK )
+    strm.avail_out = OT_SCRAPE_CHUNK_SIZE - ( job ? 0 : OT_GZIP_HEADER_SIZE );
+    if( deflateInit2(&strm,7,Z_DEFLATED,-15,8,Z_DEFAULT_STRATEGY) != Z_OK )
       fprintf( stderr, "not ok.\n" );
     r = compress_buffer;
   }
 #endif
 
-  if( ( mode & TASK_TASK_MASK ) == TASK_FULLSCRAPE )
+  /* The dictionary is opened by the first and closed by the last job */
+  if( !job && ( mode & TASK_TASK_MASK ) == TASK_FULLSCRAPE )
     r += sprintf( r, "d5:filesd" );
 
-  /* For each bucket... */
-  for( bucket=0; bucket<OT_BUCKET_COUNT; ++bucket ) {
+  /* For each bucket in our range... */
+  for( ; bucket<bucket_end; ++bucket ) {
     /* Get exclusive access to that bucket */
-    ot_vector *torrents_list = mutex_bucket_lock( bucket );
-    size_t tor_offset;
+    ot_torrent_list *torrents_list = mutex_bucket_lock( bucket );
+    size_t tor_offset, tor_count = torrents_list->size + torrents_list->idle.size, count = 0;
+
+    if( tor_count > entries_space ) {
+      ot_scrape_entry *new_entries = realloc( entries, tor_count * sizeof(ot_scrape_entry) );
+      if( !new_entries ) {
+        mutex_bucket_unlock( bucket, 0 );
+        IF_COMPRESSION( deflateEnd(&strm); )
+        iovec_free( iovec_entries, iovector );
+        free( entries );
+        return;
+      }
+      entries = new_entries;
+      entries_space = tor_count;
+    }
 
-    /* For each torrent in this bucket.. */
     for( tor_offset=0; tor_offset<torrents_list->size; ++tor_offset ) {
+      ot_torrent  *torrent   = ((ot_torrent*)(torrents_list->data)) + tor_offset;
+      ot_peerlist *peer_list = torrent->peer_list;
+      if( peer_list->changed < since || !fullscrape_in_range( torrent->hash, args ) )
+        continue;
+      memcpy( entries[count].hash, torrent->hash, sizeof(ot_hash) );
+      entries[count].base       = peer_list->base;
+      entries[count].seed_count = peer_list->seed_count;
+      entries[count].peer_count = peer_list->peer_count;
+      entries[count++].down_count = peer_list->down_count;
+    }
+
+    /* Idle torrents follow, they only have a completed count. They went
+       idle when their last peer left, which was at most OT_PEER_TIMEOUT
+       minutes after their base */
+    for( tor_offset=0; tor_offset<torrents_list->idle.size; ++tor_offset ) {
+      ot_idle_torrent *idle = torrents_list->idle.data + tor_offset;
+      ot_time          base = g_now_minutes - OT_IDLE_AGE( idle );
+      if( ( since && ( base + OT_PEER_TIMEOUT + 1 ) * 60 < since ) || !fullscrape_in_range( idle->hash, args ) )
+        continue;
+      memcpy( entries[count].hash, idle->hash, sizeof(ot_hash) );
+      entries[count].base       = base;
+      entries[count].seed_count = 0;
+      entries[count].peer_count = 0;
+      entries[count++].down_count = idle->down_count;
+    }
+
+    /* Got all we need: release lock on current bucket */
+    mutex_bucket_unlock( bucket, 0 );
+    tor_count = count;
+
+    if( tor_count > 1 )
+      qsort( entries, tor_count, sizeof(ot_scrape_entry), fullscrape_compare_entry );
+
+    /* For each torrent in this bucket.. */
+    for( tor_offset=0; tor_offset<tor_count; ++tor_offset ) {
       /* Address torrents members */
-      ot_peerlist *peer_list = ( ((ot_torrent*)(torrents_list->data))[tor_offset] ).peer_list;
-      ot_hash     *hash      =&( ((ot_torrent*)(torrents_list->data))[tor_offset] ).hash;
+      ot_scrape_entry *peer_list = entries + tor_offset;
+      ot_hash         *hash      = &entries[tor_offset].hash;
 
       switch( mode & TASK_TASK_MASK ) {
       case TASK_FULLSCRAPE:
@@ -189,46 +447,84 @@ static void fullscrape_make( int *iovec_entries, struct iovec **iovector, ot_tas
         break;
       }
 
-#ifdef WANT_COMPRESSION_GZIP
-     if( mode & TASK_FLAG_GZIP ) {
-        strm.next_in  = (uint8_t*)compress_buffer;
-        strm.avail_in = r - compress_buffer;
-        if( deflate( &strm, Z_NO_FLUSH ) < Z_OK )
-          fprintf( stderr, "deflate() failed while in fullscrape_make().\n" );
-        r = (char*)strm.next_out;
+      if( fullscrape_advance( iovec_entries, iovector, &r, &re WANT_COMPRESSION_GZIP_PARAM( &strm, mode, compress_buffer, &result->crc ) ) ) {
+        free( entries );
+        return;
       }
-#endif
-
-      /* Check if there still is enough buffer left */
-      while( r >= re )
-       if( fullscrape_increase( iovec_entries, iovector, &r, &re WANT_COMPRESSION_GZIP_PARAM( &strm, mode, Z_NO_FLUSH ) ) )
-         return mutex_bucket_unlock( bucket, 0 );
-
-      IF_COMPRESSION( r = compress_buffer; )
     }
 
-    /* All torrents done: release lock on current bucket */
-    mutex_bucket_unlock( bucket, 0 );
-
     /* Parent thread died? */
-    if( !g_opentracker_running )
+    if( !g_opentracker_running ) {
+      free( entries );
       return;
+    }
   }
-
-  if( ( mode & TASK_TASK_MASK ) == TASK_FULLSCRAPE )
+  free( entries );
+
+  /* Deltas end with the torrents removed since, their counts all ones */
+  if( since && job == OT_FULLSCRAPE_JOBS - 1 ) {
+    ot_hash *removed;
+    size_t   i, removed_count = clean_removed_since( since, &removed );
+
+    if( ( mode & TASK_TASK_MASK ) == TASK_FULLSCRAPE )
+      r += sprintf( r, "e7:removedl" );
+    for( i=0; i<removed_count; ++i ) {
+      if( !fullscrape_in_range( removed[i], args ) || !fullscrape_is_gone( removed[i] ) )
+        continue;
+      switch( mode & TASK_TASK_MASK ) {
+      case TASK_FULLSCRAPE:
+      default:
+        *r++='2'; *r++='0'; *r++=':';
+        memcpy( r, removed[i], sizeof(ot_hash) ); r += sizeof(ot_hash);
+        break;
+      case TASK_FULLSCRAPE_TPB_ASCII:
+      case TASK_FULLSCRAPE_TRACKERSTATE:
+        to_hex( r, removed[i] ); r+= 2 * sizeof(ot_hash);
+        r += sprintf( r, ":-1:-1\n" );
+        break;
+      case TASK_FULLSCRAPE_TPB_BINARY:
+        memcpy( r, removed[i], sizeof(ot_hash) ); r += sizeof(ot_hash);
+        memset( r, 0xff, 8 ); r += 8;
+        break;
+      case TASK_FULLSCRAPE_TPB_URLENCODED:
+        r += fmt_urlencoded( r, (char *)removed[i], 20 );
+        r += sprintf( r, ":-1:-1\n" );
+        break;
+      }
+      if( fullscrape_advance( iovec_entries, iovector, &r, &re WANT_COMPRESSION_GZIP_PARAM( &strm, mode, compress_buffer, &result->crc ) ) ) {
+        free( removed );
+        return;
+      }
+    }
+    free( removed );
+    if( ( mode & TASK_TASK_MASK ) == TASK_FULLSCRAPE )
+      r += sprintf( r, "ee" );
+  } else if( job == OT_FULLSCRAPE_JOBS - 1 && ( mode & TASK_TASK_MASK ) == TASK_FULLSCRAPE )
     r += sprintf( r, "ee" );
 
 #ifdef WANT_COMPRESSION_GZIP
   if( mode & TASK_FLAG_GZIP ) {
-    strm.next_in  = (uint8_t*)compress_buffer;
-    strm.avail_in = r - compress_buffer;
-    if( deflate( &strm, Z_FINISH ) < Z_OK )
-      fprintf( stderr, "deflate() failed while in fullscrape_make()'s endgame.\n" );
+    int last = job == OT_FULLSCRAPE_JOBS - 1, zaction = last ? Z_FINISH : Z_SYNC_FLUSH;
+
+    result->crc    = crc32( result->crc, (uint8_t*)compress_buffer, r - compress_buffer );
+    strm.next_in   = (uint8_t*)compress_buffer;
+    strm.avail_in  = r - compress_buffer;
     r = (char*)strm.next_out;
 
-    while( r >= re )
-      if( fullscrape_increase( iovec_entries, iovector, &r, &re WANT_COMPRESSION_GZIP_PARAM( &strm, mode, Z_FINISH ) ) )
-        return mutex_bucket_unlock( bucket, 0 );
+    /* Jobs without any torrents add nothing to the stream */
+    if( last || strm.total_in + strm.avail_in ) {
+      if( deflate( &strm, zaction ) < Z_OK )
+        fprintf( stderr, "deflate() failed while in fullscrape_make()'s endgame.\n" );
+      r = (char*)strm.next_out;
+
+      /* The last job leaves room for the trailer */
+      while( !strm.avail_out || ( last && strm.avail_out < OT_GZIP_TRAILER_SIZE ) )
+        if( fullscrape_increase( iovec_entries, iovector, &r, &re WANT_COMPRESSION_GZIP_PARAM( &strm, mode, zaction ) ) )
+          return;
+      if( last )
+        r += OT_GZIP_TRAILER_SIZE;
+    }
+    result->size = strm.total_in;
     deflateEnd(&strm);
   }
 #endif
@@ -236,6 +532,112 @@ static void fullscrape_make( int *iovec_entries, struct iovec **iovector, ot_tas
   /* Release unused memory in current output buffer */
   iovec_fixlast( iovec_entries, iovector, r );
 }
+
+/* Takes jobs of the current full scrape until none are left, called and
+   returning with g_jobs_lock held */
+static void fullscrape_take_jobs( ) {
+  while( g_jobs_next < OT_FULLSCRAPE_JOBS ) {
+    int         job  = g_jobs_next++;
+    ot_tasktype mode = g_jobs_mode;
+    ot_taskargs args = g_jobs_args;
+
+    pthread_mutex_unlock( &g_jobs_lock );
+    fullscrape_make_job( g_jobs + job, mode, &args, job );
+    pthread_mutex_lock( &g_jobs_lock );
+
+    if( ++g_jobs_done == OT_FULLSCRAPE_JOBS )
+      pthread_cond_signal( &g_jobs_finished );
+  }
+}
+
+static void fullscrape_helper_cleanup( void * args ) {
+  pthread_mutex_unlock( (pthread_mutex_t*)args );
+}
+
+static void * fullscrape_helper( void * args ) {
+  (void)args;
+  pthread_mutex_lock( &g_jobs_lock );
+  pthread_cleanup_push( fullscrape_helper_cleanup, &g_jobs_lock );
+  while( 1 ) {
+    fullscrape_take_jobs( );
+    pthread_cond_wait( &g_jobs_wait, &g_jobs_lock );
+  }
+  pthread_cleanup_pop( 1 );
+  return NULL;
+}
+
+/* Empty chunks still have their first page mapped */
+static void fullscrape_unmap( struct iovec *chunk ) {
+  munmap( chunk->iov_base, chunk->iov_len ? chunk->iov_len : 1 );
+}
+
+/* Without args, everything is listed */
+static void fullscrape_make( int *iovec_entries, struct iovec **iovector, ot_tasktype mode, const ot_taskargs *args ) {
+  int job, i, failed = 0, entries = 0;
+#ifdef WANT_COMPRESSION_GZIP
+  uLong crc = crc32( 0L, Z_NULL, 0 ), size = 0;
+#endif
+
+  *iovec_entries = 0;
+  *iovector = NULL;
+
+  /* Only one full scrape is split into jobs at a time */
+  pthread_mutex_lock( &g_make_lock );
+  pthread_mutex_lock( &g_jobs_lock );
+  g_jobs_mode = mode;
+  if( args )
+    memcpy( &g_jobs_args, args, sizeof(ot_taskargs) );
+  else
+    byte_zero( &g_jobs_args, sizeof(ot_taskargs) );
+  g_jobs_next = g_jobs_done = 0;
+  pthread_cond_broadcast( &g_jobs_wait );
+  fullscrape_take_jobs( );
+  while( g_jobs_done < OT_FULLSCRAPE_JOBS )
+    pthread_cond_wait( &g_jobs_finished, &g_jobs_lock );
+  pthread_mutex_unlock( &g_jobs_lock );
+
+  /* Jobs that failed leave no chunks, then the whole scrape is lost */
+  for( job=0; job<OT_FULLSCRAPE_JOBS; ++job ) {
+    if( !g_jobs[job].iovec_entries )
+      failed = 1;
+    entries += g_jobs[job].iovec_entries;
+  }
+  if( !failed && !( *iovector = malloc( entries * sizeof(struct iovec) ) ) )
+    failed = 1;
+
+  /* Concatenate all chunks in bucket order, dropping empty ones */
+  for( job=0; job<OT_FULLSCRAPE_JOBS; ++job ) {
+#ifdef WANT_COMPRESSION_GZIP
+    if( mode & TASK_FLAG_GZIP ) {
+      crc   = crc32_combine( crc, g_jobs[job].crc, g_jobs[job].size );
+      size += g_jobs[job].size;
+    }
+#endif
+    for( i=0; i<g_jobs[job].iovec_entries; ++i ) {
+      struct iovec *chunk = g_jobs[job].iovector + i;
+      if( failed || !chunk->iov_len )
+        fullscrape_unmap( chunk );
+      else
+        (*iovector)[(*iovec_entries)++] = *chunk;
+    }
+    free( g_jobs[job].iovector );
+    g_jobs[job].iovec_entries = 0;
+    g_jobs[job].iovector      = NULL;
+  }
+
+#ifdef WANT_COMPRESSION_GZIP
+  /* The last job left room for the trailer at its end */
+  if( ( mode & TASK_FLAG_GZIP ) && *iovec_entries ) {
+    struct iovec *chunk = *iovector + *iovec_entries - 1;
+    uint8_t      *trailer = (uint8_t*)chunk->iov_base + chunk->iov_len - OT_GZIP_TRAILER_SIZE;
+    for( i=0; i<4; ++i ) {
+      trailer[i]   = crc >> ( 8 * i );
+      trailer[4+i] = size >> ( 8 * i );
+    }
+  }
+#endif
+  pthread_mutex_unlock( &g_make_lock );
+}
 #endif
 
 const char *g_version_fullscrape_c = "$Source: /home/cvsroot/opentracker/ot_fullscrape.c,v $: $Revision: 1.33 $\n";
@@ -8,9 +8,24 @@
 
 #ifdef WANT_FULLSCRAPE
 
+/* Seconds a public full scrape is served from cache, 0 builds it anew
+   for every request */
+#define OT_FULLSCRAPE_CACHE_INTERVAL 60
+extern unsigned long g_fullscrape_cache_interval;
+
+/* Threads making a full scrape together, 0 means one per online cpu */
+extern unsigned long g_fullscrape_threads;
+
 void fullscrape_init( );
 void fullscrape_deinit( );
-void fullscrape_deliver( int64 sock, ot_tasktype tasktype );
+/* With args->since set, only torrents changed since are listed, followed
+   by those removed since. Removed torrents are listed with all counts -1,
+   all ones in binary, in bencode they are in a list called "removed".
+   With args->ranged set, only the buckets holding the range are walked. */
+int  fullscrape_deliver( int64 sock, ot_tasktype tasktype, const ot_taskargs *args );
+
+/* Age in seconds and size of the cached result for tasktype, -1 if none */
+long fullscrape_cache_age( ot_tasktype tasktype, size_t *size );
 
 #else
 
@@ -0,0 +1,179 @@
+/* This software was written by Dirk Engling <erdgeist@erdgeist.org>
+   It is considered beerware. Prost. Skol. Cheers or whatever.
+
+   $id$ */
+
+/* System */
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+/* Libowfat */
+#include "io.h"
+
+/* Opentracker */
+#include "trackerlogic.h"
+#include "ot_snapshot.h"
+#include "ot_handoff.h"
+
+char *g_handoff_path;
+
+/* Every message is a record, sockets are passed along with the record's
+   last byte */
+typedef enum {
+  HANDOFF_SOCKET,  /* a listening socket follows */
+  HANDOFF_END,     /* no more sockets */
+  HANDOFF_STATE    /* the snapshot follows as a stream */
+} ot_handoff_type;
+
+typedef struct {
+  uint32_t type;
+  uint32_t proto;
+  ot_ip6   ip;
+  uint16_t port;
+} ot_handoff_record;
+
+static int handoff_write_record( int64 conn, ot_handoff_type type, const ot_handoff_socket *handed, int64 fd ) {
+  ot_handoff_record record;
+  const char *w = (const char*)&record;
+  size_t      left = sizeof(record) - 1;
+
+  memset( &record, 0, sizeof(record) );
+  record.type = type;
+  if( handed ) {
+    record.proto = handed->proto;
+    memcpy( record.ip, handed->ip, sizeof(ot_ip6) );
+    record.port = handed->port;
+  }
+
+  while( left ) {
+    ssize_t written = write( conn, w, left );
+    if( written < 0 && errno == EINTR )
+      continue;
+    if( written <= 0 )
+      return -1;
+    w += written; left -= written;
+  }
+
+  /* io_passfd sends a byte of its own, it stands in for the last one */
+  if( fd != -1 )
+    return io_passfd( conn, fd );
+  return write( conn, w, 1 ) == 1 ? 0 : -1;
+}
+
+/* Returns the descriptor passed with the record, if any */
+static int handoff_read_record( int64 conn, ot_handoff_record *record, int64 *fd ) {
+  char  *r = (char*)record;
+  size_t left = sizeof(*record) - 1;
+
+  *fd = -1;
+  while( left ) {
+    ssize_t got = read( conn, r, left );
+    if( got < 0 && errno == EINTR )
+      continue;
+    if( got <= 0 )
+      return -1;
+    r += got; left -= got;
+  }
+
+  if( record->type == HANDOFF_SOCKET )
+    return ( *fd = io_receivefd( conn ) ) == -1 ? -1 : 0;
+  return read( conn, r, 1 ) == 1 ? 0 : -1;
+}
+
+static int handoff_address( const char *path, struct sockaddr_un *addr ) {
+  if( strlen( path ) >= sizeof(addr->sun_path) )
+    return -1;
+  memset( addr, 0, sizeof(*addr) );
+  addr->sun_family = AF_UNIX;
+  strcpy( addr->sun_path, path );
+  return 0;
+}
+
+int64 handoff_listen( const char *path ) {
+  struct sockaddr_un addr;
+  int64 sock;
+
+  if( handoff_address( path, &addr ) || ( sock = socket( AF_UNIX, SOCK_STREAM, 0 ) ) == -1 )
+    return -1;
+  unlink( path );
+  if( bind( sock, (struct sockaddr*)&addr, sizeof(addr) ) || listen( sock, 1 ) ) {
+    close( sock );
+    return -1;
+  }
+  io_nonblock( sock );
+  return sock;
+}
+
+int64 handoff_connect( const char *path ) {
+  struct sockaddr_un addr;
+  int64 sock;
+
+  if( handoff_address( path, &addr ) || ( sock = socket( AF_UNIX, SOCK_STREAM, 0 ) ) == -1 )
+    return -1;
+  if( connect( sock, (struct sockaddr*)&addr, sizeof(addr) ) ) {
+    close( sock );
+    return -1;
+  }
+  return sock;
+}
+
+int handoff_send_socket( int64 conn, const ot_handoff_socket *handed ) {
+  return handoff_write_record( conn, HANDOFF_SOCKET, handed, handed->sock );
+}
+
+int handoff_send_end( int64 conn ) {
+  return handoff_write_record( conn, HANDOFF_END, NULL, -1 );
+}
+
+/* The snapshot is written to the connection bucket by bucket, never held
+   in memory as a whole */
+int handoff_send_state( int64 conn ) {
+  if( handoff_write_record( conn, HANDOFF_STATE, NULL, -1 ) )
+    return -1;
+  return snapshot_write_stream( conn );
+}
+
+ssize_t handoff_receive_sockets( int64 conn, ot_handoff_socket **handed ) {
+  ot_handoff_record record;
+  size_t count = 0;
+  int64  fd;
+
+  *handed = NULL;
+  while( !handoff_read_record( conn, &record, &fd ) ) {
+    ot_handoff_socket *new_handed;
+
+    if( record.type == HANDOFF_END )
+      return count;
+    if( record.type != HANDOFF_SOCKET || !( new_handed = realloc( *handed, ( count + 1 ) * sizeof(ot_handoff_socket) ) ) ) {
+      if( fd != -1 )
+        close( fd );
+      break;
+    }
+    *handed = new_handed;
+    new_handed[count].sock  = fd;
+    new_handed[count].proto = record.proto;
+    memcpy( new_handed[count].ip, record.ip, sizeof(ot_ip6) );
+    new_handed[count].port  = record.port;
+    ++count;
+  }
+
+  /* Sockets already passed still are good */
+  return count;
+}
+
+ssize_t handoff_receive_state( int64 conn ) {
+  ot_handoff_record record;
+  int64   fd;
+
+  if( handoff_read_record( conn, &record, &fd ) || record.type != HANDOFF_STATE )
+    return -1;
+  return snapshot_load_stream( conn, "handed over state" );
+}
+
+const char *g_version_handoff_c = "$Source: /home/cvsroot/opentracker/ot_handoff.c,v $: $Revision: 1.1 $\n";
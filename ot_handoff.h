@@ -0,0 +1,42 @@
+/* This software was written by Dirk Engling <erdgeist@erdgeist.org>
+   It is considered beerware. Prost. Skol. Cheers or whatever.
+
+   $id$ */
+
+#ifndef __OT_HANDOFF_H__
+#define __OT_HANDOFF_H__
+
+/* Hot upgrades. An opentracker started with the tracker.handoff path of
+   a running one connects to it before binding. The running one passes on
+   its listening sockets and stops serving them, the new one serves them
+   right away. The running one finishes the requests it has accepted,
+   streams a snapshot of all torrents and exits, the new one merges it
+   into its torrents in the background. */
+
+typedef struct {
+  int64      sock;
+  PROTO_FLAG proto;
+  ot_ip6     ip;
+  uint16_t   port;
+} ot_handoff_socket;
+
+extern char *g_handoff_path;
+
+/* Returns the listening unix socket, replacing any at path */
+int64   handoff_listen( const char *path );
+/* Returns the connection to the running opentracker or -1 */
+int64   handoff_connect( const char *path );
+
+/* The running side */
+int     handoff_send_socket( int64 conn, const ot_handoff_socket *handed );
+/* After the last socket, the new side may set up while we drain */
+int     handoff_send_end( int64 conn );
+int     handoff_send_state( int64 conn );
+
+/* The new side, sockets are received until their end. Returns their
+   number, *handed is to be freed by the caller. The state may be received
+   while serving them. */
+ssize_t handoff_receive_sockets( int64 conn, ot_handoff_socket **handed );
+ssize_t handoff_receive_state( int64 conn );
+
+#endif
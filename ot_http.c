@@ -23,12 +23,16 @@
 /* Opentracker */
 #include "trackerlogic.h"
 #include "ot_mutex.h"
+#include "ot_loop.h"
+#include "ot_clock.h"
+#include "ot_shard.h"
 #include "ot_http.h"
 #include "ot_iovec.h"
 #include "scan_urlencoded_query.h"
 #include "ot_fullscrape.h"
 #include "ot_stats.h"
 #include "ot_accesslist.h"
+#include "ot_clean.h"
 
 #define OT_MAXMULTISCRAPE_COUNT 64
 extern char *g_redirecturl;
@@ -42,10 +46,10 @@ enum {
   SUCCESS_HTTP_SIZE_OFF = 17 };
 
 static void http_senddata( const int64 sock, struct ot_workstruct *ws ) {
-  struct http_data *cookie = io_getcookie( sock );
+  struct http_data *cookie = loop_getcookie( sock );
   ssize_t written_size;
 
-  if( !cookie ) { io_close(sock); return; }
+  if( !cookie ) { loop_close(sock); return; }
 
   /* whoever sends data is not interested in its input-array */
   if( ws->keep_alive && ws->header_size != ws->request_size ) {
@@ -58,19 +62,24 @@ static void http_senddata( const int64 sock, struct ot_workstruct *ws ) {
   } else
     array_reset( &cookie->request );
 
+  /* The loop may finish the connection on its own */
+  if( !ws->keep_alive && loop_send_close( sock, ws->reply, ws->reply_size ) ) {
+    free( cookie );
+    return;
+  }
+
   written_size = write( sock, ws->reply, ws->reply_size );
   if( ( written_size < 0 ) || ( ( written_size == ws->reply_size ) && !ws->keep_alive ) ) {
     array_reset( &cookie->request );
-    free( cookie ); io_close( sock ); return;
+    free( cookie ); loop_close( sock ); return;
   }
 
   if( written_size < ws->reply_size ) {
     char * outbuf;
-    tai6464 t;
 
     if( !( outbuf = malloc( ws->reply_size - written_size ) ) ) {
       array_reset( &cookie->request );
-      free(cookie); io_close( sock );
+      free(cookie); loop_close( sock );
       return;
     }
 
@@ -79,10 +88,10 @@ static void http_senddata( const int64 sock, struct ot_workstruct *ws ) {
 
     /* writeable short data sockets just have a tcp timeout */
     if( !ws->keep_alive ) {
-      taia_uint( &t, 0 ); io_timeout( sock, t );
-      io_dontwantread( sock );
+      loop_timeout( sock, 0 );
+      loop_dontwantread( sock );
     }
-    io_wantwrite( sock );
+    loop_wantwrite( sock );
   }
 }
 
@@ -95,7 +104,7 @@ static void http_senddata( const int64 sock, struct ot_workstruct *ws ) {
 #define HTTPERROR_403_IP         return http_issue_error( sock, ws, CODE_HTTPERROR_403_IP )
 #define HTTPERROR_404            return http_issue_error( sock, ws, CODE_HTTPERROR_404 )
 #define HTTPERROR_500            return http_issue_error( sock, ws, CODE_HTTPERROR_500 )
-ssize_t http_issue_error( const int64 sock, struct ot_workstruct *ws, int code ) {
+static void http_format_error( struct ot_workstruct *ws, int code ) {
   char *error_code[] = { "302 Found", "400 Invalid Request", "400 Invalid Request", "400 Invalid Request", "402 Payment Required",
                          "403 Not Modest", "403 Access Denied", "404 Not Found", "500 Internal Server Error" };
   char *title = error_code[code];
@@ -110,20 +119,26 @@ ssize_t http_issue_error( const int64 sock, struct ot_workstruct *ws, int code )
   fprintf( stderr, "DEBUG: invalid request was: %s\n", ws->debugbuf );
 #endif
   stats_issue_event( EVENT_FAILED, FLAG_TCP, code );
+}
+
+ssize_t http_issue_error( const int64 sock, struct ot_workstruct *ws, int code ) {
+  http_format_error( ws, code );
   http_senddata( sock, ws );
   return ws->reply_size = -2;
 }
 
-ssize_t http_sendiovecdata( const int64 sock, struct ot_workstruct *ws, int iovec_entries, struct iovec *iovector ) {
-  struct http_data *cookie = io_getcookie( sock );
+ssize_t http_sendiovecdata( const int64 sock, struct ot_workstruct *ws, int iovec_entries, struct iovec *iovector, ot_iovec_shared *shared ) {
+  struct http_data *cookie = loop_getcookie( sock );
   char *header;
   int i;
   size_t header_size, size = iovec_length( &iovec_entries, &iovector );
-  tai6464 t;
 
   /* No cookie? Bad socket. Leave. */
   if( !cookie ) {
-    iovec_free( &iovec_entries, &iovector );
+    if( shared )
+      iovec_shared_release( shared );
+    else
+      iovec_free( &iovec_entries, &iovector );
     HTTPERROR_500;
   }
 
@@ -135,13 +150,18 @@ ssize_t http_sendiovecdata( const int64 sock, struct ot_workstruct *ws, int iove
 
   /* Our answers never are 0 vectors. Return an error. */
   if( !iovec_entries ) {
+    if( shared )
+      iovec_shared_release( shared );
     HTTPERROR_500;
   }
 
   /* Prepare space for http header */
   header = malloc( SUCCESS_HTTP_HEADER_LENGTH + SUCCESS_HTTP_HEADER_LENGTH_CONTENT_ENCODING );
   if( !header ) {
-    iovec_free( &iovec_entries, &iovector );
+    if( shared )
+      iovec_shared_release( shared );
+    else
+      iovec_free( &iovec_entries, &iovector );
     HTTPERROR_500;
   }
 
@@ -155,29 +175,99 @@ ssize_t http_sendiovecdata( const int64 sock, struct ot_workstruct *ws, int iove
   iob_reset( &cookie->batch );
   iob_addbuf_free( &cookie->batch, header, header_size );
 
-  /* Will move to ot_iovec.c */
-  for( i=0; i<iovec_entries; ++i )
-    iob_addbuf_munmap( &cookie->batch, iovector[i].iov_base, iovector[i].iov_len );
-  free( iovector );
+  /* Shared chunks are sent from where they are, everyone else's are ours */
+  if( shared ) {
+    for( i=0; i<iovec_entries; ++i )
+      iob_addbuf( &cookie->batch, iovector[i].iov_base, iovector[i].iov_len );
+    cookie->shared = shared;
+  } else {
+    /* Will move to ot_iovec.c */
+    for( i=0; i<iovec_entries; ++i )
+      iob_addbuf_munmap( &cookie->batch, iovector[i].iov_base, iovector[i].iov_len );
+    free( iovector );
+  }
 
   /* writeable sockets timeout after 10 minutes */
-  taia_now( &t ); taia_addsec( &t, &t, OT_CLIENT_TIMEOUT_SEND );
-  io_timeout( sock, t );
-  io_dontwantread( sock );
-  io_wantwrite( sock );
+  loop_timeout( sock, g_now_monotonic + OT_CLIENT_TIMEOUT_SEND );
+  loop_dontwantread( sock );
+  loop_wantwrite( sock );
+  return 0;
+}
+
+#ifdef WANT_FULLSCRAPE
+/* Parses the value of a since= parameter into args. Deltas can only reach
+   back as far as removed torrents are remembered. */
+static int http_scan_since( char **read_ptr, ot_taskargs *args ) {
+  char   *write_ptr = *read_ptr;
+  ssize_t len       = scan_urlencoded_query( read_ptr, write_ptr, SCAN_SEARCHPATH_VALUE );
+  int     since;
+
+  if( ( len <= 0 ) || scan_fixed_int( write_ptr, len, &since ) || ( since <= 0 ) )
+    return -1;
+  if( (ot_time)since < clean_removed_horizon( ) )
+    return -1;
+  args->since = since;
   return 0;
 }
 
+/* Reads up to eight hex digits into the first and last prefix starting
+   with them */
+static int http_scan_hexprefix( const char *s, size_t len, uint32_t *first, uint32_t *last ) {
+  uint64_t value = 0;
+  size_t   i;
+
+  if( !len || len > 8 )
+    return -1;
+  for( i=0; i<len; ++i ) {
+    int digit = scan_fromhex( s[i] );
+    if( digit < 0 )
+      return -1;
+    value = ( value << 4 ) | digit;
+  }
+  value <<= 32 - 4 * len;
+  if( first ) *first = value;
+  if( last  ) *last  = value | ( 0xffffffffULL >> 4 * len );
+  return 0;
+}
+
+/* Parses prefix=<hex> or range=<hex>-<hex> into args */
+static int http_scan_range( char **read_ptr, ot_taskargs *args, int is_range ) {
+  char   *write_ptr = *read_ptr, *dash;
+  ssize_t len       = scan_urlencoded_query( read_ptr, write_ptr, SCAN_SEARCHPATH_VALUE );
+
+  if( len <= 0 )
+    return -1;
+  if( !is_range ) {
+    if( http_scan_hexprefix( write_ptr, len, &args->range_first, &args->range_last ) )
+      return -1;
+    args->ranged = 1;
+    return 0;
+  }
+  if( !( dash = memchr( write_ptr, '-', len ) ) )
+    return -1;
+  if( http_scan_hexprefix( write_ptr, dash - write_ptr, &args->range_first, NULL ) ||
+      http_scan_hexprefix( dash + 1, write_ptr + len - dash - 1, NULL, &args->range_last ) ||
+      args->range_first > args->range_last )
+    return -1;
+  args->ranged = 1;
+  return 0;
+}
+#endif
+
 static ssize_t http_handle_stats( const int64 sock, struct ot_workstruct *ws, char *read_ptr ) {
 static const ot_keywords keywords_main[] =
-  { { "mode", 1 }, {"format", 2 }, { NULL, -3 } };
+  { { "mode", 1 }, {"format", 2 }, { "since", 3 }, { "prefix", 4 }, { "range", 5 }, { NULL, -3 } };
 static const ot_keywords keywords_mode[] =
   { { "peer", TASK_STATS_PEERS }, { "conn", TASK_STATS_CONNS }, { "scrp", TASK_STATS_SCRAPE }, { "udp4", TASK_STATS_UDP }, { "tcp4", TASK_STATS_TCP },
     { "busy", TASK_STATS_BUSY_NETWORKS }, { "torr", TASK_STATS_TORRENTS }, { "fscr", TASK_STATS_FULLSCRAPE },
     { "s24s", TASK_STATS_SLASH24S }, { "tpbs", TASK_STATS_TPB }, { "herr", TASK_STATS_HTTPERRORS }, { "completed", TASK_STATS_COMPLETED },
     { "top10", TASK_STATS_TOP10 }, { "renew", TASK_STATS_RENEW }, { "syncs", TASK_STATS_SYNCS }, { "version", TASK_STATS_VERSION },
     { "everything", TASK_STATS_EVERYTHING }, { "statedump", TASK_FULLSCRAPE_TRACKERSTATE }, { "fulllog", TASK_STATS_FULLLOG },
-    { "woodpeckers", TASK_STATS_WOODPECKERS},
+    { "woodpeckers", TASK_STATS_WOODPECKERS}, { "slab", TASK_STATS_SLAB }, { "replycache", TASK_STATS_REPLYCACHE },
+    { "udpbatch", TASK_STATS_UDPBATCH },
+#ifdef WANT_FULLSCRAPE
+    { "fscrcache", TASK_STATS_FULLSCRAPE_CACHE },
+#endif
 #ifdef WANT_LOG_NUMWANT
     { "numwants", TASK_STATS_NUMWANTS},
 #endif
@@ -187,9 +277,10 @@ static const ot_keywords keywords_format[] =
     { "txt", TASK_FULLSCRAPE_TPB_ASCII }, { NULL, -3 } };
 
   int mode = TASK_STATS_PEERS, scanon = 1, format = 0;
+  ot_taskargs args = { 0 };
 
 #ifdef WANT_RESTRICT_STATS
-  struct http_data *cookie = io_getcookie( sock );
+  struct http_data *cookie = loop_getcookie( sock );
 
   if( !cookie || !accesslist_isblessed( cookie->ip, OT_PERMISSION_MAY_STAT ) )
     HTTPERROR_403_IP;
@@ -206,6 +297,27 @@ static const ot_keywords keywords_format[] =
     case  2: /* matched "format" */
       if( ( format = scan_find_keywords( keywords_format, &read_ptr, SCAN_SEARCHPATH_VALUE ) ) <= 0 ) HTTPERROR_400_PARAM;
       break;
+    case  3: /* matched "since" */
+#ifdef WANT_FULLSCRAPE
+      if( http_scan_since( &read_ptr, &args ) ) HTTPERROR_400_PARAM;
+#else
+      scan_urlencoded_skipvalue( &read_ptr );
+#endif
+      break;
+    case  4: /* matched "prefix" */
+#ifdef WANT_FULLSCRAPE
+      if( http_scan_range( &read_ptr, &args, 0 ) ) HTTPERROR_400_PARAM;
+#else
+      scan_urlencoded_skipvalue( &read_ptr );
+#endif
+      break;
+    case  5: /* matched "range" */
+#ifdef WANT_FULLSCRAPE
+      if( http_scan_range( &read_ptr, &args, 1 ) ) HTTPERROR_400_PARAM;
+#else
+      scan_urlencoded_skipvalue( &read_ptr );
+#endif
+      break;
     }
   }
 
@@ -215,8 +327,7 @@ static const ot_keywords keywords_format[] =
   }
 
   if( mode == TASK_STATS_TPB ) {
-    struct http_data* cookie = io_getcookie( sock );
-    tai6464 t;
+    struct http_data* cookie = loop_getcookie( sock );
 #ifdef WANT_COMPRESSION_GZIP
     ws->request[ws->request_size] = 0;
     if( strstr( read_ptr - 1, "gzip" ) ) {
@@ -225,22 +336,25 @@ static const ot_keywords keywords_format[] =
     }
 #endif
     /* Pass this task to the worker thread */
+    if( fullscrape_deliver( sock, format, &args ) )
+      HTTPERROR_500;
     cookie->flag |= STRUCT_HTTP_FLAG_WAITINGFORTASK;
 
     /* Clients waiting for us should not easily timeout */
-    taia_uint( &t, 0 ); io_timeout( sock, t );
-    fullscrape_deliver( sock, format );
-    io_dontwantread( sock );
+    loop_timeout( sock, 0 );
+    loop_dontwantread( sock );
     return ws->reply_size = -2;
   }
 #endif
 
   /* default format for now */
   if( ( mode & TASK_CLASS_MASK ) == TASK_STATS ) {
-    tai6464 t;
     /* Complex stats also include expensive memory debugging tools */
-    taia_uint( &t, 0 ); io_timeout( sock, t );
-    stats_deliver( sock, mode );
+    struct http_data* cookie = loop_getcookie( sock );
+    if( stats_deliver( sock, mode ) )
+      HTTPERROR_500;
+    cookie->flag |= STRUCT_HTTP_FLAG_WAITINGFORTASK;
+    loop_timeout( sock, 0 );
     return ws->reply_size = -2;
   }
 
@@ -255,10 +369,9 @@ typedef struct { ot_ip6 ip; ot_time last_fullscrape; } ot_scrape_log;
 #endif
 
 #ifdef WANT_FULLSCRAPE
-static ssize_t http_handle_fullscrape( const int64 sock, struct ot_workstruct *ws ) {
-  struct http_data* cookie = io_getcookie( sock );
+static ssize_t http_handle_fullscrape( const int64 sock, struct ot_workstruct *ws, const ot_taskargs *args ) {
+  struct http_data* cookie = loop_getcookie( sock );
   int format = 0;
-  tai6464 t;
 
 #ifdef WANT_MODEST_FULLSCRAPES
   {
@@ -296,20 +409,22 @@ static ssize_t http_handle_fullscrape( const int64 sock, struct ot_workstruct *w
 #endif
 
   /* Pass this task to the worker thread */
+  if( fullscrape_deliver( sock, TASK_FULLSCRAPE | format, args ) )
+    HTTPERROR_500;
   cookie->flag |= STRUCT_HTTP_FLAG_WAITINGFORTASK;
   /* Clients waiting for us should not easily timeout */
-  taia_uint( &t, 0 ); io_timeout( sock, t );
-  fullscrape_deliver( sock, TASK_FULLSCRAPE | format );
-  io_dontwantread( sock );
+  loop_timeout( sock, 0 );
+  loop_dontwantread( sock );
   return ws->reply_size = -2;
 }
 #endif
 
 static ssize_t http_handle_scrape( const int64 sock, struct ot_workstruct *ws, char *read_ptr ) {
-  static const ot_keywords keywords_scrape[] = { { "info_hash", 1 }, { NULL, -3 } };
+  static const ot_keywords keywords_scrape[] = { { "info_hash", 1 }, { "since", 2 }, { "prefix", 3 }, { "range", 4 }, { NULL, -3 } };
 
   ot_hash * multiscrape_buf = (ot_hash*)ws->request;
   int scanon = 1, numwant = 0;
+  ot_taskargs args = { 0 };
 
   /* This is to hack around stupid clients that send "scrape ?info_hash" */
   if( read_ptr[-1] != '?' ) {
@@ -328,9 +443,37 @@ static ssize_t http_handle_scrape( const int64 sock, struct ot_workstruct *ws, c
       if( scan_urlencoded_query( &read_ptr, (char*)(multiscrape_buf + numwant++), SCAN_SEARCHPATH_VALUE ) != (ssize_t)sizeof(ot_hash) )
         HTTPERROR_400_PARAM;
       break;
+    case  2: /* matched "since" */
+#ifdef WANT_FULLSCRAPE
+      if( http_scan_since( &read_ptr, &args ) ) HTTPERROR_400_PARAM;
+#else
+      scan_urlencoded_skipvalue( &read_ptr );
+#endif
+      break;
+    case  3: /* matched "prefix" */
+#ifdef WANT_FULLSCRAPE
+      if( http_scan_range( &read_ptr, &args, 0 ) ) HTTPERROR_400_PARAM;
+#else
+      scan_urlencoded_skipvalue( &read_ptr );
+#endif
+      break;
+    case  4: /* matched "range" */
+#ifdef WANT_FULLSCRAPE
+      if( http_scan_range( &read_ptr, &args, 1 ) ) HTTPERROR_400_PARAM;
+#else
+      scan_urlencoded_skipvalue( &read_ptr );
+#endif
+      break;
     }
   }
 
+#ifdef WANT_FULLSCRAPE
+  /* since=, prefix= or range= without info_hash ask for a part of the
+     full scrape */
+  if( !numwant && ( args.since || args.ranged ) )
+    return http_handle_fullscrape( sock, ws, &args );
+#endif
+
   /* No info_hash found? Inform user */
   if( !numwant ) HTTPERROR_400_PARAM;
 
@@ -378,7 +521,7 @@ static ssize_t http_handle_announce( const int64 sock, struct ot_workstruct *ws,
   unsigned short    port = 0;
   char             *write_ptr;
   ssize_t           len;
-  struct http_data *cookie = io_getcookie( sock );
+  struct http_data *cookie = loop_getcookie( sock );
 
   /* This is to hack around stupid clients that send "announce ?info_hash" */
   if( read_ptr[-1] != '?' ) {
@@ -514,6 +657,18 @@ static ssize_t http_handle_announce( const int64 sock, struct ot_workstruct *ws,
   if( !ws->hash )
     return ws->reply_size = sprintf( ws->reply, "d14:failure reason80:Your client forgot to send your torrent's info_hash. Please upgrade your client.e" );
 
+#ifdef WANT_SHARDS
+  /* The thread owning the torrent answers, this connection waits for it */
+  if( !shard_is_local( *ws->hash ) ) {
+    ot_shard_msg *msg = shard_msg_alloc( SHARD_HTTP_ANNOUNCE, sock, 0 );
+    if( !msg ) HTTPERROR_500;
+    shard_post_announce( msg, ws, numwant );
+    loop_timeout( sock, 0 );
+    loop_dontwantread( sock );
+    return ws->reply_size = -2;
+  }
+#endif
+
   if( OT_PEERFLAG( &ws->peer ) & PEER_FLAG_STOPPED )
     ws->reply_size = remove_peer_from_torrent( FLAG_TCP, ws );
   else
@@ -523,12 +678,34 @@ static ssize_t http_handle_announce( const int64 sock, struct ot_workstruct *ws,
   return ws->reply_size;
 }
 
+/* Prepends the header to a reply written to ws->outbuf + SUCCESS_HTTP_HEADER_LENGTH */
+static void http_finish_reply( struct ot_workstruct *ws ) {
+  ssize_t reply_off;
+
+  /* This one is rather ugly, so I take you step by step through it.
+
+     1. In order to avoid having two buffers, one for header and one for content, we allow all above functions from trackerlogic to
+     write to a fixed location, leaving SUCCESS_HTTP_HEADER_LENGTH bytes in our work buffer, which is enough for the static string
+     plus dynamic space needed to expand our Content-Length value. We reserve SUCCESS_HTTP_SIZE_OFF for its expansion and calculate
+     the space NOT needed to expand in reply_off
+  */
+  reply_off = SUCCESS_HTTP_SIZE_OFF - snprintf( ws->outbuf, 0, "%zd", ws->reply_size );
+  ws->reply = ws->outbuf + reply_off;
+
+  /* 2. Now we sprintf our header so that sprintf writes its terminating '\0' exactly one byte before content starts. Complete
+     packet size is increased by size of header plus one byte '\n', we will copy over '\0' in next step */
+  ws->reply_size += 1 + sprintf( ws->reply, "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: %zd\r\n\r", ws->reply_size );
+
+  /* 3. Finally we join both blocks neatly */
+  ws->outbuf[ SUCCESS_HTTP_HEADER_LENGTH - 1 ] = '\n';
+}
+
 ssize_t http_handle_request( const int64 sock, struct ot_workstruct *ws ) {
-  ssize_t reply_off, len;
+  ssize_t len;
   char   *read_ptr = ws->request, *write_ptr;
 
 #ifdef WANT_FULLLOG_NETWORKS
-  struct http_data *cookie = io_getcookie( sock );
+  struct http_data *cookie = loop_getcookie( sock );
   if( loglist_check_address( cookie->ip ) ) {
     ot_log *log = malloc( sizeof( ot_log ) );
     if( log ) {
@@ -552,11 +729,11 @@ ssize_t http_handle_request( const int64 sock, struct ot_workstruct *ws ) {
 #endif
 
 #ifdef _DEBUG_HTTPERROR
-  reply_off = ws->request_size;
+  len = ws->request_size;
   if( ws->request_size >= G_DEBUGBUF_SIZE )
-    reply_off = G_DEBUGBUF_SIZE - 1;
-  memcpy( ws->debugbuf, ws->request, reply_off );
-  ws->debugbuf[ reply_off ] = 0;
+    len = G_DEBUGBUF_SIZE - 1;
+  memcpy( ws->debugbuf, ws->request, len );
+  ws->debugbuf[ len ] = 0;
 #endif
   
   /* Tell subroutines where to put reply data */
@@ -583,7 +760,7 @@ ssize_t http_handle_request( const int64 sock, struct ot_workstruct *ws ) {
     http_handle_announce( sock, ws, read_ptr );
 #ifdef WANT_FULLSCRAPE
   else if( !memcmp( write_ptr, "scrape HTTP/", 12 ) )
-    http_handle_fullscrape( sock, ws );
+    http_handle_fullscrape( sock, ws, NULL );
 #endif
   /* This is the hardcore match for scrape */
   else if( !memcmp( write_ptr, "sc", 2 ) )
@@ -606,25 +783,54 @@ ssize_t http_handle_request( const int64 sock, struct ot_workstruct *ws ) {
   /* If routine failed, let http error take over */
   if( ws->reply_size <= 0 ) HTTPERROR_500;
 
-  /* This one is rather ugly, so I take you step by step through it.
+  http_finish_reply( ws );
+  http_senddata( sock, ws );
+  return ws->reply_size;
+}
 
-     1. In order to avoid having two buffers, one for header and one for content, we allow all above functions from trackerlogic to
-     write to a fixed location, leaving SUCCESS_HTTP_HEADER_LENGTH bytes in our work buffer, which is enough for the static string
-     plus dynamic space needed to expand our Content-Length value. We reserve SUCCESS_HTTP_SIZE_OFF for its expansion and calculate
-     the space NOT needed to expand in reply_off
-  */
-  reply_off = SUCCESS_HTTP_SIZE_OFF - snprintf( ws->outbuf, 0, "%zd", ws->reply_size );
-  ws->reply = ws->outbuf + reply_off;
+#ifdef WANT_SHARDS
+void http_handle_shard_announce( ot_shard_msg *msg, struct ot_workstruct *ws ) {
+  ot_shard_msg *reply;
 
-  /* 2. Now we sprintf our header so that sprintf writes its terminating '\0' exactly one byte before content starts. Complete
-     packet size is increased by size of header plus one byte '\n', we will copy over '\0' in next step */
-  ws->reply_size += 1 + sprintf( ws->reply, "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: %zd\r\n\r", ws->reply_size );
+  ws->hash    = &msg->hash;
+  ws->peer_id = msg->has_peer_id ? msg->peer_id : NULL;
+  memcpy( &ws->peer, &msg->peer, sizeof(ot_peer) );
+  ws->reply   = ws->outbuf + SUCCESS_HTTP_HEADER_LENGTH;
 
-  /* 3. Finally we join both blocks neatly */
-  ws->outbuf[ SUCCESS_HTTP_HEADER_LENGTH - 1 ] = '\n';
+  if( OT_PEERFLAG( &ws->peer ) & PEER_FLAG_STOPPED )
+    ws->reply_size = remove_peer_from_torrent( FLAG_TCP, ws );
+  else
+    ws->reply_size = add_peer_to_torrent_and_return_peers( FLAG_TCP, ws, msg->amount );
+  stats_issue_event( EVENT_ANNOUNCE, FLAG_TCP, ws->reply_size);
 
-  http_senddata( sock, ws );
-  return ws->reply_size;
+  if( ws->reply_size > 0 )
+    http_finish_reply( ws );
+  else
+    http_format_error( ws, CODE_HTTPERROR_500 );
+
+  /* The connection waits for an answer in any case, an empty one
+     becomes an error there */
+  if( ( reply = shard_msg_alloc( SHARD_HTTP_REPLY, msg->sock, ws->reply_size ) ) ) {
+    memcpy( reply->data, ws->reply, ws->reply_size );
+    shard_reply( msg, reply );
+    free( msg );
+  } else {
+    msg->type = SHARD_HTTP_REPLY;
+    msg->size = 0;
+    shard_reply( msg, msg );
+  }
+}
+
+void http_send_shard_reply( ot_shard_msg *msg, struct ot_workstruct *ws ) {
+  ws->keep_alive = 0;
+  if( msg->size ) {
+    ws->reply      = msg->data;
+    ws->reply_size = msg->size;
+    http_senddata( msg->sock, ws );
+  } else
+    http_issue_error( msg->sock, ws, CODE_HTTPERROR_500 );
+  free( msg );
 }
+#endif
 
 const char *g_version_http_c = "$Source: /home/cvsroot/opentracker/ot_http.c,v $: $Revision: 1.51 $\n";
@@ -12,17 +12,31 @@ typedef enum {
   STRUCT_HTTP_FLAG_BZIP2          = 4
 } STRUCT_HTTP_FLAG;
 
+struct ot_iovec_shared;
+
 struct http_data {
-  array            request;
-  io_batch         batch;
-  ot_ip6           ip;
-  STRUCT_HTTP_FLAG flag;
+  array                   request;
+  io_batch                batch;
+  ot_ip6                  ip;
+  STRUCT_HTTP_FLAG        flag;
+  struct ot_iovec_shared *shared; /* chunks batch points into */
 };
 
 ssize_t http_handle_request( const int64 s, struct ot_workstruct *ws );
-ssize_t http_sendiovecdata( const int64 s, struct ot_workstruct *ws, int iovec_entries, struct iovec *iovector );
+/* With shared set, the chunks are not freed but the reference is kept
+   until the connection is gone */
+ssize_t http_sendiovecdata( const int64 s, struct ot_workstruct *ws, int iovec_entries, struct iovec *iovector, struct ot_iovec_shared *shared );
 ssize_t http_issue_error( const int64 s, struct ot_workstruct *ws, int code );
 
+#ifdef WANT_SHARDS
+struct ot_shard_msg;
+
+/* Answers an announce another thread passed on and sends the reply back */
+void    http_handle_shard_announce( struct ot_shard_msg *msg, struct ot_workstruct *ws );
+/* Delivers that reply on the connection waiting for it */
+void    http_send_shard_reply( struct ot_shard_msg *msg, struct ot_workstruct *ws );
+#endif
+
 extern char   *g_stats_path;
 extern ssize_t g_stats_path_len;
 
@@ -0,0 +1,364 @@
+/* This software was written by Dirk Engling <erdgeist@erdgeist.org>
+   It is considered beerware. Prost. Skol. Cheers or whatever.
+
+   $id$ */
+
+/* System */
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/types.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* Libowfat */
+#include "uint64.h"
+
+/* Opentracker */
+#include "trackerlogic.h"
+#include "ot_mutex.h"
+
+/* The index is an open addressing hash table with linear probing. Info
+   hashes of real torrents are uniformly distributed, but clients may
+   announce whatever they like, so the hash is mixed with a secret seed
+   before its low bits select the home slot and its top bits the tag.
+   Tags live in their own array, so that a probe compares a whole group of
+   them at once. Probes do not wrap around but may run OT_INDEX_SLACK slots
+   past the last home slot, followed by a group of never used, empty tags. */
+struct ot_index {
+  size_t    capacity;
+  size_t    used;
+  uint32_t *slots;
+  uint8_t   tags[];
+};
+
+static uint64_t g_index_seed;
+
+void index_init( void ) {
+  g_index_seed = ( (uint64_t)random( ) << 32 ) ^ (uint64_t)random( ) ^ (uintptr_t)&g_index_seed;
+}
+
+static uint64_t index_mix( const uint8_t *hash ) {
+  uint64_t a, b;
+  uint32_t c;
+
+  memcpy( &a, hash, 8 ); memcpy( &b, hash + 8, 8 ); memcpy( &c, hash + 16, 4 );
+  a ^= g_index_seed;
+  a *= 0x9e3779b97f4a7c15ULL; a ^= ( a >> 32 ) ^ b;
+  a *= 0xff51afd7ed558ccdULL; a ^= ( a >> 29 ) ^ c;
+  a *= 0xc4ceb9fe1a85ec53ULL;
+  return a ^ ( a >> 32 );
+}
+
+/* Seeded hash for keys of any length, peers use it for their own index */
+uint64_t index_hash( const void *key, size_t len ) {
+  const uint8_t *p = key;
+  uint64_t       h = g_index_seed ^ ( len * 0x9e3779b97f4a7c15ULL ), w;
+
+  for( ; len >= 8; p += 8, len -= 8 ) {
+    memcpy( &w, p, 8 );
+    h = ( h ^ w ) * 0xff51afd7ed558ccdULL;
+    h ^= h >> 32;
+  }
+  if( len ) {
+    w = 0;
+    memcpy( &w, p, len );
+    h = ( h ^ w ) * 0xff51afd7ed558ccdULL;
+    h ^= h >> 32;
+  }
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  return h ^ ( h >> 29 );
+}
+
+static size_t index_home( const ot_index *index, const uint8_t *hash ) {
+  return index_mix( hash ) & ( index->capacity - 1 );
+}
+
+static uint8_t index_tag( const uint8_t *hash ) {
+  return 0x80 | ( index_mix( hash ) >> 57 );
+}
+
+static ot_index *index_alloc( size_t capacity ) {
+  size_t    tag_bytes = ( capacity + OT_INDEX_SLACK + OT_INDEX_GROUP + 3 ) & ~(size_t)3;
+  ot_index *index = malloc( sizeof( ot_index ) + tag_bytes + ( capacity + OT_INDEX_SLACK ) * sizeof( uint32_t ) );
+
+  if( !index ) return NULL;
+  index->capacity = capacity;
+  index->used = 0;
+  index->slots = (uint32_t*)( index->tags + tag_bytes );
+  memset( index->tags, 0, tag_bytes );
+  return index;
+}
+
+/* Finds the slot holding hash. Lock free scrapers run this on snapshots
+   that may be inconsistent, so never trust a position beyond size. Every
+   kind of member starts with its hash, member_size tells them apart */
+static void *index_probe( const ot_index *index, const void *data, size_t member_size, size_t size, const uint8_t *hash, size_t *slot_out ) {
+  const uint8_t *members = data;
+  uint64_t mix  = index_mix( hash );
+  size_t   slot = mix & ( index->capacity - 1 );
+  uint8_t  tag  = 0x80 | ( mix >> 57 );
+#ifdef __SSE2__
+  const __m128i tags = _mm_set1_epi8( (char)tag ), zero = _mm_setzero_si128( );
+
+  while( 1 ) {
+    __m128i  group = _mm_loadu_si128( (const __m128i*)( index->tags + slot ) );
+    unsigned empty = _mm_movemask_epi8( _mm_cmpeq_epi8( group, zero ) );
+    unsigned match = _mm_movemask_epi8( _mm_cmpeq_epi8( group, tags ) );
+
+    /* Only tags before the first empty slot are part of our probe */
+    if( empty )
+      match &= ( empty & -empty ) - 1;
+
+    while( match ) {
+      size_t   found = slot + __builtin_ctz( match );
+      uint32_t pos   = index->slots[found];
+      if( pos < size && !memcmp( members + pos * member_size, hash, sizeof( ot_hash ) ) ) {
+        *slot_out = found;
+        return (void*)( members + pos * member_size );
+      }
+      match &= match - 1;
+    }
+    if( empty )
+      return NULL;
+    slot += OT_INDEX_GROUP;
+  }
+#else
+  for( ; index->tags[slot]; ++slot )
+    if( index->tags[slot] == tag ) {
+      uint32_t pos = index->slots[slot];
+      if( pos < size && !memcmp( members + pos * member_size, hash, sizeof( ot_hash ) ) ) {
+        *slot_out = slot;
+        return (void*)( members + pos * member_size );
+      }
+    }
+  return NULL;
+#endif
+}
+
+/* Backward shift deletion: pull up every following member of the cluster
+   that may live in the hole, so probes never need tombstones */
+static void index_erase_slot( ot_index *index, const void *data, size_t member_size, size_t slot ) {
+  const uint8_t *members = data;
+  size_t         next;
+
+  for( next = slot + 1; index->tags[next]; ++next )
+    if( index_home( index, members + index->slots[next] * member_size ) <= slot ) {
+      index->tags[slot]  = index->tags[next];
+      index->slots[slot] = index->slots[next];
+      slot = next;
+    }
+  index->tags[slot] = 0;
+  index->used--;
+}
+
+/* Torrents with peers and idle torrents are kept the same way, only their
+   member type differs. This is what the code below needs to know of them */
+typedef struct {
+  void     **data;
+  size_t    *size;
+  size_t    *space;
+  ot_index **index;
+  size_t     member_size;
+} ot_index_members;
+
+#define INDEX_MEMBERS(list,type) { (void**)&(list)->data, &(list)->size, &(list)->space, &(list)->index, sizeof( type ) }
+#define INDEX_MEMBER(m,pos) ( (uint8_t*)*(m)->data + (pos) * (m)->member_size )
+
+/* Rebuilds the index for all members with a new capacity. Doubles it until
+   no probe needs to run past the slack, but gives up if that takes absurd
+   amounts of memory */
+static int index_rebuild( ot_index_members *m, size_t capacity ) {
+  while( 1 ) {
+    ot_index *index;
+    size_t    pos;
+
+    if( capacity > OT_INDEX_MAX_SPREAD * ( *m->size + OT_INDEX_MIN_CAPACITY ) )
+      return -1;
+    if( !( index = index_alloc( capacity ) ) )
+      return -1;
+
+    for( pos=0; pos<*m->size; ++pos ) {
+      const uint8_t *hash = INDEX_MEMBER( m, pos );
+      size_t slot = index_home( index, hash );
+      while( index->tags[slot] ) ++slot;
+      if( slot >= capacity + OT_INDEX_SLACK ) break;
+      index->tags[slot]  = index_tag( hash );
+      index->slots[slot] = pos;
+    }
+
+    if( pos == *m->size ) {
+      index->used = *m->size;
+      mutex_retire( *m->index, free );
+      *m->index = index;
+      return 0;
+    }
+    free( index );
+    capacity *= 2;
+  }
+}
+
+/* Lock free scrapers may be reading members, so they are never realloc()ed
+   in place. Publish a resized copy and retire the old one. */
+static int index_resize_members( ot_index_members *m, size_t new_space ) {
+  void *new_data = malloc( new_space * m->member_size );
+  if( !new_data ) return -1;
+  if( *m->size )
+    memcpy( new_data, *m->data, *m->size * m->member_size );
+  mutex_retire( *m->data, free );
+
+  *m->data = new_data;
+  *m->space = new_space;
+  return 0;
+}
+
+/* Appends a new member with its hash set, anything else is left to the
+   caller. Returns NULL, if memory could not be allocated */
+static void *index_insert_member( ot_index_members *m, const uint8_t *hash ) {
+  ot_index *index = *m->index;
+  uint8_t  *member;
+  size_t    slot;
+
+  /* Keep the load factor below 3/4 */
+  if( !index || 4 * ( index->used + 1 ) > 3 * index->capacity ) {
+    if( index_rebuild( m, index ? 2 * index->capacity : OT_INDEX_MIN_CAPACITY ) )
+      return NULL;
+    index = *m->index;
+  }
+
+  if( *m->size == *m->space &&
+      index_resize_members( m, *m->space ? OT_VECTOR_GROW_RATIO * *m->space : OT_VECTOR_MIN_MEMBERS ) )
+    return NULL;
+
+  while( 1 ) {
+    slot = index_home( index, hash );
+    while( index->tags[slot] ) ++slot;
+    if( slot < index->capacity + OT_INDEX_SLACK ) break;
+    if( index_rebuild( m, 2 * index->capacity ) )
+      return NULL;
+    index = *m->index;
+  }
+
+  member = INDEX_MEMBER( m, *m->size );
+  memcpy( member, hash, sizeof( ot_hash ) );
+
+  index->slots[slot] = (*m->size)++;
+  index->tags[slot]  = index_tag( hash );
+  index->used++;
+  return member;
+}
+
+/* Removes match from a list that is not empty. The last member moves into
+   the hole, so when iterating, look at the same position again */
+static void index_remove_member( ot_index_members *m, void *match ) {
+  ot_index *index = *m->index;
+  size_t    last = *m->size - 1, slot;
+  uint8_t  *last_member = INDEX_MEMBER( m, last );
+
+  if( index_probe( index, *m->data, m->member_size, *m->size, match, &slot ) )
+    index_erase_slot( index, *m->data, m->member_size, slot );
+
+  if( match != last_member ) {
+    if( index_probe( index, *m->data, m->member_size, *m->size, last_member, &slot ) )
+      index->slots[slot] = ( (uint8_t*)match - (uint8_t*)*m->data ) / m->member_size;
+    memcpy( match, last_member, m->member_size );
+  }
+  *m->size = last;
+
+  if( ( *m->size * OT_VECTOR_SHRINK_THRESH < *m->space ) && ( *m->space >= OT_VECTOR_SHRINK_RATIO * OT_VECTOR_MIN_MEMBERS ) )
+    index_resize_members( m, *m->space / OT_VECTOR_SHRINK_RATIO );
+
+  if( ( index->capacity > OT_INDEX_MIN_CAPACITY ) && ( 8 * index->used < index->capacity ) )
+    index_rebuild( m, index->capacity / 2 );
+}
+
+ot_torrent *index_find_torrent( const ot_torrent_list *list, const ot_hash hash ) {
+  size_t slot;
+  if( !list->index ) return NULL;
+  return index_probe( list->index, list->data, sizeof( ot_torrent ), list->size, hash, &slot );
+}
+
+/* Finds a torrent or appends a new one with its hash set and no peer list.
+   Returns NULL, if memory could not be allocated */
+ot_torrent *index_find_or_insert_torrent( ot_torrent_list *list, ot_hash hash, int *exactmatch ) {
+  ot_index_members m = INDEX_MEMBERS( list, ot_torrent );
+  ot_torrent      *torrent = index_find_torrent( list, hash );
+
+  if( ( *exactmatch = ( torrent != NULL ) ) )
+    return torrent;
+
+  if( ( torrent = index_insert_member( &m, hash ) ) )
+    torrent->peer_list = NULL;
+  return torrent;
+}
+
+/* Removes a torrent and frees its peer list. The last torrent moves into
+   the hole, so when iterating, look at the same position again */
+void index_remove_torrent( ot_torrent_list *list, ot_torrent *match ) {
+  ot_index_members m = INDEX_MEMBERS( list, ot_torrent );
+
+  if( !list->size ) return;
+
+  /* If this is being called after a unsuccessful malloc() for peer_list
+     in add_peer_to_torrent, match->peer_list actually might be NULL */
+  if( match->peer_list ) free_peerlist( match->peer_list );
+
+  index_remove_member( &m, match );
+}
+
+ot_idle_torrent *index_find_idle( const ot_torrent_list *list, const ot_hash hash ) {
+  size_t slot;
+  if( !list->idle.index ) return NULL;
+  return index_probe( list->idle.index, list->idle.data, sizeof( ot_idle_torrent ), list->idle.size, hash, &slot );
+}
+
+/* Moves a torrent without peers to the idle torrents, keeping only its
+   completed count and time base. Returns -1 and leaves the torrent alone,
+   if it has nothing worth keeping, memory is short or the count does not
+   fit */
+int index_demote_torrent( ot_torrent_list *list, ot_torrent *torrent ) {
+  ot_index_members m = INDEX_MEMBERS( &list->idle, ot_idle_torrent );
+  ot_peerlist     *peer_list = torrent->peer_list;
+  ot_idle_torrent *idle;
+
+  if( peer_list->peer_count || !peer_list->down_count || peer_list->down_count > UINT32_MAX )
+    return -1;
+  if( !( idle = index_insert_member( &m, torrent->hash ) ) )
+    return -1;
+  idle->down_count = peer_list->down_count;
+  idle->base = (uint16_t)peer_list->base;
+
+  index_remove_torrent( list, torrent );
+  return 0;
+}
+
+/* Appends an idle torrent. Returns -1, if memory is short */
+int index_insert_idle( ot_torrent_list *list, ot_hash hash, ot_time base, size_t down_count ) {
+  ot_index_members m = INDEX_MEMBERS( &list->idle, ot_idle_torrent );
+  ot_idle_torrent *idle;
+
+  if( down_count > UINT32_MAX || !( idle = index_insert_member( &m, hash ) ) )
+    return -1;
+  idle->down_count = down_count;
+  idle->base = (uint16_t)base;
+  return 0;
+}
+
+void index_remove_idle( ot_torrent_list *list, ot_idle_torrent *match ) {
+  ot_index_members m = INDEX_MEMBERS( &list->idle, ot_idle_torrent );
+
+  if( !list->idle.size ) return;
+  index_remove_member( &m, match );
+}
+
+/* Only for when no lock free reader can be around anymore */
+void index_free( ot_torrent_list *list ) {
+  free( list->data );
+  free( list->index );
+  free( list->idle.data );
+  free( list->idle.index );
+  memset( list, 0, sizeof( *list ) );
+}
+
+const char *g_version_index_c = "$Source: /home/cvsroot/opentracker/ot_index.c,v $: $Revision: 1.1 $\n";
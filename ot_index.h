@@ -0,0 +1,58 @@
+/* This software was written by Dirk Engling <erdgeist@erdgeist.org>
+   It is considered beerware. Prost. Skol. Cheers or whatever.
+
+   $id$ */
+
+#ifndef __OT_INDEX_H__
+#define __OT_INDEX_H__
+
+/* These defines control the torrent index */
+#define OT_INDEX_MIN_CAPACITY 16
+#define OT_INDEX_SLACK        64
+#define OT_INDEX_GROUP        16
+#define OT_INDEX_MAX_SPREAD   64
+
+typedef struct ot_index ot_index;
+
+/* Torrents without peers are only kept for their completed count, until
+   OT_TORRENT_TIMEOUT. They live in a dense table of their own and get a
+   peer list again on their next announce. The time base is kept in
+   minutes modulo 2^16, which is plenty for ages below a day. */
+typedef struct {
+  ot_hash  hash;
+  uint32_t down_count;
+  uint16_t base;
+} __attribute__((packed)) ot_idle_torrent;
+
+#define OT_IDLE_AGE(idle) ((ot_time)(uint16_t)(g_now_minutes-(idle)->base))
+
+typedef struct {
+  ot_idle_torrent *data;
+  size_t           size;
+  size_t           space;
+  ot_index        *index;
+} ot_idle_list;
+
+/* All torrents of a bucket. The torrents live densely in data, in no
+   particular order, an open addressing hash index finds them by hash */
+typedef struct {
+  ot_torrent  *data;
+  size_t       size;
+  size_t       space;
+  ot_index    *index;
+  ot_idle_list idle;
+} ot_torrent_list;
+
+void        index_init( void );
+uint64_t    index_hash( const void *key, size_t len );
+ot_torrent *index_find_torrent( const ot_torrent_list *list, const ot_hash hash );
+ot_torrent *index_find_or_insert_torrent( ot_torrent_list *list, ot_hash hash, int *exactmatch );
+void        index_remove_torrent( ot_torrent_list *list, ot_torrent *match );
+
+ot_idle_torrent *index_find_idle( const ot_torrent_list *list, const ot_hash hash );
+int              index_demote_torrent( ot_torrent_list *list, ot_torrent *torrent );
+int              index_insert_idle( ot_torrent_list *list, ot_hash hash, ot_time base, size_t down_count );
+void             index_remove_idle( ot_torrent_list *list, ot_idle_torrent *match );
+void        index_free( ot_torrent_list *list );
+
+#endif
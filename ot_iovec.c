@@ -73,4 +73,29 @@ size_t iovec_length( int *iovec_entries, struct iovec **iovector ) {
   return length;
 }
 
+ot_iovec_shared *iovec_share( int *iovec_entries, struct iovec **iovector ) {
+  ot_iovec_shared *shared = malloc( sizeof( ot_iovec_shared ) );
+  if( !shared )
+    return NULL;
+  shared->refcount      = 1;
+  shared->iovec_entries = *iovec_entries;
+  shared->iovector      = *iovector;
+  shared->size          = iovec_length( iovec_entries, iovector );
+  *iovec_entries = 0;
+  *iovector      = NULL;
+  return shared;
+}
+
+void iovec_shared_hold( ot_iovec_shared *shared ) {
+  __sync_fetch_and_add( &shared->refcount, 1 );
+}
+
+void iovec_shared_release( ot_iovec_shared *shared ) {
+  if( __sync_sub_and_fetch( &shared->refcount, 1 ) )
+    return;
+  iovec_free( &shared->iovec_entries, &shared->iovector );
+  free( shared->iovector );
+  free( shared );
+}
+
 const char *g_version_iovec_c = "$Source: /home/cvsroot/opentracker/ot_iovec.c,v $: $Revision: 1.6 $\n";
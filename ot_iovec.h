@@ -16,4 +16,18 @@ size_t iovec_length( int *iovec_entries, struct iovec **iovector );
 
 void  *iovec_fix_increase_or_free( int *iovec_entries, struct iovec **iovector, void *last_ptr, size_t new_alloc );
 
+/* Chunks no longer written to can be shared by several readers, each
+   holding a reference. The last one to release it unmaps the chunks. */
+typedef struct ot_iovec_shared {
+  int           refcount;
+  int           iovec_entries;
+  struct iovec *iovector;
+  size_t        size;
+} ot_iovec_shared;
+
+/* Takes over the chunks, holding the first reference */
+ot_iovec_shared *iovec_share( int *iovec_entries, struct iovec **iovector );
+void             iovec_shared_hold( ot_iovec_shared *shared );
+void             iovec_shared_release( ot_iovec_shared *shared );
+
 #endif
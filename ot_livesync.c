@@ -46,9 +46,11 @@ static int64    g_socket_in = -1;
 /* For incoming packets */
 static int64    g_socket_out = -1;
 
+/* All I/O threads tell peers into the same outgoing packet */
 char            g_outbuf[LIVESYNC_OUTGOING_BUFFSIZE_PEERS];
 static size_t   g_outbuf_data;
 static ot_time  g_next_packet_time;
+static pthread_mutex_t g_outbuf_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 static pthread_t thread_id;
 void livesync_init( ) {
@@ -112,23 +114,31 @@ static void livesync_issue_peersync( ) {
 }
 
 static void livesync_handle_peersync( struct ot_workstruct *ws ) {
-  int off = sizeof( g_tracker_id ) + sizeof( uint32_t );
+  struct ot_workstruct batch_ws[OT_BATCH_MAX];
+  ot_batch_entry       entries[OT_BATCH_MAX];
+  int                  off = sizeof( g_tracker_id ) + sizeof( uint32_t ), count = 0;
 
   /* Now basic sanity checks have been done on the live sync packet
-     We might add more testing and logging. */
+     We might add more testing and logging. Peers are applied in batches,
+     that only need one lock per bucket. */
+  memset( batch_ws, 0, sizeof( batch_ws ) );
   while( off + (ssize_t)sizeof( ot_hash ) + (ssize_t)sizeof( ot_peer ) <= ws->request_size ) {
-    memcpy( &ws->peer, ws->request + off + sizeof(ot_hash), sizeof( ot_peer ) );
-    ws->hash = (ot_hash*)(ws->request + off);
-
-    if( !g_opentracker_running ) return;
-
-    if( OT_PEERFLAG(&ws->peer) & PEER_FLAG_STOPPED )
-      remove_peer_from_torrent( FLAG_MCA, ws );
-    else
-      add_peer_to_torrent_and_return_peers( FLAG_MCA, ws, /* amount = */ 0 );
+    memcpy( &batch_ws[count].peer, ws->request + off + sizeof(ot_hash), sizeof( ot_peer ) );
+    batch_ws[count].hash = (ot_hash*)(ws->request + off);
+    entries[count].action = OT_BATCH_ANNOUNCE;
+    entries[count].proto  = FLAG_MCA;
+    entries[count].amount = 0;
+    entries[count].ws     = batch_ws + count;
 
     off += sizeof( ot_hash ) + sizeof( ot_peer );
+    if( ++count == OT_BATCH_MAX ) {
+      if( !g_opentracker_running ) return;
+      process_batch( entries, count );
+      count = 0;
+    }
   }
+  if( count && g_opentracker_running )
+    process_batch( entries, count );
 
   stats_issue_event(EVENT_SYNC, 0,
                     (ws->request_size - sizeof( g_tracker_id ) - sizeof( uint32_t ) ) /
@@ -140,14 +150,17 @@ static void livesync_handle_peersync( struct ot_workstruct *ws ) {
    enough */
 void livesync_ticker( ) {
   /* livesync_issue_peersync sets g_next_packet_time */
+  pthread_mutex_lock( &g_outbuf_mutex );
   if( g_now_seconds > g_next_packet_time &&
      g_outbuf_data > sizeof( g_tracker_id ) + sizeof( uint32_t ) )
     livesync_issue_peersync();
+  pthread_mutex_unlock( &g_outbuf_mutex );
 }
 
 /* Inform live sync about whats going on. */
 void livesync_tell( struct ot_workstruct *ws ) {
 
+  pthread_mutex_lock( &g_outbuf_mutex );
   memcpy( g_outbuf + g_outbuf_data, ws->hash, sizeof(ot_hash) );
   memcpy( g_outbuf + g_outbuf_data + sizeof(ot_hash), &ws->peer, sizeof(ot_peer) );
 
@@ -155,6 +168,7 @@ void livesync_tell( struct ot_workstruct *ws ) {
 
   if( g_outbuf_data >= LIVESYNC_OUTGOING_BUFFSIZE_PEERS - LIVESYNC_OUTGOING_WATERMARK_PEERS )
     livesync_issue_peersync();
+  pthread_mutex_unlock( &g_outbuf_mutex );
 }
 
 static void * livesync_worker( void * args ) {
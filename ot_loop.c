@@ -0,0 +1,940 @@
+/* This software was written by Dirk Engling <erdgeist@erdgeist.org>
+   It is considered beerware. Prost. Skol. Cheers or whatever.
+
+   $id$ */
+
+/* System */
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#ifdef WANT_IO_URING
+#include <stdio.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+/* Libowfat */
+#include "io.h"
+#include "socket.h"
+
+/* Opentracker */
+#include "trackerlogic.h"
+#include "ot_loop.h"
+#include "ot_clock.h"
+
+/* How a socket reads, with io_uring. Epoll polls all of them */
+#define LOOP_MODE_POLL   0
+#define LOOP_MODE_ACCEPT 1
+#define LOOP_MODE_RECV   2
+
+/* Per socket state, indexed by file descriptor. An entry is only written by
+   the thread owning the socket, it is released before the descriptor is
+   closed and may be taken by another loop afterwards. */
+typedef struct {
+  ot_loop *loop;
+  void    *cookie;
+  time_t   deadline;
+  uint32_t events;
+  int      prev, next;  /* in the owner's wheel slot of the deadline */
+#ifdef WANT_IO_URING
+  uint32_t armed;       /* events of the poll request in flight */
+  uint32_t generation;  /* tells completions of earlier polls apart */
+  uint32_t shot;        /* the same for multishot requests */
+  int      dirty;       /* armed needs to follow events */
+  uint8_t  mode;        /* LOOP_MODE_*, how reading is done */
+  uint8_t  multishot;   /* a multishot accept or receive is in flight */
+  uint8_t  closing;     /* closed once its multishot accept has ended */
+#endif
+} ot_loop_socket;
+
+#ifdef WANT_IO_URING
+/* The io_uring backend keeps the readiness interface of the epoll one.
+   Interest is armed with one shot poll requests, re-armed after each event
+   like a level triggered epoll set would report it again. Those requests,
+   closes and the final send of a connection are queued in the ring and
+   submitted together with the wait, instead of costing a syscall each.
+
+   Listening sockets instead get a multishot accept and connections a
+   multishot receive into the loop's ring of provided buffers. Each new
+   connection or each chunk of data is reported as an event of its own and
+   taken by loop_accept() or loop_read(), without a syscall. Buffers are
+   given back to the ring with the next wait, after the handlers ran. */
+/* What came with an event from a multishot request */
+typedef struct {
+  int     res;     /* the new socket or the bytes received */
+  int     buffer;  /* the provided buffer holding them, or -1 */
+  uint8_t state;   /* LOOP_RESULT_* */
+} ot_loop_result;
+
+#define LOOP_RESULT_NONE  0
+#define LOOP_RESULT_READY 1
+#define LOOP_RESULT_TAKEN 2
+
+typedef struct {
+  int                  fd;
+  unsigned             entries;
+  unsigned            *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned            *cq_head, *cq_tail, *cq_mask;
+  unsigned             sq_pending_tail;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void                *ring;
+  size_t               ring_size;
+  size_t               sqes_size;
+
+  /* Sockets whose poll request has to be changed before the next wait */
+  int                 *dirty;
+  size_t               dirty_count;
+  size_t               dirty_size;
+
+  /* The ring of provided buffers, NULL if the kernel has none. Buffers
+     used by completions reaped wait in recycle for the next wait */
+  struct io_uring_buf_ring *buf_ring;
+  size_t               buf_ring_size;
+  uint8_t             *buffers;
+  uint16_t            *recycle;
+  size_t               recycle_count;
+  int                  multishot;  /* cleared if the kernel refuses them */
+} ot_loop_uring;
+
+#define OT_LOOP_URING_ENTRIES 1024
+#define OT_LOOP_URING_BUFFERS 512
+#define OT_LOOP_URING_BUFGROUP 0
+
+/* What a completion is for, in the low bits of its user_data. Polls,
+   accepts and receives carry socket and generation, sends their buffer */
+#define LOOP_URING_POLL   0
+#define LOOP_URING_SEND   1
+#define LOOP_URING_CLOSE  2
+#define LOOP_URING_IGNORE 3
+#define LOOP_URING_ACCEPT 4
+#define LOOP_URING_RECV   5
+#define LOOP_URING_KIND(data) ((data)&7)
+#define LOOP_URING_SOCK(data) ((uint32_t)(data)>>3)
+#define LOOP_URING_DATA(sock,generation,kind) (((uint64_t)(generation)<<32)|((uint64_t)(sock)<<3)|(kind))
+#define LOOP_URING_POLLDATA(sock,generation) LOOP_URING_DATA(sock,generation,LOOP_URING_POLL)
+
+int g_loop_io_uring;
+#endif
+
+struct ot_loop {
+  int                epoll;
+  int                wakeup;
+
+  /* Sockets with a deadline hang in the slot of that second. wheel_time
+     is the next second to expire, scan the position in its slot */
+  int                wheel[OT_LOOP_WHEEL_SLOTS];
+  time_t             wheel_time;
+  int                scan;
+  int                scanning;
+
+  /* Sockets in the loop, its eventfd included, and final sends queued */
+  size_t             sockets;
+  size_t             sends;
+
+  /* Events from the last loop_wait() */
+  int                event_count;
+  int                next_read;
+  int                next_write;
+  struct epoll_event events[OT_LOOP_EVENTS];
+
+#ifdef WANT_IO_URING
+  ot_loop_uring     *uring;
+
+  /* Results of multishot requests going with the events, and the event
+     the last loop_canread() returned */
+  ot_loop_result     results[OT_LOOP_EVENTS];
+  int                current;
+#endif
+};
+
+static ot_loop_socket *g_loop_sockets;
+static size_t          g_loop_socket_count;
+
+static ot_loop_socket *loop_socket( int64 sock ) {
+  if( sock < 0 || (uint64)sock >= g_loop_socket_count || !g_loop_sockets[sock].loop )
+    return NULL;
+  return g_loop_sockets + sock;
+}
+
+#ifdef WANT_IO_URING
+/* Registers the ring of provided buffers, without it sockets are polled */
+static void uring_setup_buffers( ot_loop_uring *u ) {
+  struct io_uring_buf_reg reg;
+  int i;
+
+  u->buf_ring_size = OT_LOOP_URING_BUFFERS * sizeof(struct io_uring_buf);
+  u->buf_ring = mmap( NULL, u->buf_ring_size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0 );
+  if( u->buf_ring == MAP_FAILED ) {
+    u->buf_ring = NULL;
+    return;
+  }
+  u->buffers = malloc( OT_LOOP_URING_BUFFERS * OT_LOOP_READ_SIZE );
+  u->recycle = malloc( OT_LOOP_URING_BUFFERS * sizeof(uint16_t) );
+
+  memset( &reg, 0, sizeof(reg) );
+  reg.ring_addr    = (uintptr_t)u->buf_ring;
+  reg.ring_entries = OT_LOOP_URING_BUFFERS;
+  reg.bgid         = OT_LOOP_URING_BUFGROUP;
+  if( !u->buffers || !u->recycle || syscall( __NR_io_uring_register, u->fd, IORING_REGISTER_PBUF_RING, &reg, 1 ) ) {
+    munmap( u->buf_ring, u->buf_ring_size );
+    free( u->buffers );
+    free( u->recycle );
+    u->buf_ring = NULL;
+    u->buffers  = NULL;
+    u->recycle  = NULL;
+    return;
+  }
+
+  for( i=0; i<OT_LOOP_URING_BUFFERS; ++i )
+    u->recycle[u->recycle_count++] = i;
+  u->multishot = 1;
+}
+
+/* Hands the buffers of the last round back to the kernel */
+static void uring_recycle( ot_loop_uring *u ) {
+  uint16_t tail;
+  size_t   i;
+
+  if( !u->recycle_count )
+    return;
+  tail = u->buf_ring->tail;
+  for( i=0; i<u->recycle_count; ++i ) {
+    struct io_uring_buf *buf = u->buf_ring->bufs + ( ( tail + i ) & ( OT_LOOP_URING_BUFFERS - 1 ) );
+    buf->addr = (uintptr_t)( u->buffers + (size_t)u->recycle[i] * OT_LOOP_READ_SIZE );
+    buf->len  = OT_LOOP_READ_SIZE;
+    buf->bid  = u->recycle[i];
+  }
+  __atomic_store_n( &u->buf_ring->tail, (uint16_t)( tail + u->recycle_count ), __ATOMIC_RELEASE );
+  u->recycle_count = 0;
+}
+
+static ot_loop_uring *uring_create( void ) {
+  struct io_uring_params params;
+  ot_loop_uring *u;
+  size_t sq_size, cq_size;
+  uint8_t *ring;
+
+  if( !( u = calloc( 1, sizeof(ot_loop_uring) ) ) )
+    return NULL;
+
+  /* Timeouts for the wait and a single mapping for both rings are what we
+     need, kernels having them have everything else as well */
+  memset( &params, 0, sizeof(params) );
+  if( ( u->fd = syscall( __NR_io_uring_setup, OT_LOOP_URING_ENTRIES, &params ) ) < 0 )
+    goto error_free;
+  if( !( params.features & IORING_FEAT_EXT_ARG ) || !( params.features & IORING_FEAT_SINGLE_MMAP ) )
+    goto error_close;
+
+  sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  u->ring_size = sq_size > cq_size ? sq_size : cq_size;
+  u->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+  ring = mmap( NULL, u->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING );
+  if( ring == MAP_FAILED )
+    goto error_close;
+  u->sqes = mmap( NULL, u->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES );
+  if( u->sqes == MAP_FAILED ) {
+    munmap( ring, u->ring_size );
+    goto error_close;
+  }
+
+  u->ring     = ring;
+  u->entries  = params.sq_entries;
+  u->sq_head  = (unsigned*)( ring + params.sq_off.head );
+  u->sq_tail  = (unsigned*)( ring + params.sq_off.tail );
+  u->sq_mask  = (unsigned*)( ring + params.sq_off.ring_mask );
+  u->sq_array = (unsigned*)( ring + params.sq_off.array );
+  u->cq_head  = (unsigned*)( ring + params.cq_off.head );
+  u->cq_tail  = (unsigned*)( ring + params.cq_off.tail );
+  u->cq_mask  = (unsigned*)( ring + params.cq_off.ring_mask );
+  u->cqes     = (struct io_uring_cqe*)( ring + params.cq_off.cqes );
+  u->sq_pending_tail = *u->sq_tail;
+  uring_setup_buffers( u );
+  return u;
+
+error_close:
+  close( u->fd );
+error_free:
+  free( u );
+  return NULL;
+}
+
+static void uring_free( ot_loop_uring *u ) {
+  if( u->buf_ring ) {
+    munmap( u->buf_ring, u->buf_ring_size );
+    free( u->buffers );
+    free( u->recycle );
+  }
+  munmap( u->sqes, u->sqes_size );
+  munmap( u->ring, u->ring_size );
+  close( u->fd );
+  free( u->dirty );
+  free( u );
+}
+
+/* Submits everything queued and, with msec not 0, waits at most that long
+   for a completion. A negative msec waits forever */
+static void uring_enter( ot_loop_uring *u, int msec ) {
+  struct io_uring_getevents_arg arg;
+  struct __kernel_timespec      ts;
+  unsigned                      to_submit;
+
+  __atomic_store_n( u->sq_tail, u->sq_pending_tail, __ATOMIC_RELEASE );
+  to_submit = u->sq_pending_tail - __atomic_load_n( u->sq_head, __ATOMIC_ACQUIRE );
+
+  if( !msec ) {
+    if( to_submit )
+      syscall( __NR_io_uring_enter, u->fd, to_submit, 0, 0, NULL, 0 );
+    return;
+  }
+
+  memset( &arg, 0, sizeof(arg) );
+  if( msec > 0 ) {
+    ts.tv_sec  = msec / 1000;
+    ts.tv_nsec = ( msec % 1000 ) * 1000000;
+    arg.ts = (uint64_t)(uintptr_t)&ts;
+  }
+  syscall( __NR_io_uring_enter, u->fd, to_submit, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg) );
+}
+
+/* Makes sure count more requests fit the submission queue */
+static int uring_reserve( ot_loop_uring *u, unsigned count ) {
+  if( u->sq_pending_tail - __atomic_load_n( u->sq_head, __ATOMIC_ACQUIRE ) + count > u->entries )
+    uring_enter( u, 0 );
+  return u->sq_pending_tail - __atomic_load_n( u->sq_head, __ATOMIC_ACQUIRE ) + count <= u->entries;
+}
+
+/* Only call after uring_reserve() succeeded */
+static struct io_uring_sqe *uring_queue( ot_loop_uring *u, uint8_t opcode, int fd, uint64_t user_data ) {
+  unsigned index = u->sq_pending_tail++ & *u->sq_mask;
+  struct io_uring_sqe *sqe = u->sqes + index;
+
+  memset( sqe, 0, sizeof(*sqe) );
+  sqe->opcode    = opcode;
+  sqe->fd        = fd;
+  sqe->user_data = user_data;
+  u->sq_array[index] = index;
+  return sqe;
+}
+
+static void uring_mark_dirty( ot_loop *loop, int64 sock ) {
+  ot_loop_uring  *u = loop->uring;
+  ot_loop_socket *s = g_loop_sockets + sock;
+
+  if( s->dirty )
+    return;
+  if( u->dirty_count == u->dirty_size ) {
+    size_t size = u->dirty_size ? 2 * u->dirty_size : OT_LOOP_EVENTS;
+    int *dirty = realloc( u->dirty, size * sizeof(int) );
+    if( !dirty )
+      return;
+    u->dirty = dirty;
+    u->dirty_size = size;
+  }
+  u->dirty[u->dirty_count++] = sock;
+  s->dirty = 1;
+}
+
+/* Cancels the poll request in flight, its completion is ignored */
+static void uring_disarm( ot_loop_uring *u, int64 sock ) {
+  ot_loop_socket *s = g_loop_sockets + sock;
+
+  if( s->armed && uring_reserve( u, 1 ) )
+    uring_queue( u, IORING_OP_POLL_REMOVE, -1, LOOP_URING_IGNORE )->addr = LOOP_URING_POLLDATA( sock, s->generation );
+  s->armed = 0;
+  ++s->generation;
+}
+
+static uint64_t uring_shotdata( int64 sock ) {
+  ot_loop_socket *s = g_loop_sockets + sock;
+  return LOOP_URING_DATA( sock, s->shot, s->mode == LOOP_MODE_ACCEPT ? LOOP_URING_ACCEPT : LOOP_URING_RECV );
+}
+
+/* Cancels the multishot request in flight. Connections accepted by it
+   afterwards are closed, data received is dropped */
+static void uring_disarm_shot( ot_loop_uring *u, int64 sock ) {
+  ot_loop_socket *s = g_loop_sockets + sock;
+
+  if( s->multishot && uring_reserve( u, 1 ) )
+    uring_queue( u, IORING_OP_ASYNC_CANCEL, -1, LOOP_URING_IGNORE )->addr = uring_shotdata( sock );
+  s->multishot = 0;
+  ++s->shot;
+}
+
+static void uring_arm_shot( ot_loop_uring *u, int64 sock ) {
+  ot_loop_socket      *s = g_loop_sockets + sock;
+  struct io_uring_sqe *sqe;
+
+  if( s->mode == LOOP_MODE_ACCEPT ) {
+    sqe = uring_queue( u, IORING_OP_ACCEPT, sock, uring_shotdata( sock ) );
+    sqe->ioprio       = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK;
+  } else {
+    sqe = uring_queue( u, IORING_OP_RECV, sock, uring_shotdata( sock ) );
+    sqe->ioprio    = IORING_RECV_MULTISHOT;
+    sqe->flags     = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = OT_LOOP_URING_BUFGROUP;
+  }
+  s->multishot = 1;
+}
+
+static void loop_release( int64 sock );
+
+/* Brings the poll requests of all sockets that changed up to date. Sockets
+   closed in the meantime have left the loop and are skipped */
+static void uring_arm( ot_loop *loop ) {
+  ot_loop_uring *u = loop->uring;
+  size_t i;
+
+  for( i=0; i<u->dirty_count; ++i ) {
+    int64           sock = u->dirty[i];
+    ot_loop_socket *s = g_loop_sockets + sock;
+
+    uint32_t        poll;
+    int             shot;
+
+    if( s->loop != loop || !s->dirty )
+      continue;
+
+    /* A listener closed is left once its accept has ended */
+    if( s->closing ) {
+      if( !s->multishot ) {
+        if( !uring_reserve( u, 2 ) )
+          break;
+        loop_release( sock );
+        uring_queue( u, IORING_OP_CLOSE, sock, ( (uint64_t)sock << 3 ) | LOOP_URING_CLOSE );
+      }
+      s->dirty = 0;
+      continue;
+    }
+
+    /* Reading in a multishot request, the poll is for the rest */
+    shot = u->multishot && s->mode != LOOP_MODE_POLL && ( s->events & EPOLLIN );
+    poll = shot ? s->events & ~EPOLLIN : s->events;
+    if( s->armed == poll && s->multishot == shot ) {
+      s->dirty = 0;
+      continue;
+    }
+    if( !uring_reserve( u, 4 ) )
+      break;
+    if( s->armed != poll ) {
+      uring_disarm( u, sock );
+      if( poll ) {
+        uring_queue( u, IORING_OP_POLL_ADD, sock, LOOP_URING_POLLDATA( sock, s->generation ) )->poll32_events = poll;
+        s->armed = poll;
+      }
+    }
+    if( s->multishot != shot ) {
+      if( shot )
+        uring_arm_shot( u, sock );
+      else
+        uring_disarm_shot( u, sock );
+    }
+    s->dirty = 0;
+  }
+
+  /* Whatever did not fit is left for the next round */
+  memmove( u->dirty, u->dirty + i, ( u->dirty_count - i ) * sizeof(int) );
+  u->dirty_count -= i;
+}
+
+static void uring_event( ot_loop *loop, int64 sock, uint32_t events, int res, int buffer, uint8_t state ) {
+  loop->events[loop->event_count].events  = events;
+  loop->events[loop->event_count].data.fd = sock;
+  loop->results[loop->event_count].res    = res;
+  loop->results[loop->event_count].buffer = buffer;
+  loop->results[loop->event_count].state  = state;
+  ++loop->event_count;
+}
+
+/* Results of multishot requests. A request not flagged to go on has
+   ended and is re-armed, if still wanted */
+static void uring_reap_shot( ot_loop *loop, struct io_uring_cqe *cqe ) {
+  ot_loop_uring  *u = loop->uring;
+  uint64_t        data = cqe->user_data;
+  int64           sock = LOOP_URING_SOCK( data );
+  ot_loop_socket *s = g_loop_sockets + sock;
+  int             buffer = -1;
+
+  if( cqe->flags & IORING_CQE_F_BUFFER ) {
+    buffer = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    u->recycle[u->recycle_count++] = buffer;
+  }
+
+  if( s->loop != loop || s->shot != (uint32_t)( data >> 32 ) ) {
+    if( LOOP_URING_KIND( data ) == LOOP_URING_ACCEPT && cqe->res >= 0 )
+      close( cqe->res );
+    return;
+  }
+
+  if( !( cqe->flags & IORING_CQE_F_MORE ) ) {
+    s->multishot = 0;
+    uring_mark_dirty( loop, sock );
+    /* Kernels without multishot requests refuse them, poll instead */
+    if( cqe->res == -EINVAL ) {
+      u->multishot = 0;
+      return;
+    }
+  }
+
+  if( LOOP_URING_KIND( data ) == LOOP_URING_ACCEPT ) {
+    if( cqe->res >= 0 )
+      uring_event( loop, sock, EPOLLIN, cqe->res, -1, LOOP_RESULT_READY );
+  } else if( cqe->res != -ENOBUFS )
+    /* Out of buffers, the receive is armed again after they came back */
+    uring_event( loop, sock, EPOLLIN, cqe->res, buffer, LOOP_RESULT_READY );
+}
+
+/* Turns poll completions into events, just as epoll_wait() would return
+   them, and finishes sends and closes on the way */
+static void uring_reap( ot_loop *loop ) {
+  ot_loop_uring *u = loop->uring;
+  unsigned head = *u->cq_head, tail = __atomic_load_n( u->cq_tail, __ATOMIC_ACQUIRE );
+
+  while( head != tail && loop->event_count < OT_LOOP_EVENTS ) {
+    struct io_uring_cqe *cqe = u->cqes + ( head++ & *u->cq_mask );
+    uint64_t             data = cqe->user_data;
+
+    switch( LOOP_URING_KIND( data ) ) {
+      case LOOP_URING_SEND:
+        free( (void*)(uintptr_t)( data & ~(uint64_t)7 ) );
+        --loop->sends;
+        break;
+      case LOOP_URING_CLOSE:
+        /* A failed send cancels the close linked to it */
+        if( cqe->res == -ECANCELED )
+          close( (int)( data >> 3 ) );
+        break;
+      case LOOP_URING_POLL: {
+        int64           sock = LOOP_URING_SOCK( data );
+        ot_loop_socket *s = g_loop_sockets + sock;
+
+        if( s->loop != loop || s->generation != (uint32_t)( data >> 32 ) )
+          break;
+        s->armed = 0;
+        uring_mark_dirty( loop, sock );
+        uring_event( loop, sock, cqe->res < 0 ? EPOLLERR : (uint32_t)cqe->res, 0, -1, LOOP_RESULT_NONE );
+        break;
+      }
+      case LOOP_URING_ACCEPT:
+      case LOOP_URING_RECV:
+        uring_reap_shot( loop, cqe );
+        break;
+      default:
+        break;
+    }
+  }
+  __atomic_store_n( u->cq_head, head, __ATOMIC_RELEASE );
+}
+#endif
+
+/* A socket wanting neither to read nor to write is taken out of the epoll
+   set, else a peer hanging up on it would be reported over and over */
+static void loop_setevents( int64 sock, uint32_t events ) {
+  ot_loop_socket    *s = g_loop_sockets + sock;
+  struct epoll_event ev;
+  int                op = !s->events ? EPOLL_CTL_ADD : !events ? EPOLL_CTL_DEL : EPOLL_CTL_MOD;
+
+  if( events == s->events )
+    return;
+
+#ifdef WANT_IO_URING
+  if( s->loop->uring ) {
+    s->events = events;
+    uring_mark_dirty( s->loop, sock );
+    return;
+  }
+#endif
+
+  memset( &ev, 0, sizeof(ev) );
+  ev.events  = events;
+  ev.data.fd = sock;
+  epoll_ctl( s->loop->epoll, op, sock, &ev );
+  s->events = events;
+}
+
+static void loop_unlink( int64 sock ) {
+  ot_loop_socket *s = g_loop_sockets + sock;
+  ot_loop *loop = s->loop;
+
+  if( !s->deadline )
+    return;
+
+  if( loop->scan == sock )
+    loop->scan = s->next;
+  if( s->prev != -1 )
+    g_loop_sockets[s->prev].next = s->next;
+  else
+    loop->wheel[s->deadline & OT_LOOP_WHEEL_MASK] = s->next;
+  if( s->next != -1 )
+    g_loop_sockets[s->next].prev = s->prev;
+  s->prev = s->next = -1;
+  s->deadline = 0;
+}
+
+ot_loop *loop_create( void ) {
+  ot_loop *loop;
+
+  /* The first loop is created before any threads, set up the table then */
+  if( !g_loop_sockets ) {
+    struct rlimit limit;
+    size_t count = OT_LOOP_MAX_FDS;
+    if( !getrlimit( RLIMIT_NOFILE, &limit ) && limit.rlim_cur != RLIM_INFINITY && limit.rlim_cur < count )
+      count = limit.rlim_cur;
+    if( !( g_loop_sockets = calloc( count, sizeof(ot_loop_socket) ) ) )
+      return NULL;
+    g_loop_socket_count = count;
+  }
+
+  if( !( loop = calloc( 1, sizeof(ot_loop) ) ) )
+    return NULL;
+  memset( loop->wheel, -1, sizeof(loop->wheel) );
+  loop->wheel_time = g_now_monotonic;
+  loop->scan = -1;
+
+  loop->epoll = -1;
+
+#ifdef WANT_IO_URING
+  if( g_loop_io_uring && !( loop->uring = uring_create( ) ) ) {
+    fputs( "io_uring not supported, falling back to epoll.\n", stderr );
+    g_loop_io_uring = 0;
+  }
+  if( !loop->uring )
+#endif
+  if( ( loop->epoll = epoll_create( OT_LOOP_EVENTS ) ) == -1 ) {
+    free( loop );
+    return NULL;
+  }
+
+  /* The eventfd allows other threads to interrupt loop_wait(), the event
+     loop sees it under the FLAG_SELFPIPE cookie */
+  if( ( loop->wakeup = eventfd( 0, EFD_NONBLOCK ) ) == -1 ) {
+    if( loop->epoll != -1 ) close( loop->epoll );
+#ifdef WANT_IO_URING
+    if( loop->uring ) uring_free( loop->uring );
+#endif
+    free( loop );
+    return NULL;
+  }
+  if( !loop_add( loop, loop->wakeup, (void*)FLAG_SELFPIPE ) ) {
+    close( loop->wakeup );
+    if( loop->epoll != -1 ) close( loop->epoll );
+#ifdef WANT_IO_URING
+    if( loop->uring ) uring_free( loop->uring );
+#endif
+    free( loop );
+    return NULL;
+  }
+
+  return loop;
+}
+
+static int loop_add_mode( ot_loop *loop, int64 sock, void *cookie, int mode ) {
+  ot_loop_socket *s;
+
+  if( sock < 0 || (uint64)sock >= g_loop_socket_count )
+    return 0;
+
+  s = g_loop_sockets + sock;
+  s->loop     = loop;
+  s->cookie   = cookie;
+  s->deadline = 0;
+  s->events   = 0;
+  s->prev     = s->next = -1;
+#ifdef WANT_IO_URING
+  s->armed     = 0;
+  s->dirty     = 0;
+  s->mode      = mode;
+  s->multishot = 0;
+  s->closing   = 0;
+  ++s->generation;
+  ++s->shot;
+#else
+  (void)mode;
+#endif
+
+  ++loop->sockets;
+  loop_setevents( sock, EPOLLIN );
+  return 1;
+}
+
+int loop_add( ot_loop *loop, int64 sock, void *cookie ) {
+  return loop_add_mode( loop, sock, cookie, LOOP_MODE_POLL );
+}
+
+int loop_add_listener( ot_loop *loop, int64 sock, void *cookie ) {
+  return loop_add_mode( loop, sock, cookie, LOOP_MODE_ACCEPT );
+}
+
+int loop_add_connection( ot_loop *loop, int64 sock, void *cookie ) {
+  return loop_add_mode( loop, sock, cookie, LOOP_MODE_RECV );
+}
+
+/* Takes the socket out of its loop, leaving the descriptor open */
+static void loop_release( int64 sock ) {
+  ot_loop_socket *s = g_loop_sockets + sock;
+  ot_loop *loop = s->loop;
+  int i;
+
+  loop_unlink( sock );
+
+  /* Events fetched for this socket must not be reported for whoever
+     gets the descriptor next */
+  for( i = 0; i < loop->event_count; ++i )
+    if( loop->events[i].data.fd == sock )
+      loop->events[i].events = 0;
+
+#ifdef WANT_IO_URING
+  if( loop->uring ) {
+    uring_disarm( loop->uring, sock );
+    uring_disarm_shot( loop->uring, sock );
+    s->events  = 0;
+    s->dirty   = 0;
+    s->closing = 0;
+  } else
+#endif
+  loop_setevents( sock, 0 );
+  s->cookie = NULL;
+  s->loop   = NULL;
+  --loop->sockets;
+}
+
+void loop_close( int64 sock ) {
+  ot_loop_socket *s = loop_socket( sock );
+
+#ifdef WANT_IO_URING
+  /* The descriptor is released when the ring gets to it, so it can not be
+     taken by a new socket while requests for it are still queued */
+  if( s && s->loop->uring && uring_reserve( s->loop->uring, 3 ) ) {
+    ot_loop_uring *u = s->loop->uring;
+
+    /* Connections the accept took until it is cancelled are still served,
+       the listener stays in the loop until then */
+    if( s->mode == LOOP_MODE_ACCEPT && s->multishot ) {
+      if( !s->closing )
+        uring_queue( u, IORING_OP_ASYNC_CANCEL, -1, LOOP_URING_IGNORE )->addr = uring_shotdata( sock );
+      s->events  = 0;
+      s->closing = 1;
+      return;
+    }
+    loop_release( sock );
+    uring_queue( u, IORING_OP_CLOSE, sock, ( (uint64_t)sock << 3 ) | LOOP_URING_CLOSE );
+    return;
+  }
+#endif
+
+  if( s )
+    loop_release( sock );
+  close( sock );
+}
+
+int loop_send_close( int64 sock, const char *data, size_t size ) {
+#ifdef WANT_IO_URING
+  ot_loop_socket      *s = loop_socket( sock );
+  ot_loop_uring       *u;
+  struct io_uring_sqe *sqe;
+  char                *buffer;
+
+  if( !s || !( u = s->loop->uring ) || !uring_reserve( u, 3 ) || !( buffer = malloc( size ) ) )
+    return 0;
+  memcpy( buffer, data, size );
+  ++s->loop->sends;
+  loop_release( sock );
+
+  /* MSG_WAITALL makes newer kernels complete short sends before the close */
+  sqe = uring_queue( u, IORING_OP_SEND, sock, (uintptr_t)buffer | LOOP_URING_SEND );
+  sqe->addr      = (uintptr_t)buffer;
+  sqe->len       = size;
+  sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+  sqe->flags     = IOSQE_IO_LINK;
+  uring_queue( u, IORING_OP_CLOSE, sock, ( (uint64_t)sock << 3 ) | LOOP_URING_CLOSE );
+  return 1;
+#else
+  (void)sock; (void)data; (void)size;
+  return 0;
+#endif
+}
+
+size_t loop_busy( ot_loop *loop ) {
+  return loop->sockets - 1 + loop->sends;
+}
+
+#ifdef WANT_IO_URING
+/* The result going with the event last returned by loop_canread(), if
+   it is for sock */
+static ot_loop_result *loop_result( int64 sock ) {
+  ot_loop_socket *s = loop_socket( sock );
+  ot_loop        *loop;
+
+  if( !s || !( loop = s->loop )->uring || loop->current < 0 || loop->events[loop->current].data.fd != sock )
+    return NULL;
+  return loop->results + loop->current;
+}
+#endif
+
+int64 loop_accept( int64 sock, ot_ip6 ip, uint16_t *port ) {
+  int64 conn;
+#ifdef WANT_IO_URING
+  ot_loop_result *r = loop_result( sock );
+
+  if( r && r->state != LOOP_RESULT_NONE ) {
+    if( r->state != LOOP_RESULT_READY )
+      return -1;
+    r->state = LOOP_RESULT_TAKEN;
+    if( socket_remote6( r->res, (char*)ip, port, NULL ) ) {
+      close( r->res );
+      return -1;
+    }
+    return r->res;
+  }
+#endif
+
+  if( ( conn = socket_accept6( sock, (char*)ip, port, NULL ) ) != -1 )
+    io_nonblock( conn );
+  return conn;
+}
+
+ssize_t loop_read( int64 sock, char *buf, size_t size ) {
+#ifdef WANT_IO_URING
+  ot_loop_result *r = loop_result( sock );
+
+  if( r && r->state != LOOP_RESULT_NONE ) {
+    ot_loop_uring *u = g_loop_sockets[sock].loop->uring;
+    if( r->state != LOOP_RESULT_READY )
+      return -1;
+    r->state = LOOP_RESULT_TAKEN;
+    if( r->res <= 0 || r->buffer < 0 )
+      return r->res < 0 ? -1 : 0;
+    if( (size_t)r->res < size )
+      size = r->res;
+    memcpy( buf, u->buffers + (size_t)r->buffer * OT_LOOP_READ_SIZE, size );
+    return size;
+  }
+#endif
+
+  return read( sock, buf, size );
+}
+
+void *loop_getcookie( int64 sock ) {
+  ot_loop_socket *s = loop_socket( sock );
+  return s ? s->cookie : NULL;
+}
+
+ot_loop *loop_owner( int64 sock ) {
+  ot_loop_socket *s = loop_socket( sock );
+  return s ? s->loop : NULL;
+}
+
+void loop_wantread( int64 sock )      { loop_setevents( sock, g_loop_sockets[sock].events | EPOLLIN ); }
+void loop_dontwantread( int64 sock )  { loop_setevents( sock, g_loop_sockets[sock].events & ~EPOLLIN ); }
+void loop_wantwrite( int64 sock )     { loop_setevents( sock, g_loop_sockets[sock].events | EPOLLOUT ); }
+void loop_dontwantwrite( int64 sock ) { loop_setevents( sock, g_loop_sockets[sock].events & ~EPOLLOUT ); }
+
+void loop_timeout( int64 sock, time_t deadline ) {
+  ot_loop_socket *s = g_loop_sockets + sock;
+  ot_loop *loop = s->loop;
+  int *slot;
+
+  loop_unlink( sock );
+  if( !deadline )
+    return;
+
+  /* Deadlines passed already go to the next slot to be expired */
+  if( deadline < loop->wheel_time + loop->scanning )
+    deadline = loop->wheel_time + loop->scanning;
+
+  slot = loop->wheel + ( deadline & OT_LOOP_WHEEL_MASK );
+  s->prev = -1;
+  s->next = *slot;
+  if( s->next != -1 )
+    g_loop_sockets[s->next].prev = sock;
+  *slot = sock;
+  s->deadline = deadline;
+}
+
+void loop_wait( ot_loop *loop, int msec ) {
+  int count;
+
+#ifdef WANT_IO_URING
+  if( loop->uring ) {
+    if( loop->uring->buf_ring )
+      uring_recycle( loop->uring );
+    uring_arm( loop );
+    uring_enter( loop->uring, msec );
+    loop->event_count = 0;
+    loop->next_read   = loop->next_write = 0;
+    loop->current     = -1;
+    uring_reap( loop );
+    return;
+  }
+#endif
+
+  count = epoll_wait( loop->epoll, loop->events, OT_LOOP_EVENTS, msec );
+
+  loop->event_count = count > 0 ? count : 0;
+  loop->next_read   = loop->next_write = 0;
+}
+
+int64 loop_canread( ot_loop *loop ) {
+  while( loop->next_read < loop->event_count ) {
+    struct epoll_event *ev = loop->events + loop->next_read++;
+    ot_loop_socket     *s = g_loop_sockets + ev->data.fd;
+#ifdef WANT_IO_URING
+    loop->current = loop->next_read - 1;
+    if( ( ev->events & EPOLLIN ) && s->closing )
+      return ev->data.fd;
+#endif
+    if( ( ev->events & ( EPOLLIN | EPOLLERR | EPOLLHUP ) ) && ( s->events & EPOLLIN ) )
+      return ev->data.fd;
+  }
+  return -1;
+}
+
+int64 loop_canwrite( ot_loop *loop ) {
+  while( loop->next_write < loop->event_count ) {
+    struct epoll_event *ev = loop->events + loop->next_write++;
+    if( ( ev->events & ( EPOLLOUT | EPOLLERR | EPOLLHUP ) ) && ( g_loop_sockets[ev->data.fd].events & EPOLLOUT ) )
+      return ev->data.fd;
+  }
+  return -1;
+}
+
+/* Walks the slots of all seconds up to now, continuing where the last call
+   left off. Sockets in a slot with a deadline not reached yet are a full
+   turn of the wheel or more ahead. The socket returned has no deadline any
+   more and may be closed by the caller. */
+int64 loop_timeouted( ot_loop *loop, time_t now ) {
+  /* After a long pause, one turn visits every slot */
+  if( !loop->scanning && now - loop->wheel_time >= OT_LOOP_WHEEL_SLOTS )
+    loop->wheel_time = now - OT_LOOP_WHEEL_SLOTS + 1;
+
+  for( ; loop->wheel_time <= now; ++loop->wheel_time, loop->scanning = 0 ) {
+    int sock = loop->scanning ? loop->scan : loop->wheel[loop->wheel_time & OT_LOOP_WHEEL_MASK];
+
+    loop->scanning = 1;
+    for( ; sock != -1; sock = g_loop_sockets[sock].next )
+      if( g_loop_sockets[sock].deadline <= now ) {
+        loop->scan = g_loop_sockets[sock].next;
+        loop_unlink( sock );
+        return sock;
+      }
+  }
+  return -1;
+}
+
+void loop_wakeup( ot_loop *loop ) {
+  const uint64_t one = 1;
+  if( write( loop->wakeup, &one, sizeof(one) ) < 0 ) {
+    /* Only fails when the counter is about to overflow, still readable */
+  }
+}
+
+const char *g_version_loop_c = "$Source: /home/cvsroot/opentracker/ot_loop.c,v $: $Revision: 1.1 $\n";
@@ -0,0 +1,83 @@
+/* This software was written by Dirk Engling <erdgeist@erdgeist.org>
+   It is considered beerware. Prost. Skol. Cheers or whatever.
+
+   $id$ */
+
+#ifndef __OT_LOOP_H__
+#define __OT_LOOP_H__
+
+/* Each I/O thread runs its own event loop. A socket belongs to the loop it
+   was added to and may only be touched from that loop's thread, so apart
+   from loop_wakeup() nothing here takes a lock. libowfat's io_wait family
+   keeps one global set and can not be used this way. */
+
+#define OT_LOOP_EVENTS   256
+
+/* Seconds on the timer wheel, more than the longest deadline set, so that
+   each socket is visited only once, when it is due */
+#define OT_LOOP_WHEEL_SLOTS 1024
+#define OT_LOOP_WHEEL_MASK  (OT_LOOP_WHEEL_SLOTS-1)
+
+/* Size of the buffers connections receive into with io_uring */
+#define OT_LOOP_READ_SIZE 2048
+
+/* Upper bound for the socket table, if the file limit is unlimited */
+#define OT_LOOP_MAX_FDS  (1024*1024)
+
+typedef struct ot_loop ot_loop;
+
+/* The clock must have been read before */
+ot_loop *loop_create( void );
+
+#ifdef WANT_IO_URING
+/* Loops created while this is set use io_uring, if the kernel supports
+   it. It is cleared when falling back to epoll. */
+extern int g_loop_io_uring;
+#endif
+
+/* Sockets are added wanting to read, without a timeout */
+int      loop_add( ot_loop *loop, int64 sock, void *cookie );
+void     loop_close( int64 sock );
+
+/* Listening TCP sockets and connections. With io_uring they accept and
+   receive on their own, what came with an event from loop_canread() is
+   taken with loop_accept() until it returns -1, and with one loop_read()
+   of at least OT_LOOP_READ_SIZE bytes. Otherwise these do the syscalls.
+   Sockets accepted are non blocking. */
+int      loop_add_listener( ot_loop *loop, int64 sock, void *cookie );
+int      loop_add_connection( ot_loop *loop, int64 sock, void *cookie );
+int64    loop_accept( int64 sock, ot_ip6 ip, uint16_t *port );
+ssize_t  loop_read( int64 sock, char *buf, size_t size );
+
+/* Sends data and closes the socket, without waiting for either. Returns 0
+   if the loop can not do this, which is always the case with epoll. */
+int      loop_send_close( int64 sock, const char *data, size_t size );
+
+/* Returns the number of sockets in the loop besides its eventfd, plus
+   final sends the ring has not finished yet */
+size_t   loop_busy( ot_loop *loop );
+
+void    *loop_getcookie( int64 sock );
+ot_loop *loop_owner( int64 sock );
+
+void     loop_wantread( int64 sock );
+void     loop_dontwantread( int64 sock );
+void     loop_wantwrite( int64 sock );
+void     loop_dontwantwrite( int64 sock );
+
+/* Sockets not closed by their deadline are reported by loop_timeouted(),
+   a deadline of 0 means never. Deadlines are seconds of g_now_monotonic,
+   setting, moving and expiring one takes constant time. */
+void     loop_timeout( int64 sock, time_t deadline );
+
+/* Waits at most msec milliseconds for events, which then are fetched with
+   the loop_can* calls until they return -1 */
+void     loop_wait( ot_loop *loop, int msec );
+int64    loop_canread( ot_loop *loop );
+int64    loop_canwrite( ot_loop *loop );
+int64    loop_timeouted( ot_loop *loop, time_t now );
+
+/* May be called from any thread, makes the loop's eventfd readable */
+void     loop_wakeup( ot_loop *loop );
+
+#endif
@@ -5,331 +5,494 @@
 
 /* System */
 #include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/mman.h>
 #include <sys/uio.h>
 
 /* Libowfat */
 #include "byte.h"
 #include "io.h"
-#include "uint32.h"
 
 /* Opentracker */
 #include "trackerlogic.h"
 #include "ot_mutex.h"
+#include "ot_loop.h"
+#include "ot_iovec.h"
+#include "ot_slab.h"
 #include "ot_stats.h"
 
 /* #define MTX_DBG( STRING ) fprintf( stderr, STRING ) */
 #define MTX_DBG( STRING )
 
-/* Our global all torrents list */
-static ot_vector all_torrents[OT_BUCKET_COUNT];
+/* Our global all torrents list. Each bucket carries its own lock, padded
+   to a cache line so that threads working on neighbouring buckets do not
+   bounce each others lines. The sequence counter is odd while a writer
+   holds the bucket, see lock free readers below */
+typedef struct {
+  pthread_mutex_t       lock;
+  volatile unsigned int seq;
+  ot_torrent_list       torrents;
+} __attribute__((aligned(64))) ot_bucket;
+
+static ot_bucket all_torrents[OT_BUCKET_COUNT];
 static size_t    g_torrent_count;
 
-/* Bucket Magic */
-static int bucket_locklist[ OT_MAX_THREADS ];
-static int bucket_locklist_count = 0;
-static pthread_mutex_t bucket_mutex;
-static pthread_cond_t bucket_being_unlocked;
-
-/* Self pipe from opentracker.c */
-extern int g_self_pipe[2];
-
-static int bucket_check( int bucket ) {
-  /* C should come with auto-i ;) */
-  int i;
+/* Can block */
+ot_torrent_list *mutex_bucket_lock( int bucket ) {
+  ot_bucket *b = all_torrents + bucket;
 
-  /* No more space to acquire lock to bucket -- should not happen */
-  if( bucket_locklist_count == OT_MAX_THREADS ) {
-    fprintf( stderr, "More lock requests than mutexes. Consult source code.\n" );
-    return -1;
+  /* Only count a stall, if we really have to wait for another thread */
+  if( pthread_mutex_trylock( &b->lock ) ) {
+    stats_issue_event( EVENT_BUCKET_LOCKED, 0, 0 );
+    pthread_mutex_lock( &b->lock );
   }
+  b->seq++;
+  __sync_synchronize();
+  slab_set_arena( bucket );
+  return &b->torrents;
+}
 
-  /* See, if bucket is already locked */
-  for( i=0; i<bucket_locklist_count; ++i )
-    if( bucket_locklist[ i ] == bucket ) {
-      stats_issue_event( EVENT_BUCKET_LOCKED, 0, 0 );
-      return -1;
-    }
+ot_torrent_list *mutex_bucket_lock_by_hash( ot_hash hash ) {
+  return mutex_bucket_lock( OT_BUCKET_BY_HASH( hash ) );
+}
 
-  return 0;
+void mutex_bucket_unlock( int bucket, int delta_torrentcount ) {
+  if( delta_torrentcount )
+    __sync_fetch_and_add( &g_torrent_count, (size_t)(ssize_t)delta_torrentcount );
+  __sync_synchronize();
+  all_torrents[bucket].seq++;
+  slab_set_arena( -1 );
+  pthread_mutex_unlock( &all_torrents[bucket].lock );
 }
 
-static void bucket_push( int bucket ) {
-  bucket_locklist[ bucket_locklist_count++ ] = bucket;
+void mutex_bucket_unlock_by_hash( ot_hash hash, int delta_torrentcount ) {
+  mutex_bucket_unlock( OT_BUCKET_BY_HASH( hash ), delta_torrentcount );
 }
 
-static void bucket_remove( int bucket ) {
-  int i = 0;
+size_t mutex_get_torrent_count( ) {
+  return *(volatile size_t*)&g_torrent_count;
+}
 
-  while( ( i < bucket_locklist_count ) && ( bucket_locklist[ i ] != bucket ) )
-    ++i;
+/* Lock free readers
 
-  if( i == bucket_locklist_count ) {
-    fprintf( stderr, "Request to unlock bucket that was never locked. Consult source code.\n" );
-    return;
-  }
+   Readers sample a bucket's sequence counter, look at the bucket without
+   locking and retry, if the counter moved in between. Memory they might
+   still be looking at (torrent vectors and peer lists) must not be freed
+   by writers directly but handed to mutex_retire(). mutex_reclaim() only
+   releases it after every reader that could have seen it has left its
+   critical section, using two alternating reader counts. */
+
+#define OT_RETIRE_BACKLOG 4096
+
+typedef struct { void *ptr; void (*release)( void * ); } ot_retired;
+
+static volatile size_t g_epoch;
+static volatile size_t g_epoch_readers[2];
 
-  for( ; i < bucket_locklist_count - 1; ++i )
-    bucket_locklist[ i ] = bucket_locklist[ i + 1 ];
+static ot_retired     *g_retired;
+static size_t          g_retired_count, g_retired_space;
+static pthread_mutex_t g_retired_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t g_reclaim_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-  --bucket_locklist_count;
+const ot_torrent_list *mutex_bucket_read_begin( int bucket, unsigned int *seq ) {
+  *seq = all_torrents[bucket].seq;
+  __sync_synchronize();
+  return &all_torrents[bucket].torrents;
 }
 
-/* Can block */
-ot_vector *mutex_bucket_lock( int bucket ) {
-  pthread_mutex_lock( &bucket_mutex );
-  while( bucket_check( bucket ) )
-    pthread_cond_wait( &bucket_being_unlocked, &bucket_mutex );
-  bucket_push( bucket );
-  pthread_mutex_unlock( &bucket_mutex );
-  return all_torrents + bucket;
+int mutex_bucket_read_retry( int bucket, unsigned int seq ) {
+  __sync_synchronize();
+  return ( seq & 1 ) || ( all_torrents[bucket].seq != seq );
 }
 
-ot_vector *mutex_bucket_lock_by_hash( ot_hash hash ) {
-  return mutex_bucket_lock( uint32_read_big( (char*)hash ) >> OT_BUCKET_COUNT_SHIFT );
+int mutex_epoch_enter( ) {
+  int epoch = g_epoch & 1;
+  __sync_fetch_and_add( g_epoch_readers + epoch, 1 );
+  return epoch;
 }
 
-void mutex_bucket_unlock( int bucket, int delta_torrentcount ) {
-  pthread_mutex_lock( &bucket_mutex );
-  bucket_remove( bucket );
-  g_torrent_count += delta_torrentcount;
-  pthread_cond_broadcast( &bucket_being_unlocked );
-  pthread_mutex_unlock( &bucket_mutex );
+void mutex_epoch_leave( int epoch ) {
+  __sync_fetch_and_sub( g_epoch_readers + epoch, 1 );
 }
 
-void mutex_bucket_unlock_by_hash( ot_hash hash, int delta_torrentcount ) {
-  mutex_bucket_unlock( uint32_read_big( (char*)hash ) >> OT_BUCKET_COUNT_SHIFT, delta_torrentcount );
+/* Wait until all readers active at the time of the call are gone. A reader
+   may have sampled the epoch just before we flip it, so flip twice */
+static void mutex_epoch_synchronize( ) {
+  int i;
+  for( i=0; i<2; ++i ) {
+    int old_epoch = __sync_fetch_and_add( &g_epoch, 1 ) & 1;
+    while( g_epoch_readers[old_epoch] )
+      sched_yield( );
+  }
 }
 
-size_t mutex_get_torrent_count( ) {
-  size_t torrent_count;
-  pthread_mutex_lock( &bucket_mutex );
-  torrent_count = g_torrent_count;
-  pthread_mutex_unlock( &bucket_mutex );
-  return torrent_count;
+void mutex_reclaim( ) {
+  ot_retired *retired;
+  size_t      count;
+
+  pthread_mutex_lock( &g_reclaim_mutex );
+
+  pthread_mutex_lock( &g_retired_mutex );
+  retired = g_retired; count = g_retired_count;
+  g_retired = NULL; g_retired_count = g_retired_space = 0;
+  pthread_mutex_unlock( &g_retired_mutex );
+
+  if( count )
+    mutex_epoch_synchronize( );
+  while( count-- )
+    retired[count].release( retired[count].ptr );
+  free( retired );
+
+  pthread_mutex_unlock( &g_reclaim_mutex );
 }
 
-/* TaskQueue Magic */
+void mutex_retire( void *ptr, void (*release)( void * ) ) {
+  int backlog;
+
+  if( !ptr ) return;
+
+  pthread_mutex_lock( &g_retired_mutex );
+  if( g_retired_count == g_retired_space ) {
+    size_t      new_space = g_retired_space ? 2 * g_retired_space : 64;
+    ot_retired *new_retired = realloc( g_retired, new_space * sizeof( ot_retired ) );
+    if( !new_retired ) {
+      /* Can not defer. Better wait for readers than leak or crash */
+      pthread_mutex_unlock( &g_retired_mutex );
+      pthread_mutex_lock( &g_reclaim_mutex );
+      mutex_epoch_synchronize( );
+      pthread_mutex_unlock( &g_reclaim_mutex );
+      release( ptr );
+      return;
+    }
+    g_retired = new_retired;
+    g_retired_space = new_space;
+  }
+  g_retired[g_retired_count].ptr = ptr;
+  g_retired[g_retired_count].release = release;
+  backlog = ++g_retired_count >= OT_RETIRE_BACKLOG;
+  pthread_mutex_unlock( &g_retired_mutex );
+
+  /* Usually the cleaner reclaims, but do not let the backlog grow unbound */
+  if( backlog )
+    mutex_reclaim( );
+}
+
+/* TaskQueue Magic
+
+   Each task class has its own bounded queue, that any number of workers of
+   that class pop from. Pushers and workers only ever touch the queue's
+   positions and cells with atomic operations, a semaphore per class puts
+   idle workers to sleep and wakes exactly one of them per task.
+
+   A finished task is pushed on the result stack of the thread that created
+   it, which is woken only if the stack was empty. Only that thread pops
+   results and cancels tasks, so it keeps its outstanding tasks in a plain
+   list. Whoever sees a task last frees it: the worker for tasks cancelled
+   before they were done, the creating thread for all others. */
+
+#define OT_TASKQUEUE_SIZE 1024
+#define OT_TASKQUEUE_MASK (OT_TASKQUEUE_SIZE-1)
+#define OT_TASK_CLASSES   ((TASK_CLASS_MASK>>8)+1)
+
+enum { TASK_STATE_PENDING, TASK_STATE_RUNNING, TASK_STATE_DONE, TASK_STATE_FINISHED, TASK_STATE_CANCELLED };
+
+typedef struct ot_taskresults ot_taskresults;
 
 struct ot_task {
-  ot_taskid       taskid;
-  ot_tasktype     tasktype;
-  int64           sock;
-  int             iovec_entries;
-  struct iovec   *iovec;
-  struct ot_task *next;
+  ot_tasktype      tasktype;
+  ot_taskargs      args;
+  int              state;
+  int64            sock;
+  ot_loop         *loop;
+  ot_taskresults  *results;
+  int              iovec_entries;
+  struct iovec    *iovec;
+  ot_iovec_shared *shared;
+  struct ot_task  *next_result;
+
+  /* The creating thread's list of outstanding tasks */
+  struct ot_task  *prev, *next;
 };
 
-static ot_taskid next_free_taskid = 1;
-static struct ot_task *tasklist;
-static pthread_mutex_t tasklist_mutex;
-static pthread_cond_t tasklist_being_filled;
+struct ot_taskresults {
+  struct ot_task *pushed;  /* by workers, newest first */
+  struct ot_task *taken;   /* by the owner, oldest first */
+};
 
-int mutex_workqueue_pushtask( int64 sock, ot_tasktype tasktype ) {
-  struct ot_task ** tmptask, * task;
-
-  /* Want exclusive access to tasklist */
-  MTX_DBG( "pushtask locks.\n" );
-  pthread_mutex_lock( &tasklist_mutex );
-  MTX_DBG( "pushtask locked.\n" );
-
-  task = malloc(sizeof( struct ot_task));
-  if( !task ) {
-    MTX_DBG( "pushtask fail unlocks.\n" );
-    pthread_mutex_unlock( &tasklist_mutex );
-    MTX_DBG( "pushtask fail unlocked.\n" );
-    return -1;
+typedef struct {
+  size_t          sequence;
+  struct ot_task *task;
+} ot_taskcell;
+
+typedef struct {
+  size_t          enqueue_pos __attribute__((aligned(64)));
+  size_t          dequeue_pos __attribute__((aligned(64)));
+  sem_t           pending;
+  ot_taskcell     cells[OT_TASKQUEUE_SIZE];
+} ot_taskqueue;
+
+static ot_taskqueue              g_taskqueues[OT_TASK_CLASSES];
+static __thread ot_taskresults   t_taskresults;
+static __thread struct ot_task  *t_outstanding;
+
+static ot_taskqueue *taskqueue_for( ot_tasktype tasktype ) {
+  return g_taskqueues + ( ( tasktype & TASK_CLASS_MASK ) >> 8 );
+}
+
+/* Bounded multi producer multi consumer queue: a cell's sequence tells
+   whether it is free for the position enqueued next, or filled for the
+   position dequeued next */
+static int taskqueue_push( ot_taskqueue *queue, struct ot_task *task ) {
+  size_t       pos = __atomic_load_n( &queue->enqueue_pos, __ATOMIC_RELAXED );
+  ot_taskcell *cell;
+
+  for( ; ; ) {
+    intptr_t diff;
+    cell = queue->cells + ( pos & OT_TASKQUEUE_MASK );
+    diff = (intptr_t)__atomic_load_n( &cell->sequence, __ATOMIC_ACQUIRE ) - (intptr_t)pos;
+    if( !diff ) {
+      if( __atomic_compare_exchange_n( &queue->enqueue_pos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED ) )
+        break;
+    } else if( diff < 0 )
+      return -1; /* full */
+    else
+      pos = __atomic_load_n( &queue->enqueue_pos, __ATOMIC_RELAXED );
   }
 
-  /* Skip to end of list */
-  tmptask = &tasklist;
-  while( *tmptask )
-    tmptask = &(*tmptask)->next;
-  *tmptask = task;
+  cell->task = task;
+  __atomic_store_n( &cell->sequence, pos + 1, __ATOMIC_RELEASE );
+  sem_post( &queue->pending );
+  return 0;
+}
+
+static struct ot_task *taskqueue_pop( ot_taskqueue *queue ) {
+  size_t       pos = __atomic_load_n( &queue->dequeue_pos, __ATOMIC_RELAXED );
+  ot_taskcell *cell;
+  struct ot_task *task;
+
+  for( ; ; ) {
+    intptr_t diff;
+    cell = queue->cells + ( pos & OT_TASKQUEUE_MASK );
+    diff = (intptr_t)__atomic_load_n( &cell->sequence, __ATOMIC_ACQUIRE ) - (intptr_t)( pos + 1 );
+    if( !diff ) {
+      if( __atomic_compare_exchange_n( &queue->dequeue_pos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED ) )
+        break;
+    } else if( diff < 0 )
+      return NULL; /* empty */
+    else
+      pos = __atomic_load_n( &queue->dequeue_pos, __ATOMIC_RELAXED );
+  }
+
+  task = cell->task;
+  __atomic_store_n( &cell->sequence, pos + OT_TASKQUEUE_SIZE, __ATOMIC_RELEASE );
+  return task;
+}
+
+static void task_unlink( struct ot_task *task ) {
+  if( task->prev )
+    task->prev->next = task->next;
+  else
+    t_outstanding = task->next;
+  if( task->next )
+    task->next->prev = task->prev;
+}
+
+int mutex_workqueue_pushtask( int64 sock, ot_tasktype tasktype ) {
+  return mutex_workqueue_pushtask_args( sock, tasktype, NULL );
+}
 
-  task->taskid        = 0;
+int mutex_workqueue_pushtask_args( int64 sock, ot_tasktype tasktype, const ot_taskargs *args ) {
+  struct ot_task *task = malloc( sizeof( struct ot_task ) );
+
+  if( !task )
+    return -1;
+
+  if( args )
+    memcpy( &task->args, args, sizeof( ot_taskargs ) );
+  else
+    byte_zero( &task->args, sizeof( ot_taskargs ) );
   task->tasktype      = tasktype;
+  task->state         = TASK_STATE_PENDING;
   task->sock          = sock;
+  task->loop          = loop_owner( sock );
+  task->results       = &t_taskresults;
   task->iovec_entries = 0;
   task->iovec         = NULL;
-  task->next          = 0;
-
-  /* Inform waiting workers and release lock */
-  MTX_DBG( "pushtask broadcasts.\n" );
-  pthread_cond_broadcast( &tasklist_being_filled );
-  MTX_DBG( "pushtask broadcasted, mutex unlocks.\n" );
-  pthread_mutex_unlock( &tasklist_mutex );
-  MTX_DBG( "pushtask end mutex unlocked.\n" );
+  task->shared        = NULL;
+  task->next_result   = NULL;
+
+  /* Link it before workers can see it, they never touch the list */
+  task->prev = NULL;
+  task->next = t_outstanding;
+  if( t_outstanding )
+    t_outstanding->prev = task;
+  t_outstanding = task;
+
+  if( taskqueue_push( taskqueue_for( tasktype ), task ) ) {
+    task_unlink( task );
+    free( task );
+    return -1;
+  }
   return 0;
 }
 
 void mutex_workqueue_canceltask( int64 sock ) {
-  struct ot_task ** task;
+  struct ot_task *task = t_outstanding;
+  int state;
 
-  /* Want exclusive access to tasklist */
-  MTX_DBG( "canceltask locks.\n" );
-  pthread_mutex_lock( &tasklist_mutex );
-  MTX_DBG( "canceltask locked.\n" );
+  while( task && task->sock != sock )
+    task = task->next;
+  if( !task )
+    return;
 
-  task = &tasklist;
-  while( *task && ( (*task)->sock != sock ) )
-    *task = (*task)->next;
+  task_unlink( task );
+  do
+    state = task->state;
+  while( !__sync_bool_compare_and_swap( &task->state, state, TASK_STATE_CANCELLED ) );
+}
 
-  if( *task && ( (*task)->sock == sock ) ) {
-    struct iovec *iovec = (*task)->iovec;
-    struct ot_task *ptask = *task;
-    int i;
+ot_taskid mutex_workqueue_poptask( ot_tasktype *tasktype ) {
+  ot_taskqueue   *queue = taskqueue_for( *tasktype );
+  struct ot_task *task;
 
-    /* Free task's iovec */
-    for( i=0; i<(*task)->iovec_entries; ++i )
-      munmap( iovec[i].iov_base, iovec[i].iov_len );
+  for( ; ; ) {
+    MTX_DBG( "poptask waits.\n" );
+    if( sem_wait( &queue->pending ) )
+      continue;
 
-    *task = (*task)->next;
-    free( ptask );
-  }
+    /* Each post stands for a task already in the queue */
+    while( !( task = taskqueue_pop( queue ) ) )
+      sched_yield( );
 
-  /* Release lock */
-  MTX_DBG( "canceltask unlocks.\n" );
-  pthread_mutex_unlock( &tasklist_mutex );
-  MTX_DBG( "canceltask unlocked.\n" );
-}
+    if( __sync_bool_compare_and_swap( &task->state, TASK_STATE_PENDING, TASK_STATE_RUNNING ) )
+      break;
 
-ot_taskid mutex_workqueue_poptask( ot_tasktype *tasktype ) {
-  struct ot_task * task;
-  ot_taskid taskid = 0;
-
-  /* Want exclusive access to tasklist */
-  MTX_DBG( "poptask mutex locks.\n" );
-  pthread_mutex_lock( &tasklist_mutex );
-  MTX_DBG( "poptask mutex locked.\n" );
-
-  while( !taskid ) {
-    /* Skip to the first unassigned task this worker wants to do */
-    task = tasklist;
-    while( task && ( ( ( TASK_CLASS_MASK & task->tasktype ) != *tasktype ) || task->taskid ) )
-      task = task->next;
-
-    /* If we found an outstanding task, assign a taskid to it
-       and leave the loop */
-    if( task ) {
-      task->taskid = taskid = ++next_free_taskid;
-      *tasktype = task->tasktype;
-    } else {
-      /* Wait until the next task is being fed */
-      MTX_DBG( "poptask cond waits.\n" );
-      pthread_cond_wait( &tasklist_being_filled, &tasklist_mutex );
-      MTX_DBG( "poptask cond waited.\n" );
-    }
+    /* Cancelled while waiting */
+    free( task );
   }
 
-  /* Release lock */
-  MTX_DBG( "poptask end mutex unlocks.\n" );
-  pthread_mutex_unlock( &tasklist_mutex );
-  MTX_DBG( "poptask end mutex unlocked.\n" );
+  *tasktype = task->tasktype;
+  return (ot_taskid)task;
+}
 
-  return taskid;
+const ot_taskargs *mutex_workqueue_taskargs( ot_taskid taskid ) {
+  return &((struct ot_task *)taskid)->args;
 }
 
-void mutex_workqueue_pushsuccess( ot_taskid taskid ) {
-  struct ot_task ** task;
+static int task_finish( struct ot_task *task, int state ) {
+  ot_taskresults *results = task->results;
+  ot_loop        *loop = task->loop;
+  struct ot_task *head;
 
-  /* Want exclusive access to tasklist */
-  MTX_DBG( "pushsuccess locks.\n" );
-  pthread_mutex_lock( &tasklist_mutex );
-  MTX_DBG( "pushsuccess locked.\n" );
+  if( !__sync_bool_compare_and_swap( &task->state, TASK_STATE_RUNNING, state ) ) {
+    free( task );
+    return -1;
+  }
 
-  task = &tasklist;
-  while( *task && ( (*task)->taskid != taskid ) )
-    *task = (*task)->next;
+  /* The task may be gone as soon as it is on the stack */
+  do
+    head = task->next_result = results->pushed;
+  while( !__sync_bool_compare_and_swap( &results->pushed, head, task ) );
 
-  if( *task && ( (*task)->taskid == taskid ) ) {
-    struct ot_task *ptask = *task;
-    *task = (*task)->next;
-    free( ptask );
-  }
+  if( !head && loop )
+    loop_wakeup( loop );
+  return 0;
+}
 
-  /* Release lock */
-  MTX_DBG( "pushsuccess unlocks.\n" );
-  pthread_mutex_unlock( &tasklist_mutex );
-  MTX_DBG( "pushsuccess unlocked.\n" );
+void mutex_workqueue_pushsuccess( ot_taskid taskid ) {
+  task_finish( (struct ot_task *)taskid, TASK_STATE_FINISHED );
 }
 
 int mutex_workqueue_pushresult( ot_taskid taskid, int iovec_entries, struct iovec *iovec ) {
-  struct ot_task * task;
-  const char byte = 'o';
-
-  /* Want exclusive access to tasklist */
-  MTX_DBG( "pushresult locks.\n" );
-  pthread_mutex_lock( &tasklist_mutex );
-  MTX_DBG( "pushresult locked.\n" );
+  struct ot_task *task = (struct ot_task *)taskid;
 
-  task = tasklist;
-  while( task && ( task->taskid != taskid ) )
-    task = task->next;
-
-  if( task ) {
-    task->iovec_entries = iovec_entries;
-    task->iovec         = iovec;
-    task->tasktype      = TASK_DONE;
-  }
-
-  /* Release lock */
-  MTX_DBG( "pushresult unlocks.\n" );
-  pthread_mutex_unlock( &tasklist_mutex );
-  MTX_DBG( "pushresult unlocked.\n" );
-
-  io_trywrite( g_self_pipe[1], &byte, 1 );
+  task->iovec_entries = iovec_entries;
+  task->iovec         = iovec;
 
   /* Indicate whether the worker has to throw away results */
-  return task ? 0 : -1;
+  return task_finish( task, TASK_STATE_DONE );
 }
 
-int64 mutex_workqueue_popresult( int *iovec_entries, struct iovec ** iovec ) {
-  struct ot_task ** task;
-  int64 sock = -1;
-
-  /* Want exclusive access to tasklist */
-  MTX_DBG( "popresult locks.\n" );
-  pthread_mutex_lock( &tasklist_mutex );
-  MTX_DBG( "popresult locked.\n" );
+int mutex_workqueue_pushshared( ot_taskid taskid, ot_iovec_shared *shared ) {
+  struct ot_task *task = (struct ot_task *)taskid;
 
-  task = &tasklist;
-  while( *task && ( (*task)->tasktype != TASK_DONE ) )
-    task = &(*task)->next;
+  task->iovec_entries = shared->iovec_entries;
+  task->iovec         = shared->iovector;
+  task->shared        = shared;
+  return task_finish( task, TASK_STATE_DONE );
+}
 
-  if( *task && ( (*task)->tasktype == TASK_DONE ) ) {
-    struct ot_task *ptask = *task;
+int64 mutex_workqueue_popresult( int *iovec_entries, struct iovec ** iovec, ot_iovec_shared **shared ) {
+  ot_taskresults *results = &t_taskresults;
+  struct ot_task *task;
+
+  for( ; ; ) {
+    int64 sock;
+
+    /* Take all pushed results at once, turning them into oldest first */
+    if( !results->taken ) {
+      struct ot_task *pushed = __sync_lock_test_and_set( &results->pushed, NULL );
+      while( pushed ) {
+        task = pushed;
+        pushed = task->next_result;
+        task->next_result = results->taken;
+        results->taken = task;
+      }
+      if( !results->taken )
+        return -1;
+    }
 
-    *iovec_entries = (*task)->iovec_entries;
-    *iovec         = (*task)->iovec;
-    sock           = (*task)->sock;
+    task = results->taken;
+    results->taken = task->next_result;
+
+    if( task->state == TASK_STATE_DONE ) {
+      task_unlink( task );
+      *iovec_entries = task->iovec_entries;
+      *iovec         = task->iovec;
+      *shared        = task->shared;
+      sock           = task->sock;
+      free( task );
+      return sock;
+    }
 
-    *task = (*task)->next;
-    free( ptask );
+    /* Cancelled after it was done or without a result */
+    if( task->state == TASK_STATE_CANCELLED && task->shared )
+      iovec_shared_release( task->shared );
+    else if( task->state == TASK_STATE_CANCELLED ) {
+      int i;
+      for( i=0; i<task->iovec_entries; ++i )
+        munmap( task->iovec[i].iov_base, task->iovec[i].iov_len );
+      free( task->iovec );
+    } else
+      task_unlink( task );
+    free( task );
   }
-
-  /* Release lock */
-  MTX_DBG( "popresult unlocks.\n" );
-  pthread_mutex_unlock( &tasklist_mutex );
-  MTX_DBG( "popresult unlocked.\n" );
-  return sock;
 }
 
 void mutex_init( ) {
-  pthread_mutex_init(&tasklist_mutex, NULL);
-  pthread_cond_init (&tasklist_being_filled, NULL);
-  pthread_mutex_init(&bucket_mutex, NULL);
-  pthread_cond_init (&bucket_being_unlocked, NULL);
+  int bucket, i, j;
+  for( i=0; i<OT_TASK_CLASSES; ++i ) {
+    sem_init( &g_taskqueues[i].pending, 0, 0 );
+    for( j=0; j<OT_TASKQUEUE_SIZE; ++j )
+      g_taskqueues[i].cells[j].sequence = j;
+  }
   byte_zero( all_torrents, sizeof( all_torrents ) );
+  for( bucket=0; bucket<OT_BUCKET_COUNT; ++bucket )
+    pthread_mutex_init( &all_torrents[bucket].lock, NULL );
 }
 
 void mutex_deinit( ) {
-  pthread_mutex_destroy(&bucket_mutex);
-  pthread_cond_destroy(&bucket_being_unlocked);
-  pthread_mutex_destroy(&tasklist_mutex);
-  pthread_cond_destroy(&tasklist_being_filled);
+  int bucket, i;
+  mutex_reclaim( );
+  slab_deinit( );
+  for( bucket=0; bucket<OT_BUCKET_COUNT; ++bucket )
+    pthread_mutex_destroy( &all_torrents[bucket].lock );
+  for( i=0; i<OT_TASK_CLASSES; ++i )
+    sem_destroy( &g_taskqueues[i].pending );
   byte_zero( all_torrents, sizeof( all_torrents ) );
 }
 
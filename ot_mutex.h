@@ -8,17 +8,33 @@
 
 #include <sys/uio.h>
 
+#include "ot_loop.h"
+
 void mutex_init( );
 void mutex_deinit( );
 
-ot_vector *mutex_bucket_lock( int bucket );
-ot_vector *mutex_bucket_lock_by_hash( ot_hash hash );
+ot_torrent_list *mutex_bucket_lock( int bucket );
+ot_torrent_list *mutex_bucket_lock_by_hash( ot_hash hash );
 
 void mutex_bucket_unlock( int bucket, int delta_torrentcount );
 void mutex_bucket_unlock_by_hash( ot_hash hash, int delta_torrentcount );
 
 size_t mutex_get_torrent_count();
 
+/* Lock free read access to a bucket, valid only between
+   mutex_epoch_enter() and mutex_epoch_leave(). If mutex_bucket_read_retry()
+   returns non-zero, everything read since mutex_bucket_read_begin() must be
+   discarded */
+const ot_torrent_list *mutex_bucket_read_begin( int bucket, unsigned int *seq );
+int                    mutex_bucket_read_retry( int bucket, unsigned int seq );
+
+int  mutex_epoch_enter( );
+void mutex_epoch_leave( int epoch );
+
+/* Memory lock free readers may see is released only after they are gone */
+void mutex_retire( void *ptr, void (*release)( void * ) );
+void mutex_reclaim( );
+
 typedef enum {
   TASK_STATS_CONNS                 = 0x0001,
   TASK_STATS_TCP                   = 0x0002,
@@ -33,6 +49,9 @@ typedef enum {
   TASK_STATS_SYNCS                 = 0x000b,
   TASK_STATS_COMPLETED             = 0x000c,
   TASK_STATS_NUMWANTS              = 0x000d,
+  TASK_STATS_REPLYCACHE            = 0x000e,
+  TASK_STATS_UDPBATCH              = 0x000f,
+  TASK_STATS_FULLSCRAPE_CACHE      = 0x0010,
 
   TASK_STATS                       = 0x0100, /* Mask */
   TASK_STATS_TORRENTS              = 0x0101,
@@ -42,6 +61,7 @@ typedef enum {
   TASK_STATS_EVERYTHING            = 0x0105,
   TASK_STATS_FULLLOG               = 0x0106,
   TASK_STATS_WOODPECKERS           = 0x0107,
+  TASK_STATS_SLAB                  = 0x0108,
   
   TASK_FULLSCRAPE                  = 0x0200, /* Default mode */
   TASK_FULLSCRAPE_TPB_BINARY       = 0x0201,
@@ -62,12 +82,31 @@ typedef enum {
 } ot_tasktype;
 
 typedef unsigned long ot_taskid;
-
+struct ot_iovec_shared;
+
+/* Parameters some tasks take, all zero for their defaults */
+typedef struct {
+  ot_time  since;       /* full scrapes: only torrents changed or removed since */
+  int      ranged;      /* full scrapes: only info_hashes whose first four */
+  uint32_t range_first; /* bytes, read big endian, are in this range, */
+  uint32_t range_last;  /* both ends included */
+} ot_taskargs;
+
+/* Any number of workers may pop tasks of their class. Tasks are pushed,
+   cancelled and their results popped by the same thread, which is woken
+   through its loop when results arrive. Pushing fails if the class's queue
+   is full. */
 int       mutex_workqueue_pushtask( int64 sock, ot_tasktype tasktype );
+int       mutex_workqueue_pushtask_args( int64 sock, ot_tasktype tasktype, const ot_taskargs *args );
 void      mutex_workqueue_canceltask( int64 sock );
 void      mutex_workqueue_pushsuccess( ot_taskid taskid );
 ot_taskid mutex_workqueue_poptask( ot_tasktype *tasktype );
+/* The arguments of a popped task, until its result is pushed */
+const ot_taskargs *mutex_workqueue_taskargs( ot_taskid taskid );
 int       mutex_workqueue_pushresult( ot_taskid taskid, int iovec_entries, struct iovec *iovector );
-int64     mutex_workqueue_popresult( int *iovec_entries, struct iovec ** iovector );
+/* Passes on a reference to shared chunks instead. It is returned by
+   popresult along with their vector, which then must not be freed. */
+int       mutex_workqueue_pushshared( ot_taskid taskid, struct ot_iovec_shared *shared );
+int64     mutex_workqueue_popresult( int *iovec_entries, struct iovec ** iovector, struct ot_iovec_shared **shared );
 
 #endif
@@ -0,0 +1,56 @@
+/* This software was written by Dirk Engling <erdgeist@erdgeist.org>
+   It is considered beerware. Prost. Skol. Cheers or whatever.
+
+   $id$ */
+
+/* System */
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Opentracker */
+#include "ot_random.h"
+
+/* glibc's random() serializes all its callers on an internal lock. Every
+   announce draws several numbers, so each thread instead runs its own PCG32
+   generator, seeded from a process wide seed and a thread counter. */
+static uint64_t          g_random_seed;
+static uint64_t          g_random_threads;
+static __thread uint64_t t_random_state;
+
+void random_init( void ) {
+  g_random_seed = ( (uint64_t)random( ) << 32 ) ^ (uint64_t)random( ) ^ (uint64_t)time( NULL ) ^ ( (uint64_t)getpid( ) << 16 );
+}
+
+/* splitmix64 spreads seeds of neighbouring threads over the state space */
+static uint64_t random_seed_thread( void ) {
+  uint64_t z = g_random_seed + 0x9e3779b97f4a7c15ULL * ( 1 + __sync_fetch_and_add( &g_random_threads, 1 ) );
+  z = ( z ^ ( z >> 30 ) ) * 0xbf58476d1ce4e5b9ULL;
+  z = ( z ^ ( z >> 27 ) ) * 0x94d049bb133111ebULL;
+  z ^= z >> 31;
+  /* A state of zero marks an unseeded thread */
+  return z ? z : 1;
+}
+
+uint32_t random_next( void ) {
+  uint64_t state = t_random_state;
+  uint32_t xorshifted, rot;
+
+  if( !state )
+    state = random_seed_thread( );
+  t_random_state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+  if( !t_random_state )
+    t_random_state = 1;
+
+  xorshifted = (uint32_t)( ( ( state >> 18 ) ^ state ) >> 27 );
+  rot = (uint32_t)( state >> 59 );
+  return ( xorshifted >> rot ) | ( xorshifted << ( ( -rot ) & 31 ) );
+}
+
+/* Maps a random number to [0, bound) by multiplication instead of modulo */
+uint32_t random_below( uint32_t bound ) {
+  return (uint32_t)( ( (uint64_t)random_next( ) * bound ) >> 32 );
+}
+
+const char *g_version_random_c = "$Source: /home/cvsroot/opentracker/ot_random.c,v $: $Revision: 1.1 $\n";
@@ -0,0 +1,15 @@
+/* This software was written by Dirk Engling <erdgeist@erdgeist.org>
+   It is considered beerware. Prost. Skol. Cheers or whatever.
+
+   $id$ */
+
+#ifndef __OT_RANDOM_H__
+#define __OT_RANDOM_H__
+
+void     random_init( void );
+
+/* Each thread draws from its own generator, no locks involved */
+uint32_t random_next( void );
+uint32_t random_below( uint32_t bound );
+
+#endif
@@ -0,0 +1,150 @@
+/* This software was written by Dirk Engling <erdgeist@erdgeist.org>
+   It is considered beerware. Prost. Skol. Cheers or whatever.
+
+   $id$ */
+
+/* System */
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#ifdef WANT_SHARDS
+#include <linux/filter.h>
+#endif
+
+/* Libowfat */
+#include "io.h"
+
+/* Opentracker */
+#include "trackerlogic.h"
+#include "ot_loop.h"
+#include "ot_shard.h"
+
+#ifdef WANT_SHARDS
+
+/* One message queue per shard, on its own cache line */
+typedef struct {
+  pthread_mutex_t lock;
+  ot_shard_msg   *first;
+  ot_shard_msg  **last;
+  ot_loop        *loop;
+} __attribute__((aligned(64))) ot_shard;
+
+static ot_shard     g_shards[OT_MAX_THREADS];
+static int          g_shard_count = 1;
+static __thread int t_shard;
+
+void shard_init( ot_loop **loops, int count ) {
+  int i;
+  for( i=0; i<count; ++i ) {
+    pthread_mutex_init( &g_shards[i].lock, NULL );
+    g_shards[i].first = NULL;
+    g_shards[i].last  = &g_shards[i].first;
+    g_shards[i].loop  = loops[i];
+  }
+  g_shard_count = count;
+}
+
+void shard_enter( ot_loop *loop ) {
+  int i;
+  for( i=0; i<g_shard_count; ++i )
+    if( g_shards[i].loop == loop )
+      t_shard = i;
+}
+
+static int shard_for_hash( ot_hash hash ) {
+  return OT_SHARD_BY_BUCKET( OT_BUCKET_BY_HASH( hash ), g_shard_count );
+}
+
+int shard_is_local( ot_hash hash ) {
+  return shard_for_hash( hash ) == t_shard;
+}
+
+/* The program sees the udp payload and returns the index of the socket in
+   its reuseport group, which is the index of the I/O thread that bound it.
+   Packets carrying an info_hash, announces and scrapes, go to the owner of
+   its bucket, the shorter connect requests to any thread. */
+void shard_steer_udp( int64 sock ) {
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+  struct sock_filter code[] = {
+    BPF_STMT( BPF_LD  | BPF_W   | BPF_LEN, 0 ),
+    BPF_JUMP( BPF_JMP | BPF_JGE | BPF_K,   16 + 2, 2, 0 ),
+    BPF_STMT( BPF_LD  | BPF_W   | BPF_ABS, SKF_AD_OFF + SKF_AD_RANDOM ),
+    BPF_JUMP( BPF_JMP | BPF_JA,            2, 0, 0 ),
+    BPF_STMT( BPF_LD  | BPF_H   | BPF_ABS, 16 ),
+    BPF_STMT( BPF_ALU | BPF_RSH | BPF_K,   16 - OT_BUCKET_COUNT_BITS ),
+    BPF_STMT( BPF_ALU | BPF_MOD | BPF_K,   g_shard_count ),
+    BPF_STMT( BPF_RET | BPF_A,             0 )
+  };
+  struct sock_fprog prog = { sizeof(code) / sizeof(*code), code };
+
+  /* Without steering, misdirected announces still are passed on */
+  if( g_shard_count > 1 )
+    setsockopt( sock, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog) );
+#ifdef SO_DETACH_REUSEPORT_BPF
+  else
+    setsockopt( sock, SOL_SOCKET, SO_DETACH_REUSEPORT_BPF, &prog, sizeof(prog) );
+#endif
+#else
+  (void)sock;
+#endif
+}
+
+ot_shard_msg *shard_msg_alloc( ot_shard_msgtype type, int64 sock, size_t size ) {
+  ot_shard_msg *msg = malloc( sizeof(ot_shard_msg) + size );
+  if( !msg )
+    return NULL;
+  memset( msg, 0, sizeof(ot_shard_msg) );
+  msg->type = type;
+  msg->from = t_shard;
+  msg->sock = sock;
+  msg->size = size;
+  return msg;
+}
+
+static void shard_post( int shard, ot_shard_msg *msg ) {
+  ot_shard *s = g_shards + shard;
+  int       wakeup;
+
+  msg->next = NULL;
+  pthread_mutex_lock( &s->lock );
+  wakeup = !s->first;
+  *s->last = msg;
+  s->last  = &msg->next;
+  pthread_mutex_unlock( &s->lock );
+
+  /* A non empty queue has already woken its loop */
+  if( wakeup )
+    loop_wakeup( s->loop );
+}
+
+void shard_post_announce( ot_shard_msg *msg, struct ot_workstruct *ws, size_t amount ) {
+  memcpy( msg->hash, *ws->hash, sizeof(ot_hash) );
+  memcpy( &msg->peer, &ws->peer, sizeof(ot_peer) );
+  if( ws->peer_id ) {
+    memcpy( msg->peer_id, ws->peer_id, sizeof(msg->peer_id) );
+    msg->has_peer_id = 1;
+  }
+  msg->amount = amount;
+  shard_post( shard_for_hash( msg->hash ), msg );
+}
+
+void shard_reply( ot_shard_msg *request, ot_shard_msg *reply ) {
+  shard_post( request->from, reply );
+}
+
+ot_shard_msg *shard_take( void ) {
+  ot_shard     *s = g_shards + t_shard;
+  ot_shard_msg *msg;
+
+  pthread_mutex_lock( &s->lock );
+  msg      = s->first;
+  s->first = NULL;
+  s->last  = &s->first;
+  pthread_mutex_unlock( &s->lock );
+  return msg;
+}
+
+#endif
+
+const char *g_version_shard_c = "$Source: /home/cvsroot/opentracker/ot_shard.c,v $: $Revision: 1.1 $\n";
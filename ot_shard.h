@@ -0,0 +1,82 @@
+/* This software was written by Dirk Engling <erdgeist@erdgeist.org>
+   It is considered beerware. Prost. Skol. Cheers or whatever.
+
+   $id$ */
+
+#ifndef __OT_SHARD_H__
+#define __OT_SHARD_H__
+
+/* In sharded mode, the torrent buckets are partitioned across the I/O
+   threads and all announces for a bucket are handled by the thread owning
+   it, so torrent memory stays in that core's caches and its bucket locks
+   are never contended. UDP announces are steered to their owner by the
+   kernel, everything else reaching the wrong thread is passed on through
+   the owner's message queue. */
+
+#ifdef WANT_SHARDS
+
+#define OT_SHARD_BY_BUCKET(bucket,count) ((bucket)%(count))
+
+typedef enum {
+  SHARD_UDP_ANNOUNCE,  /* owner answers on sock, the receiving udp socket */
+  SHARD_HTTP_ANNOUNCE, /* owner posts a SHARD_HTTP_REPLY back */
+  SHARD_HTTP_REPLY     /* complete http answer for sock in data */
+} ot_shard_msgtype;
+
+typedef struct ot_shard_msg {
+  struct ot_shard_msg *next;
+  ot_shard_msgtype     type;
+  int                  from;
+  int64                sock;
+
+  /* Announces */
+  ot_hash              hash;
+  ot_peer              peer;
+  char                 peer_id[20];
+  int                  has_peer_id;
+  size_t               amount;
+
+  /* UDP announces */
+  ot_ip6               remoteip;
+  uint16_t             remoteport;
+  uint32_t             transaction_id;
+
+  /* Replies */
+  size_t               size;
+  char                 data[];
+} ot_shard_msg;
+
+void          shard_init( ot_loop **loops, int count );
+
+/* Called by each I/O thread with its loop before serving requests */
+void          shard_enter( ot_loop *loop );
+
+int           shard_is_local( ot_hash hash );
+
+/* Attach the kernel steering program to a udp listening socket, replacing
+   any it was handed over with. The socket bound by the n-th I/O thread
+   must be the n-th one bound to its address. */
+void          shard_steer_udp( int64 sock );
+
+/* Messages carry size bytes of data and are freed by their receiver.
+   shard_post_announce fills in the announce from ws and posts it to the
+   owner of its torrent, shard_reply posts a reply back to the thread that
+   sent request. */
+ot_shard_msg *shard_msg_alloc( ot_shard_msgtype type, int64 sock, size_t size );
+void          shard_post_announce( ot_shard_msg *msg, struct ot_workstruct *ws, size_t amount );
+void          shard_reply( ot_shard_msg *request, ot_shard_msg *reply );
+
+/* Takes all messages for the calling thread, oldest first */
+ot_shard_msg *shard_take( void );
+
+#else
+
+/* Without sharding, every thread owns every torrent */
+#define shard_init(loops,count)
+#define shard_enter(loop)
+#define shard_is_local(hash) 1
+#define shard_steer_udp(sock)
+
+#endif
+
+#endif
@@ -0,0 +1,258 @@
+/* This software was written by Dirk Engling <erdgeist@erdgeist.org>
+   It is considered beerware. Prost. Skol. Cheers or whatever.
+
+   $id$ */
+
+/* System */
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+/* Opentracker */
+#include "trackerlogic.h"
+#include "ot_slab.h"
+
+/* Peer lists and small peer vectors come and go all the time. Instead of
+   spreading them over the heap, objects of similar size are packed into
+   slabs of OT_SLAB_SIZE bytes. Slabs are aligned to their size, so their
+   header is found from any object within. Size classes are powers of two
+   and the halfway points between them. Each group of torrent buckets owns
+   an arena, so bucket locks mostly keep arena locks uncontended, and empty
+   slabs beyond a few spare ones are returned to the system right away. */
+
+typedef struct ot_slab ot_slab;
+struct ot_slab {
+  ot_slab *next;
+  ot_slab *prev;
+  void    *free_list;
+  size_t   used;
+  size_t   bump;
+  int      size_class;
+  int      arena;
+};
+
+#define OT_SLAB_HEADER ( ( sizeof( ot_slab ) + 63 ) & ~(size_t)63 )
+
+typedef struct {
+  pthread_mutex_t lock;
+  ot_slab        *partial[OT_SLAB_CLASSES];
+  ot_slab        *spare;
+  size_t          spare_count;
+  size_t          objects[OT_SLAB_CLASSES];
+  size_t          slabs[OT_SLAB_CLASSES];
+} __attribute__((aligned(64))) ot_arena;
+
+/* Arena 0 is the shared one */
+static ot_arena      g_arenas[1 + OT_SLAB_ARENAS];
+static __thread int  t_arena;
+static size_t        g_large_count, g_large_bytes;
+
+static size_t slab_class_size( int size_class ) {
+  return (size_t)( ( size_class & 1 ) ? 24 : 16 ) << ( size_class >> 1 );
+}
+
+static int slab_class( size_t size ) {
+  int shift;
+  if( size <= 16 ) return 0;
+  shift = 63 - __builtin_clzll( (unsigned long long)size - 1 );
+  return 2 * ( shift - 4 ) + ( size > ( (size_t)3 << ( shift - 1 ) ) ? 2 : 1 );
+}
+
+static size_t slab_capacity( int size_class ) {
+  return ( OT_SLAB_SIZE - OT_SLAB_HEADER ) / slab_class_size( size_class );
+}
+
+static ot_slab *slab_of( void *ptr ) {
+  return (ot_slab*)( (uintptr_t)ptr & ~(uintptr_t)( OT_SLAB_SIZE - 1 ) );
+}
+
+void slab_set_arena( int bucket ) {
+  t_arena = bucket < 0 ? 0 : 1 + bucket / ( OT_BUCKET_COUNT / OT_SLAB_ARENAS );
+}
+
+/* mmap gives us page alignment only, so map twice the size and trim */
+static ot_slab *slab_map( void ) {
+  uint8_t *raw = mmap( NULL, 2 * OT_SLAB_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 ), *slab;
+
+  if( raw == MAP_FAILED ) return NULL;
+  slab = (uint8_t*)( ( (uintptr_t)raw + OT_SLAB_SIZE - 1 ) & ~(uintptr_t)( OT_SLAB_SIZE - 1 ) );
+  if( slab > raw )
+    munmap( raw, slab - raw );
+  if( raw + OT_SLAB_SIZE > slab )
+    munmap( slab + OT_SLAB_SIZE, raw + OT_SLAB_SIZE - slab );
+  return (ot_slab*)slab;
+}
+
+static void slab_link( ot_slab **list, ot_slab *slab ) {
+  slab->prev = NULL;
+  if( ( slab->next = *list ) )
+    slab->next->prev = slab;
+  *list = slab;
+}
+
+static void slab_unlink( ot_slab **list, ot_slab *slab ) {
+  if( slab->prev )
+    slab->prev->next = slab->next;
+  else
+    *list = slab->next;
+  if( slab->next )
+    slab->next->prev = slab->prev;
+}
+
+/* Expects arena locked */
+static ot_slab *slab_new( ot_arena *arena, int size_class ) {
+  ot_slab *slab = arena->spare;
+
+  if( slab ) {
+    arena->spare = slab->next;
+    arena->spare_count--;
+  } else if( !( slab = slab_map( ) ) )
+    return NULL;
+
+  slab->free_list  = NULL;
+  slab->used       = 0;
+  slab->bump       = OT_SLAB_HEADER;
+  slab->size_class = size_class;
+  slab->arena      = arena - g_arenas;
+  slab_link( arena->partial + size_class, slab );
+  arena->slabs[size_class]++;
+  return slab;
+}
+
+void *slab_alloc( size_t size ) {
+  ot_arena *arena = g_arenas + t_arena;
+  ot_slab  *slab;
+  void     *object;
+  int       size_class;
+
+  if( size > OT_SLAB_MAX_SIZE ) {
+    if( ( object = malloc( size ) ) ) {
+      __sync_fetch_and_add( &g_large_count, 1 );
+      __sync_fetch_and_add( &g_large_bytes, size );
+    }
+    return object;
+  }
+
+  size_class = slab_class( size );
+  pthread_mutex_lock( &arena->lock );
+  if( !( slab = arena->partial[size_class] ) && !( slab = slab_new( arena, size_class ) ) ) {
+    pthread_mutex_unlock( &arena->lock );
+    return NULL;
+  }
+
+  if( ( object = slab->free_list ) )
+    slab->free_list = *(void**)object;
+  else {
+    object = (uint8_t*)slab + slab->bump;
+    slab->bump += slab_class_size( size_class );
+  }
+
+  /* Full slabs leave the partial list until an object comes back */
+  if( ++slab->used == slab_capacity( size_class ) )
+    slab_unlink( arena->partial + size_class, slab );
+  arena->objects[size_class]++;
+  pthread_mutex_unlock( &arena->lock );
+  return object;
+}
+
+void slab_free( void *ptr, size_t size ) {
+  ot_slab  *slab;
+  ot_arena *arena;
+  int       size_class;
+
+  if( !ptr ) return;
+
+  if( size > OT_SLAB_MAX_SIZE ) {
+    __sync_fetch_and_sub( &g_large_count, 1 );
+    __sync_fetch_and_sub( &g_large_bytes, size );
+    free( ptr );
+    return;
+  }
+
+  slab = slab_of( ptr );
+  arena = g_arenas + slab->arena;
+  size_class = slab->size_class;
+
+  pthread_mutex_lock( &arena->lock );
+  *(void**)ptr = slab->free_list;
+  slab->free_list = ptr;
+  if( slab->used-- == slab_capacity( size_class ) )
+    slab_link( arena->partial + size_class, slab );
+  arena->objects[size_class]--;
+
+  if( !slab->used ) {
+    slab_unlink( arena->partial + size_class, slab );
+    arena->slabs[size_class]--;
+    if( arena->spare_count < OT_SLAB_SPARE ) {
+      slab->next = arena->spare;
+      arena->spare = slab;
+      arena->spare_count++;
+    } else
+      munmap( slab, OT_SLAB_SIZE );
+  }
+  pthread_mutex_unlock( &arena->lock );
+}
+
+void *slab_realloc( void *ptr, size_t old_size, size_t new_size ) {
+  void *new_ptr;
+
+  if( !ptr )
+    return slab_alloc( new_size );
+
+  if( old_size > OT_SLAB_MAX_SIZE && new_size > OT_SLAB_MAX_SIZE ) {
+    if( ( new_ptr = realloc( ptr, new_size ) ) ) {
+      __sync_fetch_and_add( &g_large_bytes, new_size );
+      __sync_fetch_and_sub( &g_large_bytes, old_size );
+    }
+    return new_ptr;
+  }
+
+  /* Still fits into the same size class */
+  if( old_size <= OT_SLAB_MAX_SIZE && new_size <= OT_SLAB_MAX_SIZE && slab_class( old_size ) == slab_class( new_size ) )
+    return ptr;
+
+  if( !( new_ptr = slab_alloc( new_size ) ) )
+    return NULL;
+  memcpy( new_ptr, ptr, old_size < new_size ? old_size : new_size );
+  slab_free( ptr, old_size );
+  return new_ptr;
+}
+
+void slab_get_stats( ot_slab_stats *stats ) {
+  int arena, size_class;
+
+  memset( stats, 0, sizeof( *stats ) );
+  for( size_class=0; size_class<OT_SLAB_CLASSES; ++size_class )
+    stats->class_size[size_class] = slab_class_size( size_class );
+
+  for( arena=0; arena<=OT_SLAB_ARENAS; ++arena ) {
+    pthread_mutex_lock( &g_arenas[arena].lock );
+    for( size_class=0; size_class<OT_SLAB_CLASSES; ++size_class ) {
+      stats->class_objects[size_class] += g_arenas[arena].objects[size_class];
+      stats->class_slabs[size_class]   += g_arenas[arena].slabs[size_class];
+    }
+    stats->spare_slabs += g_arenas[arena].spare_count;
+    pthread_mutex_unlock( &g_arenas[arena].lock );
+  }
+  stats->large_count = g_large_count;
+  stats->large_bytes = g_large_bytes;
+}
+
+void slab_deinit( void ) {
+  int arena;
+
+  for( arena=0; arena<=OT_SLAB_ARENAS; ++arena ) {
+    pthread_mutex_lock( &g_arenas[arena].lock );
+    while( g_arenas[arena].spare ) {
+      ot_slab *slab = g_arenas[arena].spare;
+      g_arenas[arena].spare = slab->next;
+      munmap( slab, OT_SLAB_SIZE );
+    }
+    g_arenas[arena].spare_count = 0;
+    pthread_mutex_unlock( &g_arenas[arena].lock );
+  }
+}
+
+const char *g_version_slab_c = "$Source: /home/cvsroot/opentracker/ot_slab.c,v $: $Revision: 1.1 $\n";
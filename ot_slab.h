@@ -0,0 +1,38 @@
+/* This software was written by Dirk Engling <erdgeist@erdgeist.org>
+   It is considered beerware. Prost. Skol. Cheers or whatever.
+
+   $id$ */
+
+#ifndef __OT_SLAB_H__
+#define __OT_SLAB_H__
+
+/* These defines control the slab allocator */
+#define OT_SLAB_SIZE      (64*1024)
+#define OT_SLAB_ARENAS    64
+#define OT_SLAB_SPARE     4
+#define OT_SLAB_CLASSES   17
+#define OT_SLAB_MAX_SIZE  4096
+
+typedef struct {
+  size_t class_size[OT_SLAB_CLASSES];
+  size_t class_objects[OT_SLAB_CLASSES];
+  size_t class_slabs[OT_SLAB_CLASSES];
+  size_t spare_slabs;
+  size_t large_count;
+  size_t large_bytes;
+} ot_slab_stats;
+
+void  slab_deinit( void );
+
+/* Allocations made while holding a bucket lock come from that bucket's
+   arena, all others from a shared one */
+void  slab_set_arena( int bucket );
+
+/* Callers need to remember the size of their allocations */
+void *slab_alloc( size_t size );
+void *slab_realloc( void *ptr, size_t old_size, size_t new_size );
+void  slab_free( void *ptr, size_t size );
+
+void  slab_get_stats( ot_slab_stats *stats );
+
+#endif
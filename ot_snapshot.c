@@ -0,0 +1,555 @@
+/* This software was written by Dirk Engling <erdgeist@erdgeist.org>
+   It is considered beerware. Prost. Skol. Cheers or whatever.
+
+   $id$ */
+
+/* System */
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+
+/* Libowfat */
+#include "byte.h"
+#include "io.h"
+
+/* Opentracker */
+#include "trackerlogic.h"
+#include "ot_mutex.h"
+#include "ot_vector.h"
+#include "ot_slab.h"
+#include "ot_clean.h"
+#include "ot_snapshot.h"
+
+char          *g_snapshot_file;
+unsigned long  g_snapshot_interval = OT_SNAPSHOT_INTERVAL;
+int            g_snapshot_peers = 1;
+
+/* The file starts with a header, followed by one section per bucket. A
+   section holds its torrents, each followed by its peers, then its idle
+   torrents. Times are in minutes, peers are kept as they are in memory,
+   so their age still is relative to their torrent's base. Everything is
+   in host byte order, snapshots do not move between machines. Streams
+   have no offsets in their header, each section follows its size. */
+#define OT_SNAPSHOT_MAGIC      "otsnap\r\n"
+#define OT_SNAPSHOT_BYTE_ORDER 0x01020304
+#define OT_SNAPSHOT_PEERS      0x0001
+#define OT_SNAPSHOT_STREAM     0x0002
+
+typedef struct {
+  char     magic[8];
+  uint32_t version;
+  uint32_t flags;
+  uint64_t written;
+  uint32_t bucket_count;
+  uint32_t byte_order;
+  /* Where each bucket's section starts, the last entry is the file size */
+  uint64_t bucket_offset[OT_BUCKET_COUNT+1];
+} ot_snapshot_header;
+
+typedef struct {
+  uint32_t torrent_count;
+  uint32_t idle_count;
+} __attribute__((packed)) ot_snapshot_bucket;
+
+typedef struct {
+  ot_hash  hash;
+  uint32_t base;
+  uint64_t down_count;
+  uint32_t peer_count[OT_PEER_FAMILIES];
+} __attribute__((packed)) ot_snapshot_torrent;
+
+typedef struct {
+  ot_hash  hash;
+  uint32_t base;
+  uint32_t down_count;
+} __attribute__((packed)) ot_snapshot_idle;
+
+static size_t snapshot_bucket_size( const ot_torrent_list *torrents_list, int peers ) {
+  size_t size = sizeof(ot_snapshot_bucket) + torrents_list->size * sizeof(ot_snapshot_torrent) + torrents_list->idle.size * sizeof(ot_snapshot_idle);
+  size_t i;
+  int    family;
+
+  if( peers )
+    for( i=0; i<torrents_list->size; ++i )
+      for( family=0; family<OT_PEER_FAMILIES; ++family )
+        size += torrents_list->data[i].peer_list->families[family].peers.size * OT_PEER_SIZE_FOR_FAMILY( family );
+  return size;
+}
+
+static char *snapshot_put_bucket( char *w, const ot_torrent_list *torrents_list, int peers ) {
+  ot_snapshot_bucket bucket = { torrents_list->size, torrents_list->idle.size };
+  size_t i;
+  int    family;
+
+  memcpy( w, &bucket, sizeof(bucket) ); w += sizeof(bucket);
+
+  for( i=0; i<torrents_list->size; ++i ) {
+    ot_peerlist        *peer_list = torrents_list->data[i].peer_list;
+    ot_snapshot_torrent torrent;
+
+    memcpy( torrent.hash, torrents_list->data[i].hash, sizeof(ot_hash) );
+    torrent.base       = peer_list->base;
+    torrent.down_count = peer_list->down_count;
+    for( family=0; family<OT_PEER_FAMILIES; ++family )
+      torrent.peer_count[family] = peers ? peer_list->families[family].peers.size : 0;
+    memcpy( w, &torrent, sizeof(torrent) ); w += sizeof(torrent);
+
+    for( family=0; family<OT_PEER_FAMILIES; ++family ) {
+      size_t len = torrent.peer_count[family] * OT_PEER_SIZE_FOR_FAMILY( family );
+      if( len )
+        memcpy( w, peer_list->families[family].peers.data, len );
+      w += len;
+    }
+  }
+
+  for( i=0; i<torrents_list->idle.size; ++i ) {
+    ot_idle_torrent *idle = torrents_list->idle.data + i;
+    ot_snapshot_idle entry;
+
+    memcpy( entry.hash, idle->hash, sizeof(ot_hash) );
+    entry.base       = g_now_minutes - OT_IDLE_AGE( idle );
+    entry.down_count = idle->down_count;
+    memcpy( w, &entry, sizeof(entry) ); w += sizeof(entry);
+  }
+  return w;
+}
+
+/* Each bucket is copied to a buffer under its lock and written after
+   releasing it */
+static int snapshot_write_file( FILE *file, int stream ) {
+  ot_snapshot_header *header;
+  char   *buffer = NULL;
+  size_t  buffer_size = 0;
+  int     bucket, peers = g_snapshot_peers, failed = 0;
+
+  if( !( header = calloc( 1, sizeof(ot_snapshot_header) ) ) )
+    return -1;
+
+  /* The header is written again with the offsets in the end */
+  memcpy( header->magic, OT_SNAPSHOT_MAGIC, sizeof(header->magic) );
+  header->version      = OT_SNAPSHOT_VERSION;
+  header->flags        = ( peers ? OT_SNAPSHOT_PEERS : 0 ) | ( stream ? OT_SNAPSHOT_STREAM : 0 );
+  header->written      = g_now_seconds;
+  header->bucket_count = OT_BUCKET_COUNT;
+  header->byte_order   = OT_SNAPSHOT_BYTE_ORDER;
+  header->bucket_offset[0] = sizeof(ot_snapshot_header);
+  if( fwrite( header, sizeof(ot_snapshot_header), 1, file ) != 1 )
+    failed = 1;
+
+  for( bucket=0; bucket<OT_BUCKET_COUNT && !failed; ++bucket ) {
+    ot_torrent_list *torrents_list = mutex_bucket_lock( bucket );
+    size_t size = snapshot_bucket_size( torrents_list, peers );
+
+    if( size > buffer_size ) {
+      char *new_buffer = realloc( buffer, size );
+      if( !new_buffer ) {
+        mutex_bucket_unlock( bucket, 0 );
+        failed = 1;
+        break;
+      }
+      buffer = new_buffer;
+      buffer_size = size;
+    }
+    snapshot_put_bucket( buffer, torrents_list, peers );
+    mutex_bucket_unlock( bucket, 0 );
+
+    if( ( stream && fwrite( &(uint64_t){ size }, sizeof(uint64_t), 1, file ) != 1 ) || fwrite( buffer, size, 1, file ) != 1 )
+      failed = 1;
+    header->bucket_offset[bucket+1] = header->bucket_offset[bucket] + size;
+  }
+  free( buffer );
+
+  if( stream ) {
+    if( fflush( file ) )
+      failed = 1;
+  } else {
+    if( !failed && ( fseek( file, 0, SEEK_SET ) || fwrite( header, sizeof(ot_snapshot_header), 1, file ) != 1 ) )
+      failed = 1;
+    if( fflush( file ) || fsync( fileno( file ) ) )
+      failed = 1;
+  }
+  free( header );
+  return failed ? -1 : 0;
+}
+
+/* The file is written under a temporary name and only replaces the last
+   snapshot when complete */
+int snapshot_write( const char *filename ) {
+  size_t len = strlen( filename );
+  char  *tmpname = malloc( len + 5 );
+  FILE  *file;
+  int    failed;
+
+  if( !tmpname )
+    return -1;
+  memcpy( tmpname, filename, len );
+  memcpy( tmpname + len, ".tmp", 5 );
+
+  if( !( file = fopen( tmpname, "w" ) ) ) {
+    fprintf( stderr, "Warning: Can't write snapshot file: %s.\n", tmpname );
+    free( tmpname );
+    return -1;
+  }
+
+  failed = snapshot_write_file( file, 0 );
+  if( fclose( file ) )
+    failed = -1;
+
+  if( failed || rename( tmpname, filename ) ) {
+    fprintf( stderr, "Warning: Writing snapshot file %s failed.\n", filename );
+    unlink( tmpname );
+    failed = -1;
+  }
+  free( tmpname );
+  return failed;
+}
+
+int snapshot_write_stream( int fd ) {
+  FILE *file;
+  int   failed, dupfd = dup( fd );
+
+  if( dupfd < 0 )
+    return -1;
+  if( !( file = fdopen( dupfd, "w" ) ) ) {
+    close( dupfd );
+    return -1;
+  }
+  failed = snapshot_write_file( file, 1 );
+  if( fclose( file ) )
+    failed = -1;
+  return failed;
+}
+
+/* Snapshot being loaded, buckets are handed out to the loading threads */
+static const uint8_t            *g_load_map;
+static const ot_snapshot_header *g_load_header;
+static int                       g_load_next;
+static size_t                    g_load_torrents;
+static int                       g_load_failed;
+
+/* Peers of a torrent already live, e.g. announced while the snapshot
+   was handed over, are added to it with their times relative to now.
+   Peers it knows already are fresher and kept. */
+static void snapshot_merge_peers( ot_torrent *torrent, const ot_snapshot_torrent *entry, const uint8_t *r ) {
+  ot_peerlist *peer_list = torrent->peer_list;
+  uint8_t      peer[OT_PEER_SIZE6];
+  time_t       age = g_now_minutes - (ot_time)entry->base, oldest = 0;
+  size_t       j;
+  int          family, exactmatch;
+
+  clean_single_torrent( torrent );
+  if( !peer_list->peer_count )
+    peer_list->base = g_now_minutes;
+  if( age < 0 )
+    age = 0;
+
+  for( family=0; family<OT_PEER_FAMILIES; ++family ) {
+    size_t peer_size = OT_PEER_SIZE_FOR_FAMILY( family );
+    for( j=0; j<entry->peer_count[family]; ++j, r += peer_size ) {
+      ot_peer *dest;
+      if( age + OT_PEERTIME_D( r, peer_size ) >= OT_PEER_TIMEOUT )
+        continue;
+      memcpy( peer, r, peer_size );
+      OT_PEERTIME_D( peer, peer_size ) += age;
+      if( !( dest = vector_find_or_insert_peer( peer_list->families + family, (const ot_peer*)peer, peer_size, &exactmatch ) ) || exactmatch )
+        continue;
+      if( OT_PEERTIME_D( peer, peer_size ) > oldest )
+        oldest = OT_PEERTIME_D( peer, peer_size );
+      peer_list->peer_count++;
+      if( OT_PEERFLAG_D( peer, peer_size ) & PEER_FLAG_SEEDING )
+        peer_list->seed_count++;
+    }
+  }
+
+  peer_list->down_count += entry->down_count;
+  peer_list->changed     = g_now_seconds;
+  if( g_now_minutes + OT_PEER_TIMEOUT - oldest < peer_list->due )
+    clean_schedule_torrent( torrent, g_now_minutes + OT_PEER_TIMEOUT - oldest );
+}
+
+/* Returns the number of torrents restored or -1 for a broken section */
+static ssize_t snapshot_load_bucket( int bucket, const uint8_t *r, const uint8_t *re, int peers ) {
+  ot_snapshot_bucket section;
+  ot_torrent_list   *torrents_list;
+  ot_torrent        *live;
+  int                delta_torrentcount = 0, family;
+  time_t             age, oldest;
+  size_t             i, j;
+
+  if( (size_t)( re - r ) < sizeof(section) )
+    return -1;
+  memcpy( &section, r, sizeof(section) ); r += sizeof(section);
+
+  torrents_list = mutex_bucket_lock( bucket );
+  for( i=0; i<section.torrent_count; ++i ) {
+    ot_snapshot_torrent entry;
+    ot_torrent         *torrent;
+    ot_peerlist        *peer_list;
+    size_t              peers_size = 0;
+    int                 exactmatch;
+
+    if( (size_t)( re - r ) < sizeof(entry) )
+      goto broken;
+    memcpy( &entry, r, sizeof(entry) ); r += sizeof(entry);
+    for( family=0; family<OT_PEER_FAMILIES; ++family )
+      peers_size += (size_t)entry.peer_count[family] * OT_PEER_SIZE_FOR_FAMILY( family );
+    if( OT_BUCKET_BY_HASH( entry.hash ) != bucket || ( peers_size && !peers ) || (size_t)( re - r ) < peers_size )
+      goto broken;
+
+    if( !( torrent = index_find_or_insert_torrent( torrents_list, entry.hash, &exactmatch ) ) )
+      goto broken;
+    if( exactmatch ) {
+      snapshot_merge_peers( torrent, &entry, r );
+      r += peers_size;
+      continue;
+    }
+    if( !( peer_list = torrent->peer_list = slab_alloc( sizeof(ot_peerlist) ) ) ) {
+      index_remove_torrent( torrents_list, torrent );
+      goto broken;
+    }
+    byte_zero( peer_list, sizeof(ot_peerlist) );
+    peer_list->base       = entry.base;
+    peer_list->changed    = g_now_seconds;
+    peer_list->down_count = entry.down_count;
+    ++delta_torrentcount;
+
+    /* Peers that would have timed out by now are left out, the cleaner
+       comes back when the oldest of the others does */
+    age = g_now_minutes - (ot_time)entry.base;
+    if( age < 0 )
+      age = 0;
+    oldest = 0;
+    for( family=0; family<OT_PEER_FAMILIES; ++family ) {
+      size_t peer_size = OT_PEER_SIZE_FOR_FAMILY( family );
+      for( j=0; j<entry.peer_count[family]; ++j, r += peer_size ) {
+        ot_peer *peer;
+        if( age + OT_PEERTIME_D( r, peer_size ) >= OT_PEER_TIMEOUT )
+          continue;
+        if( age + OT_PEERTIME_D( r, peer_size ) > oldest )
+          oldest = age + OT_PEERTIME_D( r, peer_size );
+        if( !( peer = vector_find_or_insert_peer( peer_list->families + family, (const ot_peer*)r, peer_size, &exactmatch ) ) || exactmatch )
+          continue;
+        peer_list->peer_count++;
+        if( OT_PEERFLAG_D( r, peer_size ) & PEER_FLAG_SEEDING )
+          peer_list->seed_count++;
+      }
+    }
+    clean_schedule_torrent( torrent, peer_list->peer_count ? g_now_minutes + OT_PEER_TIMEOUT - oldest : g_now_minutes );
+  }
+
+  for( i=0; i<section.idle_count; ++i ) {
+    ot_snapshot_idle entry;
+
+    if( (size_t)( re - r ) < sizeof(entry) )
+      goto broken;
+    memcpy( &entry, r, sizeof(entry) ); r += sizeof(entry);
+    if( OT_BUCKET_BY_HASH( entry.hash ) != bucket )
+      goto broken;
+    if( g_now_minutes - (ot_time)entry.base > OT_TORRENT_TIMEOUT )
+      continue;
+    /* An idle torrent announced again since only gets its completed count */
+    if( ( live = index_find_torrent( torrents_list, entry.hash ) ) ) {
+      live->peer_list->down_count += entry.down_count;
+      continue;
+    }
+    if( index_find_idle( torrents_list, entry.hash ) )
+      continue;
+    if( !index_insert_idle( torrents_list, entry.hash, entry.base, entry.down_count ) ) {
+      clean_schedule_idle( index_find_idle( torrents_list, entry.hash ) );
+      ++delta_torrentcount;
+    }
+  }
+
+  mutex_bucket_unlock( bucket, delta_torrentcount );
+  return delta_torrentcount;
+
+broken:
+  mutex_bucket_unlock( bucket, delta_torrentcount );
+  return -1;
+}
+
+static void * snapshot_loader( void * args ) {
+  int bucket;
+  (void)args;
+
+  while( ( bucket = __sync_fetch_and_add( &g_load_next, 1 ) ) < OT_BUCKET_COUNT ) {
+    ssize_t restored = snapshot_load_bucket( bucket, g_load_map + g_load_header->bucket_offset[bucket],
+                                             g_load_map + g_load_header->bucket_offset[bucket+1], g_load_header->flags & OT_SNAPSHOT_PEERS );
+    if( restored < 0 )
+      g_load_failed = 1;
+    else
+      __sync_fetch_and_add( &g_load_torrents, (size_t)restored );
+  }
+  return NULL;
+}
+
+static int snapshot_check_version( const ot_snapshot_header *header, int stream ) {
+  return memcmp( header->magic, OT_SNAPSHOT_MAGIC, sizeof(header->magic) ) || header->version != OT_SNAPSHOT_VERSION ||
+         header->byte_order != OT_SNAPSHOT_BYTE_ORDER || header->bucket_count != OT_BUCKET_COUNT ||
+         !( header->flags & OT_SNAPSHOT_STREAM ) != !stream ? -1 : 0;
+}
+
+static int snapshot_check_header( const ot_snapshot_header *header, size_t size ) {
+  int bucket;
+
+  if( size < sizeof(ot_snapshot_header) || snapshot_check_version( header, 0 ) || header->bucket_offset[0] != sizeof(ot_snapshot_header) )
+    return -1;
+  for( bucket=0; bucket<OT_BUCKET_COUNT; ++bucket )
+    if( header->bucket_offset[bucket+1] < header->bucket_offset[bucket] )
+      return -1;
+  return header->bucket_offset[OT_BUCKET_COUNT] > size ? -1 : 0;
+}
+
+static ssize_t snapshot_load_fd( int fd, const char *filename ) {
+  pthread_t   threads[OT_MAX_THREADS];
+  struct stat st;
+  long        cpus = sysconf( _SC_NPROCESSORS_ONLN );
+  int         i, thread_count = 0;
+  void       *map;
+
+  if( fstat( fd, &st ) || !st.st_size ||
+      ( map = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 ) ) == MAP_FAILED )
+    return -1;
+
+  if( snapshot_check_header( map, st.st_size ) ) {
+    fprintf( stderr, "Warning: %s is no snapshot of version %d.\n", filename, OT_SNAPSHOT_VERSION );
+    munmap( map, st.st_size );
+    return -1;
+  }
+  madvise( map, st.st_size, MADV_SEQUENTIAL );
+
+  g_load_map      = map;
+  g_load_header   = map;
+  g_load_next     = 0;
+  g_load_torrents = 0;
+  g_load_failed   = 0;
+
+  /* The calling thread loads buckets, too */
+  if( cpus > OT_MAX_THREADS )
+    cpus = OT_MAX_THREADS;
+  for( i=1; i<cpus; ++i )
+    if( !pthread_create( threads + thread_count, NULL, snapshot_loader, NULL ) )
+      ++thread_count;
+  snapshot_loader( NULL );
+  for( i=0; i<thread_count; ++i )
+    pthread_join( threads[i], NULL );
+
+  munmap( map, st.st_size );
+  if( g_load_failed ) {
+    fprintf( stderr, "Warning: Snapshot %s is broken, restored %zu torrents.\n", filename, g_load_torrents );
+    return -1;
+  }
+  return g_load_torrents;
+}
+
+ssize_t snapshot_load( const char *filename ) {
+  int     fd = open( filename, O_RDONLY );
+  ssize_t restored;
+
+  if( fd < 0 )
+    return -1;
+  restored = snapshot_load_fd( fd, filename );
+  close( fd );
+  return restored;
+}
+
+static int snapshot_read( int fd, void *buffer, size_t size ) {
+  char *r = buffer;
+
+  while( size ) {
+    ssize_t got = read( fd, r, size );
+    if( got < 0 && errno == EINTR )
+      continue;
+    if( got <= 0 )
+      return -1;
+    r += got; size -= got;
+  }
+  return 0;
+}
+
+/* Streams are loaded a section at a time, into buckets that may be served
+   already */
+ssize_t snapshot_load_stream( int fd, const char *filename ) {
+  ot_snapshot_header *header = malloc( sizeof(ot_snapshot_header) );
+  uint8_t *buffer = NULL;
+  size_t   buffer_size = 0, torrents = 0;
+  uint64_t size;
+  int      bucket, failed = 0;
+
+  if( !header )
+    return -1;
+  if( snapshot_read( fd, header, sizeof(ot_snapshot_header) ) || snapshot_check_version( header, 1 ) ) {
+    fprintf( stderr, "Warning: %s is no snapshot of version %d.\n", filename, OT_SNAPSHOT_VERSION );
+    free( header );
+    return -1;
+  }
+
+  for( bucket=0; bucket<OT_BUCKET_COUNT && !failed; ++bucket ) {
+    ssize_t restored;
+
+    if( snapshot_read( fd, &size, sizeof(size) ) ) {
+      failed = 1;
+      break;
+    }
+    if( size > buffer_size ) {
+      uint8_t *new_buffer = realloc( buffer, size );
+      if( !new_buffer ) {
+        failed = 1;
+        break;
+      }
+      buffer = new_buffer;
+      buffer_size = size;
+    }
+    if( snapshot_read( fd, buffer, size ) || ( restored = snapshot_load_bucket( bucket, buffer, buffer + size, header->flags & OT_SNAPSHOT_PEERS ) ) < 0 )
+      failed = 1;
+    else
+      torrents += restored;
+  }
+  free( buffer );
+  free( header );
+
+  if( failed ) {
+    fprintf( stderr, "Warning: Snapshot %s is broken, restored %zu torrents.\n", filename, torrents );
+    return -1;
+  }
+  return torrents;
+}
+
+static void * snapshot_worker( void * args ) {
+  (void)args;
+  while( 1 ) {
+    sleep( g_snapshot_interval );
+    /* A snapshot being written must be finished */
+    pthread_setcancelstate( PTHREAD_CANCEL_DISABLE, NULL );
+    snapshot_write( g_snapshot_file );
+    pthread_setcancelstate( PTHREAD_CANCEL_ENABLE, NULL );
+  }
+  return NULL;
+}
+
+static pthread_t thread_id;
+static int       thread_running;
+
+void snapshot_init( void ) {
+  if( g_snapshot_file && g_snapshot_interval && !pthread_create( &thread_id, NULL, snapshot_worker, NULL ) )
+    thread_running = 1;
+}
+
+void snapshot_deinit( void ) {
+  if( thread_running ) {
+    pthread_cancel( thread_id );
+    pthread_join( thread_id, NULL );
+    thread_running = 0;
+  }
+  if( g_snapshot_file )
+    snapshot_write( g_snapshot_file );
+}
+
+const char *g_version_snapshot_c = "$Source: /home/cvsroot/opentracker/ot_snapshot.c,v $: $Revision: 1.1 $\n";
@@ -0,0 +1,35 @@
+/* This software was written by Dirk Engling <erdgeist@erdgeist.org>
+   It is considered beerware. Prost. Skol. Cheers or whatever.
+
+   $id$ */
+
+#ifndef __OT_SNAPSHOT_H__
+#define __OT_SNAPSHOT_H__
+
+/* Snapshots hold all torrents with their counters and, if wanted, their
+   peers in a binary file. They are written by a background thread every
+   g_snapshot_interval seconds and on exit, and loaded at startup by one
+   thread per cpu, each restoring whole buckets. */
+
+#define OT_SNAPSHOT_INTERVAL 300
+#define OT_SNAPSHOT_VERSION  1
+
+extern char          *g_snapshot_file;
+extern unsigned long  g_snapshot_interval;
+extern int            g_snapshot_peers;
+
+void    snapshot_init( void );
+/* Stops the background thread and writes a last snapshot */
+void    snapshot_deinit( void );
+
+/* Returns the number of torrents restored or -1, if the file could not be
+   read or is no snapshot of this version */
+ssize_t snapshot_load( const char *filename );
+int     snapshot_write( const char *filename );
+
+/* The same as a stream, e.g. over a socket. Torrents already live get the
+   peers and completed counts of the snapshot added. */
+ssize_t snapshot_load_stream( int fd, const char *filename );
+int     snapshot_write_stream( int fd );
+
+#endif
@@ -27,9 +27,11 @@
 /* Opentracker */
 #include "trackerlogic.h"
 #include "ot_mutex.h"
+#include "ot_slab.h"
 #include "ot_iovec.h"
 #include "ot_stats.h"
 #include "ot_accesslist.h"
+#include "ot_fullscrape.h"
 
 #ifndef NO_FULLSCRAPE_LOGGING
 #define LOG_TO_STDERR( ... ) fprintf( stderr, __VA_ARGS__ )
@@ -59,6 +61,10 @@ static char *             ot_failed_request_names[] = { "302 Redirect", "400 Par
 static unsigned long long ot_renewed[OT_PEER_TIMEOUT];
 static unsigned long long ot_overall_sync_count;
 static unsigned long long ot_overall_stall_count;
+static unsigned long long ot_replycache_hits;
+static unsigned long long ot_replycache_misses;
+static unsigned long long ot_udp_batches;
+static unsigned long long ot_udp_batched_datagrams;
 
 static time_t ot_start_time;
 
@@ -72,13 +78,14 @@ static time_t ot_start_time;
 #define __LDR(P,D)   ((__BYTE((P),(D))>>__SHFT((D)))&__MSK)
 #define __STR(P,D,V)   __BYTE((P),(D))=(__BYTE((P),(D))&~(__MSK<<__SHFT((D))))|((V)<<__SHFT((D)))
 
-#ifdef WANT_V6
-#define STATS_NETWORK_NODE_MAXDEPTH  (68-STATS_NETWORK_NODE_BITWIDTH)
-#define STATS_NETWORK_NODE_LIMIT     (48-STATS_NETWORK_NODE_BITWIDTH)
-#else
-#define STATS_NETWORK_NODE_MAXDEPTH  (28-STATS_NETWORK_NODE_BITWIDTH)
-#define STATS_NETWORK_NODE_LIMIT     (24-STATS_NETWORK_NODE_BITWIDTH)
-#endif
+/* Each address family has its own trees, IPv4 ones are keyed by the
+   plain four byte address */
+#define STATS_NETWORK_NODE_MAXDEPTH4 (28-STATS_NETWORK_NODE_BITWIDTH)
+#define STATS_NETWORK_NODE_LIMIT4    (24-STATS_NETWORK_NODE_BITWIDTH)
+#define STATS_NETWORK_NODE_MAXDEPTH6 (68-STATS_NETWORK_NODE_BITWIDTH)
+#define STATS_NETWORK_NODE_LIMIT6    (48-STATS_NETWORK_NODE_BITWIDTH)
+#define STATS_NETWORK_NODE_MAXDEPTH(family) ((family)==OT_PEER_FAMILY_V4?STATS_NETWORK_NODE_MAXDEPTH4:STATS_NETWORK_NODE_MAXDEPTH6)
+#define STATS_NETWORK_NODE_LIMIT(family)    ((family)==OT_PEER_FAMILY_V4?STATS_NETWORK_NODE_LIMIT4:STATS_NETWORK_NODE_LIMIT6)
 
 typedef union stats_network_node stats_network_node;
 union stats_network_node {
@@ -90,7 +97,7 @@ union stats_network_node {
 static stats_network_node *stats_network_counters_root;
 #endif
 
-static int stat_increase_network_count( stats_network_node **pnode, int depth, uintptr_t ip ) {
+static int stat_increase_network_count( stats_network_node **pnode, int depth, uintptr_t ip, int maxdepth ) {
   int foo = __LDR(ip,depth);
   stats_network_node *node;
   
@@ -102,22 +109,22 @@ static int stat_increase_network_count( stats_network_node **pnode, int depth, u
   }
   node = *pnode;
 
-  if( depth < STATS_NETWORK_NODE_MAXDEPTH )
-    return stat_increase_network_count( node->children + foo, depth+STATS_NETWORK_NODE_BITWIDTH, ip );
+  if( depth < maxdepth )
+    return stat_increase_network_count( node->children + foo, depth+STATS_NETWORK_NODE_BITWIDTH, ip, maxdepth );
 
   node->counters[ foo ]++;
   return 0;
 }
 
-static int stats_shift_down_network_count( stats_network_node **node, int depth, int shift ) {
+static int stats_shift_down_network_count( stats_network_node **node, int depth, int shift, int maxdepth ) {
   int i, rest = 0;
 
   if( !*node )
     return 0;
 
   for( i=0; i<STATS_NETWORK_NODE_COUNT; ++i )
-    if( depth < STATS_NETWORK_NODE_MAXDEPTH )
-      rest += stats_shift_down_network_count( (*node)->children + i, depth+STATS_NETWORK_NODE_BITWIDTH, shift );
+    if( depth < maxdepth )
+      rest += stats_shift_down_network_count( (*node)->children + i, depth+STATS_NETWORK_NODE_BITWIDTH, shift, maxdepth );
     else
       rest += (*node)->counters[i] >>= shift;
 
@@ -129,7 +136,7 @@ static int stats_shift_down_network_count( stats_network_node **node, int depth,
   return rest;
 }
 
-static size_t stats_get_highscore_networks( stats_network_node *node, int depth, ot_ip6 node_value, size_t *scores, ot_ip6 *networks, int network_count, int limit ) {
+static size_t stats_get_highscore_networks( stats_network_node *node, int depth, ot_ip6 node_value, size_t *scores, ot_ip6 *networks, int network_count, int limit, int maxdepth ) {
   size_t score = 0;
   int i;
 
@@ -139,19 +146,19 @@ static size_t stats_get_highscore_networks( stats_network_node *node, int depth,
     for( i=0; i<STATS_NETWORK_NODE_COUNT; ++i )
       if( node->children[i] ) {
         __STR(node_value,depth,i);
-        score += stats_get_highscore_networks( node->children[i], depth+STATS_NETWORK_NODE_BITWIDTH, node_value, scores, networks, network_count, limit );
+        score += stats_get_highscore_networks( node->children[i], depth+STATS_NETWORK_NODE_BITWIDTH, node_value, scores, networks, network_count, limit, maxdepth );
       }
     return score;
   }
 
-  if( depth > limit && depth < STATS_NETWORK_NODE_MAXDEPTH ) {
+  if( depth > limit && depth < maxdepth ) {
     for( i=0; i<STATS_NETWORK_NODE_COUNT; ++i )
       if( node->children[i] )
-        score += stats_get_highscore_networks( node->children[i], depth+STATS_NETWORK_NODE_BITWIDTH, node_value, scores, networks, network_count, limit );
+        score += stats_get_highscore_networks( node->children[i], depth+STATS_NETWORK_NODE_BITWIDTH, node_value, scores, networks, network_count, limit, maxdepth );
     return score;
   }
 
-  if( depth > limit && depth == STATS_NETWORK_NODE_MAXDEPTH ) {
+  if( depth > limit && depth == maxdepth ) {
     for( i=0; i<STATS_NETWORK_NODE_COUNT; ++i )
       score += node->counters[i];
     return score;
@@ -162,10 +169,10 @@ static size_t stats_get_highscore_networks( stats_network_node *node, int depth,
     int j=1;
     size_t node_score;
 
-    if( depth == STATS_NETWORK_NODE_MAXDEPTH )
+    if( depth == maxdepth )
       node_score = node->counters[i];
     else
-      node_score = stats_get_highscore_networks( node->children[i], depth+STATS_NETWORK_NODE_BITWIDTH, node_value, scores, networks, network_count, limit );
+      node_score = stats_get_highscore_networks( node->children[i], depth+STATS_NETWORK_NODE_BITWIDTH, node_value, scores, networks, network_count, limit, maxdepth );
 
     score += node_score;
 
@@ -184,7 +191,7 @@ static size_t stats_get_highscore_networks( stats_network_node *node, int depth,
   return score;
 }
 
-static size_t stats_return_busy_networks( char * reply, stats_network_node *tree, int amount, int limit ) {
+static size_t stats_return_busy_networks( char * reply, stats_network_node *tree, int amount, int limit, int family ) {
   ot_ip6   networks[amount];
   ot_ip6   node_value;
   size_t   scores[amount];
@@ -195,17 +202,16 @@ static size_t stats_return_busy_networks( char * reply, stats_network_node *tree
   memset( networks, 0, sizeof( networks ) );
   memset( node_value, 0, sizeof( node_value ) );
 
-  stats_get_highscore_networks( tree, 0, node_value, scores, networks, amount, limit );
+  stats_get_highscore_networks( tree, 0, node_value, scores, networks, amount, limit, STATS_NETWORK_NODE_MAXDEPTH( family ) );
 
   r += sprintf( r, "Networks, limit /%d:\n", limit+STATS_NETWORK_NODE_BITWIDTH );
   for( i=amount-1; i>=0; --i) {
     if( scores[i] ) {
       r += sprintf( r, "%08zd: ", scores[i] );
-#ifdef WANT_V6
-      r += fmt_ip6c( r, networks[i] );
-#else
-      r += fmt_ip4( r, networks[i]);
-#endif
+      if( family == OT_PEER_FAMILY_V4 )
+        r += fmt_ip4( r, networks[i] );
+      else
+        r += fmt_ip6c( r, networks[i] );
       *r++ = '\n';
     }
   }
@@ -215,30 +221,22 @@ static size_t stats_return_busy_networks( char * reply, stats_network_node *tree
 }
 
 static size_t stats_slash24s_txt( char *reply, size_t amount ) {
-  stats_network_node *slash24s_network_counters_root = NULL;
+  stats_network_node *slash24s_network_counters_root[OT_PEER_FAMILIES] = { NULL, NULL };
   char *r=reply;
-  int bucket;
+  int bucket, family;
   size_t i;
 
   for( bucket=0; bucket<OT_BUCKET_COUNT; ++bucket ) {
-    ot_vector *torrents_list = mutex_bucket_lock( bucket );
+    ot_torrent_list *torrents_list = mutex_bucket_lock( bucket );
     for( i=0; i<torrents_list->size; ++i ) {
       ot_peerlist *peer_list = ( ((ot_torrent*)(torrents_list->data))[i] ).peer_list;
-      ot_vector   *bucket_list = &peer_list->peers;
-      int          num_buckets = 1;
-
-      if( OT_PEERLIST_HASBUCKETS( peer_list ) ) {
-        num_buckets = bucket_list->size;
-        bucket_list = (ot_vector *)bucket_list->data;
-      }
+      for( family=0; family<OT_PEER_FAMILIES; ++family ) {
+        uint8_t *peers = peer_list->families[family].peers.data;
+        size_t   numpeers = peer_list->families[family].peers.size;
 
-      while( num_buckets-- ) {
-        ot_peer *peers = (ot_peer*)bucket_list->data;
-        size_t   numpeers = bucket_list->size;
-        while( numpeers-- )
-          if( stat_increase_network_count( &slash24s_network_counters_root, 0, (uintptr_t)(peers++) ) )
+        for( ; numpeers--; peers += OT_PEER_SIZE_FOR_FAMILY( family ) )
+          if( stat_increase_network_count( slash24s_network_counters_root + family, 0, (uintptr_t)peers, STATS_NETWORK_NODE_MAXDEPTH( family ) ) )
             goto bailout_unlock;
-        ++bucket_list;
       }
     }
     mutex_bucket_unlock( bucket, 0 );
@@ -246,9 +244,11 @@ static size_t stats_slash24s_txt( char *reply, size_t amount ) {
       goto bailout_error;
   }
 
-  /* The tree is built. Now analyze */
-  r += stats_return_busy_networks( r, slash24s_network_counters_root, amount, STATS_NETWORK_NODE_MAXDEPTH );
-  r += stats_return_busy_networks( r, slash24s_network_counters_root, amount, STATS_NETWORK_NODE_LIMIT );
+  /* The trees are built. Now analyze */
+  for( family=0; family<OT_PEER_FAMILIES; ++family ) {
+    r += stats_return_busy_networks( r, slash24s_network_counters_root[family], amount, STATS_NETWORK_NODE_MAXDEPTH( family ), family );
+    r += stats_return_busy_networks( r, slash24s_network_counters_root[family], amount, STATS_NETWORK_NODE_LIMIT( family ), family );
+  }
   goto success;
 
 bailout_unlock:
@@ -256,20 +256,23 @@ bailout_unlock:
 bailout_error:
   r = reply;
 success:
-  stats_shift_down_network_count( &slash24s_network_counters_root, 0, sizeof(int)*8-1 );
+  for( family=0; family<OT_PEER_FAMILIES; ++family )
+    stats_shift_down_network_count( slash24s_network_counters_root + family, 0, sizeof(int)*8-1, STATS_NETWORK_NODE_MAXDEPTH( family ) );
 
   return r-reply;
 }
 
 #ifdef WANT_SPOT_WOODPECKER
-static stats_network_node *stats_woodpeckers_tree;
+static stats_network_node *stats_woodpeckers_tree[OT_PEER_FAMILIES];
 static pthread_mutex_t g_woodpeckers_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 static size_t stats_return_woodpeckers( char * reply, int amount ) {
   char * r = reply;
+  int    family;
 
   pthread_mutex_lock( &g_woodpeckers_mutex );
-  r += stats_return_busy_networks( r, stats_woodpeckers_tree, amount, STATS_NETWORK_NODE_MAXDEPTH );
+  for( family=0; family<OT_PEER_FAMILIES; ++family )
+    r += stats_return_busy_networks( r, stats_woodpeckers_tree[family], amount, STATS_NETWORK_NODE_MAXDEPTH( family ), family );
   pthread_mutex_unlock( &g_woodpeckers_mutex );
   return r-reply;
 }
@@ -277,6 +280,7 @@ static size_t stats_return_woodpeckers( char * reply, int amount ) {
 
 typedef struct {
   unsigned long long torrent_count;
+  unsigned long long idle_count;
   unsigned long long peer_count;
   unsigned long long seed_count;
 } torrent_stats;
@@ -289,6 +293,19 @@ static int torrent_statter( ot_torrent *torrent, uintptr_t data ) {
   return 0;
 }
 
+/* Idle torrents are not visited by iterate_all_torrents, count them, too */
+static void stats_count_torrents( torrent_stats *stats ) {
+  int bucket;
+
+  iterate_all_torrents( torrent_statter, (uintptr_t)stats );
+  for( bucket=0; bucket<OT_BUCKET_COUNT && g_opentracker_running; ++bucket ) {
+    ot_torrent_list *torrents_list = mutex_bucket_lock( bucket );
+    stats->idle_count += torrents_list->idle.size;
+    mutex_bucket_unlock( bucket, 0 );
+  }
+  stats->torrent_count += stats->idle_count;
+}
+
 /* Converter function from memory to human readable hex strings */
 static char*to_hex(char*d,uint8_t*s){char*m="0123456789ABCDEF";char *t=d;char*e=d+40;while(d<e){*d++=m[*s>>4];*d++=m[*s++&15];}*d=0;return t;}
 
@@ -305,7 +322,7 @@ size_t stats_top10_txt( char * reply ) {
   byte_zero( top10c, sizeof( top10c ) );
 
   for( bucket=0; bucket<OT_BUCKET_COUNT; ++bucket ) {
-    ot_vector *torrents_list = mutex_bucket_lock( bucket );
+    ot_torrent_list *torrents_list = mutex_bucket_lock( bucket );
     for( j=0; j<torrents_list->size; ++j ) {
       ot_peerlist *peer_list = ( ((ot_torrent*)(torrents_list->data))[j] ).peer_list;
       int idx = 9; while( (idx >= 0) && ( peer_list->peer_count > top10c[idx].val ) ) --idx;
@@ -407,9 +424,9 @@ static size_t stats_fullscrapes_mrtg( char * reply ) {
 }
 
 static size_t stats_peers_mrtg( char * reply ) {
-  torrent_stats stats = {0,0,0};
+  torrent_stats stats = {0,0,0,0};
 
-  iterate_all_torrents( torrent_statter, (uintptr_t)&stats );
+  stats_count_torrents( &stats );
 
   return sprintf( reply, "%llu\n%llu\nopentracker serving %llu torrents\nopentracker",
                  stats.peer_count,
@@ -471,6 +488,53 @@ static size_t stats_return_completed_mrtg( char * reply ) {
                  );
 }
 
+static size_t stats_return_replycache_mrtg( char * reply ) {
+  ot_time t = time( NULL ) - ot_start_time;
+
+  return sprintf( reply,
+                 "%llu\n%llu\n%i seconds (%i hours)\nopentracker reply cache, %lu hits/s :: %lu misses/s.",
+                 ot_replycache_hits,
+                 ot_replycache_misses,
+                 (int)t,
+                 (int)(t / 3600),
+                 events_per_time( ot_replycache_hits, t ),
+                 events_per_time( ot_replycache_misses, t )
+                 );
+}
+
+static size_t stats_return_udpbatch_mrtg( char * reply ) {
+  ot_time t = time( NULL ) - ot_start_time;
+
+  return sprintf( reply,
+                 "%llu\n%llu\n%i seconds (%i hours)\nopentracker udp batches, %lu batches/s :: %llu datagrams per batch.",
+                 ot_udp_batches,
+                 ot_udp_batched_datagrams,
+                 (int)t,
+                 (int)(t / 3600),
+                 events_per_time( ot_udp_batches, t ),
+                 ot_udp_batches ? ot_udp_batched_datagrams / ot_udp_batches : 0
+                 );
+}
+
+#ifdef WANT_FULLSCRAPE
+static char *ot_fullscrape_format_names[] = { "ben", "bin", "txt", "url" };
+
+/* One line per cached full scrape: format, encoding, age in seconds and
+   size, age is -1 for those not built yet */
+static size_t stats_return_fullscrape_cache( char * reply ) {
+  char *r = reply;
+  int format, gzip;
+
+  for( format=0; format<4; ++format )
+    for( gzip=0; gzip<2; ++gzip ) {
+      size_t size = 0;
+      long age = fullscrape_cache_age( ( TASK_FULLSCRAPE + format ) | ( gzip ? TASK_FLAG_GZIP : 0 ), &size );
+      r += sprintf( r, "%s %s %ld %zd\n", ot_fullscrape_format_names[format], gzip ? "gzip" : "identity", age, size );
+    }
+  return r - reply;
+}
+#endif
+
 #ifdef WANT_LOG_NUMWANT
 extern unsigned long long numwants[201];
 static size_t stats_return_numwants( char * reply ) {
@@ -514,12 +578,27 @@ static void stats_return_fulllog( int *iovec_entries, struct iovec **iovector, c
 }
 #endif
 
+static size_t stats_return_slab_txt( char * reply ) {
+  ot_slab_stats slab;
+  char *r = reply;
+  int i;
+
+  slab_get_stats( &slab );
+  r += sprintf( r, "size\tobjects\tslabs\n" );
+  for( i=0; i<OT_SLAB_CLASSES; ++i )
+    r += sprintf( r, "%zd\t%zd\t%zd\n", slab.class_size[i], slab.class_objects[i], slab.class_slabs[i] );
+  r += sprintf( r, "spare slabs: %zd\nlarge allocations: %zd (%zd bytes)\n", slab.spare_slabs, slab.large_count, slab.large_bytes );
+  return r - reply;
+}
+
 static size_t stats_return_everything( char * reply ) {
-  torrent_stats stats = {0,0,0};
+  torrent_stats stats = {0,0,0,0};
+  ot_slab_stats slab;
   int i;
   char * r = reply;
 
-  iterate_all_torrents( torrent_statter, (uintptr_t)&stats );
+  stats_count_torrents( &stats );
+  slab_get_stats( &slab );
 
   r += sprintf( r, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n" );
   r += sprintf( r, "<stats>\n" );
@@ -529,6 +608,7 @@ static size_t stats_return_everything( char * reply ) {
   r += sprintf( r, "  <torrents>\n" );
   r += sprintf( r, "    <count_mutex>%zd</count_mutex>\n", mutex_get_torrent_count() );
   r += sprintf( r, "    <count_iterator>%llu</count_iterator>\n", stats.torrent_count );
+  r += sprintf( r, "    <count_idle>%llu</count_idle>\n", stats.idle_count );
   r += sprintf( r, "  </torrents>\n" );
   r += sprintf( r, "  <peers>\n    <count>%llu</count>\n  </peers>\n", stats.peer_count );
   r += sprintf( r, "  <seeds>\n    <count>%llu</count>\n  </seeds>\n", stats.seed_count );
@@ -538,6 +618,16 @@ static size_t stats_return_everything( char * reply ) {
   r += sprintf( r, "    <udp>\n      <overall>%llu</overall>\n      <connect>%llu</connect>\n      <announce>%llu</announce>\n      <scrape>%llu</scrape>\n    </udp>\n", ot_overall_udp_connections, ot_overall_udp_connects, ot_overall_udp_successfulannounces, ot_overall_udp_successfulscrapes );
   r += sprintf( r, "    <livesync>\n      <count>%llu</count>\n    </livesync>\n", ot_overall_sync_count );
   r += sprintf( r, "  </connections>\n" );
+#ifdef WANT_FULLSCRAPE
+  r += sprintf( r, "  <fullscrape_cache>\n" );
+  for( i=0; i<8; ++i ) {
+    size_t size = 0;
+    long age = fullscrape_cache_age( ( TASK_FULLSCRAPE + i / 2 ) | ( i % 2 ? TASK_FLAG_GZIP : 0 ), &size );
+    r += sprintf( r, "    <cache format=\"%s\" encoding=\"%s\">\n      <age>%ld</age>\n      <size>%zd</size>\n    </cache>\n",
+                  ot_fullscrape_format_names[i / 2], i % 2 ? "gzip" : "identity", age, size );
+  }
+  r += sprintf( r, "  </fullscrape_cache>\n" );
+#endif
   r += sprintf( r, "  <debug>\n" );
   r += sprintf( r, "    <renew>\n" );
   for( i=0; i<OT_PEER_TIMEOUT; ++i )
@@ -548,20 +638,27 @@ static size_t stats_return_everything( char * reply ) {
     r += sprintf( r, "      <count code=\"%s\">%llu</count>\n", ot_failed_request_names[i], ot_failed_request_counts[i] );
   r += sprintf( r, "    </http_error>\n" );
   r += sprintf( r, "    <mutex_stall>\n      <count>%llu</count>\n    </mutex_stall>\n", ot_overall_stall_count );
+  r += sprintf( r, "    <replycache>\n      <hits>%llu</hits>\n      <misses>%llu</misses>\n    </replycache>\n", ot_replycache_hits, ot_replycache_misses );
+  r += sprintf( r, "    <udp_batch>\n      <batches>%llu</batches>\n      <datagrams>%llu</datagrams>\n    </udp_batch>\n", ot_udp_batches, ot_udp_batched_datagrams );
+  r += sprintf( r, "    <slab>\n" );
+  for( i=0; i<OT_SLAB_CLASSES; ++i )
+    r += sprintf( r, "      <class size=\"%zd\">\n        <objects>%zd</objects>\n        <slabs>%zd</slabs>\n      </class>\n", slab.class_size[i], slab.class_objects[i], slab.class_slabs[i] );
+  r += sprintf( r, "      <spare>%zd</spare>\n      <large>\n        <count>%zd</count>\n        <bytes>%zd</bytes>\n      </large>\n", slab.spare_slabs, slab.large_count, slab.large_bytes );
+  r += sprintf( r, "    </slab>\n" );
   r += sprintf( r, "  </debug>\n" );
   r += sprintf( r, "</stats>" );
   return r - reply;
 }
 
 extern const char
-*g_version_opentracker_c, *g_version_accesslist_c, *g_version_clean_c, *g_version_fullscrape_c, *g_version_http_c,
-*g_version_iovec_c, *g_version_mutex_c, *g_version_stats_c, *g_version_udp_c, *g_version_vector_c,
+*g_version_opentracker_c, *g_version_accesslist_c, *g_version_clean_c, *g_version_clock_c, *g_version_fullscrape_c, *g_version_handoff_c, *g_version_http_c,
+*g_version_index_c, *g_version_iovec_c, *g_version_loop_c, *g_version_mutex_c, *g_version_random_c, *g_version_shard_c, *g_version_slab_c, *g_version_snapshot_c, *g_version_stats_c, *g_version_udp_c, *g_version_vector_c,
 *g_version_scan_urlencoded_query_c, *g_version_trackerlogic_c, *g_version_livesync_c;
 
 size_t stats_return_tracker_version( char *reply ) {
-  return sprintf( reply, "%s%s%s%s%s%s%s%s%s%s%s%s%s",
-                 g_version_opentracker_c, g_version_accesslist_c, g_version_clean_c, g_version_fullscrape_c, g_version_http_c,
-                 g_version_iovec_c, g_version_mutex_c, g_version_stats_c, g_version_udp_c, g_version_vector_c,
+  return sprintf( reply, "%s%s%s%s%s%s%s%s%s%s%s%s%s%s%s%s%s%s%s%s%s",
+                 g_version_opentracker_c, g_version_accesslist_c, g_version_clean_c, g_version_clock_c, g_version_fullscrape_c, g_version_handoff_c, g_version_http_c,
+                 g_version_index_c, g_version_iovec_c, g_version_loop_c, g_version_mutex_c, g_version_random_c, g_version_shard_c, g_version_slab_c, g_version_snapshot_c, g_version_stats_c, g_version_udp_c, g_version_vector_c,
                  g_version_scan_urlencoded_query_c, g_version_trackerlogic_c, g_version_livesync_c );
 }
 
@@ -588,6 +685,14 @@ size_t return_stats_for_tracker( char *reply, int mode, int format ) {
       return stats_return_renew_bucket( reply );
     case TASK_STATS_SYNCS:
       return stats_return_sync_mrtg( reply );
+    case TASK_STATS_REPLYCACHE:
+      return stats_return_replycache_mrtg( reply );
+    case TASK_STATS_UDPBATCH:
+      return stats_return_udpbatch_mrtg( reply );
+#ifdef WANT_FULLSCRAPE
+    case TASK_STATS_FULLSCRAPE_CACHE:
+      return stats_return_fullscrape_cache( reply );
+#endif
 #ifdef WANT_LOG_NUMWANT
     case TASK_STATS_NUMWANTS:
       return stats_return_numwants( reply );
@@ -611,6 +716,7 @@ static void stats_make( int *iovec_entries, struct iovec **iovector, ot_tasktype
     case TASK_STATS_SLASH24S:    r += stats_slash24s_txt( r, 128 );         break;
     case TASK_STATS_TOP10:       r += stats_top10_txt( r );                 break;
     case TASK_STATS_EVERYTHING:  r += stats_return_everything( r );         break;
+    case TASK_STATS_SLAB:        r += stats_return_slab_txt( r );           break;
 #ifdef WANT_SPOT_WOODPECKER
     case TASK_STATS_WOODPECKERS: r += stats_return_woodpeckers( r, 128 );   break;
 #endif
@@ -628,16 +734,16 @@ static void stats_make( int *iovec_entries, struct iovec **iovector, ot_tasktype
 void stats_issue_event( ot_status_event event, PROTO_FLAG proto, uintptr_t event_data ) {
   switch( event ) {
     case EVENT_ACCEPT:
-      if( proto == FLAG_TCP ) ot_overall_tcp_connections++; else ot_overall_udp_connections++;
+      if( proto == FLAG_TCP ) __sync_fetch_and_add( &ot_overall_tcp_connections, 1 ); else __sync_fetch_and_add( &ot_overall_udp_connections, 1 );
 #ifdef WANT_LOG_NETWORKS
-      stat_increase_network_count( &stats_network_counters_root, 0, event_data );
+      stat_increase_network_count( &stats_network_counters_root, 0, event_data, STATS_NETWORK_NODE_MAXDEPTH6 );
 #endif
       break;
     case EVENT_ANNOUNCE:
-      if( proto == FLAG_TCP ) ot_overall_tcp_successfulannounces++; else ot_overall_udp_successfulannounces++;
+      if( proto == FLAG_TCP ) __sync_fetch_and_add( &ot_overall_tcp_successfulannounces, 1 ); else __sync_fetch_and_add( &ot_overall_udp_successfulannounces, 1 );
       break;
     case EVENT_CONNECT:
-      if( proto == FLAG_TCP ) ot_overall_tcp_connects++; else ot_overall_udp_connects++;
+      if( proto == FLAG_TCP ) __sync_fetch_and_add( &ot_overall_tcp_connects, 1 ); else __sync_fetch_and_add( &ot_overall_udp_connects, 1 );
       break;
     case EVENT_COMPLETED:
 #ifdef WANT_SYSLOGS
@@ -659,21 +765,17 @@ void stats_issue_event( ot_status_event event, PROTO_FLAG proto, uintptr_t event
           *peerid_hex=0;
         }
 
-#ifdef WANT_V6
         ip_readable[ fmt_ip6c( ip_readable, (char*)&ws->peer ) ] = 0;
-#else
-        ip_readable[ fmt_ip4( ip_readable, (char*)&ws->peer ) ] = 0;
-#endif
         syslog( LOG_INFO, "time=%s event=completed info_hash=%s peer_id=%s ip=%s", timestring, hash_hex, peerid_hex, ip_readable );
       }
 #endif
-      ot_overall_completed++;
+      __sync_fetch_and_add( &ot_overall_completed, 1 );
       break;
     case EVENT_SCRAPE:
-      if( proto == FLAG_TCP ) ot_overall_tcp_successfulscrapes++; else ot_overall_udp_successfulscrapes++;
+      if( proto == FLAG_TCP ) __sync_fetch_and_add( &ot_overall_tcp_successfulscrapes, 1 ); else __sync_fetch_and_add( &ot_overall_udp_successfulscrapes, 1 );
     case EVENT_FULLSCRAPE:
-      ot_full_scrape_count++;
-      ot_full_scrape_size += event_data;
+      __sync_fetch_and_add( &ot_full_scrape_count, 1 );
+      __sync_fetch_and_add( &ot_full_scrape_size, event_data );
       break;
     case EVENT_FULLSCRAPE_REQUEST:
     {
@@ -683,7 +785,7 @@ void stats_issue_event( ot_status_event event, PROTO_FLAG proto, uintptr_t event
       off += fmt_ip6c( _debug+off, *ip );
       off += snprintf( _debug+off, sizeof(_debug)-off, " - FULL SCRAPE\n" );
       write( 2, _debug, off );
-      ot_full_scrape_request_count++;
+      __sync_fetch_and_add( &ot_full_scrape_request_count, 1 );
     }
       break;
     case EVENT_FULLSCRAPE_REQUEST_GZIP:
@@ -694,26 +796,39 @@ void stats_issue_event( ot_status_event event, PROTO_FLAG proto, uintptr_t event
       off += fmt_ip6c(_debug+off, *ip );
       off += snprintf( _debug+off, sizeof(_debug)-off, " - FULL SCRAPE\n" );
       write( 2, _debug, off );
-      ot_full_scrape_request_count++;
+      __sync_fetch_and_add( &ot_full_scrape_request_count, 1 );
     }
       break;
     case EVENT_FAILED:
-      ot_failed_request_counts[event_data]++;
+      __sync_fetch_and_add( &ot_failed_request_counts[event_data], 1 );
       break;
     case EVENT_RENEW:
-      ot_renewed[event_data]++;
+      __sync_fetch_and_add( &ot_renewed[event_data], 1 );
       break;
     case EVENT_SYNC:
-      ot_overall_sync_count+=event_data;
+      __sync_fetch_and_add( &ot_overall_sync_count, event_data );
 	    break;
     case EVENT_BUCKET_LOCKED:
-      ot_overall_stall_count++;
+      __sync_fetch_and_add( &ot_overall_stall_count, 1 );
+      break;
+    case EVENT_REPLYCACHE_HIT:
+      __sync_fetch_and_add( &ot_replycache_hits, 1 );
+      break;
+    case EVENT_REPLYCACHE_MISS:
+      __sync_fetch_and_add( &ot_replycache_misses, 1 );
+      break;
+    case EVENT_UDP_BATCH:
+      __sync_fetch_and_add( &ot_udp_batches, 1 );
+      __sync_fetch_and_add( &ot_udp_batched_datagrams, event_data );
       break;
 #ifdef WANT_SPOT_WOODPECKER
     case EVENT_WOODPECKER:
+    {
+      int family = peer_family( (ot_peer*)event_data );
       pthread_mutex_lock( &g_woodpeckers_mutex );
-      stat_increase_network_count( &stats_woodpeckers_tree, 0, event_data );
+      stat_increase_network_count( stats_woodpeckers_tree + family, 0, (uintptr_t)OT_PEER_COMPACT( event_data, family ), STATS_NETWORK_NODE_MAXDEPTH( family ) );
       pthread_mutex_unlock( &g_woodpeckers_mutex );
+    }
       break;
 #endif
     default:
@@ -737,8 +852,8 @@ static void * stats_worker( void * args ) {
   return NULL;
 }
 
-void stats_deliver( int64 sock, int tasktype ) {
-  mutex_workqueue_pushtask( sock, tasktype );
+int stats_deliver( int64 sock, int tasktype ) {
+  return mutex_workqueue_pushtask( sock, tasktype );
 }
 
 static pthread_t thread_id;
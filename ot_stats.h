@@ -20,6 +20,9 @@ typedef enum {
   EVENT_FULLSCRAPE,   /* TCP only */
   EVENT_FAILED,
   EVENT_BUCKET_LOCKED,
+  EVENT_REPLYCACHE_HIT,
+  EVENT_REPLYCACHE_MISS,
+  EVENT_UDP_BATCH,    /* Datagrams read with one call */
   EVENT_WOODPECKER
 } ot_status_event;
 
@@ -37,7 +40,7 @@ enum {
 };
 
 void   stats_issue_event( ot_status_event event, PROTO_FLAG proto, uintptr_t event_data );
-void   stats_deliver( int64 sock, int tasktype );
+int    stats_deliver( int64 sock, int tasktype );
 size_t return_stats_for_tracker( char *reply, int mode, int format );
 size_t stats_return_tracker_version( char *reply );
 void   stats_init( );
@@ -89,7 +89,7 @@ static void sync_make( int *iovec_entries, struct iovec **iovector ) {
   /* For each bucket... */
   for( bucket=0; bucket<OT_BUCKET_COUNT; ++bucket ) {
     /* Get exclusive access to that bucket */
-    ot_vector *torrents_list = mutex_bucket_lock( bucket );
+    ot_torrent_list *torrents_list = mutex_bucket_lock( bucket );
     size_t tor_offset;
 
     /* For each torrent in this bucket.. */
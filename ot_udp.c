@@ -4,18 +4,25 @@
    $id$ */
 
 /* System */
+#define _GNU_SOURCE
+#include <stdlib.h>
 #include <string.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
 #include <stdio.h>
 
 /* Libowfat */
 #include "socket.h"
 #include "io.h"
+#include "ip6.h"
 
 /* Opentracker */
 #include "trackerlogic.h"
 #include "ot_udp.h"
 #include "ot_stats.h"
+#include "ot_loop.h"
+#include "ot_shard.h"
 
 static const uint8_t g_static_connid[8] = { 0x23, 0x42, 0x05, 0x17, 0xde, 0x41, 0x50, 0xff };
 
@@ -27,16 +34,44 @@ static void udp_make_connectionid( uint32_t * connid, const ot_ip6 remoteip ) {
   memcpy( connid, g_static_connid, 8 );
 }
 
-/* UDP implementation according to http://xbtt.sourceforge.net/udp_tracker_protocol.html */
-void handle_udp6( int64 serversocket, struct ot_workstruct *ws ) {
-  ot_ip6      remoteip;
+/* Points the reply for the announce in ws into outbuf, which already starts
+   with action and transaction id. Peer lists go behind them. */
+static void udp_announce_start( struct ot_workstruct *ws ) {
+  ws->reply = ( OT_PEERFLAG( &ws->peer ) & PEER_FLAG_STOPPED ) ? ws->outbuf : ws->outbuf + 8;
+}
+
+/* Returns the size of the whole reply, once the announce is done */
+static size_t udp_announce_finish( struct ot_workstruct *ws ) {
+  size_t reply_size = ( ws->reply - ws->outbuf ) + ws->reply_size;
+  stats_issue_event( EVENT_ANNOUNCE, FLAG_UDP, reply_size );
+  return reply_size;
+}
+
+static void udp_announce( int64 serversocket, struct ot_workstruct *ws, ot_ip6 remoteip, uint16_t remoteport, size_t numwant ) {
+  udp_announce_start( ws );
+  if( OT_PEERFLAG( &ws->peer ) & PEER_FLAG_STOPPED ) /* Peer is gone. */
+    ws->reply_size = remove_peer_from_torrent( FLAG_UDP, ws );
+  else
+    ws->reply_size = add_peer_to_torrent_and_return_peers( FLAG_UDP, ws, numwant );
+
+  socket_send6( serversocket, ws->outbuf, udp_announce_finish( ws ), remoteip, remoteport, 0 );
+}
+
+/* UDP implementation according to http://xbtt.sourceforge.net/udp_tracker_protocol.html
+
+   Handles the request in ws->inbuf. Connects and scrapes are answered in
+   ws->outbuf, returning the size of the reply or 0 for none. Announces are
+   only parsed into ws and return -1, leaving the number of peers wanted in
+   numwant. */
+static ssize_t udp_handle_request( int64 serversocket, struct ot_workstruct *ws, size_t byte_count, ot_ip6 remoteip, uint16_t remoteport, size_t *numwant ) {
   uint32_t   *inpacket = (uint32_t*)ws->inbuf;
   uint32_t   *outpacket = (uint32_t*)ws->outbuf;
-  uint32_t    numwant, left, event, scopeid;
-  uint16_t    port, remoteport;
-  size_t      byte_count, scrape_count;
+  uint32_t    left, event;
+  uint16_t    port;
+  size_t      scrape_count;
 
-  byte_count = socket_recv6( serversocket, ws->inbuf, G_INBUF_SIZE, remoteip, &remoteport, &scopeid );
+  /* Only needed to pass announces on */
+  (void)serversocket;
 
   stats_issue_event( EVENT_ACCEPT, FLAG_UDP, (uintptr_t)remoteip );
   stats_issue_event( EVENT_READ, FLAG_UDP, byte_count );
@@ -45,33 +80,32 @@ void handle_udp6( int64 serversocket, struct ot_workstruct *ws ) {
   ws->hash = NULL;
   ws->peer_id = NULL;
   
-  /* Minimum udp tracker packet size, also catches error */
+  /* Minimum udp tracker packet size */
   if( byte_count < 16 )
-    return;
+    return 0;
 
   switch( ntohl( inpacket[2] ) ) {
     case 0: /* This is a connect action */
       /* look for udp bittorrent magic id */
       if( (ntohl(inpacket[0]) != 0x00000417) || (ntohl(inpacket[1]) != 0x27101980) )
-        return;
+        return 0;
 
       outpacket[0] = 0;
       outpacket[1] = inpacket[3];
       udp_make_connectionid( outpacket + 2, remoteip );
 
-      socket_send6( serversocket, ws->outbuf, 16, remoteip, remoteport, 0 );
       stats_issue_event( EVENT_CONNECT, FLAG_UDP, 16 );
-      break;
+      return 16;
     case 1: /* This is an announce action */
       /* Minimum udp announce packet size */
       if( byte_count < 98 )
-        return;
+        return 0;
 
       /* We do only want to know, if it is zero */
       left  = inpacket[64/4] | inpacket[68/4];
 
-      numwant = ntohl( inpacket[92/4] );
-      if (numwant > 200) numwant = 200;
+      *numwant = ntohl( inpacket[92/4] );
+      if (*numwant > 200) *numwant = 200;
 
       event    = ntohl( inpacket[80/4] );
       port     = *(uint16_t*)( ((char*)inpacket) + 96 );
@@ -93,30 +127,190 @@ void handle_udp6( int64 serversocket, struct ot_workstruct *ws ) {
       outpacket[0] = htonl( 1 );    /* announce action */
       outpacket[1] = inpacket[12/4];
 
-      if( OT_PEERFLAG( &ws->peer ) & PEER_FLAG_STOPPED ) { /* Peer is gone. */
-        ws->reply      = ws->outbuf;
-        ws->reply_size = remove_peer_from_torrent( FLAG_UDP, ws );
-      } else {
-        ws->reply      = ws->outbuf + 8;
-        ws->reply_size = 8 + add_peer_to_torrent_and_return_peers( FLAG_UDP, ws, numwant );
+#ifdef WANT_SHARDS
+      /* The kernel steers announces to their owner, when it can */
+      if( !shard_is_local( *ws->hash ) ) {
+        ot_shard_msg *msg = shard_msg_alloc( SHARD_UDP_ANNOUNCE, serversocket, 0 );
+        if( msg ) {
+          memcpy( msg->remoteip, remoteip, sizeof(ot_ip6) );
+          msg->remoteport     = remoteport;
+          msg->transaction_id = inpacket[12/4];
+          shard_post_announce( msg, ws, *numwant );
+        }
+        return 0;
       }
-
-      socket_send6( serversocket, ws->outbuf, ws->reply_size, remoteip, remoteport, 0 );
-      stats_issue_event( EVENT_ANNOUNCE, FLAG_UDP, ws->reply_size );
-      break;
+#else
+      (void)remoteport;
+#endif
+      return -1;
 
     case 2: /* This is a scrape action */
       outpacket[0] = htonl( 2 );    /* scrape action */
       outpacket[1] = inpacket[12/4];
 
-      for( scrape_count = 0; ( scrape_count * 20 < byte_count - 16) && ( scrape_count <= 74 ); scrape_count++ )
-        return_udp_scrape_for_torrent( *(ot_hash*)( ((char*)inpacket) + 16 + 20 * scrape_count ), ((char*)outpacket) + 8 + 12 * scrape_count );
+      /* Up to 75 hashes fit a reply, a partial hash still counts */
+      scrape_count = ( byte_count - 16 + 19 ) / 20;
+      if( scrape_count > 75 ) scrape_count = 75;
+      return_udp_scrape_for_torrent( (ot_hash*)( ((char*)inpacket) + 16 ), scrape_count, ((char*)outpacket) + 8 );
 
-      socket_send6( serversocket, ws->outbuf, 8 + 12 * scrape_count, remoteip, remoteport, 0 );
       stats_issue_event( EVENT_SCRAPE, FLAG_UDP, scrape_count );
+      return 8 + 12 * scrape_count;
+  }
+  return 0;
+}
+
+/* Buffers for batches of datagrams, each I/O thread gets its own set */
+typedef struct {
+  struct mmsghdr        requests[OT_UDP_BATCH_MAX];
+  struct mmsghdr        replies[OT_UDP_BATCH_MAX];
+  struct iovec          request_iov[OT_UDP_BATCH_MAX];
+  struct iovec          reply_iov[OT_UDP_BATCH_MAX];
+  struct sockaddr_in6   addresses[OT_UDP_BATCH_MAX];
+  struct ot_workstruct  ws[OT_UDP_BATCH_MAX];
+  ot_batch_entry        announces[OT_UDP_BATCH_MAX];
+  ssize_t               reply_size[OT_UDP_BATCH_MAX];
+  char                  inbuf[OT_UDP_BATCH_MAX][OT_UDP_REQUEST_SIZE];
+  char                  outbuf[OT_UDP_BATCH_MAX][OT_UDP_REPLY_SIZE];
+} ot_udp_batch;
+
+static __thread ot_udp_batch *t_udp_batch;
+
+size_t g_udp_batch = OT_UDP_BATCH;
+
+static ot_udp_batch *udp_batch_get( void ) {
+  ot_udp_batch *batch = t_udp_batch;
+  int i;
+
+  if( batch || !( batch = t_udp_batch = malloc( sizeof(ot_udp_batch) ) ) )
+    return batch;
+
+  memset( batch->requests, 0, sizeof(batch->requests) );
+  memset( batch->replies, 0, sizeof(batch->replies) );
+  for( i=0; i<OT_UDP_BATCH_MAX; ++i ) {
+    batch->request_iov[i].iov_base = batch->inbuf[i];
+    batch->request_iov[i].iov_len  = OT_UDP_REQUEST_SIZE;
+    batch->requests[i].msg_hdr.msg_name   = batch->addresses + i;
+    batch->requests[i].msg_hdr.msg_iov    = batch->request_iov + i;
+    batch->requests[i].msg_hdr.msg_iovlen = 1;
+    batch->replies[i].msg_hdr.msg_iov     = batch->reply_iov + i;
+    batch->replies[i].msg_hdr.msg_iovlen  = 1;
+    batch->ws[i].inbuf  = batch->inbuf[i];
+    batch->ws[i].outbuf = batch->outbuf[i];
+  }
+  return batch;
+}
+
+/* The same as socket_recv6 does for a single datagram */
+static void udp_unpack_address( const struct sockaddr_in6 *address, ot_ip6 ip, uint16_t *port ) {
+  if( address->sin6_family == AF_INET ) {
+    const struct sockaddr_in *address4 = (const struct sockaddr_in *)address;
+    memcpy( ip, V4mappedprefix, sizeof(V4mappedprefix) );
+    memcpy( ip + sizeof(V4mappedprefix), &address4->sin_addr, 4 );
+    *port = ntohs( address4->sin_port );
+  } else {
+    memcpy( ip, &address->sin6_addr, sizeof(ot_ip6) );
+    *port = ntohs( address->sin6_port );
+  }
+}
+
+/* Fetches up to g_udp_batch datagrams with one recvmmsg(), runs all their
+   announces through one process_batch() and sends all replies with one
+   sendmmsg(). A single pending datagram costs the same two syscalls as
+   before. */
+static void handle_udp6_batch( int64 serversocket, ot_udp_batch *batch ) {
+  ot_ip6   remoteip;
+  uint16_t remoteport;
+  size_t   numwant, announce_count = 0;
+  int      count, reply_count = 0, sent, i;
+
+  for( i=0; i<(int)g_udp_batch; ++i )
+    batch->requests[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in6);
+
+  count = recvmmsg( serversocket, batch->requests, g_udp_batch, MSG_DONTWAIT, NULL );
+  if( count <= 0 )
+    return;
+  stats_issue_event( EVENT_UDP_BATCH, FLAG_UDP, count );
+
+  for( i=0; i<count; ++i ) {
+    struct ot_workstruct *ws = batch->ws + i;
+    udp_unpack_address( batch->addresses + i, remoteip, &remoteport );
+
+    batch->reply_size[i] = udp_handle_request( serversocket, ws, batch->requests[i].msg_len, remoteip, remoteport, &numwant );
+    if( batch->reply_size[i] == -1 ) {
+      ot_batch_entry *entry = batch->announces + announce_count++;
+      udp_announce_start( ws );
+      entry->action = OT_BATCH_ANNOUNCE;
+      entry->proto  = FLAG_UDP;
+      entry->amount = numwant;
+      entry->ws     = ws;
+    }
+  }
+
+  if( announce_count )
+    process_batch( batch->announces, announce_count );
+
+  for( i=0; i<count; ++i ) {
+    struct msghdr *reply = &batch->replies[reply_count].msg_hdr;
+    ssize_t reply_size = batch->reply_size[i];
+
+    if( reply_size == -1 )
+      reply_size = udp_announce_finish( batch->ws + i );
+    if( !reply_size )
+      continue;
+
+    reply->msg_name    = batch->addresses + i;
+    reply->msg_namelen = batch->requests[i].msg_hdr.msg_namelen;
+    batch->reply_iov[reply_count].iov_base = batch->outbuf[i];
+    batch->reply_iov[reply_count].iov_len  = reply_size;
+    ++reply_count;
+  }
+
+  /* Replies the socket can not take right now are dropped, like with
+     socket_send6 */
+  for( i=0; i<reply_count; i+=sent )
+    if( ( sent = sendmmsg( serversocket, batch->replies + i, reply_count - i, MSG_DONTWAIT ) ) <= 0 )
       break;
+}
+
+void handle_udp6( int64 serversocket, struct ot_workstruct *ws ) {
+  ot_udp_batch *batch;
+  ot_ip6        remoteip;
+  uint32_t      scopeid;
+  uint16_t      remoteport;
+  ssize_t       byte_count, reply_size;
+  size_t        numwant;
+
+  if( g_udp_batch > 1 && ( batch = udp_batch_get( ) ) ) {
+    handle_udp6_batch( serversocket, batch );
+    return;
   }
+
+  byte_count = socket_recv6( serversocket, ws->inbuf, G_INBUF_SIZE, remoteip, &remoteport, &scopeid );
+  if( byte_count < 0 )
+    return;
+
+  reply_size = udp_handle_request( serversocket, ws, byte_count, remoteip, remoteport, &numwant );
+  if( reply_size == -1 )
+    udp_announce( serversocket, ws, remoteip, remoteport, numwant );
+  else if( reply_size )
+    socket_send6( serversocket, ws->outbuf, reply_size, remoteip, remoteport, 0 );
+}
+
+#ifdef WANT_SHARDS
+void udp_handle_shard_announce( ot_shard_msg *msg, struct ot_workstruct *ws ) {
+  uint32_t *outpacket = (uint32_t*)ws->outbuf;
+
+  ws->hash    = &msg->hash;
+  ws->peer_id = NULL;
+  memcpy( &ws->peer, &msg->peer, sizeof(ot_peer) );
+
+  outpacket[0] = htonl( 1 );    /* announce action */
+  outpacket[1] = msg->transaction_id;
+
+  udp_announce( msg->sock, ws, msg->remoteip, msg->remoteport, msg->amount );
+  free( msg );
 }
+#endif
 
 void udp_init( ) {
 
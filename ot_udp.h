@@ -6,6 +6,24 @@
 #ifndef __OT_UDP_H__
 #define __OT_UDP_H__
 
+/* Datagrams read with one recvmmsg() call, a batch size of 1 reads and
+   answers every datagram on its own. Batched requests may be up to
+   OT_UDP_REQUEST_SIZE bytes, enough for scraping 75 torrents, and replies
+   up to OT_UDP_REPLY_SIZE, enough for 200 IPv6 peers. */
+#define OT_UDP_BATCH        16
+#define OT_UDP_BATCH_MAX    OT_BATCH_MAX
+#define OT_UDP_REQUEST_SIZE 2048
+#define OT_UDP_REPLY_SIZE   4096
+
+extern size_t g_udp_batch;
+
 void handle_udp6( int64 serversocket, struct ot_workstruct *ws );
 
+#ifdef WANT_SHARDS
+struct ot_shard_msg;
+
+/* Answers an announce another thread passed on */
+void udp_handle_shard_announce( struct ot_shard_msg *msg, struct ot_workstruct *ws );
+#endif
+
 #endif
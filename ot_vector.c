@@ -8,19 +8,17 @@
 #include <string.h>
 #include <strings.h>
 #include <stdint.h>
+#include <sys/types.h>
 
 /* Opentracker */
 #include "trackerlogic.h"
 #include "ot_vector.h"
+#include "ot_slab.h"
 
 /* Libowfat */
 #include "uint32.h"
 #include "uint16.h"
 
-static int vector_compare_peer(const void *peer1, const void *peer2 ) {
-  return memcmp( peer1, peer2, OT_PEER_COMPARE_SIZE );
-}
-
 /* This function gives us a binary search that returns a pointer, even if
    no exact match is found. In that case it sets exactmatch 0 and gives
    calling functions the chance to insert data
@@ -47,13 +45,6 @@ void *binary_search( const void * const key, const void * base, const size_t mem
   return (void*)base;
 }
 
-static uint8_t vector_hash_peer( ot_peer *peer, int bucket_count ) {
-  unsigned int hash = 5381, i = OT_PEER_COMPARE_SIZE;
-  uint8_t *p = (uint8_t*)peer;
-  while( i-- ) hash += (hash<<5) + *(p++);
-  return hash % bucket_count;
-}
-
 /* This is the generic insert operation for our vector type.
    It tries to locate the object at "key" with size "member_size" by comparing its first "compare_size" bytes with
    those of objects in vector. Our special "binary_search" function does that and either returns the match or a
@@ -82,185 +73,333 @@ void *vector_find_or_insert( ot_vector *vector, void *key, size_t member_size, s
   return match;
 }
 
-ot_peer *vector_find_or_insert_peer( ot_vector *vector, ot_peer *peer, int *exactmatch ) {
-  ot_peer *match;
+/* Peers of a torrent live densely in a vector per address family, in no
+   particular order. Peers are peer_size bytes long, address and port make
+   up all but the last two bytes. Small swarms are simply scanned, swarms
+   of more than OT_PEER_INDEX_MINCOUNT peers get an open addressing hash
+   index with linear probing. Its entries hold a tag from the top bits of
+   the peer's hash in the top byte and the peer's position plus one below,
+   zero marks an empty slot. Probes do not wrap around but may run
+   OT_PEER_INDEX_SLACK slots past the last home slot.
+   Growing or shrinking the index never rehashes all peers at once: the old
+   table is kept and each following insert or remove moves a few of its
+   slots over, lookups meanwhile check both tables. */
+struct ot_peer_index {
+  uint32_t *slots[2];    /* current table and the old one being migrated */
+  size_t    capacity[2];
+  size_t    used[2];
+  size_t    migrated;    /* slots of the old table below this are empty */
+};
+
+#define OT_PEER_INDEX_POS(entry) ( ( (entry) & 0xffffff ) - 1 )
+
+static uint64_t vector_hash_peer( const uint8_t *peer, size_t peer_size ) {
+  return index_hash( peer, OT_PEER_COMPARE_SIZE_FROM_PEER_SIZE( peer_size ) );
+}
 
-  /* If space is zero but size is set, we're dealing with a list of vector->size buckets */
-  if( vector->space < vector->size )
-    vector = ((ot_vector*)vector->data) + vector_hash_peer(peer, vector->size );
-  match = (ot_peer*)binary_search( peer, vector->data, vector->size, sizeof(ot_peer), OT_PEER_COMPARE_SIZE, exactmatch );
+/* One extra slot stays empty and ends every probe */
+static uint32_t *peer_table_alloc( size_t capacity ) {
+  uint32_t *slots = slab_alloc( ( capacity + OT_PEER_INDEX_SLACK + 1 ) * sizeof( uint32_t ) );
+  if( slots ) memset( slots, 0, ( capacity + OT_PEER_INDEX_SLACK + 1 ) * sizeof( uint32_t ) );
+  return slots;
+}
 
-  if( *exactmatch ) return match;
+static void peer_table_free( uint32_t *slots, size_t capacity ) {
+  slab_free( slots, ( capacity + OT_PEER_INDEX_SLACK + 1 ) * sizeof( uint32_t ) );
+}
 
-  if( vector->size + 1 > vector->space ) {
-    size_t   new_space = vector->space ? OT_VECTOR_GROW_RATIO * vector->space : OT_VECTOR_MIN_MEMBERS;
-    ot_peer *new_data = realloc( vector->data, new_space * sizeof(ot_peer) );
-    if( !new_data ) return NULL;
-    /* Adjust pointer if it moved by realloc */
-    match = new_data + (match - (ot_peer*)vector->data);
+static void peer_index_free( ot_peerset *set ) {
+  ot_peer_index *index = set->index;
+  int t;
 
-    vector->data = new_data;
-    vector->space = new_space;
-  }
-  memmove( match + 1, match, sizeof(ot_peer) * ( ((ot_peer*)vector->data) + vector->size - match ) );
+  if( !index ) return;
+  for( t=0; t<2; ++t )
+    if( index->slots[t] )
+      peer_table_free( index->slots[t], index->capacity[t] );
+  slab_free( index, sizeof( ot_peer_index ) );
+  set->index = NULL;
+}
 
-  vector->size++;
-  return match;
+/* Returns the slot holding peer in table t, or -1 */
+static ssize_t peer_table_find( const ot_peer_index *index, int t, const uint8_t *peers, const uint8_t *peer, size_t peer_size, uint64_t hash ) {
+  const uint32_t *slots = index->slots[t];
+  uint32_t        entry, tag = (uint32_t)( hash >> 56 ) << 24;
+  size_t          slot = hash & ( index->capacity[t] - 1 );
+
+  if( t && slot < index->migrated )
+    slot = index->migrated;
+  for( ; ( entry = slots[slot] ); ++slot )
+    if( ( entry & 0xff000000 ) == tag &&
+        !memcmp( peers + OT_PEER_INDEX_POS( entry ) * peer_size, peer, OT_PEER_COMPARE_SIZE_FROM_PEER_SIZE( peer_size ) ) )
+      return slot;
+  return -1;
 }
 
-/* This is the non-generic delete from vector-operation specialized for peers in pools.
-   It returns 0 if no peer was found (and thus not removed)
-              1 if a non-seeding peer was removed
-              2 if a seeding peer was removed
-*/
-int vector_remove_peer( ot_vector *vector, ot_peer *peer ) {
-  int      exactmatch;
-  ot_peer *match, *end;
+static ssize_t peer_index_find( const ot_peerset *set, const uint8_t *peer, size_t peer_size, uint64_t hash, int *t ) {
+  ssize_t slot;
+  for( *t=0; *t<2; ++*t )
+    if( set->index->slots[*t] && ( slot = peer_table_find( set->index, *t, set->peers.data, peer, peer_size, hash ) ) >= 0 )
+      return slot;
+  return -1;
+}
 
-  if( !vector->size ) return 0;
+/* New peers always go to the current table */
+static int peer_table_insert( ot_peer_index *index, uint64_t hash, size_t pos ) {
+  uint32_t *slots = index->slots[0];
+  size_t    slot = hash & ( index->capacity[0] - 1 );
+
+  while( slots[slot] ) ++slot;
+  if( slot >= index->capacity[0] + OT_PEER_INDEX_SLACK )
+    return -1;
+  slots[slot] = ( (uint32_t)( hash >> 56 ) << 24 ) | ( pos + 1 );
+  index->used[0]++;
+  return 0;
+}
+
+/* Backward shift deletion, see index_erase_slot */
+static void peer_table_erase( ot_peer_index *index, int t, const uint8_t *peers, size_t peer_size, size_t slot ) {
+  uint32_t *slots = index->slots[t];
+  size_t    next;
 
-  /* If space is zero but size is set, we're dealing with a list of vector->size buckets */
-  if( vector->space < vector->size )
-    vector = ((ot_vector*)vector->data) + vector_hash_peer(peer, vector->size );
+  for( next = slot + 1; slots[next]; ++next )
+    if( ( vector_hash_peer( peers + OT_PEER_INDEX_POS( slots[next] ) * peer_size, peer_size ) & ( index->capacity[t] - 1 ) ) <= slot ) {
+      slots[slot] = slots[next];
+      slot = next;
+    }
+  slots[slot] = 0;
+  index->used[t]--;
+}
 
-  end = ((ot_peer*)vector->data) + vector->size;
-  match = (ot_peer*)binary_search( peer, vector->data, vector->size, sizeof(ot_peer), OT_PEER_COMPARE_SIZE, &exactmatch );
-  if( !exactmatch ) return 0;
+/* Builds a fresh index for all peers at once. This is where small swarms
+   get their index, and the fallback if anything goes wrong with the
+   incremental path. Without memory, peers are simply scanned again. */
+static void peer_index_rebuild( ot_peerset *set, size_t peer_size ) {
+  const uint8_t *peers = set->peers.data;
+  ot_peer_index *index;
+  size_t         capacity = OT_PEER_INDEX_MIN_CAPACITY, pos;
 
-  exactmatch = ( OT_PEERFLAG( match ) & PEER_FLAG_SEEDING ) ? 2 : 1;
-  memmove( match, match + 1, sizeof(ot_peer) * ( end - match - 1 ) );
+  peer_index_free( set );
+  while( capacity < 2 * set->peers.size )
+    capacity *= 2;
 
-  vector->size--;
-  vector_fixup_peers( vector );
-  return exactmatch;
+  if( !( index = slab_alloc( sizeof( ot_peer_index ) ) ) )
+    return;
+  memset( index, 0, sizeof( ot_peer_index ) );
+  set->index = index;
+
+  while( 1 ) {
+    if( !( index->slots[0] = peer_table_alloc( capacity ) ) )
+      return peer_index_free( set );
+    index->capacity[0] = capacity;
+    index->used[0] = 0;
+
+    for( pos=0; pos<set->peers.size; ++pos )
+      if( peer_table_insert( index, vector_hash_peer( peers + pos * peer_size, peer_size ), pos ) )
+        break;
+    if( pos == set->peers.size )
+      return;
+
+    peer_table_free( index->slots[0], capacity );
+    index->slots[0] = NULL;
+    capacity *= 2;
+  }
 }
 
-void vector_remove_torrent( ot_vector *vector, ot_torrent *match ) {
-  ot_torrent *end = ((ot_torrent*)vector->data) + vector->size;
+/* Moves up to steps slots of the old table over to the current one */
+static int peer_index_migrate( ot_peerset *set, size_t peer_size, size_t steps ) {
+  ot_peer_index *index = set->index;
+  const uint8_t *peers = set->peers.data;
+  uint32_t      *old = index->slots[1];
+  size_t         end = index->capacity[1] + OT_PEER_INDEX_SLACK;
+
+  if( !old ) return 0;
+
+  for( ; steps && index->migrated < end; --steps, ++index->migrated ) {
+    uint32_t entry = old[index->migrated];
+    size_t   pos = OT_PEER_INDEX_POS( entry );
+    if( !entry ) continue;
+    if( peer_table_insert( index, vector_hash_peer( peers + pos * peer_size, peer_size ), pos ) )
+      return -1;
+    old[index->migrated] = 0;
+    index->used[1]--;
+  }
+
+  if( index->migrated == end ) {
+    peer_table_free( old, index->capacity[1] );
+    index->slots[1] = NULL;
+    index->capacity[1] = index->used[1] = 0;
+  }
+  return 0;
+}
 
-  if( !vector->size ) return;
+/* Makes the current table the old one and starts over with a new, empty
+   one. A migration still running is finished first. */
+static int peer_index_resize( ot_peerset *set, size_t peer_size, size_t capacity ) {
+  ot_peer_index *index = set->index;
+  uint32_t      *slots;
+
+  if( peer_index_migrate( set, peer_size, (size_t)-1 ) || !( slots = peer_table_alloc( capacity ) ) )
+    return -1;
+
+  index->slots[1]    = index->slots[0];
+  index->capacity[1] = index->capacity[0];
+  index->used[1]     = index->used[0];
+  index->slots[0]    = slots;
+  index->capacity[0] = capacity;
+  index->used[0]     = 0;
+  index->migrated    = 0;
+  return 0;
+}
 
-  /* If this is being called after a unsuccessful malloc() for peer_list
-     in add_peer_to_torrent, match->peer_list actually might be NULL */
-  if( match->peer_list) free_peerlist( match->peer_list );
+static ssize_t vector_find_peer( const ot_peerset *set, const uint8_t *peer, size_t peer_size, uint64_t hash ) {
+  const uint8_t *peers = set->peers.data;
+  ssize_t        pos;
 
-  memmove( match, match + 1, sizeof(ot_torrent) * ( end - match - 1 ) );
-  if( ( --vector->size * OT_VECTOR_SHRINK_THRESH < vector->space ) && ( vector->space >= OT_VECTOR_SHRINK_RATIO * OT_VECTOR_MIN_MEMBERS ) ) {
-    vector->space /= OT_VECTOR_SHRINK_RATIO;
-    vector->data = realloc( vector->data, vector->space * sizeof( ot_torrent ) );
+  if( set->index ) {
+    int t;
+    if( ( pos = peer_index_find( set, peer, peer_size, hash, &t ) ) >= 0 )
+      pos = OT_PEER_INDEX_POS( set->index->slots[t][pos] );
+    return pos;
   }
-}
 
-void vector_clean_list( ot_vector * vector, int num_buckets ) {
-  while( num_buckets-- )
-    free( vector[num_buckets].data );
-  free( vector );
-  return;
+  for( pos=0; pos<(ssize_t)set->peers.size; ++pos )
+    if( !memcmp( peers + pos * peer_size, peer, OT_PEER_COMPARE_SIZE_FROM_PEER_SIZE( peer_size ) ) )
+      return pos;
+  return -1;
 }
 
-void vector_redistribute_buckets( ot_peerlist * peer_list ) {
-  int tmp, bucket, bucket_size_new, num_buckets_new, num_buckets_old = 1;
-  ot_vector * bucket_list_new, * bucket_list_old = &peer_list->peers;
+/* This is the non-generic find or insert operation for peers in a peer set.
+   New peers are appended and their address and port are copied already.
+   If resizing the vector failed, NULL is returned, else the pointer to the
+   peer in vector.
+*/
+ot_peer *vector_find_or_insert_peer( ot_peerset *set, const ot_peer *peer, size_t peer_size, int *exactmatch ) {
+  ot_vector     *vector = &set->peers;
+  ot_peer_index *index  = set->index;
+  uint8_t       *peers  = vector->data;
+  uint64_t       hash   = index ? vector_hash_peer( (const uint8_t*)peer, peer_size ) : 0;
+  ssize_t        pos    = vector_find_peer( set, (const uint8_t*)peer, peer_size, hash );
+
+  if( ( *exactmatch = ( pos >= 0 ) ) )
+    return (ot_peer*)( peers + pos * peer_size );
+
+  if( vector->size >= OT_PEER_INDEX_MAXCOUNT )
+    return NULL;
 
-  if( OT_PEERLIST_HASBUCKETS( peer_list ) ) {
-    num_buckets_old = peer_list->peers.size;
-    bucket_list_old = peer_list->peers.data;
+  if( vector->size + 1 > vector->space ) {
+    size_t new_space = vector->space ? OT_VECTOR_GROW_RATIO * vector->space : OT_VECTOR_MIN_MEMBERS;
+    if( !( peers = slab_realloc( vector->data, vector->space * peer_size, new_space * peer_size ) ) )
+      return NULL;
+    vector->data = peers;
+    vector->space = new_space;
   }
 
-  if( peer_list->peer_count < 255 )
-    num_buckets_new = 1;
-  else if( peer_list->peer_count > 8192 )
-    num_buckets_new = 64;
-  else if( peer_list->peer_count >= 512 && peer_list->peer_count < 4096 )
-    num_buckets_new = 16;
-  else if( peer_list->peer_count < 512 && num_buckets_old <= 16 )
-    num_buckets_new = num_buckets_old;
-  else if( peer_list->peer_count < 512 )
-    num_buckets_new = 1;
-  else if( peer_list->peer_count < 8192 && num_buckets_old > 1 )
-    num_buckets_new = num_buckets_old;
-  else
-    num_buckets_new = 16;
-
-  if( num_buckets_new == num_buckets_old )
-    return;
+  pos = vector->size++;
+  memcpy( peers + pos * peer_size, peer, peer_size );
 
-  /* Assume near perfect distribution */
-  bucket_list_new = malloc( num_buckets_new * sizeof( ot_vector ) );
-  if( !bucket_list_new) return;
-  bzero( bucket_list_new, num_buckets_new * sizeof( ot_vector ) );
-
-  tmp = peer_list->peer_count / num_buckets_new;
-  bucket_size_new = OT_VECTOR_MIN_MEMBERS;
-  while( bucket_size_new < tmp)
-    bucket_size_new *= OT_VECTOR_GROW_RATIO;
-
-  /* preallocate vectors to hold all peers */
-  for( bucket=0; bucket<num_buckets_new; ++bucket ) {
-    bucket_list_new[bucket].space = bucket_size_new;
-    bucket_list_new[bucket].data  = malloc( bucket_size_new * sizeof(ot_peer) );
-    if( !bucket_list_new[bucket].data )
-      return vector_clean_list( bucket_list_new, num_buckets_new );
+  if( !index ) {
+    if( vector->size > OT_PEER_INDEX_MINCOUNT )
+      peer_index_rebuild( set, peer_size );
+    return (ot_peer*)( peers + pos * peer_size );
   }
 
-  /* Now sort them into the correct bucket */
-  for( bucket=0; bucket<num_buckets_old; ++bucket ) {
-    ot_peer * peers_old = bucket_list_old[bucket].data, * peers_new;
-    int peer_count_old = bucket_list_old[bucket].size;
-    while( peer_count_old-- ) {
-      ot_vector * bucket_dest = bucket_list_new;
-      if( num_buckets_new > 1 )
-        bucket_dest += vector_hash_peer(peers_old, num_buckets_new);
-      if( bucket_dest->size + 1 > bucket_dest->space ) {
-        void * tmp = realloc( bucket_dest->data, sizeof(ot_peer) * OT_VECTOR_GROW_RATIO * bucket_dest->space );
-        if( !tmp ) return vector_clean_list( bucket_list_new, num_buckets_new );
-        bucket_dest->data   = tmp;
-        bucket_dest->space *= OT_VECTOR_GROW_RATIO;
-      }
-      peers_new = (ot_peer*)bucket_dest->data;
-      memcpy(peers_new + bucket_dest->size++, peers_old++, sizeof(ot_peer));
-    }
+  /* Keep the load factor below 3/4, the new table takes over gradually */
+  if( ( 4 * ( index->used[0] + index->used[1] + 1 ) > 3 * index->capacity[0] &&
+        peer_index_resize( set, peer_size, 2 * index->capacity[0] ) ) ||
+      peer_table_insert( index, hash, pos ) ||
+      peer_index_migrate( set, peer_size, OT_PEER_INDEX_MIGRATE ) )
+    peer_index_rebuild( set, peer_size );
+  return (ot_peer*)( peers + pos * peer_size );
+}
+
+/* Removes the peer at pos. The last peer moves into the hole, so when
+   iterating, look at the same position again */
+void vector_remove_peer_at( ot_peerset *set, size_t pos, size_t peer_size ) {
+  ot_vector     *vector = &set->peers;
+  ot_peer_index *index  = set->index;
+  uint8_t       *peers  = vector->data;
+  size_t         last   = vector->size - 1;
+
+  if( index ) {
+    ssize_t slot;
+    int     t;
+    if( ( slot = peer_index_find( set, peers + pos * peer_size, peer_size, vector_hash_peer( peers + pos * peer_size, peer_size ), &t ) ) >= 0 )
+      peer_table_erase( index, t, peers, peer_size, slot );
+    if( pos != last && ( slot = peer_index_find( set, peers + last * peer_size, peer_size, vector_hash_peer( peers + last * peer_size, peer_size ), &t ) ) >= 0 )
+      index->slots[t][slot] = ( index->slots[t][slot] & 0xff000000 ) | ( pos + 1 );
   }
 
-  /* Now sort each bucket to later allow bsearch */
-  for( bucket=0; bucket<num_buckets_new; ++bucket )
-    qsort( bucket_list_new[bucket].data, bucket_list_new[bucket].size, sizeof( ot_peer ), vector_compare_peer );
-
-  /* Everything worked fine. Now link new bucket_list to peer_list */
-  if( OT_PEERLIST_HASBUCKETS( peer_list) )
-    vector_clean_list( (ot_vector*)peer_list->peers.data, peer_list->peers.size );
-  else
-    free( peer_list->peers.data );
-
-  if( num_buckets_new > 1 ) {
-    peer_list->peers.data  = bucket_list_new;
-    peer_list->peers.size  = num_buckets_new;
-    peer_list->peers.space = 0; /* Magic marker for "is list of buckets" */
-  } else {
-    peer_list->peers.data  = bucket_list_new->data;
-    peer_list->peers.size  = bucket_list_new->size;
-    peer_list->peers.space = bucket_list_new->space;
-    free( bucket_list_new );
+  if( pos != last )
+    memcpy( peers + pos * peer_size, peers + last * peer_size, peer_size );
+  vector->size = last;
+
+  if( index ) {
+    if( vector->size < OT_PEER_INDEX_MINCOUNT / 2 )
+      peer_index_free( set );
+    else if( ( index->capacity[0] > OT_PEER_INDEX_MIN_CAPACITY ) && ( 8 * ( index->used[0] + index->used[1] ) < index->capacity[0] ) ) {
+      if( peer_index_resize( set, peer_size, index->capacity[0] / 2 ) )
+        peer_index_rebuild( set, peer_size );
+    } else if( peer_index_migrate( set, peer_size, OT_PEER_INDEX_MIGRATE ) )
+      peer_index_rebuild( set, peer_size );
   }
+
+  vector_fixup_peers( vector, peer_size );
 }
 
-void vector_fixup_peers( ot_vector * vector ) {
-  int need_fix = 0;
+/* This is the non-generic delete from vector-operation specialized for peers in pools.
+   It returns 0 if no peer was found (and thus not removed)
+              1 if a non-seeding peer was removed
+              2 if a seeding peer was removed
+*/
+int vector_remove_peer( ot_peerset *set, const ot_peer *peer, size_t peer_size ) {
+  ssize_t pos = vector_find_peer( set, (const uint8_t*)peer, peer_size, set->index ? vector_hash_peer( (const uint8_t*)peer, peer_size ) : 0 );
+  int     seeding;
+
+  if( pos < 0 ) return 0;
+
+  seeding = OT_PEERFLAG_D( (uint8_t*)set->peers.data + pos * peer_size, peer_size ) & PEER_FLAG_SEEDING;
+  vector_remove_peer_at( set, pos, peer_size );
+  return seeding ? 2 : 1;
+}
+
+/* After peers were moved in bulk, positions in the index are void */
+void vector_reindex_peers( ot_peerset *set, size_t peer_size ) {
+  if( set->index ) {
+    if( set->peers.size < OT_PEER_INDEX_MINCOUNT / 2 )
+      peer_index_free( set );
+    else
+      peer_index_rebuild( set, peer_size );
+  }
+  vector_fixup_peers( &set->peers, peer_size );
+}
+
+void vector_free_peers( ot_peerset *set, size_t peer_size ) {
+  peer_index_free( set );
+  slab_free( set->peers.data, set->peers.space * peer_size );
+  memset( &set->peers, 0, sizeof( ot_vector ) );
+}
+
+void vector_fixup_peers( ot_vector * vector, size_t peer_size ) {
+  size_t new_space = vector->space;
+  void  *new_data;
 
   if( !vector->size ) {
-    free( vector->data );
+    slab_free( vector->data, vector->space * peer_size );
     vector->data = NULL;
     vector->space = 0;
     return;
   }
 
-  while( ( vector->size * OT_VECTOR_SHRINK_THRESH < vector->space ) &&
-         ( vector->space >= OT_VECTOR_SHRINK_RATIO * OT_VECTOR_MIN_MEMBERS ) ) {
-    vector->space /= OT_VECTOR_SHRINK_RATIO;
-    need_fix++;
+  while( ( vector->size * OT_VECTOR_SHRINK_THRESH < new_space ) &&
+         ( new_space >= OT_VECTOR_SHRINK_RATIO * OT_VECTOR_MIN_MEMBERS ) )
+    new_space /= OT_VECTOR_SHRINK_RATIO;
+
+  /* If shrinking fails, just keep the larger vector */
+  if( new_space != vector->space &&
+      ( new_data = slab_realloc( vector->data, vector->space * peer_size, new_space * peer_size ) ) ) {
+    vector->data  = new_data;
+    vector->space = new_space;
   }
-  if( need_fix )
-    vector->data = realloc( vector->data, vector->space * sizeof( ot_peer ) );
 }
 
 const char *g_version_vector_c = "$Source: /home/cvsroot/opentracker/ot_vector.c,v $: $Revision: 1.19 $\n";
@@ -12,8 +12,14 @@
 #define OT_VECTOR_SHRINK_THRESH 4
 #define OT_VECTOR_SHRINK_RATIO  2
 
-#define OT_PEER_BUCKET_MINCOUNT 512
-#define OT_PEER_BUCKET_MAXCOUNT 256
+/* These defines control the peer index of large swarms */
+#define OT_PEER_INDEX_MINCOUNT     16
+#define OT_PEER_INDEX_MIN_CAPACITY 32
+#define OT_PEER_INDEX_SLACK        32
+#define OT_PEER_INDEX_MIGRATE      16
+#define OT_PEER_INDEX_MAXCOUNT     0xffffff
+
+typedef struct ot_peer_index ot_peer_index;
 
 typedef struct {
   void   *data;
@@ -21,14 +27,22 @@ typedef struct {
   size_t  space;
 } ot_vector;
 
+/* The peers of one address family in a torrent */
+typedef struct {
+  ot_vector      peers;
+  ot_peer_index *index;
+  ot_replycache *reply_cache;
+} ot_peerset;
+
 void    *binary_search( const void * const key, const void * base, const size_t member_count, const size_t member_size,
                         size_t compare_size, int *exactmatch );
 void    *vector_find_or_insert( ot_vector *vector, void *key, size_t member_size, size_t compare_size, int *exactmatch );
-ot_peer *vector_find_or_insert_peer( ot_vector *vector, ot_peer *peer, int *exactmatch );
+ot_peer *vector_find_or_insert_peer( ot_peerset *set, const ot_peer *peer, size_t peer_size, int *exactmatch );
 
-int      vector_remove_peer( ot_vector *vector, ot_peer *peer );
-void     vector_remove_torrent( ot_vector *vector, ot_torrent *match );
-void     vector_redistribute_buckets( ot_peerlist * peer_list );
-void     vector_fixup_peers( ot_vector * vector );
+int      vector_remove_peer( ot_peerset *set, const ot_peer *peer, size_t peer_size );
+void     vector_remove_peer_at( ot_peerset *set, size_t pos, size_t peer_size );
+void     vector_reindex_peers( ot_peerset *set, size_t peer_size );
+void     vector_free_peers( ot_peerset *set, size_t peer_size );
+void     vector_fixup_peers( ot_vector * vector, size_t peer_size );
 
 #endif
@@ -30,6 +30,7 @@
 #include "trackerlogic.h"
 #include "ot_vector.h"
 #include "ot_mutex.h"
+#include "ot_slab.h"
 #include "ot_stats.h"
 
 #ifndef WANT_SYNC_LIVE
@@ -41,7 +42,6 @@ ot_ip6   g_serverip;
 uint16_t g_serverport = 9009;
 uint32_t g_tracker_id;
 char     groupip_1[4] = { 224,0,23,5 };
-int      g_self_pipe[2];
 
 /* If you have more than 10 peers, don't use this proxy
    Use 20 slots for 10 peers to have room for 10 incoming connection slots
@@ -121,21 +121,19 @@ void livesync_bind_mcast( ot_ip6 ip, uint16_t port) {
 }
 
 size_t add_peer_to_torrent_proxy( ot_hash hash, ot_peer *peer ) {
-  int         exactmatch;
-  ot_torrent *torrent;
-  ot_peer    *peer_dest;
-  ot_vector  *torrents_list = mutex_bucket_lock_by_hash( hash );
+  int              exactmatch;
+  ot_torrent      *torrent;
+  ot_peer         *peer_dest;
+  ot_torrent_list *torrents_list = mutex_bucket_lock_by_hash( hash );
 
-  torrent = vector_find_or_insert( torrents_list, (void*)hash, sizeof( ot_torrent ), OT_HASH_COMPARE_SIZE, &exactmatch );
+  torrent = index_find_or_insert_torrent( torrents_list, hash, &exactmatch );
   if( !torrent )
     return -1;
 
   if( !exactmatch ) {
     /* Create a new torrent entry, then */
-    memcpy( torrent->hash, hash, sizeof(ot_hash) );
-
-    if( !( torrent->peer_list = malloc( sizeof (ot_peerlist) ) ) ) {
-      vector_remove_torrent( torrents_list, torrent );
+    if( !( torrent->peer_list = slab_alloc( sizeof (ot_peerlist) ) ) ) {
+      index_remove_torrent( torrents_list, torrent );
       mutex_bucket_unlock_by_hash( hash, 0 );
       return -1;
     }
@@ -144,7 +142,8 @@ size_t add_peer_to_torrent_proxy( ot_hash hash, ot_peer *peer ) {
   }
 
   /* Check for peer in torrent */
-  peer_dest = vector_find_or_insert_peer( &(torrent->peer_list->peers), peer, &exactmatch );
+  /* The proxy only relays peers, so they all stay in their wire layout */
+  peer_dest = vector_find_or_insert_peer( torrent->peer_list->families + OT_PEER_FAMILY_V6, peer, OT_PEER_SIZE6, &exactmatch );
   if( !peer_dest ) {
     mutex_bucket_unlock_by_hash( hash, 0 );
     return -1;
@@ -164,13 +163,12 @@ size_t add_peer_to_torrent_proxy( ot_hash hash, ot_peer *peer ) {
 }
 
 size_t remove_peer_from_torrent_proxy( ot_hash hash, ot_peer *peer ) {
-  int          exactmatch;
-  ot_vector   *torrents_list = mutex_bucket_lock_by_hash( hash );
-  ot_torrent  *torrent = binary_search( hash, torrents_list->data, torrents_list->size, sizeof( ot_torrent ), OT_HASH_COMPARE_SIZE, &exactmatch );
+  ot_torrent_list *torrents_list = mutex_bucket_lock_by_hash( hash );
+  ot_torrent      *torrent = index_find_torrent( torrents_list, hash );
 
-  if( exactmatch ) {
+  if( torrent ) {
     ot_peerlist *peer_list = torrent->peer_list;
-    switch( vector_remove_peer( &peer_list->peers, peer ) ) {
+    switch( vector_remove_peer( peer_list->families + OT_PEER_FAMILY_V6, peer, OT_PEER_SIZE6 ) ) {
       case 2:  peer_list->seed_count--; /* Fall throughs intended */
       case 1:  peer_list->peer_count--; /* Fall throughs intended */
       default: break;
@@ -182,16 +180,8 @@ size_t remove_peer_from_torrent_proxy( ot_hash hash, ot_peer *peer ) {
 }
 
 void free_peerlist( ot_peerlist *peer_list ) {
-  if( peer_list->peers.data ) {
-    if( OT_PEERLIST_HASBUCKETS( peer_list ) ) {
-      ot_vector *bucket_list = (ot_vector*)(peer_list->peers.data);
-
-      while( peer_list->peers.size-- )
-        free( bucket_list++->data );
-    }
-    free( peer_list->peers.data );
-  }
-  free( peer_list );
+  vector_free_peers( peer_list->families + OT_PEER_FAMILY_V6, OT_PEER_SIZE6 );
+  slab_free( peer_list, sizeof( ot_peerlist ) );
 }
 
 static void livesync_handle_peersync( ssize_t datalen ) {
@@ -554,6 +544,7 @@ int main( int argc, char **argv ) {
 
   srandom( time(NULL) );
   g_tracker_id = random();
+  index_init( );
   noipv6=1;
 
   while( scanon ) {
@@ -599,7 +590,7 @@ static void * streamsync_worker( void * args ) {
     /* For each bucket... */
     for( bucket=0; bucket<OT_BUCKET_COUNT; ++bucket ) {
       /* Get exclusive access to that bucket */
-      ot_vector *torrents_list = mutex_bucket_lock( bucket );
+      ot_torrent_list *torrents_list = mutex_bucket_lock( bucket );
       size_t tor_offset, count_def = 0, count_one = 0, count_two = 0, count_peers = 0;
       size_t mem, mem_a = 0, mem_b = 0;
       uint8_t *ptr = 0, *ptr_a, *ptr_b, *ptr_c;
@@ -663,7 +654,7 @@ static void * streamsync_worker( void * args ) {
         /* Address torrents members */
         ot_torrent *torrent = ((ot_torrent*)(torrents_list->data)) + tor_offset;
         ot_peerlist *peer_list = torrent->peer_list;
-        ot_peer *peers = (ot_peer*)(peer_list->peers.data);
+        ot_peer *peers = (ot_peer*)(peer_list->families[OT_PEER_FAMILY_V6].peers.data);
         uint8_t **dst;
 
         /* Determine destination slot */
@@ -692,14 +683,13 @@ static void * streamsync_worker( void * args ) {
         /* Copy peers */
         count_peers = peer_list->peer_count;
         while( count_peers-- ) {
-          memcpy( *dst, peers++, OT_IP_SIZE + 3 );
-          *dst += OT_IP_SIZE + 3;
+          memcpy( *dst, peers++, OT_IP_SIZE6 + 3 );
+          *dst += OT_IP_SIZE6 + 3;
         }
         free_peerlist(peer_list);
       }
 
-      free( torrents_list->data );
-      memset( torrents_list, 0, sizeof(*torrents_list ) );
+      index_free( torrents_list );
 unlock_continue:
       mutex_bucket_unlock( bucket, 0 );
 
@@ -786,7 +776,7 @@ printf( "type: %hhu, prefix: %02X, torrentcount: %zd\n", peer->packet_type, peer
     }
 
     /* Ensure size for a minimal torrent block */
-    if( data + sizeof(ot_hash) + OT_IP_SIZE + 3 > dataend ) break;
+    if( data + sizeof(ot_hash) + OT_IP_SIZE6 + 3 > dataend ) break;
 
     /* Advance pointer to peer count or peers */
     hash = data;
@@ -803,13 +793,13 @@ printf( "type: %hhu, prefix: %02X, torrentcount: %zd\n", peer->packet_type, peer
 printf( "peers: %zd\n", peers );
 #endif
     /* Ensure enough data being read to hold all peers */
-    if( data + (OT_IP_SIZE + 3) * peers > dataend ) {
+    if( data + (OT_IP_SIZE6 + 3) * peers > dataend ) {
       data = hash;
       break;
     }
     while( peers-- ) {
       livesync_proxytell( peer->packet_tprefix, hash, data );
-      data += OT_IP_SIZE + 3;
+      data += OT_IP_SIZE6 + 3;
     }
     --peer->packet_tcount;
   }
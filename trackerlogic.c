@@ -11,74 +11,118 @@
 #include <unistd.h>
 #include <errno.h>
 #include <stdint.h>
+#include <time.h>
 
 /* Libowfat */
 #include "byte.h"
 #include "io.h"
 #include "iob.h"
 #include "array.h"
+#include "ip6.h"
 
 /* Opentracker */
 #include "trackerlogic.h"
 #include "ot_mutex.h"
+#include "ot_slab.h"
+#include "ot_random.h"
 #include "ot_stats.h"
 #include "ot_clean.h"
 #include "ot_http.h"
 #include "ot_accesslist.h"
 #include "ot_fullscrape.h"
 #include "ot_livesync.h"
+#include "ot_snapshot.h"
+
+/* A cached peer sample, see OT_REPLYCACHE_MIN_PEERS. TCP and UDP replies
+   carry the same compact peer strings, so both protocols share samples. */
+typedef struct {
+  uint64_t expires;
+  size_t   uses;
+} ot_replycache_sample;
+
+/* The samples' peers follow, their size depends on the address family */
+struct ot_replycache {
+  size_t               next;
+  ot_replycache_sample samples[OT_REPLYCACHE_SAMPLES];
+  uint8_t              peers[];
+};
+
+#define OT_REPLYCACHE_SAMPLE_SIZE(peer_size) (OT_REPLYCACHE_PEERS*OT_PEER_COMPARE_SIZE_FROM_PEER_SIZE(peer_size))
+#define OT_REPLYCACHE_SIZE(peer_size) (sizeof(ot_replycache)+OT_REPLYCACHE_SAMPLES*OT_REPLYCACHE_SAMPLE_SIZE(peer_size))
 
 /* Forward declaration */
-size_t return_peers_for_torrent( ot_torrent *torrent, size_t amount, char *reply, PROTO_FLAG proto );
+size_t return_peers_for_torrent( ot_torrent *torrent, int family, ot_peer *self, size_t amount, char *reply, PROTO_FLAG proto );
 
-void free_peerlist( ot_peerlist *peer_list ) {
-  if( peer_list->peers.data ) {
-    if( OT_PEERLIST_HASBUCKETS( peer_list ) ) {
-      ot_vector *bucket_list = (ot_vector*)(peer_list->peers.data);
+static void release_peerlist( void *peer_list ) {
+  slab_free( peer_list, sizeof( ot_peerlist ) );
+}
 
-      while( peer_list->peers.size-- )
-        free( bucket_list++->data );
-    }
-    free( peer_list->peers.data );
+static void replycache_free( ot_peerset *set, size_t peer_size ) {
+  slab_free( set->reply_cache, OT_REPLYCACHE_SIZE( peer_size ) );
+  set->reply_cache = NULL;
+}
+
+int peer_family( const ot_peer *peer ) {
+  return ip6_isv4mapped( peer->data ) ? OT_PEER_FAMILY_V4 : OT_PEER_FAMILY_V6;
+}
+
+void free_peerlist( ot_peerlist *peer_list ) {
+  int family;
+  for( family=0; family<OT_PEER_FAMILIES; ++family ) {
+    vector_free_peers( peer_list->families + family, OT_PEER_SIZE_FOR_FAMILY( family ) );
+    replycache_free( peer_list->families + family, OT_PEER_SIZE_FOR_FAMILY( family ) );
   }
-  free( peer_list );
+  /* Lock free scrapers may still be reading the counters */
+  mutex_retire( peer_list, release_peerlist );
 }
 
 void add_torrent_from_saved_state( ot_hash hash, ot_time base, size_t down_count ) {
-  int         exactmatch;
-  ot_torrent *torrent;
-  ot_vector  *torrents_list = mutex_bucket_lock_by_hash( hash );
+  int              exactmatch;
+  ot_torrent      *torrent;
+  ot_torrent_list *torrents_list = mutex_bucket_lock_by_hash( hash );
 
-  if( !accesslist_hashisvalid( hash ) )
+  if( !accesslist_hashisvalid( hash ) || index_find_idle( torrents_list, hash ) )
     return mutex_bucket_unlock_by_hash( hash, 0 );
-  
-  torrent = vector_find_or_insert( torrents_list, (void*)hash, sizeof( ot_torrent ), OT_HASH_COMPARE_SIZE, &exactmatch );
+
+  /* Without peers, torrents only need to be remembered for their
+     completed count */
+  if( down_count && g_now_minutes - base <= OT_TORRENT_TIMEOUT && !index_find_torrent( torrents_list, hash ) ) {
+    if( !index_insert_idle( torrents_list, hash, base, down_count ) ) {
+      clean_schedule_idle( index_find_idle( torrents_list, hash ) );
+      return mutex_bucket_unlock_by_hash( hash, 1 );
+    }
+  }
+
+  torrent = index_find_or_insert_torrent( torrents_list, hash, &exactmatch );
   if( !torrent || exactmatch )
     return mutex_bucket_unlock_by_hash( hash, 0 );
 
   /* Create a new torrent entry, then */
-  memcpy( torrent->hash, hash, sizeof(ot_hash) );
-    
-  if( !( torrent->peer_list = malloc( sizeof (ot_peerlist) ) ) ) {
-    vector_remove_torrent( torrents_list, torrent );
+  if( !( torrent->peer_list = slab_alloc( sizeof (ot_peerlist) ) ) ) {
+    index_remove_torrent( torrents_list, torrent );
     return mutex_bucket_unlock_by_hash( hash, 0 );
   }
     
   byte_zero( torrent->peer_list, sizeof( ot_peerlist ) );
   torrent->peer_list->base = base;
+  torrent->peer_list->changed = g_now_seconds;
   torrent->peer_list->down_count = down_count;
+  clean_schedule_torrent( torrent, g_now_minutes );
 
   return mutex_bucket_unlock_by_hash( hash, 1 );
 }
 
-size_t add_peer_to_torrent_and_return_peers( PROTO_FLAG proto, struct ot_workstruct *ws, size_t amount ) {
-  int         exactmatch, delta_torrentcount = 0;
-  ot_torrent *torrent;
-  ot_peer    *peer_dest;
-  ot_vector  *torrents_list = mutex_bucket_lock_by_hash( *ws->hash );
+/* The caller holds the lock of the torrent's bucket and accounts for
+   torrents added in *delta_torrentcount */
+static size_t add_peer_to_torrent_locked( ot_torrent_list *torrents_list, PROTO_FLAG proto, struct ot_workstruct *ws, size_t amount, int *delta_torrentcount ) {
+  int              exactmatch;
+  int              family = peer_family( &ws->peer );
+  size_t           peer_size = OT_PEER_SIZE_FOR_FAMILY( family );
+  ot_peer         *peer_src = (ot_peer*)OT_PEER_COMPACT( &ws->peer, family );
+  ot_torrent      *torrent;
+  ot_peer         *peer_dest;
 
   if( !accesslist_hashisvalid( *ws->hash ) ) {
-    mutex_bucket_unlock_by_hash( *ws->hash, 0 );
     if( proto == FLAG_TCP ) {
       const char invalid_hash[] = "d14:failure reason63:Requested download is not authorized for use with this tracker.e";
       memcpy( ws->reply, invalid_hash, strlen( invalid_hash ) );
@@ -87,35 +131,39 @@ size_t add_peer_to_torrent_and_return_peers( PROTO_FLAG proto, struct ot_workstr
     return 0;
   }
 
-  torrent = vector_find_or_insert( torrents_list, (void*)ws->hash, sizeof( ot_torrent ), OT_HASH_COMPARE_SIZE, &exactmatch );
-  if( !torrent ) {
-    mutex_bucket_unlock_by_hash( *ws->hash, 0 );
+  torrent = index_find_or_insert_torrent( torrents_list, *ws->hash, &exactmatch );
+  if( !torrent )
     return 0;
-  }
 
   if( !exactmatch ) {
-    /* Create a new torrent entry, then */
-    memcpy( torrent->hash, *ws->hash, sizeof(ot_hash) );
+    ot_idle_torrent *idle;
 
-    if( !( torrent->peer_list = malloc( sizeof (ot_peerlist) ) ) ) {
-      vector_remove_torrent( torrents_list, torrent );
-      mutex_bucket_unlock_by_hash( *ws->hash, 0 );
+    /* Create a new torrent entry, then */
+    if( !( torrent->peer_list = slab_alloc( sizeof (ot_peerlist) ) ) ) {
+      index_remove_torrent( torrents_list, torrent );
       return 0;
     }
 
     byte_zero( torrent->peer_list, sizeof( ot_peerlist ) );
-    delta_torrentcount = 1;
+
+    /* An idle torrent comes back to life, it has been counted already */
+    if( ( idle = index_find_idle( torrents_list, *ws->hash ) ) ) {
+      torrent->peer_list->down_count = idle->down_count;
+      index_remove_idle( torrents_list, idle );
+    } else
+      ++*delta_torrentcount;
+
+    /* Its only peer times out first */
+    clean_schedule_torrent( torrent, g_now_minutes + OT_PEER_TIMEOUT );
   } else
     clean_single_torrent( torrent );
 
   torrent->peer_list->base = g_now_minutes;
 
   /* Check for peer in torrent */
-  peer_dest = vector_find_or_insert_peer( &(torrent->peer_list->peers), &ws->peer, &exactmatch );
-  if( !peer_dest ) {
-    mutex_bucket_unlock_by_hash( *ws->hash, delta_torrentcount );
+  peer_dest = vector_find_or_insert_peer( torrent->peer_list->families + family, peer_src, peer_size, &exactmatch );
+  if( !peer_dest )
     return 0;
-  }
 
   /* Tell peer that it's fresh */
   OT_PEERTIME( &ws->peer ) = 0;
@@ -135,6 +183,7 @@ size_t add_peer_to_torrent_and_return_peers( PROTO_FLAG proto, struct ot_workstr
 #endif
 
     torrent->peer_list->peer_count++;
+    torrent->peer_list->changed = g_now_seconds;
     if( OT_PEERFLAG(&ws->peer) & PEER_FLAG_COMPLETED ) {
       torrent->peer_list->down_count++;
       stats_issue_event( EVENT_COMPLETED, 0, (uintptr_t)ws );
@@ -143,135 +192,234 @@ size_t add_peer_to_torrent_and_return_peers( PROTO_FLAG proto, struct ot_workstr
       torrent->peer_list->seed_count++;
 
   } else {
-    stats_issue_event( EVENT_RENEW, 0, OT_PEERTIME( peer_dest ) );
+    stats_issue_event( EVENT_RENEW, 0, OT_PEERTIME_D( peer_dest, peer_size ) );
 #ifdef WANT_SPOT_WOODPECKER
-    if( ( OT_PEERTIME(peer_dest) > 0 ) && ( OT_PEERTIME(peer_dest) < 20 ) )
+    if( ( OT_PEERTIME_D( peer_dest, peer_size ) > 0 ) && ( OT_PEERTIME_D( peer_dest, peer_size ) < 20 ) )
       stats_issue_event( EVENT_WOODPECKER, 0, (uintptr_t)&ws->peer );
 #endif
 #ifdef WANT_SYNC_LIVE
     /* Won't live sync peers that come back too fast. Only exception:
        fresh "completed" reports */
     if( proto != FLAG_MCA ) {
-      if( OT_PEERTIME( peer_dest ) > OT_CLIENT_SYNC_RENEW_BOUNDARY ||
-         ( !(OT_PEERFLAG(peer_dest) & PEER_FLAG_COMPLETED ) && (OT_PEERFLAG(&ws->peer) & PEER_FLAG_COMPLETED ) ) )
+      if( OT_PEERTIME_D( peer_dest, peer_size ) > OT_CLIENT_SYNC_RENEW_BOUNDARY ||
+         ( !(OT_PEERFLAG_D( peer_dest, peer_size ) & PEER_FLAG_COMPLETED ) && (OT_PEERFLAG(&ws->peer) & PEER_FLAG_COMPLETED ) ) )
         livesync_tell( ws );
     }
 #endif
 
-    if(  (OT_PEERFLAG(peer_dest) & PEER_FLAG_SEEDING )   && !(OT_PEERFLAG(&ws->peer) & PEER_FLAG_SEEDING ) )
+    /* Seeding or completed flags flipping change the counters */
+    if( ( OT_PEERFLAG_D( peer_dest, peer_size ) ^ OT_PEERFLAG(&ws->peer) ) & PEER_FLAG_SEEDING ||
+        ( ~OT_PEERFLAG_D( peer_dest, peer_size ) & OT_PEERFLAG(&ws->peer) & PEER_FLAG_COMPLETED ) )
+      torrent->peer_list->changed = g_now_seconds;
+    if(  (OT_PEERFLAG_D( peer_dest, peer_size ) & PEER_FLAG_SEEDING )   && !(OT_PEERFLAG(&ws->peer) & PEER_FLAG_SEEDING ) )
       torrent->peer_list->seed_count--;
-    if( !(OT_PEERFLAG(peer_dest) & PEER_FLAG_SEEDING )   &&  (OT_PEERFLAG(&ws->peer) & PEER_FLAG_SEEDING ) )
+    if( !(OT_PEERFLAG_D( peer_dest, peer_size ) & PEER_FLAG_SEEDING )   &&  (OT_PEERFLAG(&ws->peer) & PEER_FLAG_SEEDING ) )
       torrent->peer_list->seed_count++;
-    if( !(OT_PEERFLAG(peer_dest) & PEER_FLAG_COMPLETED ) &&  (OT_PEERFLAG(&ws->peer) & PEER_FLAG_COMPLETED ) ) {
+    if( !(OT_PEERFLAG_D( peer_dest, peer_size ) & PEER_FLAG_COMPLETED ) &&  (OT_PEERFLAG(&ws->peer) & PEER_FLAG_COMPLETED ) ) {
       torrent->peer_list->down_count++;
       stats_issue_event( EVENT_COMPLETED, 0, (uintptr_t)ws );
     }
-    if(   OT_PEERFLAG(peer_dest) & PEER_FLAG_COMPLETED )
+    if(   OT_PEERFLAG_D( peer_dest, peer_size ) & PEER_FLAG_COMPLETED )
       OT_PEERFLAG( &ws->peer ) |= PEER_FLAG_COMPLETED;
   }
 
-  memcpy( peer_dest, &ws->peer, sizeof(ot_peer) );
+  memcpy( peer_dest, peer_src, peer_size );
 #ifdef WANT_SYNC
-  if( proto == FLAG_MCA ) {
-    mutex_bucket_unlock_by_hash( *ws->hash, delta_torrentcount );
+  if( proto == FLAG_MCA )
     return 0;
-  }
 #endif
 
-  ws->reply_size = return_peers_for_torrent( torrent, amount, ws->reply, proto );
+  return ws->reply_size = return_peers_for_torrent( torrent, family, peer_dest, amount, ws->reply, proto );
+}
+
+size_t add_peer_to_torrent_and_return_peers( PROTO_FLAG proto, struct ot_workstruct *ws, size_t amount ) {
+  int              delta_torrentcount = 0;
+  ot_torrent_list *torrents_list = mutex_bucket_lock_by_hash( *ws->hash );
+  size_t           reply_size = add_peer_to_torrent_locked( torrents_list, proto, ws, amount, &delta_torrentcount );
+
   mutex_bucket_unlock_by_hash( *ws->hash, delta_torrentcount );
-  return ws->reply_size;
+  return reply_size;
 }
 
-static size_t return_peers_all( ot_peerlist *peer_list, char *reply ) {
-  unsigned int bucket, num_buckets = 1;
-  ot_vector  * bucket_list = &peer_list->peers;
-  size_t       result = OT_PEER_COMPARE_SIZE * peer_list->peer_count;
+static size_t return_peers_all( ot_peerset *set, size_t peer_size, uint8_t *self, char *reply ) {
+  uint8_t    * peers = set->peers.data;
+  size_t       peer_count = set->peers.size;
+  size_t       compare_size = OT_PEER_COMPARE_SIZE_FROM_PEER_SIZE( peer_size );
+  size_t       result = compare_size * ( peer_count - ( self != NULL ) );
   char       * r_end = reply + result;
 
-  if( OT_PEERLIST_HASBUCKETS(peer_list) ) {
-    num_buckets = bucket_list->size;
-    bucket_list = (ot_vector *)bucket_list->data;
-  }
-
-  for( bucket = 0; bucket<num_buckets; ++bucket ) {
-    ot_peer * peers = (ot_peer*)bucket_list[bucket].data;
-    size_t    peer_count = bucket_list[bucket].size;
-    while( peer_count-- ) {
-      if( OT_PEERFLAG(peers) & PEER_FLAG_SEEDING ) {
-        r_end-=OT_PEER_COMPARE_SIZE;
-        memcpy(r_end,peers++,OT_PEER_COMPARE_SIZE);      
-      } else {
-        memcpy(reply,peers++,OT_PEER_COMPARE_SIZE);
-        reply+=OT_PEER_COMPARE_SIZE;
-      }
+  for( ; peer_count--; peers += peer_size ) {
+    if( peers == self )
+      continue;
+    if( OT_PEERFLAG_D(peers,peer_size) & PEER_FLAG_SEEDING ) {
+      r_end-=compare_size;
+      memcpy(r_end,peers,compare_size);
+    } else {
+      memcpy(reply,peers,compare_size);
+      reply+=compare_size;
     }
   }
   return result;
 }
 
-static size_t return_peers_selection( ot_peerlist *peer_list, size_t amount, char *reply ) {
-  unsigned int bucket_offset, bucket_index = 0, num_buckets = 1;
-  ot_vector  * bucket_list = &peer_list->peers;
-  unsigned int shifted_pc = peer_list->peer_count;
-  unsigned int shifted_step = 0;
-  unsigned int shift = 0;
-  size_t       result = OT_PEER_COMPARE_SIZE * amount;
+/* Draws amount peers in a single pass. All peers but self are split into
+   amount equally sized ranges, each range contributes the peer at a random
+   offset. Rotating by a random amount keeps range boundaries from always
+   separating the same peers. */
+static size_t return_peers_selection( ot_peerset *set, size_t peer_size, uint8_t *self, size_t amount, char *reply ) {
+  uint8_t    * peers = set->peers.data;
+  uint64_t     candidates = set->peers.size - ( self != NULL );
+  uint64_t     self_pos = self ? (uint64_t)( self - peers ) / peer_size : candidates;
+  uint64_t     rotation = random_below( candidates ), i;
+  size_t       compare_size = OT_PEER_COMPARE_SIZE_FROM_PEER_SIZE( peer_size );
+  size_t       result = compare_size * amount;
   char       * r_end = reply + result;
-  
-  if( OT_PEERLIST_HASBUCKETS(peer_list) ) {
-    num_buckets = bucket_list->size;
-    bucket_list = (ot_vector *)bucket_list->data;
+
+  for( i=0; i<amount; ++i ) {
+    uint64_t lo = i * candidates / amount, hi = ( i + 1 ) * candidates / amount;
+    uint64_t pos = lo + random_below( hi - lo ) + rotation;
+    uint8_t *peer;
+
+    if( pos >= candidates )
+      pos -= candidates;
+    if( pos >= self_pos )
+      ++pos;
+    peer = peers + pos * peer_size;
+
+    if( OT_PEERFLAG_D(peer,peer_size) & PEER_FLAG_SEEDING ) {
+      r_end-=compare_size;
+      memcpy(r_end,peer,compare_size);
+    } else {
+      memcpy(reply,peer,compare_size);
+      reply+=compare_size;
+    }
   }
+  return result;
+}
 
-  /* Make fixpoint arithmetic as exact as possible */
-#define MAXPRECBIT (1<<(8*sizeof(int)-3))
-  while( !(shifted_pc & MAXPRECBIT ) ) { shifted_pc <<= 1; shift++; }
-  shifted_step = shifted_pc/amount;
-#undef MAXPRECBIT
+static uint64_t replycache_now( void ) {
+  struct timespec now;
+#ifdef CLOCK_MONOTONIC_COARSE
+  clock_gettime( CLOCK_MONOTONIC_COARSE, &now );
+#else
+  clock_gettime( CLOCK_MONOTONIC, &now );
+#endif
+  return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
 
-  /* Initialize somewhere in the middle of peers so that
-   fixpoint's aliasing doesn't alway miss the same peers */
-  bucket_offset = random() % peer_list->peer_count;
+/* Picks the next sample of a hot swarm's cache, redrawing it if it is
+   stale, and returns its peers. Returns NULL, if the swarm does not
+   qualify or memory is short */
+static uint8_t *replycache_sample( ot_peerset *set, size_t peer_size, PROTO_FLAG proto ) {
+  ot_replycache        *cache = set->reply_cache;
+  ot_replycache_sample *sample;
+  size_t                compare_size = OT_PEER_COMPARE_SIZE_FROM_PEER_SIZE( peer_size );
+  uint8_t              *peers;
+  uint64_t              now;
+  size_t                i, index;
+
+  if( !g_replycache_min_peers || set->peers.size < g_replycache_min_peers || set->peers.size <= OT_REPLYCACHE_PEERS ) {
+    /* Some slack, so swarms around the limit do not keep reallocating */
+    if( cache && ( !g_replycache_min_peers || set->peers.size < g_replycache_min_peers / 2 ) )
+      replycache_free( set, peer_size );
+    return NULL;
+  }
 
-  while( amount-- ) {
-    ot_peer * peer;
+  if( !cache ) {
+    if( !( cache = slab_alloc( OT_REPLYCACHE_SIZE( peer_size ) ) ) )
+      return NULL;
+    memset( cache, 0, OT_REPLYCACHE_SIZE( peer_size ) );
+    set->reply_cache = cache;
+  }
 
-    /* This is the aliased, non shifted range, next value may fall into */
-    unsigned int diff = ( ( ( amount + 1 ) * shifted_step ) >> shift ) -
-                        ( (   amount       * shifted_step ) >> shift );
-    bucket_offset += 1 + random() % diff;
+  index = cache->next++ % OT_REPLYCACHE_SAMPLES;
+  sample = cache->samples + index;
+  peers = cache->peers + index * OT_REPLYCACHE_SAMPLE_SIZE( peer_size );
+  now = replycache_now( );
+  if( sample->uses < OT_REPLYCACHE_USES && now < sample->expires ) {
+    sample->uses++;
+    stats_issue_event( EVENT_REPLYCACHE_HIT, proto, 0 );
+    return peers;
+  }
+  stats_issue_event( EVENT_REPLYCACHE_MISS, proto, 0 );
+
+  /* Announces copy a window at a random offset, so shuffle the sample */
+  return_peers_selection( set, peer_size, NULL, OT_REPLYCACHE_PEERS, (char*)peers );
+  for( i=OT_REPLYCACHE_PEERS-1; i>0; --i ) {
+    uint8_t tmp[OT_PEER_SIZE6], *a = peers + i * compare_size;
+    uint8_t *b = peers + random_below( i + 1 ) * compare_size;
+    memcpy( tmp, a, compare_size );
+    memcpy( a, b, compare_size );
+    memcpy( b, tmp, compare_size );
+  }
+  sample->uses = 1;
+  sample->expires = now + OT_REPLYCACHE_MSEC;
+  return peers;
+}
 
-    while( bucket_offset >= bucket_list[bucket_index].size ) {
-      bucket_offset -= bucket_list[bucket_index].size;
-      bucket_index = ( bucket_index + 1 ) % num_buckets;
-    }
-    peer = ((ot_peer*)bucket_list[bucket_index].data) + bucket_offset;
-    if( OT_PEERFLAG(peer) & PEER_FLAG_SEEDING ) {
-      r_end-=OT_PEER_COMPARE_SIZE;
-      memcpy(r_end,peer,OT_PEER_COMPARE_SIZE);      
-    } else {
-      memcpy(reply,peer,OT_PEER_COMPARE_SIZE);
-      reply+=OT_PEER_COMPARE_SIZE;
+/* Copies amount peers from a sample, leaving out self. The sample holds
+   more peers than anyone may ask for, so there always are enough */
+static size_t replycache_copy( uint8_t *sample, size_t peer_size, uint8_t *self, size_t amount, char *reply ) {
+  size_t compare_size = OT_PEER_COMPARE_SIZE_FROM_PEER_SIZE( peer_size );
+  size_t pos = random_below( OT_REPLYCACHE_PEERS ), left = amount;
+
+  while( left ) {
+    uint8_t *peer = sample + pos * compare_size;
+    if( !self || memcmp( peer, self, compare_size ) ) {
+      memcpy( reply, peer, compare_size );
+      reply += compare_size;
+      --left;
     }
+    if( ++pos == OT_REPLYCACHE_PEERS )
+      pos = 0;
   }
-  return result;
+  return compare_size * amount;
+}
+
+static size_t return_peers_for_family( ot_peerset *set, size_t peer_size, uint8_t *self, size_t amount, char *reply, PROTO_FLAG proto ) {
+  uint8_t *sample;
+
+  if( !amount )
+    return 0;
+  if( amount == set->peers.size - ( self != NULL ) )
+    return return_peers_all( set, peer_size, self, reply );
+  if( amount < OT_REPLYCACHE_PEERS && ( sample = replycache_sample( set, peer_size, proto ) ) )
+    return replycache_copy( sample, peer_size, self, amount, reply );
+  return return_peers_selection( set, peer_size, self, amount, reply );
 }
 
 /* Compiles a list of random peers for a torrent
-   * reply must have enough space to hold 92+6*amount bytes
-   * does not yet check not to return self
+   * reply must have enough space to hold 104+18*amount bytes
+   * self, if not NULL, is the requesting peer of the given family and
+     never returned
+   TCP replies split amount between both families by their share of the
+   swarm, UDP replies only carry peers of the requesting peer's family.
 */
-size_t return_peers_for_torrent( ot_torrent *torrent, size_t amount, char *reply, PROTO_FLAG proto ) {
+size_t return_peers_for_torrent( ot_torrent *torrent, int family, ot_peer *self, size_t amount, char *reply, PROTO_FLAG proto ) {
   ot_peerlist *peer_list = torrent->peer_list;
   char        *r = reply;
+  size_t       candidates[OT_PEER_FAMILIES], amounts[OT_PEER_FAMILIES], total = 0;
+  int          f;
+
+  for( f=0; f<OT_PEER_FAMILIES; ++f ) {
+    candidates[f] = peer_list->families[f].peers.size - ( f == family && self );
+    if( proto == FLAG_TCP || f == family )
+      total += candidates[f];
+    else
+      candidates[f] = 0;
+  }
 
-  if( amount > peer_list->peer_count )
-    amount = peer_list->peer_count;
+  if( amount >= total )
+    memcpy( amounts, candidates, sizeof( amounts ) );
+  else {
+    /* Rounding down for IPv6 never leaves IPv4 with more than it has */
+    amounts[OT_PEER_FAMILY_V6] = amount * candidates[OT_PEER_FAMILY_V6] / total;
+    amounts[OT_PEER_FAMILY_V4] = amount - amounts[OT_PEER_FAMILY_V6];
+  }
 
   if( proto == FLAG_TCP ) {
     int erval = OT_CLIENT_REQUEST_INTERVAL_RANDOM;
-    r += sprintf( r, "d8:completei%zde10:downloadedi%zde10:incompletei%zde8:intervali%ie12:min intervali%ie" PEERS_BENCODED "%zd:", peer_list->seed_count, peer_list->down_count, peer_list->peer_count-peer_list->seed_count, erval, erval/2, OT_PEER_COMPARE_SIZE*amount );
+    r += sprintf( r, "d8:completei%zde10:downloadedi%zde10:incompletei%zde8:intervali%ie12:min intervali%ie", peer_list->seed_count, peer_list->down_count, peer_list->peer_count-peer_list->seed_count, erval, erval/2 );
   } else {
     *(uint32_t*)(r+0) = htonl( OT_CLIENT_REQUEST_INTERVAL_RANDOM );
     *(uint32_t*)(r+4) = htonl( peer_list->peer_count - peer_list->seed_count );
@@ -279,11 +427,16 @@ size_t return_peers_for_torrent( ot_torrent *torrent, size_t amount, char *reply
     r += 12;
   }
 
-  if( amount ) {
-    if( amount == peer_list->peer_count )
-      r += return_peers_all( peer_list, r );
-    else
-      r += return_peers_selection( peer_list, amount, r );
+  for( f=0; f<OT_PEER_FAMILIES; ++f ) {
+    size_t peer_size = OT_PEER_SIZE_FOR_FAMILY( f );
+    if( proto == FLAG_TCP ) {
+      /* peers is always there for clients that expect it, peers6 only if needed */
+      if( f == OT_PEER_FAMILY_V4 )
+        r += sprintf( r, "5:peers%zd:", OT_PEER_COMPARE_SIZE_FROM_PEER_SIZE( peer_size ) * amounts[f] );
+      else if( amounts[f] )
+        r += sprintf( r, "6:peers6%zd:", OT_PEER_COMPARE_SIZE_FROM_PEER_SIZE( peer_size ) * amounts[f] );
+    }
+    r += return_peers_for_family( peer_list->families + f, peer_size, f == family ? (uint8_t*)self : NULL, amounts[f], r, proto );
   }
 
   if( proto == FLAG_TCP )
@@ -292,56 +445,126 @@ size_t return_peers_for_torrent( ot_torrent *torrent, size_t amount, char *reply
   return r - reply;
 }
 
-/* Fetches scrape info for a specific torrent */
-size_t return_udp_scrape_for_torrent( ot_hash hash, char *reply ) {
-  int          exactmatch, delta_torrentcount = 0;
-  ot_vector   *torrents_list = mutex_bucket_lock_by_hash( hash );
-  ot_torrent  *torrent = binary_search( hash, torrents_list->data, torrents_list->size, sizeof( ot_torrent ), OT_HASH_COMPARE_SIZE, &exactmatch );
+/* Copies a torrent's scrape counters, unless it has expired. Expiry itself
+   is left to the cleaner, readers only pretend it already happened */
+static int scrape_copy_counters( ot_peerlist *peer_list, size_t *counts ) {
+  ot_time timedout = (ot_time)( g_now_minutes - peer_list->base );
 
-  if( !exactmatch ) {
-    memset( reply, 0, 12);
+  if( timedout > OT_TORRENT_TIMEOUT )
+    return 0;
+
+  if( timedout > OT_PEER_TIMEOUT ) {
+    if( !peer_list->down_count )
+      return 0;
+    counts[0] = counts[2] = 0;
   } else {
-    uint32_t *r = (uint32_t*) reply;
+    counts[0] = peer_list->seed_count;
+    counts[2] = peer_list->peer_count - peer_list->seed_count;
+  }
+  counts[1] = peer_list->down_count;
+  return 1;
+}
 
-    if( clean_single_torrent( torrent ) ) {
-      vector_remove_torrent( torrents_list, torrent );
-      memset( reply, 0, 12);
-      delta_torrentcount = -1;
-    } else {
-      r[0] = htonl( torrent->peer_list->seed_count );
-      r[1] = htonl( torrent->peer_list->down_count );
-      r[2] = htonl( torrent->peer_list->peer_count-torrent->peer_list->seed_count );
+/* Idle torrents have no seeds and leechers, only completed counts */
+static int scrape_copy_idle_counters( const ot_idle_torrent *idle, size_t *counts ) {
+  if( !idle || OT_IDLE_AGE( idle ) > OT_TORRENT_TIMEOUT )
+    return 0;
+  counts[0] = counts[2] = 0;
+  counts[1] = idle->down_count;
+  return 1;
+}
+
+static int scrape_counters_locked( ot_torrent_list *torrents_list, ot_hash hash, size_t *counts ) {
+  ot_torrent *torrent = index_find_torrent( torrents_list, hash );
+  if( torrent )
+    return scrape_copy_counters( torrent->peer_list, counts );
+  return scrape_copy_idle_counters( index_find_idle( torrents_list, hash ), counts );
+}
+
+/* Looks up seeds, completed and leechers for a torrent without taking the
+   bucket lock. Falls back to locking, if writers keep interfering */
+static int scrape_counters_for_torrent( ot_hash hash, size_t *counts ) {
+  int              bucket = OT_BUCKET_BY_HASH( hash ), epoch = mutex_epoch_enter( ), found, tries;
+  ot_torrent_list *torrents_list;
+
+  for( tries=0; tries<OT_SCRAPE_READ_TRIES; ++tries ) {
+    unsigned int     seq;
+    ot_torrent_list  snapshot = *mutex_bucket_read_begin( bucket, &seq );
+    ot_torrent      *torrent;
+    ot_peerlist     *peer_list;
+
+    if( mutex_bucket_read_retry( bucket, seq ) ) continue;
+
+    torrent = index_find_torrent( &snapshot, hash );
+    peer_list = torrent ? torrent->peer_list : NULL;
+    if( mutex_bucket_read_retry( bucket, seq ) ) continue;
+    if( !peer_list ) {
+      found = scrape_copy_idle_counters( index_find_idle( &snapshot, hash ), counts );
+      if( mutex_bucket_read_retry( bucket, seq ) ) continue;
+      mutex_epoch_leave( epoch );
+      return found;
     }
+
+    found = scrape_copy_counters( peer_list, counts );
+    if( mutex_bucket_read_retry( bucket, seq ) ) continue;
+
+    mutex_epoch_leave( epoch );
+    return found;
+  }
+  mutex_epoch_leave( epoch );
+
+  /* Never block on a bucket lock while inside an epoch */
+  torrents_list = mutex_bucket_lock( bucket );
+  found = scrape_counters_locked( torrents_list, hash, counts );
+  mutex_bucket_unlock( bucket, 0 );
+  return found;
+}
+
+/* Fetches scrape info for a list of torrents */
+size_t return_udp_scrape_for_torrent( ot_hash *hash_list, int amount, char *reply ) {
+  ot_batch_entry entries[amount > 0 ? amount : 1];
+  uint32_t      *r = (uint32_t*) reply;
+  int            i;
+
+  for( i=0; i<amount; ++i ) {
+    entries[i].action = OT_BATCH_SCRAPE;
+    entries[i].hash   = hash_list + i;
   }
-  mutex_bucket_unlock_by_hash( hash, delta_torrentcount );
-  return 12;
+  process_batch( entries, amount );
+
+  for( i=0; i<amount; ++i, r+=3 )
+    if( !entries[i].found ) {
+      memset( r, 0, 12 );
+    } else {
+      r[0] = htonl( entries[i].counts[0] );
+      r[1] = htonl( entries[i].counts[1] );
+      r[2] = htonl( entries[i].counts[2] );
+    }
+  return 12 * amount;
 }
 
-/* Fetches scrape info for a specific torrent */
+/* Fetches scrape info for a list of torrents */
 size_t return_tcp_scrape_for_torrent( ot_hash *hash_list, int amount, char *reply ) {
-  char *r = reply;
-  int   exactmatch, i;
+  ot_batch_entry entries[amount > 0 ? amount : 1];
+  char          *r = reply;
+  int            i;
+
+  for( i=0; i<amount; ++i ) {
+    entries[i].action = OT_BATCH_SCRAPE;
+    entries[i].hash   = hash_list + i;
+  }
+  process_batch( entries, amount );
 
   r += sprintf( r, "d5:filesd" );
 
   for( i=0; i<amount; ++i ) {
-    int          delta_torrentcount = 0;
-    ot_hash     *hash = hash_list + i;
-    ot_vector   *torrents_list = mutex_bucket_lock_by_hash( *hash );
-    ot_torrent  *torrent = binary_search( hash, torrents_list->data, torrents_list->size, sizeof( ot_torrent ), OT_HASH_COMPARE_SIZE, &exactmatch );
-
-    if( exactmatch ) {
-      if( clean_single_torrent( torrent ) ) {
-        vector_remove_torrent( torrents_list, torrent );
-        delta_torrentcount = -1;
-      } else {
-        *r++='2';*r++='0';*r++=':';
-        memcpy( r, hash, sizeof(ot_hash) ); r+=sizeof(ot_hash);
-        r += sprintf( r, "d8:completei%zde10:downloadedi%zde10:incompletei%zdee",
-          torrent->peer_list->seed_count, torrent->peer_list->down_count, torrent->peer_list->peer_count-torrent->peer_list->seed_count );
-      }
+    ot_hash *hash = hash_list + i;
+
+    if( entries[i].found ) {
+      *r++='2';*r++='0';*r++=':';
+      memcpy( r, hash, sizeof(ot_hash) ); r+=sizeof(ot_hash);
+      r += sprintf( r, "d8:completei%zde10:downloadedi%zde10:incompletei%zdee", entries[i].counts[0], entries[i].counts[1], entries[i].counts[2] );
     }
-    mutex_bucket_unlock_by_hash( *hash, delta_torrentcount );
   }
 
   *r++ = 'e'; *r++ = 'e';
@@ -349,11 +572,9 @@ size_t return_tcp_scrape_for_torrent( ot_hash *hash_list, int amount, char *repl
 }
 
 static ot_peerlist dummy_list;
-size_t remove_peer_from_torrent( PROTO_FLAG proto, struct ot_workstruct *ws ) {
-  int          exactmatch;
-  ot_vector   *torrents_list = mutex_bucket_lock_by_hash( *ws->hash );
-  ot_torrent  *torrent = binary_search( ws->hash, torrents_list->data, torrents_list->size, sizeof( ot_torrent ), OT_HASH_COMPARE_SIZE, &exactmatch );
-  ot_peerlist *peer_list = &dummy_list;
+static size_t remove_peer_from_torrent_locked( ot_torrent_list *torrents_list, PROTO_FLAG proto, struct ot_workstruct *ws ) {
+  ot_torrent      *torrent = index_find_torrent( torrents_list, *ws->hash );
+  ot_peerlist     *peer_list = &dummy_list;
 
 #ifdef WANT_SYNC_LIVE
   if( proto != FLAG_MCA ) {
@@ -362,18 +583,24 @@ size_t remove_peer_from_torrent( PROTO_FLAG proto, struct ot_workstruct *ws ) {
   }
 #endif
 
-  if( exactmatch ) {
+  if( torrent ) {
+    int family = peer_family( &ws->peer );
     peer_list = torrent->peer_list;
-    switch( vector_remove_peer( &peer_list->peers, &ws->peer ) ) {
+    switch( vector_remove_peer( peer_list->families + family, (ot_peer*)OT_PEER_COMPACT( &ws->peer, family ), OT_PEER_SIZE_FOR_FAMILY( family ) ) ) {
       case 2:  peer_list->seed_count--; /* Fall throughs intended */
-      case 1:  peer_list->peer_count--; /* Fall throughs intended */
+      case 1:  peer_list->peer_count--;
+               peer_list->changed = g_now_seconds; /* Fall throughs intended */
       default: break;
     }
+
+    /* The last peer left, the cleaner demotes the torrent right away */
+    if( !peer_list->peer_count )
+      clean_schedule_torrent( torrent, g_now_minutes );
   }
 
   if( proto == FLAG_TCP ) {
     int erval = OT_CLIENT_REQUEST_INTERVAL_RANDOM;
-    ws->reply_size = sprintf( ws->reply, "d8:completei%zde10:incompletei%zde8:intervali%ie12:min intervali%ie" PEERS_BENCODED "0:e", peer_list->seed_count, peer_list->peer_count - peer_list->seed_count, erval, erval / 2 );
+    ws->reply_size = sprintf( ws->reply, "d8:completei%zde10:incompletei%zde8:intervali%ie12:min intervali%ie5:peers0:e", peer_list->seed_count, peer_list->peer_count - peer_list->seed_count, erval, erval / 2 );
   }
 
   /* Handle UDP reply */
@@ -384,16 +611,79 @@ size_t remove_peer_from_torrent( PROTO_FLAG proto, struct ot_workstruct *ws ) {
     ws->reply_size = 20;
   }
 
-  mutex_bucket_unlock_by_hash( *ws->hash, 0 );
   return ws->reply_size;
 }
 
+size_t remove_peer_from_torrent( PROTO_FLAG proto, struct ot_workstruct *ws ) {
+  ot_torrent_list *torrents_list = mutex_bucket_lock_by_hash( *ws->hash );
+  size_t           reply_size = remove_peer_from_torrent_locked( torrents_list, proto, ws );
+
+  mutex_bucket_unlock_by_hash( *ws->hash, 0 );
+  return reply_size;
+}
+
+static ot_hash *batch_hash( const ot_batch_entry *entry ) {
+  return entry->action == OT_BATCH_SCRAPE ? entry->hash : entry->ws->hash;
+}
+
+/* Orders by bucket, entries of the same bucket keep their order */
+static int batch_compare( const void *a, const void *b ) {
+  const ot_batch_entry *entry_a = *(const ot_batch_entry**)a, *entry_b = *(const ot_batch_entry**)b;
+  int bucket_a = OT_BUCKET_BY_HASH( *batch_hash( entry_a ) ), bucket_b = OT_BUCKET_BY_HASH( *batch_hash( entry_b ) );
+
+  if( bucket_a != bucket_b )
+    return bucket_a - bucket_b;
+  return ( entry_a > entry_b ) - ( entry_a < entry_b );
+}
+
+/* Works through a batch of requests, taking each bucket lock only once.
+   Buckets with nothing but scrapes are not locked at all */
+void process_batch( ot_batch_entry *entries, size_t count ) {
+  ot_batch_entry *order[count ? count : 1];
+  size_t          i, j, k;
+
+  for( i=0; i<count; ++i )
+    order[i] = entries + i;
+  qsort( order, count, sizeof( *order ), batch_compare );
+
+  for( i=0; i<count; i=j ) {
+    int              bucket = OT_BUCKET_BY_HASH( *batch_hash( order[i] ) ), writes = 0, delta_torrentcount = 0;
+    ot_torrent_list *torrents_list;
+
+    for( j=i; j<count && OT_BUCKET_BY_HASH( *batch_hash( order[j] ) ) == bucket; ++j )
+      writes |= order[j]->action != OT_BATCH_SCRAPE;
+
+    if( !writes ) {
+      for( k=i; k<j; ++k )
+        order[k]->found = scrape_counters_for_torrent( *order[k]->hash, order[k]->counts );
+      continue;
+    }
+
+    torrents_list = mutex_bucket_lock( bucket );
+    for( k=i; k<j; ++k ) {
+      ot_batch_entry *entry = order[k];
+      switch( entry->action ) {
+        case OT_BATCH_SCRAPE:
+          entry->found = scrape_counters_locked( torrents_list, *entry->hash, entry->counts );
+          break;
+        case OT_BATCH_ANNOUNCE:
+          if( OT_PEERFLAG( &entry->ws->peer ) & PEER_FLAG_STOPPED )
+            entry->ws->reply_size = remove_peer_from_torrent_locked( torrents_list, entry->proto, entry->ws );
+          else
+            entry->ws->reply_size = add_peer_to_torrent_locked( torrents_list, entry->proto, entry->ws, entry->amount, &delta_torrentcount );
+          break;
+      }
+    }
+    mutex_bucket_unlock( bucket, delta_torrentcount );
+  }
+}
+
 void iterate_all_torrents( int (*for_each)( ot_torrent* torrent, uintptr_t data ), uintptr_t data ) {
   int bucket;
   size_t j;
 
   for( bucket=0; bucket<OT_BUCKET_COUNT; ++bucket ) {
-    ot_vector  *torrents_list = mutex_bucket_lock( bucket );
+    ot_torrent_list *torrents_list = mutex_bucket_lock( bucket );
     ot_torrent *torrents = (ot_torrent*)(torrents_list->data);
 
     for( j=0; j<torrents_list->size; ++j )
@@ -413,6 +703,8 @@ void exerr( char * message ) {
 void trackerlogic_init( ) {
   srandom( time(NULL) );
   g_tracker_id = random();
+  random_init( );
+  index_init( );
 
   if( !g_stats_path )
     g_stats_path = "stats";
@@ -425,23 +717,28 @@ void trackerlogic_init( ) {
   accesslist_init( );
   livesync_init( );
   stats_init( );
+  snapshot_init( );
 }
 
 void trackerlogic_deinit( void ) {
   int bucket, delta_torrentcount = 0;
   size_t j;
 
+  /* Keep the torrents for the next start */
+  snapshot_deinit( );
+
   /* Free all torrents... */
   for(bucket=0; bucket<OT_BUCKET_COUNT; ++bucket ) {
-    ot_vector *torrents_list = mutex_bucket_lock( bucket );
+    ot_torrent_list *torrents_list = mutex_bucket_lock( bucket );
     if( torrents_list->size ) {
       for( j=0; j<torrents_list->size; ++j ) {
         ot_torrent *torrent = ((ot_torrent*)(torrents_list->data)) + j;
         free_peerlist( torrent->peer_list );
         delta_torrentcount -= 1;
       }
-      free( torrents_list->data );
     }
+    delta_torrentcount -= torrents_list->idle.size;
+    index_free( torrents_list );
     mutex_bucket_unlock( bucket, delta_torrentcount );
   }
 
@@ -16,25 +16,20 @@ typedef time_t  ot_time;
 typedef char    ot_ip6[16];
 typedef struct { ot_ip6 address; int bits; }
                 ot_net;
-#ifdef WANT_V6
-#define OT_IP_SIZE 16
-#define PEERS_BENCODED "6:peers6"
-#else
-#define OT_IP_SIZE 4
-#define PEERS_BENCODED "5:peers"
-#endif
+#define OT_IP_SIZE4 4
+#define OT_IP_SIZE6 16
 
 /* Some tracker behaviour tunable */
 #define OT_CLIENT_TIMEOUT 30
-#define OT_CLIENT_TIMEOUT_CHECKINTERVAL 10
 #define OT_CLIENT_TIMEOUT_SEND (60*15)
+#define OT_SHUTDOWN_DRAIN 10
 #define OT_CLIENT_REQUEST_INTERVAL (60*30)
 #define OT_CLIENT_REQUEST_VARIATION (60*6)
 
 #define OT_TORRENT_TIMEOUT_HOURS 24
 #define OT_TORRENT_TIMEOUT      (60*OT_TORRENT_TIMEOUT_HOURS)
 
-#define OT_CLIENT_REQUEST_INTERVAL_RANDOM ( OT_CLIENT_REQUEST_INTERVAL - OT_CLIENT_REQUEST_VARIATION/2 + (int)( random( ) % OT_CLIENT_REQUEST_VARIATION ) )
+#define OT_CLIENT_REQUEST_INTERVAL_RANDOM ( OT_CLIENT_REQUEST_INTERVAL - OT_CLIENT_REQUEST_VARIATION/2 + (int)random_below( OT_CLIENT_REQUEST_VARIATION ) )
 
 /* If WANT_MODEST_FULLSCRAPES is on, ip addresses may not
    fullscrape more frequently than this amount in seconds */
@@ -45,7 +40,9 @@ typedef struct { ot_ip6 address; int bits; }
 
 /* Number of tracker admin ip addresses allowed */
 #define OT_ADMINIP_MAX 64
-#define OT_MAX_THREADS 16
+
+/* Upper bound for the number of I/O threads */
+#define OT_MAX_THREADS 64
 
 #define OT_PEER_TIMEOUT 45
 
@@ -55,17 +52,49 @@ typedef struct { ot_ip6 address; int bits; }
 
 #define OT_BUCKET_COUNT (1<<OT_BUCKET_COUNT_BITS)
 #define OT_BUCKET_COUNT_SHIFT (32-OT_BUCKET_COUNT_BITS)
+#define OT_BUCKET_BY_HASH(hash) ((int)(((((uint8_t*)(hash))[0]<<8)|((uint8_t*)(hash))[1])>>(16-OT_BUCKET_COUNT_BITS)))
+
+/* How often lock free scrapers retry before taking the bucket lock */
+#define OT_SCRAPE_READ_TRIES 4
+
+/* Swarms of at least OT_REPLYCACHE_MIN_PEERS peers answer announces from
+   OT_REPLYCACHE_SAMPLES cached peer samples. Each sample is redrawn after
+   OT_REPLYCACHE_MSEC milliseconds or OT_REPLYCACHE_USES announces. Samples
+   hold one peer more than the largest numwant, 200, as the announcing peer
+   is left out. */
+#define OT_REPLYCACHE_MIN_PEERS 1000
+#define OT_REPLYCACHE_SAMPLES   4
+#define OT_REPLYCACHE_PEERS     201
+#define OT_REPLYCACHE_MSEC      1000
+#define OT_REPLYCACHE_USES      256
+
+/* From ot_clock.c */
+extern time_t g_now_seconds;
+#define       g_now_minutes (g_now_seconds/60)
 
 /* From opentracker.c */
-extern time_t g_now_seconds;
 extern volatile int g_opentracker_running;
-#define       g_now_minutes (g_now_seconds/60)
 
 extern uint32_t g_tracker_id;
-typedef enum { FLAG_TCP, FLAG_UDP, FLAG_MCA, FLAG_SELFPIPE } PROTO_FLAG;
+extern size_t   g_replycache_min_peers;
+typedef enum { FLAG_TCP, FLAG_UDP, FLAG_MCA, FLAG_SELFPIPE, FLAG_HANDOFF } PROTO_FLAG;
+
+/* Peers of both address families are stored compactly as address, port,
+   flag and time. Within a request, the peer is kept with a full ot_ip6
+   address, IPv4 peers as v4 mapped. The compact IPv4 peer then is its last
+   OT_PEER_SIZE4 bytes. */
+#define OT_PEER_SIZE4 ((OT_IP_SIZE4)+2+2)
+#define OT_PEER_SIZE6 ((OT_IP_SIZE6)+2+2)
+
+#define OT_PEER_FAMILY_V4 0
+#define OT_PEER_FAMILY_V6 1
+#define OT_PEER_FAMILIES  2
+
+#define OT_PEER_SIZE_FOR_FAMILY(family) ((family)==OT_PEER_FAMILY_V4?OT_PEER_SIZE4:OT_PEER_SIZE6)
+#define OT_PEER_COMPACT(peer,family)    (((uint8_t*)(peer))+((family)==OT_PEER_FAMILY_V4?OT_IP_SIZE6-OT_IP_SIZE4:0))
 
 typedef struct {
-  uint8_t data[OT_IP_SIZE+2+2];
+  uint8_t data[OT_PEER_SIZE6];
 } ot_peer;
 static const uint8_t PEER_FLAG_SEEDING   = 0x80;
 static const uint8_t PEER_FLAG_COMPLETED = 0x40;
@@ -73,38 +102,39 @@ static const uint8_t PEER_FLAG_STOPPED   = 0x20;
 static const uint8_t PEER_FLAG_FROM_SYNC = 0x10;
 static const uint8_t PEER_FLAG_LEECHING  = 0x00;
 
-#ifdef WANT_V6
-#define OT_SETIP(peer,ip)     memcpy((peer),(ip),(OT_IP_SIZE))
-#else
-#define OT_SETIP(peer,ip)     memcpy((peer),(((uint8_t*)ip)+12),(OT_IP_SIZE))
-#endif
-#define OT_SETPORT(peer,port) memcpy(((uint8_t*)(peer))+(OT_IP_SIZE),(port),2)
-#define OT_PEERFLAG(peer)     (((uint8_t*)(peer))[(OT_IP_SIZE)+2])
-#define OT_PEERTIME(peer)     (((uint8_t*)(peer))[(OT_IP_SIZE)+3])
+#define OT_SETIP(peer,ip)     memcpy((peer),(ip),(OT_IP_SIZE6))
+#define OT_SETPORT(peer,port) memcpy(((uint8_t*)(peer))+(OT_IP_SIZE6),(port),2)
+#define OT_PEERFLAG(peer)     (((uint8_t*)(peer))[(OT_IP_SIZE6)+2])
+#define OT_PEERTIME(peer)     (((uint8_t*)(peer))[(OT_IP_SIZE6)+3])
+
+/* The same for compact peers of either family */
+#define OT_PEERFLAG_D(peer,peer_size) (((uint8_t*)(peer))[(peer_size)-2])
+#define OT_PEERTIME_D(peer,peer_size) (((uint8_t*)(peer))[(peer_size)-1])
 
 #define OT_HASH_COMPARE_SIZE (sizeof(ot_hash))
-#define OT_PEER_COMPARE_SIZE ((OT_IP_SIZE)+2)
+#define OT_PEER_COMPARE_SIZE_FROM_PEER_SIZE(peer_size) ((peer_size)-2)
 
 struct ot_peerlist;
 typedef struct ot_peerlist ot_peerlist;
+typedef struct ot_replycache ot_replycache;
 typedef struct {
   ot_hash      hash;
   ot_peerlist *peer_list;
 } ot_torrent;
 
 #include "ot_vector.h"
+#include "ot_index.h"
 
 struct ot_peerlist {
   ot_time        base;
+  ot_time        changed; /* g_now_seconds when a counter last changed */
+  ot_time        due;     /* g_now_minutes the cleaner visits, see ot_clean.c */
   size_t         seed_count;
   size_t         peer_count;
   size_t         down_count;
-/* normal peers vector or
-   pointer to ot_vector[32] buckets if data != NULL and space == 0
-*/
-  ot_vector      peers;
+/* one peer set per address family, counts above are for both */
+  ot_peerset     families[OT_PEER_FAMILIES];
 };
-#define OT_PEERLIST_HASBUCKETS(peer_list) ((peer_list)->peers.size > (peer_list)->peers.space)
 
 struct ot_workstruct {
   /* Thread specific, static */
@@ -159,14 +189,37 @@ void exerr( char * message );
    otherwise it is released in return_peers_for_torrent */
 size_t  add_peer_to_torrent_and_return_peers( PROTO_FLAG proto, struct ot_workstruct *ws, size_t amount );
 size_t  remove_peer_from_torrent( PROTO_FLAG proto, struct ot_workstruct *ws );
-size_t  return_tcp_scrape_for_torrent( ot_hash *hash, int amount, char *reply );
-size_t  return_udp_scrape_for_torrent( ot_hash hash, char *reply );
+size_t  return_tcp_scrape_for_torrent( ot_hash *hash_list, int amount, char *reply );
+size_t  return_udp_scrape_for_torrent( ot_hash *hash_list, int amount, char *reply );
 void    add_torrent_from_saved_state( ot_hash hash, ot_time base, size_t down_count );
 
+/* Batches of requests are grouped by bucket, so that each bucket lock is
+   taken only once. Announces, including stops, carry everything in their
+   workstruct and get their reply_size set just like from the functions
+   above. Scrapes get their counters, if found. */
+#define OT_BATCH_MAX 64
+
+typedef enum { OT_BATCH_ANNOUNCE, OT_BATCH_SCRAPE } ot_batch_action;
+
+typedef struct {
+  ot_batch_action       action;
+  PROTO_FLAG            proto;
+  size_t                amount;     /* announces: number of peers wanted */
+  struct ot_workstruct *ws;         /* announces: hash, peer and reply buffer */
+  ot_hash              *hash;       /* scrapes: the torrent to look up */
+  size_t                counts[3];  /* scrapes: seeds, completed, leechers */
+  int                   found;
+} ot_batch_entry;
+
+void    process_batch( ot_batch_entry *entries, size_t count );
+
 /* torrent iterator */
 void iterate_all_torrents( int (*for_each)( ot_torrent* torrent, uintptr_t data ), uintptr_t data );
 
 /* Helper, before it moves to its own object */
 void free_peerlist( ot_peerlist *peer_list );
 
+/* Address family of a peer in the working, OT_PEER_FAMILY_V4 for v4 mapped addresses */
+int peer_family( const ot_peer *peer );
+
 #endif